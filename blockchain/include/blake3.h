@@ -0,0 +1,62 @@
+/*
+blake3.h: BLAKE3 hash function declarations
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN    32
+#define BLAKE3_BLOCK_LEN  64
+#define BLAKE3_CHUNK_LEN  1024
+#define BLAKE3_MAX_DEPTH  54   // 2^54 chunks fill a 64 bit length
+
+// forward declaration
+typedef struct Blake3Hasher Blake3Hasher;
+
+struct Blake3Hasher
+// -----------------------------------------------------------------------------
+// Description
+//  Incremental BLAKE3 for input that arrives in pieces. The chunk being
+//  filled is held back until more input shows it is not the last one; the
+//  completed subtrees to its left are kept as a stack of chaining values,
+//  one per set bit of the chunk count, so memory stays fixed.
+// -----------------------------------------------------------------------------
+{
+  uint32_t stack[BLAKE3_MAX_DEPTH][8];
+  int depth;
+  uint64_t chunks;                // chunks pushed on the stack
+  uint8_t buf[BLAKE3_CHUNK_LEN];  // the chunk being filled
+  uint64_t buf_len;
+};
+
+// one shot hash of a whole buffer, 32 byte digest. Full chunks are
+// compressed 4, 8 or 16 at a time (SSE4.1, AVX2, AVX-512, picked at run time)
+// and so are the parent nodes inside each 256 chunk subtree. Nothing is
+// allocated.
+void blake3_hash(const uint8_t *buf, uint64_t buf_sz, uint8_t *hash);
+
+// the same digest over input given in any number of pieces
+void blake3_init(Blake3Hasher *this);
+void blake3_update(Blake3Hasher *this, const uint8_t *buf, uint64_t buf_sz);
+void blake3_final(Blake3Hasher *this, uint8_t *hash);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+blockcache.h: sharded cache of framed blocks read back from disk
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define BLOCKCACHE_SHARD_BITS 4
+#define BLOCKCACHE_SHARDS     (1 << BLOCKCACHE_SHARD_BITS)
+#define BLOCKCACHE_BUCKETS    1024 // per shard at first, doubled as it fills
+
+// forward declaration
+typedef struct BlockCache BlockCache;
+typedef struct BlockCacheShard BlockCacheShard;
+typedef struct BlockCacheEntry BlockCacheEntry;
+
+struct BlockCacheEntry
+// -----------------------------------------------------------------------------
+// Description
+//  One cached frame. A pinned entry is never evicted; an entry evicted while
+//  pinned is freed by the last release.
+// -----------------------------------------------------------------------------
+{
+  uint64_t index;
+  uint8_t *frame;
+  uint64_t size;
+  uint32_t pins;
+  uint8_t ref;              // CLOCK reference bit
+  uint8_t cached;           // 0 once evicted
+  uint64_t slot;            // position on the clock
+  BlockCacheEntry *next;    // hash chain
+};
+
+struct BlockCacheShard
+// -----------------------------------------------------------------------------
+// Description
+//  Blocks whose index falls in this shard, with its own lock, table and clock
+// -----------------------------------------------------------------------------
+{
+  pthread_mutex_t lock;
+  BlockCacheEntry **buckets;
+  uint64_t nbuckets;        // a power of two, at least count
+  BlockCacheEntry **clock;  // entries in CLOCK order
+  uint64_t count;
+  uint64_t cap;
+  uint64_t hand;
+  uint64_t bytes;
+  uint64_t budget;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+struct BlockCache
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of BlockCache, sits in front of Blockchain->get so that hot
+//  blocks whose record has been pruned to the spill file are read from disk
+//  once. Blocks are spread over BLOCKCACHE_SHARDS by index, each shard
+//  replaces with CLOCK within its share of the byte budget. Readers pin what
+//  they get and release it when done; misses read the disk outside the shard
+//  lock. Lookups hold the chain's lock shared, so get may run while another
+//  thread appends. Resident blocks are copied into the cache the same way,
+//  as the chain may prune them at any append, so every frame get returns
+//  stays valid until it is released.
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  BlockCacheShard shards[BLOCKCACHE_SHARDS];
+
+  uint8_t *(*get)(BlockCache *this, uint64_t index, BlockCacheEntry **pin);
+  void (*release)(BlockCache *this, BlockCacheEntry *pin);
+};
+
+// public methods
+int blockcache_init(BlockCache *this, Blockchain *chain, uint64_t budget);
+void blockcache_destroy(BlockCache *this);
+void blockcache_stats(BlockCache *this, uint64_t *hits, uint64_t *misses,
+                      uint64_t *evictions, uint64_t *bytes);
+
+#endif
@@ -23,10 +23,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "node.h"
 #include "linkedlist.h"
+#include "signature.h"
+#include "headerstore.h"
+#include "chunkstore.h"
+
+#include <pthread.h>
 
 #define BLOCK_HEADER_SZ 88
 
-#define HASH_SZ         32 // SHA256 sum has 32 byte digest
+#define HASH_SZ         32 // SHA256 and BLAKE3 both have 32 byte digests
 #define WORD_SZ         8  // 8 byte words for high integer counters, etc
                            // probably unecessary?
 
@@ -37,9 +42,44 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RECORD_SZ_POS   80
 #define RECORD_POS      88
 
+// the block index is a directory of fixed size pages of node pointers, so that
+// pages never move once published and lookups by index are O(1)
+#define BLOCKCHAIN_PAGE_BITS  16
+#define BLOCKCHAIN_PAGE_SZ    ((uint64_t)1 << BLOCKCHAIN_PAGE_BITS)
+#define BLOCKCHAIN_MAX_PAGES  ((uint64_t)1 << 16)
+
+#define BLOCKCHAIN_MAX_HOOKS  16
+
+// records whose signatures are checked together by blockchain_verify_chain
+#define BLOCKCHAIN_SIG_BATCH  4096
+
+// hash functions a chain can be built with, see blockchain_init_hash. The
+// choice is recorded in the root block's record, after the root message.
+#define BLOCKCHAIN_HASH_SHA256  0
+#define BLOCKCHAIN_HASH_BLAKE3  1
+
+#define BLOCKCHAIN_ROOT_MSG     "this is the first block"
+#define BLOCKCHAIN_ROOT_BLAKE3  "blake3" // tag, absent on SHA256 chains
+
+// spill offset of a pruned block whose record was dropped rather than spilled
+#define BLOCKCHAIN_NOT_SPILLED UINT64_MAX
+// spill offset flag of a pruned block whose record went to the chunk store,
+// the rest of the value is the record's recipe
+#define BLOCKCHAIN_CHUNKED     ((uint64_t)1 << 63)
+
 typedef struct Block Block;
 typedef struct Blockchain Blockchain;
 
+// called with every framed block right after it is stored in the chain
+typedef void (*BlockchainHook)(void *ctx, Blockchain *chain,
+                               uint8_t *blockframe);
+
+// pulls an application key out of a record. Returns 0 and points key into the
+// record if there is one, -1 if the record has no key
+typedef int (*RecordKeyFunc)(void *ctx, const uint8_t *record,
+                             uint64_t record_sz, const uint8_t **key,
+                             uint64_t *key_sz);
+
 struct Block 
 // -----------------------------------------------------------------------------
 // Description
@@ -60,7 +100,9 @@ struct Block
 
 // TODO encapsulate these functions?
 void blockframe_decode(uint8_t *blockframe, Block *block);
+void blockheader_decode(uint8_t *header, Block *block);
 void blockframe_print(uint8_t *this) ;
+uint64_t blockframe_size(uint8_t *blockframe);
 
 struct Blockchain
 //------------------------------------------------------------------------------
@@ -72,6 +114,41 @@ struct Blockchain
 {
   LinkedList *ll;
   uint64_t length;
+  uint8_t hash_alg; // BLOCKCHAIN_HASH_*, taken from the root block
+  Node ***pages; // block index -> list node, see BLOCKCHAIN_PAGE_BITS
+
+  // every block's header, back to back, so the prevhash chain can be checked
+  // even after record bodies have been pruned
+  uint8_t *headers;
+  uint64_t headers_cap;   // capacity in headers
+  HeaderStore links;      // the same headers' link fields, array per field
+
+  // pruning, see blockchain_set_pruning. Blocks [0, pruned) no longer hold
+  // their record in memory; it is either in the spill file or gone.
+  uint64_t prune_depth;   // keep records of this many recent blocks, 0 = all
+  uint64_t prune_budget;  // keep at most this many record bytes, 0 = no limit
+  uint64_t resident_sz;   // record bytes currently held in memory
+  uint64_t pruned;
+  uint64_t *spill_off;    // offset of each pruned record in the spill file
+  uint64_t spill_sz;      // bytes written to the spill file
+  int spill_fd;           // -1 when pruned records are dropped
+  ChunkStore *chunk_store; // takes pruned records instead, see set_chunk_store
+  uint64_t pins;          // readers that need every record, see blockchain_pin
+
+  // taken shared by readers on other threads (see BlockCache) and exclusive
+  // by appends while they grow the index or prune and by hook registration,
+  // hooks run outside it
+  pthread_rwlock_t lock;
+
+  // observers of appends, see blockchain_add_hook
+  BlockchainHook hooks[BLOCKCHAIN_MAX_HOOKS];
+  void *hook_ctx[BLOCKCHAIN_MAX_HOOKS];
+  int nhooks;
+
+  // record signatures, see blockchain_set_signatures. Signed records are
+  // always checked; these only make it cheaper.
+  SigCache *sig_cache;    // NULL for no cache
+  ThreadPool *sig_pool;   // NULL to check on the calling thread
 
   // peek_front maps directly to LinkedList->peek_front
   void *(*peek_front)(Blockchain *this);
@@ -80,12 +157,12 @@ struct Blockchain
   // Blockchain->insert_front has different implementation 
   // than LinkedList->insert_front. We can call this append,
   // but this seems more obj oriented if that's desireable
-  void (*insert_front)(Blockchain *this,
+  int (*insert_front)(Blockchain *this,
                  uint8_t *record,
                  uint64_t record_sz);
 
   // should these be public?
-  int (*verify_block)(Block *new_block, Block *old_block);
+  int (*verify_block)(Block *new_block, Block *old_block, uint8_t hash_alg);
   int (*blockchain_verify_chain)(Blockchain *blockchain);
 
   // Can't delete blocks... returns error.  I think we can get rid of this... 
@@ -95,6 +172,43 @@ struct Blockchain
 
 // public methods
 void blockchain_init(Blockchain *this); // blockchain contructor
+void blockchain_init_hash(Blockchain *this, uint8_t hash_alg); // pick a hash
+void blockchain_init_empty(Blockchain *this); // constructor without a root
 void blockchain_destroy(Blockchain *this); // blockchain destructor
 
+// append a framed block that has already been built and verified, used when
+// loading chains that were produced elsewhere
+int blockchain_store(Blockchain *this, uint8_t *blockframe, uint64_t blocksize);
+int blockchain_verify_block(Block *block, Block *prev_block, uint8_t hash_alg);
+int blockchain_verify_links(Block *block, Block *prev_block);
+int blockchain_verify_root(Block *block);
+uint8_t blockchain_root_hash_alg(Block *root);
+void block_hash(Block *this, uint8_t hash_alg, uint8_t *hash);
+
+// structures that follow the chain (indexes, filters, ...) register here
+int blockchain_add_hook(Blockchain *this, BlockchainHook hook, void *ctx);
+int blockchain_add_hook_locked(Blockchain *this, BlockchainHook hook,
+                               void *ctx);
+void blockchain_remove_hook(Blockchain *this, BlockchainHook hook, void *ctx);
+
+// signed records, see signature.h
+void blockchain_set_signatures(Blockchain *this, SigCache *cache,
+                               ThreadPool *pool);
+int blockchain_append_batch(Blockchain *this, uint8_t **records,
+                            const uint64_t *record_sz, uint64_t n);
+int blockchain_verify_signatures(Blockchain *this);
+int blockchain_verify_signature_range(Blockchain *this, uint64_t lo,
+                                      uint64_t hi);
+
+// pruned mode
+int blockchain_set_pruning(Blockchain *this, uint64_t depth, uint64_t budget,
+                           const char *spill_path);
+void blockchain_set_chunk_store(Blockchain *this, ChunkStore *store);
+int blockchain_pin(Blockchain *this);
+void blockchain_unpin(Blockchain *this);
+uint8_t *blockchain_get_header(Blockchain *this, uint64_t index);
+int blockchain_read_frame(Blockchain *this, uint64_t index, uint8_t *buf);
+int blockchain_verify_headers(Blockchain *this);
+int blockchain_verify_range(Blockchain *this, uint64_t lo, uint64_t hi);
+
 #endif
@@ -0,0 +1,129 @@
+/*
+blockreader.h: asynchronous block reads from snapshot files
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BLOCKREADER_H
+#define BLOCKREADER_H
+
+#include "threadpool.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define BLOCKREADER_MAX_DEPTH 4096
+
+// backends
+#define BLOCKREADER_AUTO      0 // io_uring if the kernel allows it
+#define BLOCKREADER_URING     1
+#define BLOCKREADER_THREADS   2 // pread on a thread pool
+
+// forward declaration
+typedef struct BlockReader BlockReader;
+typedef struct BlockReadRequest BlockReadRequest;
+typedef struct BlockReadResult BlockReadResult;
+
+// called in block order by blockreader_scan, nonzero stops the scan
+typedef int (*BlockScanFunc)(void *ctx, uint64_t index, uint8_t *blockframe,
+                             uint64_t blocksize);
+
+struct BlockReadResult
+// -----------------------------------------------------------------------------
+// Description
+//  A finished read, as handed back by BlockReader->reap
+// -----------------------------------------------------------------------------
+{
+  uint64_t index;
+  uint8_t *buf;             // the caller's buffer, now holding the frame
+  void *tag;                // as passed to submit
+  int res;                  // 0 on success, -1 on I/O error or a bad frame
+};
+
+struct BlockReadRequest
+// -----------------------------------------------------------------------------
+// Description
+//  An outstanding read, one per queue slot
+// -----------------------------------------------------------------------------
+{
+  BlockReader *reader;
+  uint64_t index;
+  uint8_t *buf;
+  uint64_t size;
+  uint64_t off;             // file offset of the frame
+  uint64_t done;            // bytes read so far, reads may come back short
+  void *tag;
+  int res;
+};
+
+struct BlockReader
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of BlockReader, reads framed blocks out of a snapshot file (see
+//  snapshot.h) or a chain log (see chainlog.h) without blocking the caller. Up to depth reads are in flight
+//  at once, completing into caller buffers in any order. The io_uring backend
+//  talks to the kernel through the raw syscalls and the shared rings; when
+//  io_uring is unavailable the reads run as pread tasks on a thread pool.
+// -----------------------------------------------------------------------------
+{
+  int fd;
+  uint64_t count;           // blocks in the file
+  uint64_t *offsets;        // the snapshot's index, or each log record's
+  uint64_t index_off;
+  uint64_t skip;            // bytes from an offset to its frame
+  uint64_t *sizes;          // chain logs only, each frame's size
+  uint32_t *crcs;           // chain logs only, each record's crc
+
+  int backend;              // BLOCKREADER_URING or BLOCKREADER_THREADS
+  int depth;
+  int inflight;
+  BlockReadRequest *reqs;   // depth slots
+  int *free_slots;          // stack of unused slots
+  int nfree;
+
+  // io_uring backend
+  int ring_fd;
+  void *sq_ring, *cq_ring, *sqes;
+  uint64_t sq_ring_sz, cq_ring_sz, sqes_sz;
+  uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+  uint32_t *cq_head, *cq_tail, *cq_mask;
+  void *cqes;
+  uint32_t to_submit;
+
+  // thread pool backend, finished slots are queued until reaped
+  ThreadPool pool;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  int *done_slots;
+  int ndone;
+
+  uint64_t (*frame_size)(BlockReader *this, uint64_t index);
+  int (*submit)(BlockReader *this, uint64_t index, uint8_t *buf, void *tag);
+  int (*reap)(BlockReader *this, BlockReadResult *results, int min, int max);
+};
+
+// public methods
+int blockreader_open(BlockReader *this, const char *pathname, int depth,
+                     int backend);
+void blockreader_close(BlockReader *this);
+
+// read blocks [lo, hi) in order, keeping depth reads ahead of the cursor
+int blockreader_scan(BlockReader *this, uint64_t lo, uint64_t hi,
+                     BlockScanFunc fn, void *ctx);
+
+#endif
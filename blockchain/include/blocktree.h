@@ -0,0 +1,104 @@
+/*
+blocktree.h: fork-aware block tree definition
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BLOCKTREE_H
+#define BLOCKTREE_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+
+// fork choice rules
+#define BLOCKTREE_LONGEST     0 // highest tip wins
+#define BLOCKTREE_MOST_WORK   1 // most cumulative work wins, see blocktree_work
+
+// results of BlockTree->add
+#define BLOCKTREE_EXTENDED    0 // the block extends the current tip
+#define BLOCKTREE_SIDE        1 // the block was stored on a side branch
+#define BLOCKTREE_REORG       2 // the block's branch became the main chain
+#define BLOCKTREE_DUPLICATE   3 // the block is already in the tree
+
+// forward declaration
+typedef struct BlockTree BlockTree;
+typedef struct BlockTreeEntry BlockTreeEntry;
+
+// called after the tip moves to another branch. Blocks above ancestor on
+// old_tip's branch were disconnected, those above it on new_tip's connected.
+typedef void (*BlockTreeReorgFunc)(void *ctx, BlockTree *tree,
+                                   BlockTreeEntry *ancestor,
+                                   BlockTreeEntry *old_tip,
+                                   BlockTreeEntry *new_tip);
+
+struct BlockTreeEntry
+// -----------------------------------------------------------------------------
+// Description
+//  One block in the tree, on the main chain or a side branch
+// -----------------------------------------------------------------------------
+{
+  uint8_t *frame;           // owned copy of the framed block
+  uint8_t *hash;            // points into frame
+  BlockTreeEntry *parent;   // NULL for the root
+  BlockTreeEntry *skip;     // ancestor at blocktree_skip_height(height)
+  uint64_t height;          // same as the block's index
+  uint64_t work;            // cumulative work from the root, saturating
+  BlockTreeEntry *next;     // hash table chain
+};
+
+struct BlockTree
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of BlockTree, every block seen so far keyed by hash, so that
+//  competing blocks at the same height can be kept side by side. The main
+//  chain is an array of entries by height that follows the tip chosen by the
+//  fork choice rule; a reorg only rewrites the entries above the fork point,
+//  so it costs time proportional to the fork depth.
+// -----------------------------------------------------------------------------
+{
+  BlockTreeEntry **buckets;
+  uint64_t nbuckets;        // a power of two
+  uint64_t nentries;
+  uint64_t seed;            // random per tree, see blocktree_bucket
+
+  BlockTreeEntry **main;    // main[h] is the main chain block at height h
+  uint64_t main_cap;
+  BlockTreeEntry *tip;
+
+  int rule;
+  uint8_t hash_alg;         // the root's, see blockchain_root_hash_alg
+  BlockTreeReorgFunc on_reorg; // optional
+  void *reorg_ctx;
+
+  int (*add)(BlockTree *this, uint8_t *blockframe);
+  BlockTreeEntry *(*find)(BlockTree *this, const uint8_t *hash);
+  uint8_t *(*get)(BlockTree *this, uint64_t height);
+};
+
+// public methods
+int blocktree_init(BlockTree *this, uint8_t *root_frame, int rule);
+void blocktree_destroy(BlockTree *this);
+uint64_t blocktree_work(const uint8_t *hash);
+
+// O(log n) ancestor queries over the skip pointers, work on any branch
+BlockTreeEntry *blocktree_get_ancestor(BlockTreeEntry *entry, uint64_t height);
+BlockTreeEntry *blocktree_find_common_ancestor(BlockTreeEntry *a,
+                                               BlockTreeEntry *b);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+bloom.h: per-segment blocked bloom filter definition
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+
+// each key sets one bit in each of the 8 words of a single 256 bit block, so
+// a probe touches one cache line and checks all 8 words with one AVX2 compare
+#define BLOOM_WORDS         8
+#define BLOOM_BLOCK_BITS    256
+#define BLOOM_BITS_PER_KEY  16 // ~0.1% false positives at one key per block
+
+typedef struct SegmentBloom SegmentBloom;
+
+// called by scan for every block whose record key matches
+typedef void (*BloomMatchFunc)(void *ctx, uint64_t index, uint8_t *blockframe);
+
+struct SegmentBloom
+// -----------------------------------------------------------------------------
+// Description
+//  One blocked bloom filter per seg_blocks consecutive chain blocks, over the
+//  keys returned by a caller supplied RecordKeyFunc. Filters are filled in by
+//  a chain hook as blocks are appended, so a key lookup only has to decode
+//  the blocks of segments whose filter might contain it. Blocks from
+//  covered on are not in the filters yet (an allocation failed), scans
+//  decode them all and the next append tries again.
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  RecordKeyFunc key;
+  void *key_ctx;
+
+  uint64_t seg_blocks;    // chain blocks per segment
+  uint64_t filter_blocks; // 256 bit blocks per filter, a power of two
+  uint64_t nsegs;         // segments with a filter
+  uint64_t cap;           // segments allocated
+  uint32_t *filters;      // nsegs filters of filter_blocks*BLOOM_WORDS words
+  uint64_t covered;       // blocks [0, covered) are in the filters
+
+  int (*may_contain)(SegmentBloom *this, uint64_t segment,
+                     const uint8_t *key, uint64_t key_sz);
+  int64_t (*scan)(SegmentBloom *this, const uint8_t *key, uint64_t key_sz,
+                  BloomMatchFunc match, void *ctx);
+};
+
+// public methods
+int bloom_init(SegmentBloom *this, Blockchain *chain, uint64_t seg_blocks,
+               RecordKeyFunc key, void *key_ctx);
+void bloom_destroy(SegmentBloom *this);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+chainagg.h: running aggregates over the blocks of a chain
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CHAINAGG_H
+#define CHAINAGG_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define CHAINAGG_MAX_LEVELS 64
+
+// forward declaration
+typedef struct ChainAgg ChainAgg;
+typedef struct ChainAggPart ChainAggPart;
+
+struct ChainAggPart
+// -----------------------------------------------------------------------------
+// Description
+//  Aggregate of the record sizes of a set of blocks. Two of them merge into
+//  the aggregate of the union, see chainagg_merge. An empty one has count 0
+//  and min UINT64_MAX.
+// -----------------------------------------------------------------------------
+{
+  uint64_t count;           // blocks
+  uint64_t bytes;           // record bytes
+  uint64_t min;             // smallest record
+  uint64_t max;             // largest record
+};
+
+struct ChainAgg
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of ChainAgg, record size aggregates of a chain kept up to date
+//  by a chain hook, so dashboards never rescan. Blocks are put in buckets of
+//  width seconds by timestamp. Only buckets holding blocks are kept, in
+//  timestamp order, so memory follows the number of occupied buckets and
+//  not the span of time the chain covers. Above them sits a tree of merged
+//  partials, level k holding one per 2^k buckets, so an append folds into one
+//  node per level and a query over any span of time merges O(log n) nodes.
+//  Queries may run on any thread while the chain is appended to.
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  uint64_t width;           // seconds per bucket
+  uint64_t *ids;            // timestamp / width of each bucket, ascending
+  uint64_t nbuckets;        // buckets holding blocks
+  uint64_t cap;             // buckets allocated, a power of two
+  int nlevels;              // levels[nlevels-1] has a single node
+  ChainAggPart *levels[CHAINAGG_MAX_LEVELS];
+  ChainAggPart all;         // every block
+  uint64_t lost;            // blocks in all but not in a bucket, out of memory
+  pthread_rwlock_t lock;
+
+  void (*total)(ChainAgg *this, ChainAggPart *out);
+  void (*range)(ChainAgg *this, uint64_t t0, uint64_t t1, ChainAggPart *out);
+  uint64_t (*series)(ChainAgg *this, uint64_t t0, uint64_t t1,
+                     ChainAggPart *out, uint64_t max);
+};
+
+// public methods
+int chainagg_init(ChainAgg *this, Blockchain *chain, uint64_t width);
+void chainagg_destroy(ChainAgg *this);
+void chainagg_merge(ChainAggPart *into, const ChainAggPart *from);
+double chainagg_mean(const ChainAggPart *part);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+chainexport.h: bulk export of blocks as hex, JSON lines or raw frames
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef CHAINEXPORT_H
+#define CHAINEXPORT_H
+
+#include "blockchain.h"
+#include "blockreader.h"
+#include "checkpoint.h"
+#include "threadpool.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+// output formats
+#define CHAINEXPORT_HEX   0 // each frame in hex, one per line
+#define CHAINEXPORT_JSON  1 // one JSON object per line, hashes and record hex
+#define CHAINEXPORT_RAW   2 // the frames back to back, as stored
+
+// a segment, the unit of work, ends at whichever limit it reaches first
+#define CHAINEXPORT_SEG_BLOCKS  4096
+#define CHAINEXPORT_SEG_BYTES   (4 << 20) // frame bytes
+
+// segments encoded ahead of the writer, per worker
+#define CHAINEXPORT_AHEAD       4
+
+// reads in flight while streaming a file, see BlockReader
+#define CHAINEXPORT_READ_DEPTH  64
+
+// forward declaration
+typedef struct ChainExport ChainExport;
+typedef struct ChainExportSeg ChainExportSeg;
+
+struct ChainExportSeg
+// -----------------------------------------------------------------------------
+// Description
+//  Blocks [lo, hi) encoded into buf by a worker, waiting for their turn to
+//  be written. When streaming from a file the segment also carries its
+//  frames, read ahead of the workers, and the header of the block before it
+//  so each frame can be verified.
+// -----------------------------------------------------------------------------
+{
+  ChainExport *job;
+  uint64_t lo;
+  uint64_t hi;
+  uint8_t *buf;
+  uint64_t len;
+  uint64_t cap;
+  uint8_t *frames;          // streamed: the frames of [lo, hi) back to back
+  uint64_t frames_len;
+  uint64_t frames_cap;
+  uint8_t prev[BLOCK_HEADER_SZ]; // streamed: header of block lo-1
+  int done;                 // 1 once buf holds the whole segment
+  int err;                  // 1 if a pruned record was dropped or a streamed
+                            // block failed verification
+};
+
+struct ChainExport
+// -----------------------------------------------------------------------------
+// Description
+//  An export in progress. Segments are encoded on the pool in parallel, at
+//  most a window of them ahead, and written strictly in order by the
+//  calling thread with one write per segment. Blocks come from a chain in
+//  memory, or are streamed from a file through a BlockReader and verified
+//  on the way, so a file is exported without loading it.
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;        // NULL when streaming
+  int format;
+  int fd;
+  ThreadPool *pool;         // NULL to encode on the calling thread
+  ChainExportSeg *segs;     // the window, used round robin
+  int nsegs;
+  uint64_t submitted;       // segments handed to the pool
+  uint64_t written;         // segments written, or given up on after an error
+  int err;
+  pthread_mutex_t lock;
+  pthread_cond_t done;      // a segment finished
+
+  // streaming only
+  BlockReader *reader;
+  uint64_t lo;              // blocks before lo are verified, not written
+  uint64_t hi;
+  uint8_t hash_alg;         // the root's
+  uint64_t assumed;         // blocks below a matching checkpoint
+  ChainExportSeg *fill;     // the segment being read into, NULL between
+  uint8_t last[BLOCK_HEADER_SZ]; // header of the last block streamed
+  uint8_t header[BLOCK_HEADER_SZ]; // scratch for checkpoint lookups
+};
+
+// public methods
+int chainexport_run(Blockchain *chain, uint64_t lo, uint64_t hi, int format,
+                    int fd, ThreadPool *pool);
+int chainexport_stream(BlockReader *reader, uint64_t lo, uint64_t hi,
+                       int format, int fd, ThreadPool *pool,
+                       const CheckpointSet *checkpoints);
+int chainexport_cmd(int argc, char **argv);
+
+#endif
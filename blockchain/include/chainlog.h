@@ -0,0 +1,95 @@
+/*
+chainlog.h: append-only chain file with crash recovery
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef CHAINLOG_H
+#define CHAINLOG_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+
+// Chain log file layout, integers in host byte order like the frames:
+//
+//   header   CHAINLOG_MAGIC (8)
+//   records  framed block | zero padding to 8 bytes | trailer, repeated
+//   trailer  frame size (8) | crc32c of frame and size (4) | CHAINLOG_TAG (4)
+//
+// Every record ends on an 8 byte boundary with its trailer, so the log can be
+// walked backwards from its end without an index. A crash in the middle of an
+// append leaves a torn last record whose trailer is missing or whose crc does
+// not match; recovery drops it.
+
+#define CHAINLOG_MAGIC        "BCOSLOG1"
+#define CHAINLOG_TAG          "BCLG"
+
+#define CHAINLOG_HEADER_SZ    8
+#define CHAINLOG_TRAILER_SZ   16
+
+// bytes of tail read per step while looking back for an intact record
+#define CHAINLOG_SCAN_BUF     (1 << 16)
+
+// forward declaration
+typedef struct ChainLog ChainLog;
+
+// called by chainlog_walk with each record in order, nonzero stops the walk.
+// offset is where the frame starts in the file, crc is its trailer's.
+typedef int (*ChainLogFunc)(void *ctx, uint64_t index, uint8_t *blockframe,
+                            uint64_t blocksize, uint64_t offset, uint32_t crc);
+
+struct ChainLog
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of ChainLog, a chain kept on disk one record per block. Opening
+//  a log recovers it: the tail is searched backwards for the last intact
+//  record, linked by hash to the one before it, and anything after that is
+//  truncated (or only passed over when the log is opened read only). Only
+//  the torn tail is read, so recovery takes the same time on a chain of any
+//  length. Once attached, a chain hook writes every appended block to the
+//  end of the log.
+// -----------------------------------------------------------------------------
+{
+  int fd;
+  uint64_t end;             // bytes of intact log, the next record goes here
+  uint64_t count;           // blocks in the log
+  uint64_t torn;            // bytes cut off (or passed over) at the tail
+  int readonly;             // 1 if opened with chainlog_open_readonly
+  uint8_t tip[HASH_SZ];     // hash of the last block in the log
+
+  Blockchain *chain;        // attached chain, NULL until chainlog_attach
+  uint8_t *buf;             // a record being written or checked
+  uint64_t buf_sz;
+  int sync;                 // 1 to fdatasync after every append
+  int failed;               // 1 once an append could not be written
+
+  int (*flush)(ChainLog *this);
+};
+
+// public methods
+int chainlog_open(ChainLog *this, const char *pathname, int sync);
+int chainlog_open_readonly(ChainLog *this, const char *pathname);
+void chainlog_close(ChainLog *this);
+int chainlog_load(ChainLog *this, Blockchain *chain);
+int chainlog_walk(ChainLog *this, int check, ChainLogFunc fn, void *ctx);
+int chainlog_attach(ChainLog *this, Blockchain *chain);
+uint32_t chainlog_crc(const uint8_t *blockframe, uint64_t blocksize);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+chainscan.h: parallel map/reduce over ranges of blocks
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CHAINSCAN_H
+#define CHAINSCAN_H
+
+#include "blockchain.h"
+#include "threadpool.h"
+
+#include <stdint.h>
+
+#define CHAINSCAN_MIN_GRAIN 1024 // blocks, ranges this small are not split
+
+// forward declaration
+typedef struct ChainScanOps ChainScanOps;
+
+struct ChainScanOps
+// -----------------------------------------------------------------------------
+// Description
+//  What a scan does. Each worker folds the blocks it is given into its own
+//  partial result with map; the partials are merged on the calling thread at
+//  the end. Blocks reach a partial in no particular order, so map and merge
+//  should not depend on it.
+// -----------------------------------------------------------------------------
+{
+  // a new, empty partial result; NULL on failure
+  void *(*init)(void *ctx);
+
+  // fold one block into a partial. blockframe points into the chain (or a
+  // buffer, for pruned blocks) and is only valid during the call. Nonzero
+  // stops the scan.
+  int (*map)(void *ctx, void *partial, uint64_t index,
+             const uint8_t *blockframe, uint64_t blocksize);
+
+  // fold the partial from into into; from is freed right after
+  void (*merge)(void *ctx, void *into, void *from);
+
+  // free a partial result
+  void (*free)(void *ctx, void *partial);
+};
+
+// public methods
+int chainscan_run(Blockchain *chain, ThreadPool *pool, uint64_t lo,
+                  uint64_t hi, const ChainScanOps *ops, void *ctx,
+                  void **result);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+chaintail.h: subscriptions to blocks as they are appended
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CHAINTAIL_H
+#define CHAINTAIL_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define CHAINTAIL_MAX_FDS     64   // subscribers woken through an eventfd
+#define CHAINTAIL_SPIN        2000 // polls of the tail before sleeping
+
+// forward declaration
+typedef struct ChainTail ChainTail;
+typedef struct ChainTailSlot ChainTailSlot;
+typedef struct TailSubscriber TailSubscriber;
+
+// called by drain with each new block in order, nonzero stops the drain
+typedef int (*TailFunc)(void *ctx, uint64_t index, const uint8_t *blockframe,
+                        uint64_t blocksize);
+
+struct ChainTailSlot
+// -----------------------------------------------------------------------------
+// Description
+//  A recently appended block. index is written last, so a reader that sees
+//  the same index before and after reading the slot has a consistent copy.
+// -----------------------------------------------------------------------------
+{
+  uint64_t index;
+  uint8_t *frame;           // the frame as stored in the chain
+  uint64_t size;
+};
+
+struct TailSubscriber
+// -----------------------------------------------------------------------------
+// Description
+//  One consumer of a ChainTail, with its own cursor. Used by one thread.
+// -----------------------------------------------------------------------------
+{
+  ChainTail *tail;
+  uint64_t cursor;          // next block to deliver
+  uint64_t lost;            // blocks overwritten in the ring before drained
+  int fd;                   // eventfd, -1 unless asked for
+  int armed;                // 1 while the subscriber wants an eventfd wakeup
+
+  int (*wait)(TailSubscriber *this, int64_t timeout_ns);
+  int (*arm)(TailSubscriber *this);
+  uint64_t (*drain)(TailSubscriber *this, uint64_t max, TailFunc fn,
+                    void *ctx);
+};
+
+struct ChainTail
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of ChainTail, the front of a chain as seen by subscribers on
+//  other threads. A chain hook puts each appended frame in a ring and bumps
+//  the published count; sleeping subscribers are woken with one futex wake,
+//  and eventfd subscribers that armed get a write. The appender never waits
+//  on a subscriber: one that falls a whole ring behind loses the oldest
+//  blocks (counted in lost) and can fetch them from the chain itself.
+//  Frames are handed out in place, and a subscriber may still hold one long
+//  after the ring moved on, so the tail pins the chain (see blockchain_pin):
+//  pruning can't be turned on while the tail exists.
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  ChainTailSlot *ring;
+  uint64_t mask;            // ring size - 1, a power of two
+
+  uint64_t published;       // blocks [0, published) have been appended
+  uint32_t seq;             // futex word, bumped on every publish
+  uint32_t waiters;         // subscribers in futex wait
+  int spin;                 // polls before sleeping, 0 on one cpu
+
+  pthread_mutex_t lock;     // guards fds
+  TailSubscriber *fds[CHAINTAIL_MAX_FDS];
+  int nfds;
+};
+
+// public methods
+int chaintail_init(ChainTail *this, Blockchain *chain, uint64_t ring_sz);
+void chaintail_destroy(ChainTail *this);
+int chaintail_subscribe(ChainTail *this, TailSubscriber *sub, int want_fd);
+void chaintail_unsubscribe(ChainTail *this, TailSubscriber *sub);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+checkpoint.h: trusted checkpoints that let old history skip rehashing
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+// blocks rehashed between progress updates and cancel checks of a DeepVerify
+#define CHECKPOINT_DEEP_STEP 4096
+
+// forward declaration
+typedef struct Checkpoint Checkpoint;
+typedef struct CheckpointSet CheckpointSet;
+typedef struct DeepVerify DeepVerify;
+
+// returns the hash stored in the header of block height, NULL if unknown
+typedef const uint8_t *(*CheckpointHashFunc)(void *ctx, uint64_t height);
+
+struct Checkpoint
+// -----------------------------------------------------------------------------
+// Description
+//  A block the operator trusts, by height and hash
+// -----------------------------------------------------------------------------
+{
+  uint64_t height;
+  uint8_t hash[HASH_SZ];
+};
+
+struct CheckpointSet
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of CheckpointSet, the trusted blocks of a chain sorted by
+//  height: the ones built in (see checkpoint.c) and any an operator adds.
+//  When the header at a checkpoint's height carries its hash, every block
+//  below it is assumed valid: loading only checks their prevhash links,
+//  indices and timestamps and rehashes from the checkpoint up. Their records
+//  are trusted, not proven, until a DeepVerify has been over them.
+//  Checkpoints whose hash does not match are ignored.
+// -----------------------------------------------------------------------------
+{
+  Checkpoint *points;
+  uint64_t n;
+  uint64_t cap;
+
+  int (*add)(CheckpointSet *this, uint64_t height, const uint8_t *hash);
+  int (*load)(CheckpointSet *this, const char *pathname);
+  uint64_t (*find)(const CheckpointSet *this, uint64_t length,
+                   CheckpointHashFunc hash_at, void *ctx);
+};
+
+struct DeepVerify
+// -----------------------------------------------------------------------------
+// Description
+//  A thread rehashing the blocks below a checkpoint after startup, oldest
+//  first. The chain may be appended to meanwhile; it is pinned (see
+//  blockchain_pin) so pruning can't be turned on until the thread is done.
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  uint64_t hi;              // blocks [0, hi) are checked
+  uint64_t done;            // blocks checked so far
+  int valid;                // -1 while running, then 1 or 0
+  int cancel;
+  pthread_t thread;
+};
+
+// public methods
+int checkpoint_init(CheckpointSet *this);
+void checkpoint_destroy(CheckpointSet *this);
+int checkpoint_verify_chain(const CheckpointSet *this, Blockchain *chain,
+                            uint64_t *assumed);
+uint64_t checkpoint_assumed(const CheckpointSet *this, Blockchain *chain);
+int deepverify_start(DeepVerify *this, Blockchain *chain, uint64_t hi);
+int deepverify_wait(DeepVerify *this);
+void deepverify_cancel(DeepVerify *this);
+
+#endif
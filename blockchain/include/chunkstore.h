@@ -0,0 +1,99 @@
+/*
+chunkstore.h: content-defined chunking and a deduplicating chunk store
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define CHUNKSTORE_DIGEST_SZ  32      // BLAKE3
+#define CHUNKSTORE_SLAB_SZ    (1 << 22)
+#define CHUNKSTORE_MIN_AVG    256
+#define CHUNKSTORE_MAX_AVG    (1 << 18) // so max chunks still fit a slab
+
+// forward declaration
+typedef struct ChunkStore ChunkStore;
+typedef struct ChunkRef ChunkRef;
+
+struct ChunkRef
+// -----------------------------------------------------------------------------
+// Description
+//  One unique chunk, found by the digest of its bytes
+// -----------------------------------------------------------------------------
+{
+  uint8_t digest[CHUNKSTORE_DIGEST_SZ];
+  uint64_t loc;             // slab * CHUNKSTORE_SLAB_SZ + offset in the slab
+  uint32_t len;
+};
+
+struct ChunkStore
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of ChunkStore. Records are cut into chunks at content-defined
+//  boundaries (FastCDC: a gear rolling hash with normalized chunking), so an
+//  edit only changes the chunks around it. Each distinct chunk is stored once,
+//  keyed by its BLAKE3 digest, and a record is kept as its recipe, the list
+//  of its chunks. Chunks are never freed. Readers and the writer may run on
+//  different threads.
+// -----------------------------------------------------------------------------
+{
+  pthread_rwlock_t lock;
+
+  // chunking parameters, see chunkstore_init
+  uint32_t min_sz, avg_sz, max_sz;
+  uint64_t mask_s;          // stricter mask, before avg_sz
+  uint64_t mask_l;          // looser mask, after avg_sz
+  uint64_t gear[256];
+
+  // chunk bytes, in slabs that never move
+  uint8_t **slabs;
+  uint64_t nslabs;
+  uint64_t slab_used;       // bytes used in the last slab
+
+  // unique chunks and the digest table over them (open addressing, ids + 1)
+  ChunkRef *chunks;
+  uint64_t nchunks, chunks_cap;
+  uint32_t *table;
+  uint64_t table_cap;       // a power of two, at most half full
+
+  // recipe r is list[start[r]] .. list[start[r+1]-1]
+  uint32_t *list;
+  uint64_t nlist, list_cap;
+  uint64_t *start;
+  uint64_t nrecipes, recipes_cap;
+
+  uint64_t logical_sz;      // bytes put
+  uint64_t stored_sz;       // bytes of unique chunks
+
+  int (*put)(ChunkStore *this, const uint8_t *record, uint64_t record_sz,
+             uint64_t *recipe);
+  int (*read)(ChunkStore *this, uint64_t recipe, uint8_t *buf);
+};
+
+// public methods
+int chunkstore_init(ChunkStore *this, uint32_t avg_sz);
+void chunkstore_destroy(ChunkStore *this);
+uint64_t chunkstore_cut(ChunkStore *this, const uint8_t *buf, uint64_t buf_sz);
+void chunkstore_stats(ChunkStore *this, uint64_t *logical, uint64_t *stored,
+                      uint64_t *chunks);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+filehash.h: parallel hashing of files and directory trees
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef FILEHASH_H
+#define FILEHASH_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+
+#define FILEHASH_CHUNK_SZ  (1 << 20) // bytes hashed per read or per update
+#define FILEHASH_MMAP_MIN  (1 << 16) // smaller files are read, not mapped
+
+// forward declaration
+typedef struct FileHash FileHash;
+
+struct FileHash
+// -----------------------------------------------------------------------------
+// Description
+//  One file to hash and, once hashed, its digest or the error that stopped it
+// -----------------------------------------------------------------------------
+{
+  char *path;               // "-" for standard input
+  uint8_t hash_alg;         // BLOCKCHAIN_HASH_*
+  uint8_t hash[HASH_SZ];
+  int err;                  // errno, 0 on success
+};
+
+// public methods
+int filehash_fd(int fd, uint8_t hash_alg, uint8_t *hash);
+int filehash_cmd(int argc, char **argv);
+
+#endif
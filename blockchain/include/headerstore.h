@@ -0,0 +1,57 @@
+/*
+headerstore.h: block header link fields stored as parallel arrays
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HEADERSTORE_H
+#define HEADERSTORE_H
+
+#include <stdint.h>
+
+#define HEADERSTORE_CHUNK 4096 // headers checked between early exits
+
+// forward declaration
+typedef struct HeaderStore HeaderStore;
+
+struct HeaderStore
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of HeaderStore, the fields that link a block to its
+//  predecessor, one array per field: hashes, prevhashes, indices and
+//  timestamps of every block, in chain order. Checking the links of a range
+//  of headers is then a few passes over contiguous memory, vectorized with
+//  AVX2 where the CPU has it, instead of a decode per block.
+// -----------------------------------------------------------------------------
+{
+  uint64_t count;
+  uint64_t cap;
+  uint8_t *hashes;          // HASH_SZ bytes per block
+  uint8_t *prevhashes;      // HASH_SZ bytes per block
+  uint64_t *indices;
+  uint64_t *timestamps;
+
+  int (*append)(HeaderStore *this, const uint8_t *header);
+  int (*verify_links)(HeaderStore *this, uint64_t lo, uint64_t hi);
+};
+
+// public methods
+int headerstore_init(HeaderStore *this);
+void headerstore_destroy(HeaderStore *this);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+histogram.h: HDR style latency histograms
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// 2^HISTOGRAM_SUB_BITS sub-buckets per power of two: values are kept to
+// within 1 part in 2^(HISTOGRAM_SUB_BITS-1), better than 3 significant digits
+#define HISTOGRAM_SUB_BITS  11
+
+// forward declaration
+typedef struct Histogram Histogram;
+
+struct Histogram
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of Histogram, a log-linear histogram in the style of
+//  HdrHistogram. Values from 0 to max are counted in buckets whose width is
+//  a fixed fraction of the value, so the whole range costs a few tens of
+//  kilobytes and recording is a shift and an increment. Not thread safe; give
+//  each thread its own and merge them.
+// -----------------------------------------------------------------------------
+{
+  uint64_t *counts;
+  uint64_t ncounts;
+  uint64_t max;             // largest trackable value, larger ones are clamped
+  uint64_t total;           // values recorded
+  uint64_t clamped;         // of which were above max
+  uint64_t min_seen;
+  uint64_t max_seen;
+  double sum;
+
+  void (*record)(Histogram *this, uint64_t value);
+  void (*merge)(Histogram *this, const Histogram *from);
+  uint64_t (*percentile)(const Histogram *this, double p);
+  double (*mean)(const Histogram *this);
+  void (*print)(const Histogram *this, FILE *fp, double scale);
+};
+
+// public methods
+int histogram_init(Histogram *this, uint64_t max);
+void histogram_destroy(Histogram *this);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ingest.h: lock-free submission of records to a sequencer thread
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define INGEST_LINE       64   // cache line, hot counters get one each
+#define INGEST_SPIN       2000 // polls before sleeping, on more than one cpu
+
+// states of an IngestFuture
+#define INGEST_PENDING    0
+#define INGEST_SLEEPING   1    // pending, and a waiter is in futex wait
+#define INGEST_DONE       2
+#define INGEST_FAILED     3    // bad signature, or the chain is full
+
+// forward declaration
+typedef struct IngestQueue IngestQueue;
+typedef struct IngestSlot IngestSlot;
+typedef struct IngestFuture IngestFuture;
+
+struct IngestFuture
+// -----------------------------------------------------------------------------
+// Description
+//  Where a submitted record ended up, filled in by the sequencer. Owned by
+//  the producer and must stay put, like the record, until it completes.
+//  Poll state with an acquire load, or block in IngestQueue->wait.
+// -----------------------------------------------------------------------------
+{
+  uint64_t index;           // the block's index in the chain
+  uint8_t hash[HASH_SZ];    // the block's hash
+  uint32_t state;           // INGEST_*, a futex word
+};
+
+struct IngestSlot
+// -----------------------------------------------------------------------------
+// Description
+//  One ring entry. seq says whose turn it is: the producer holding ticket t
+//  may fill the slot when seq == t and publishes it by setting t + 1; the
+//  sequencer frees it for the next lap by setting t + ring size.
+// -----------------------------------------------------------------------------
+{
+  uint64_t seq;
+  uint8_t *record;
+  uint64_t record_sz;
+  IngestFuture *future;
+} __attribute__((aligned(INGEST_LINE))); // neighbours are filled at once
+
+struct IngestQueue
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of IngestQueue, a bounded ring between any number of producer
+//  threads and one sequencer thread that owns the chain's front. A producer
+//  takes a ticket with one fetch-and-add, which never retries however many
+//  producers there are, fills its slot and publishes it. The sequencer
+//  drains runs of published slots, appends them as one batch (signatures
+//  checked together on the chain's pool) and completes their futures. Only
+//  a sleeping sequencer, a full ring or a sleeping waiter costs a syscall.
+//  Nothing else may append to the chain while the queue runs.
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  IngestSlot *ring;
+  uint64_t mask;            // ring size - 1, a power of two
+  uint64_t batch;           // most records appended at once
+  int spin;                 // polls before sleeping, 0 on one cpu
+  int stop;
+  pthread_t thread;
+
+  // producers
+  uint64_t tail __attribute__((aligned(INGEST_LINE)));
+  uint32_t posted;          // futex word, bumped to wake the sequencer
+  uint32_t idle;            // 1 while the sequencer may be asleep
+
+  // sequencer
+  uint64_t head __attribute__((aligned(INGEST_LINE)));
+  uint32_t freed;           // futex word, bumped when a full ring drains
+  uint32_t blocked;         // producers waiting for room
+  uint8_t **records;        // scratch, batch entries each
+  uint64_t *record_sz;
+  uint64_t *where;          // index each record got, UINT64_MAX if it failed
+
+  int (*submit)(IngestQueue *this, uint8_t *record, uint64_t record_sz,
+                IngestFuture *future);
+  int (*wait)(IngestQueue *this, IngestFuture *future);
+};
+
+// public methods
+int ingest_init(IngestQueue *this, Blockchain *chain, uint64_t ring_sz,
+                uint64_t batch);
+void ingest_destroy(IngestQueue *this);
+
+#endif
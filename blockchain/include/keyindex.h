@@ -0,0 +1,113 @@
+/*
+keyindex.h: secondary index from record keys to block indices
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KEYINDEX_H
+#define KEYINDEX_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+
+#define KEYINDEX_ORDER    32 // max keys per tree node
+#define KEYINDEX_MAX_DEPTH 24 // levels, half full nodes hold 2^64 keys in 16
+#define KEYINDEX_MAGIC    "BCOSKIDX"
+#define KEYINDEX_VERSION  1
+
+// forward declaration
+typedef struct KeyIndex KeyIndex;
+typedef struct KeyIndexNode KeyIndexNode;
+typedef struct KeyIndexPostings KeyIndexPostings;
+
+// called by prefix_scan for every key, in key order
+typedef void (*KeyIndexScanFunc)(void *ctx, const uint8_t *key, uint64_t key_sz,
+                                 const uint64_t *indices, uint64_t n);
+
+struct KeyIndexPostings
+// -----------------------------------------------------------------------------
+// Description
+//  The blocks holding one key, in ascending (append) order
+// -----------------------------------------------------------------------------
+{
+  uint64_t *indices;
+  uint64_t n;
+  uint64_t cap;
+};
+
+struct KeyIndexNode
+// -----------------------------------------------------------------------------
+// Description
+//  A B+-tree node. Internal nodes hold n separator keys and n+1 children,
+//  where child i+1 holds keys >= keys[i]. Leaves hold n keys with their
+//  postings and are chained in key order for range scans.
+// -----------------------------------------------------------------------------
+{
+  int leaf;
+  int n;
+  uint8_t *keys[KEYINDEX_ORDER];
+  uint64_t key_sz[KEYINDEX_ORDER];
+  KeyIndexNode *children[KEYINDEX_ORDER+1];     // internal nodes only
+  KeyIndexPostings postings[KEYINDEX_ORDER];    // leaves only
+  KeyIndexNode *next;                           // leaves only
+};
+
+struct KeyIndex
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of KeyIndex, a B+-tree keyed by the application key of each
+//  record (from a caller supplied RecordKeyFunc), mapping it to the blocks
+//  that carry that key. Kept up to date by a chain hook as blocks are
+//  appended, and can be saved next to the chain and loaded back without
+//  rescanning the blocks it already covers. An insert allocates everything
+//  it may need before touching the tree, so running out of memory leaves
+//  the tree as it was; the hook then stops at that block (covered falls
+//  behind the chain) and retries it on the next append or keyindex_sync.
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  RecordKeyFunc key;
+  void *key_ctx;
+
+  KeyIndexNode *root;
+  uint64_t nkeys;     // distinct keys
+  uint64_t covered;   // blocks [0, covered) have been indexed
+
+  // nodes set aside for the splits of the next insert, one per level
+  KeyIndexNode *spare[KEYINDEX_MAX_DEPTH+1];
+  int nspare;
+
+  int (*latest)(KeyIndex *this, const uint8_t *key, uint64_t key_sz,
+                uint64_t *index);
+  const uint64_t *(*lookup)(KeyIndex *this, const uint8_t *key,
+                            uint64_t key_sz, uint64_t *n);
+  uint64_t (*prefix_scan)(KeyIndex *this, const uint8_t *prefix,
+                          uint64_t prefix_sz, KeyIndexScanFunc fn, void *ctx);
+  int (*save)(KeyIndex *this, const char *pathname);
+};
+
+// public methods
+int keyindex_init(KeyIndex *this, Blockchain *chain, RecordKeyFunc key,
+                  void *key_ctx);
+int keyindex_load(KeyIndex *this, Blockchain *chain, RecordKeyFunc key,
+                  void *key_ctx, const char *pathname);
+void keyindex_destroy(KeyIndex *this);
+int keyindex_sync(KeyIndex *this); // index what a failed hook left out
+
+#endif
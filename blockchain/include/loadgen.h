@@ -0,0 +1,123 @@
+/*
+loadgen.h: open loop load generator for the chain
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include "blockchain.h"
+#include "histogram.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define LOADGEN_MAX_THREADS   64
+#define LOADGEN_MAX_LATENCY   60000000000ULL // ns, longer ones are clamped
+
+// operations, in the order of LoadGenConfig mix
+#define LOADGEN_APPEND        0
+#define LOADGEN_READ          1
+#define LOADGEN_SCAN          2
+#define LOADGEN_NOPS          3
+
+// record size distributions
+#define LOADGEN_SIZE_FIXED    0 // size_a bytes
+#define LOADGEN_SIZE_UNIFORM  1 // size_a to size_b bytes
+#define LOADGEN_SIZE_EXP      2 // exponential with mean size_a, up to 16x that
+
+// forward declaration
+typedef struct LoadGenConfig LoadGenConfig;
+typedef struct LoadGen LoadGen;
+typedef struct LoadGenWorker LoadGenWorker;
+
+struct LoadGenConfig
+// -----------------------------------------------------------------------------
+// Description
+//  What load to generate, see loadgen_parse for the command line form
+// -----------------------------------------------------------------------------
+{
+  int threads;
+  double rate;              // ops per second over all threads, 0 = closed loop
+  int poisson;              // exponential gaps between arrivals, else fixed
+  double duration;          // seconds
+  unsigned mix[LOADGEN_NOPS]; // relative weights of append, read and scan
+  int size_dist;            // LOADGEN_SIZE_*
+  uint64_t size_a;
+  uint64_t size_b;
+  uint64_t scan_len;        // blocks per scan
+  uint64_t preload;         // blocks appended before the clock starts
+  uint64_t seed;
+  uint8_t hash_alg;         // in process chains only
+  char host[256];           // server to drive, empty for an in process chain
+  char port[16];
+  const char *dump;         // file for the full distributions, NULL for none
+};
+
+struct LoadGenWorker
+// -----------------------------------------------------------------------------
+// Description
+//  One load thread with its own schedule, random state and histograms
+// -----------------------------------------------------------------------------
+{
+  LoadGen *lg;
+  pthread_t thread;
+  int id;
+  uint64_t rng;
+  int sock;                 // connection to the server, -1 in process
+  uint8_t *record;          // record bytes, as large as the largest record
+  char *io;                 // response buffer, server only
+  uint64_t ops[LOADGEN_NOPS];
+  uint64_t errors[LOADGEN_NOPS];
+  uint64_t missed[LOADGEN_NOPS]; // due before the end but never sent
+  Histogram latency[LOADGEN_NOPS]; // from when the op was due
+  Histogram service[LOADGEN_NOPS]; // from when it was actually issued
+};
+
+struct LoadGen
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of LoadGen, a run of the load generator. Each worker issues
+//  ops on its own schedule: with a rate set, arrivals are due at fixed or
+//  Poisson intervals whether or not earlier ops have finished (open loop),
+//  and latency is measured from when an op was due rather than when it was
+//  sent. A chain that stalls therefore shows the stall in every op queued
+//  behind it, instead of the generator politely waiting it out (coordinated
+//  omission); ops still due when the run ends are counted the same way.
+//  Service time, from send to completion, is kept alongside for contrast.
+//  The chain is either one in this process, behind a writer preferring
+//  rwlock, or the Node server's over HTTP keep-alive connections.
+// -----------------------------------------------------------------------------
+{
+  LoadGenConfig cfg;
+  Blockchain chain;
+  pthread_rwlock_t lock;    // appends exclusive, reads and scans shared
+  uint64_t length;          // blocks known to the server, server only
+  uint64_t start_ns;
+  uint64_t end_ns;
+  LoadGenWorker workers[LOADGEN_MAX_THREADS];
+};
+
+// public methods
+int loadgen_parse(LoadGenConfig *cfg, int argc, char **argv);
+int loadgen_run(const LoadGenConfig *cfg);
+int loadgen_cmd(int argc, char **argv);
+
+#endif
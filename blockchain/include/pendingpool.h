@@ -0,0 +1,103 @@
+/*
+pendingpool.h: prioritized pool of records waiting to be appended
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PENDINGPOOL_H
+#define PENDINGPOOL_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define PENDINGPOOL_DIGEST_SZ 32
+
+// the two heaps every entry sits in
+#define PENDINGPOOL_TOP       0 // highest priority first, popped by appenders
+#define PENDINGPOOL_BOTTOM    1 // lowest priority first, evicted over budget
+
+// results of PendingPool->add
+#define PENDINGPOOL_ADDED     0
+#define PENDINGPOOL_DUPLICATE 1 // an identical record is already pending
+#define PENDINGPOOL_EVICTED   2 // the pool is full of higher priority records
+
+// forward declaration
+typedef struct PendingPool PendingPool;
+typedef struct PendingEntry PendingEntry;
+
+struct PendingEntry
+// -----------------------------------------------------------------------------
+// Description
+//  One pending record and where it sits in the pool's heaps and table
+// -----------------------------------------------------------------------------
+{
+  uint8_t digest[PENDINGPOOL_DIGEST_SZ]; // BLAKE3 of the record
+  uint8_t *record;                       // owned copy
+  uint64_t record_sz;
+  uint64_t priority;                     // larger is more urgent
+  uint64_t seq;                          // arrival order, breaks ties
+  uint64_t pos[2];                       // index in each heap
+  PendingEntry *next;                    // hash table chain
+};
+
+struct PendingPool
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of PendingPool, a buffer between producers and the appender.
+//  Records are deduplicated by digest in a hash table and kept in two binary
+//  heaps over the same entries: a max heap the appender pops from and a min
+//  heap that picks eviction victims when the byte budget is exceeded. Every
+//  entry knows its index in both heaps, so removal from the other heap is
+//  also O(log n). Equal priorities are served oldest first and evicted
+//  newest first. All methods lock, producers may call add concurrently.
+// -----------------------------------------------------------------------------
+{
+  PendingEntry **heaps[2];  // PENDINGPOOL_TOP and PENDINGPOOL_BOTTOM
+  uint64_t count;
+  uint64_t cap;             // capacity of each heap
+
+  PendingEntry **buckets;
+  uint64_t nbuckets;        // a power of two
+
+  uint64_t bytes;           // record bytes held
+  uint64_t budget;          // most record bytes held at once
+  uint64_t seq;
+
+  uint64_t added;           // counters
+  uint64_t duplicates;
+  uint64_t evicted;
+
+  pthread_mutex_t lock;
+
+  int (*add)(PendingPool *this, const uint8_t *record, uint64_t record_sz,
+             uint64_t priority);
+  uint64_t (*pop)(PendingPool *this, uint64_t n, uint64_t max_bytes,
+                  uint8_t **records, uint64_t *record_sz);
+};
+
+// public methods
+int pendingpool_init(PendingPool *this, uint64_t budget);
+void pendingpool_destroy(PendingPool *this);
+
+// pop up to n records, at most max_bytes, and append them to chain
+int pendingpool_flush(PendingPool *this, Blockchain *chain, uint64_t n,
+                      uint64_t max_bytes);
+
+#endif
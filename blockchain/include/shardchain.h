@@ -0,0 +1,114 @@
+/*
+shardchain.h: sharded chains anchored to a root chain
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef SHARDCHAIN_H
+#define SHARDCHAIN_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define SHARDCHAIN_MAX_SHARDS   256
+#define SHARDCHAIN_MAX_PENDING  (16 << 20) // queued record bytes per shard
+
+// Anchor record, appended to the root chain:
+//
+//   SHARDCHAIN_ANCHOR_MAGIC (8) | shard count (8) |
+//   per shard: length (8) | hash of its block length-1 (32)
+//
+// so every root block after the first commits to the tip of every shard.
+
+#define SHARDCHAIN_ANCHOR_MAGIC "BCOSANCH"
+#define SHARDCHAIN_ANCHOR_SZ(n) (16 + (uint64_t)(n)*(8 + HASH_SZ))
+
+// forward declaration
+typedef struct ShardChain ShardChain;
+typedef struct Shard Shard;
+
+struct Shard
+// -----------------------------------------------------------------------------
+// Description
+//  One chain and the thread that owns it. Producers add records to pending;
+//  the shard thread swaps it for its empty draining buffer and appends the
+//  batch without holding the lock. Both buffers hold size (8) | record
+//  entries back to back.
+// -----------------------------------------------------------------------------
+{
+  ShardChain *sc;
+  Blockchain chain;         // touched only by the shard thread while running
+  pthread_t thread;
+  int cpu;                  // pinned here, -1 if pinning failed
+
+  pthread_mutex_t lock;     // guards everything below
+  pthread_cond_t work;      // records were queued, or stop
+  pthread_cond_t room;      // pending was taken, or the shard is idle
+  uint8_t *pending;
+  uint64_t pending_sz;
+  uint64_t pending_cap;
+  uint8_t *draining;        // owned by the shard thread
+  uint64_t draining_cap;
+  int busy;                 // 1 while a batch is being appended
+  int failed;               // 1 once an append failed, the shard takes no more
+  uint64_t length;          // the chain's length as of the last batch
+  uint8_t tip[HASH_SZ];     // and the hash of its last block
+};
+
+struct ShardChain
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of ShardChain, nshards independent chains that append in
+//  parallel, each on its own thread pinned to its own cpu. A shard's chain
+//  is created on its thread, so with first-touch placement its memory is
+//  local to that cpu's node. Records go to a shard by a hash of their key.
+//  A coordinator thread appends an anchor block to the root chain every
+//  anchor_ns, committing to every shard's tip; verifying the shards and the
+//  anchors against them checks the whole set from the root's tip alone.
+//  The chains themselves should only be read once flushed or destroyed.
+// -----------------------------------------------------------------------------
+{
+  Shard *shards;
+  int nshards;
+  uint8_t hash_alg;         // of every chain, root included
+  RecordKeyFunc key;        // NULL to route on the whole record
+  void *key_ctx;
+
+  pthread_mutex_t lock;     // guards root and the coordinator's state
+  pthread_cond_t tick;      // wakes the coordinator early to stop
+  Blockchain root;          // anchors
+  uint64_t *anchored;       // each shard's length in the last anchor
+  uint64_t anchor_ns;
+  pthread_t coordinator;
+  int stop;
+
+  int (*submit)(ShardChain *this, uint8_t *record, uint64_t record_sz);
+  int (*route)(ShardChain *this, const uint8_t *record, uint64_t record_sz);
+  int (*flush)(ShardChain *this);
+  int (*verify)(ShardChain *this);
+};
+
+// public methods
+int shardchain_init(ShardChain *this, int nshards, uint8_t hash_alg,
+                    uint64_t anchor_ns, RecordKeyFunc key, void *key_ctx);
+void shardchain_destroy(ShardChain *this);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+shmchain.h: a live chain published to other processes through shared memory
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SHMCHAIN_H
+#define SHMCHAIN_H
+
+#include "blockchain.h"
+
+#include <stdint.h>
+
+#define SHMCHAIN_MAGIC    "BCOSSHM1"
+#define SHMCHAIN_LINE     64 // cache line, the tip gets one to itself
+
+// forward declaration
+typedef struct ShmChain ShmChain;
+typedef struct ShmChainHeader ShmChainHeader;
+typedef struct ShmChainTip ShmChainTip;
+
+struct ShmChainTip
+// -----------------------------------------------------------------------------
+// Description
+//  A consistent view of the front of a published chain
+// -----------------------------------------------------------------------------
+{
+  uint64_t length;          // blocks published, frames [0, length) are final
+  uint64_t data_sz;         // frame bytes published
+  uint64_t timestamp;       // of the front block
+  uint8_t hash[HASH_SZ];    // of the front block
+};
+
+struct ShmChainHeader
+// -----------------------------------------------------------------------------
+// Description
+//  The start of the shared segment. It is followed by max_blocks frame
+//  offsets, then by max_bytes of frames stored back to back. Everything
+//  before the tip is written once by the writer and never changes.
+// -----------------------------------------------------------------------------
+{
+  char magic[8];
+  uint64_t max_blocks;
+  uint64_t max_bytes;
+  uint64_t offsets_off;     // from the start of the segment
+  uint64_t data_off;
+  uint8_t hash_alg;
+  uint8_t full;             // set once an append did not fit, the tip stops
+
+  // seqlock: odd while the writer updates the tip
+  uint64_t seq __attribute__((aligned(SHMCHAIN_LINE)));
+  ShmChainTip tip;
+};
+
+struct ShmChain
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of ShmChain, one side of a chain shared between processes. The
+//  writer maps a named segment, copies the chain's frames into it and hooks
+//  the chain so that every append is copied in and then made visible by
+//  bumping the seqlocked tip. Readers map the segment read only and follow
+//  the tip by polling it; frames below the tip never move, so readers use
+//  them in place without locks, copies or messages to the writer.
+//  The chain's own frames live in malloc'd list nodes, one allocation per
+//  block, and may be pruned, so they can't be shared as they are; the copy
+//  is what gives readers a single stable mapping. A writer replaces any
+//  segment left under its name, readers still mapping the old one keep it
+//  until they unmap and must map again to follow the new writer.
+// -----------------------------------------------------------------------------
+{
+  int writer;               // 1 for the publishing side
+  char *name;
+  uint8_t *base;            // the mapped segment
+  uint64_t size;
+  ShmChainHeader *header;
+  uint64_t *offsets;
+  uint8_t *data;
+  Blockchain *chain;        // writer only
+  uint64_t length;          // reader's last seen tip length
+
+  int (*tip)(ShmChain *this, ShmChainTip *tip);
+  uint8_t *(*get)(ShmChain *this, uint64_t index);
+};
+
+// public methods
+int shmchain_publish(ShmChain *this, Blockchain *chain, const char *name,
+                     uint64_t max_blocks, uint64_t max_bytes);
+int shmchain_attach(ShmChain *this, const char *name);
+void shmchain_detach(ShmChain *this);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+signature.h: Ed25519 record signatures and verification cache definition
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SIGNATURE_H
+#define SIGNATURE_H
+
+#include "threadpool.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+// A signed record is the payload followed by a fixed trailer:
+//   [payload][public key 32][signature 64][SIGNATURE_MAGIC 8]
+// The signature covers the payload only. Records without the trailer are
+// unsigned and always pass signature checks.
+#define SIGNATURE_SECKEY_SZ   32
+#define SIGNATURE_PUBKEY_SZ   32
+#define SIGNATURE_SIG_SZ      64
+#define SIGNATURE_MAGIC       "BCOSSIG1"
+#define SIGNATURE_MAGIC_SZ    8
+#define SIGNATURE_TRAILER_SZ  (SIGNATURE_PUBKEY_SZ + SIGNATURE_SIG_SZ + \
+                               SIGNATURE_MAGIC_SZ)
+
+#define SIGCACHE_DIGEST_SZ    32
+#define SIGCACHE_WAYS         4  // slots probed per lookup
+
+// forward declaration
+typedef struct SigCache SigCache;
+
+struct SigCache
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of SigCache, a fixed size set of records whose signature has
+//  already been checked, keyed by the BLAKE3 digest of the whole record (so
+//  payload, key and signature all have to match). A record verified on append
+//  is found here again at audit time and is not verified twice. When a set of
+//  SIGCACHE_WAYS slots is full a random one is replaced. Shared by verifying
+//  threads, so every access is under the lock.
+// -----------------------------------------------------------------------------
+{
+  uint8_t *slots;       // nslots digests, back to back
+  uint8_t *used;        // 1 if the slot holds a digest
+  uint64_t nslots;      // a power of two
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t seed;        // victim choice
+  pthread_mutex_t lock;
+
+  int (*contains)(SigCache *this, const uint8_t *digest);
+  void (*insert)(SigCache *this, const uint8_t *digest);
+};
+
+// public methods
+int sigcache_init(SigCache *this, uint64_t nslots);
+void sigcache_destroy(SigCache *this);
+
+int signature_keypair(uint8_t *seckey, uint8_t *pubkey);
+int signature_sign(const uint8_t *seckey, const uint8_t *payload,
+                   uint64_t payload_sz, uint8_t *record);
+int signature_present(const uint8_t *record, uint64_t record_sz);
+
+// check every signed record in the batch, split across pool (NULL to check
+// on the calling thread). cache may be NULL.
+int signature_verify_batch(SigCache *cache, ThreadPool *pool,
+                           uint8_t **records, const uint64_t *record_sz,
+                           uint64_t n);
+
+#endif
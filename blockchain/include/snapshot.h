@@ -0,0 +1,54 @@
+/*
+snapshot.h: chain snapshot export/import declarations
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "blockchain.h"
+#include "checkpoint.h"
+
+#include <stdint.h>
+
+// Snapshot file layout, all integers in host byte order like the frames:
+//
+//   header   SNAPSHOT_MAGIC (8) | version (8) | block count (8) | reserved (8)
+//   frames   frame size (8) | framed block, repeated block count times
+//   index    file offset of each frame size word (8), block count times
+//   trailer  index offset (8) | block count (8) | SNAPSHOT_INDEX_MAGIC (8)
+//
+// A reader can find every frame from the trailer alone, without scanning.
+
+#define SNAPSHOT_MAGIC        "BCOSSNAP"
+#define SNAPSHOT_INDEX_MAGIC  "BCOSIDX"
+#define SNAPSHOT_VERSION      1
+
+#define SNAPSHOT_HEADER_SZ    32
+#define SNAPSHOT_TRAILER_SZ   24
+
+// blocks verified per batch on import, bounds how much of the file has to
+// stay resident between the verify and store passes
+#define SNAPSHOT_BATCH        4096
+
+int snapshot_export(Blockchain *chain, const char *pathname);
+int snapshot_import(Blockchain *chain, const char *pathname, int nthreads,
+                    const CheckpointSet *checkpoints);
+
+#endif
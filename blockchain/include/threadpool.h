@@ -0,0 +1,92 @@
+/*
+threadpool.h: fixed size worker pool definition
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// forward declaration
+typedef struct ThreadPool ThreadPool;
+typedef struct ThreadPoolTask ThreadPoolTask;
+typedef struct ThreadPoolDeque ThreadPoolDeque;
+
+struct ThreadPoolTask
+// -----------------------------------------------------------------------------
+// Description
+//  A unit of work: fn is called on a worker thread with arg.
+// -----------------------------------------------------------------------------
+{
+  void (*fn)(void *arg);
+  void *arg;
+};
+
+struct ThreadPoolDeque
+// -----------------------------------------------------------------------------
+// Description
+//  A ring buffer of tasks with its own lock. The owner takes from the tail,
+//  thieves and the shared queue's workers take from the head.
+// -----------------------------------------------------------------------------
+{
+  ThreadPool *pool;
+  pthread_mutex_t lock;
+  ThreadPoolTask *tasks;
+  uint64_t cap;          // capacity of the ring buffer
+  uint64_t head;         // oldest task
+  uint64_t sz;           // number of queued tasks
+};
+
+struct ThreadPool
+// -----------------------------------------------------------------------------
+// Description
+//  Definition of ThreadPool, a fixed number of worker threads. Tasks
+//  submitted from outside the pool go to a shared FIFO queue; tasks a worker
+//  submits go to the tail of its own deque, which it works through newest
+//  first, so a task that splits its range keeps the pieces local. Workers
+//  that run dry take the oldest shared task, else steal the oldest task of
+//  another worker. The caller waits for every task, including the ones
+//  tasks submitted, to finish; queues grow as needed so submit never blocks.
+// -----------------------------------------------------------------------------
+{
+  pthread_t *threads;
+  int nthreads;
+
+  ThreadPoolDeque *deques; // one per worker, then the shared queue
+  uint64_t queued;       // tasks in any deque
+  uint64_t pending;      // tasks queued or running
+  int sleeping;          // workers waiting for work
+  int stop;              // set on destroy
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;   // signalled when a task is queued
+  pthread_cond_t idle;   // signalled when the pool runs out of work
+
+  int (*submit)(ThreadPool *this, void (*fn)(void *), void *arg);
+  void (*wait)(ThreadPool *this);
+};
+
+// public methods
+int threadpool_init(ThreadPool *this, int nthreads); // 0 - one per cpu
+void threadpool_destroy(ThreadPool *this);
+int threadpool_self(ThreadPool *this); // worker running the caller, or -1
+
+#endif
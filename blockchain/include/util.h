@@ -31,13 +31,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define COPYRIGHT_YEAR "2019"
 #define MAINTAINER "Carlos WM"
 
-// command line arguments
-void util_cmd_hash(const char *str);
-
 // buffer utilities
 void util_buf_print_hex(uint8_t *buf, uint64_t buf_sz, 
                         const char *label, const int newline);
+void util_buf_hex(char *dest, const uint8_t *src, uint64_t src_sz);
 void util_buf_hash(uint8_t *buf, uint64_t buf_sz, uint8_t *hash);
+uint64_t util_buf_hash64(const uint8_t *buf, uint64_t buf_sz, uint64_t seed);
+uint32_t util_buf_crc32c(uint32_t crc, const uint8_t *buf, uint64_t buf_sz);
 void util_buf_reverse(uint8_t *dest, const uint8_t *src,
                       const int len);
 int util_buf_write_raw(const uint8_t *, int, const char *pathname);
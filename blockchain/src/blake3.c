@@ -0,0 +1,607 @@
+/*
+blake3.c: BLAKE3 hash function, portable and SIMD implementations
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blake3.h"
+
+#include <string.h>
+#include <immintrin.h>
+
+// chunks compressed per batch, a subtree whose parents are reduced in the
+// vector unit too. Its chaining values live on the stack.
+#define BLAKE3_BATCH_LOG    8
+#define BLAKE3_BATCH        (1 << BLAKE3_BATCH_LOG)
+
+// domain flags
+#define BLAKE3_CHUNK_START  1
+#define BLAKE3_CHUNK_END    2
+#define BLAKE3_PARENT       4
+#define BLAKE3_ROOT         8
+
+static const uint32_t blake3_iv[8] = {
+  0x6a09e667U, 0xbb67ae85U, 0x3c6ef372U, 0xa54ff53aU,
+  0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U
+};
+
+// message word order for each of the 7 rounds
+static const uint8_t blake3_schedule[7][16] = {
+  {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+  {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+  {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+  {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+  {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+  {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+  {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+// the quarter round and full round, written once over ADD/XOR/ROTR so the
+// same code serves plain words and every vector width
+#define BLAKE3_G(ADD, XOR, ROTR, v, a, b, c, d, x, y)   \
+  v[a] = ADD(ADD(v[a], v[b]), x);                       \
+  v[d] = ROTR(XOR(v[d], v[a]), 16);                     \
+  v[c] = ADD(v[c], v[d]);                               \
+  v[b] = ROTR(XOR(v[b], v[c]), 12);                     \
+  v[a] = ADD(ADD(v[a], v[b]), y);                       \
+  v[d] = ROTR(XOR(v[d], v[a]), 8);                      \
+  v[c] = ADD(v[c], v[d]);                               \
+  v[b] = ROTR(XOR(v[b], v[c]), 7);
+
+#define BLAKE3_ROUND(ADD, XOR, ROTR, v, m, s)                     \
+  BLAKE3_G(ADD, XOR, ROTR, v, 0, 4,  8, 12, m[s[0]],  m[s[1]])    \
+  BLAKE3_G(ADD, XOR, ROTR, v, 1, 5,  9, 13, m[s[2]],  m[s[3]])    \
+  BLAKE3_G(ADD, XOR, ROTR, v, 2, 6, 10, 14, m[s[4]],  m[s[5]])    \
+  BLAKE3_G(ADD, XOR, ROTR, v, 3, 7, 11, 15, m[s[6]],  m[s[7]])    \
+  BLAKE3_G(ADD, XOR, ROTR, v, 0, 5, 10, 15, m[s[8]],  m[s[9]])    \
+  BLAKE3_G(ADD, XOR, ROTR, v, 1, 6, 11, 12, m[s[10]], m[s[11]])   \
+  BLAKE3_G(ADD, XOR, ROTR, v, 2, 7,  8, 13, m[s[12]], m[s[13]])   \
+  BLAKE3_G(ADD, XOR, ROTR, v, 3, 4,  9, 14, m[s[14]], m[s[15]])
+
+// compress LANES independent inputs at once. Input i starts at in + i*stride
+// and is nblocks blocks long; its chaining value goes to out + i*32. MSG
+// loads one block of every lane transposed, so that vector j holds word j of
+// every lane.
+#define BLAKE3_MANY_BODY(LANES, VEC, SET1, LOAD, STORE, ADD, XOR, ROTR, MSG) \
+  VEC h[8], v[16], m[16];                                                    \
+  uint32_t words[8][LANES] __attribute__((aligned(64)));                     \
+  uint32_t ctr_lo[LANES] __attribute__((aligned(64)));                       \
+  uint32_t ctr_hi[LANES] __attribute__((aligned(64)));                       \
+  uint64_t ctr;                                                              \
+  uint8_t block_flags;                                                       \
+  int i, j, b, r;                                                            \
+                                                                             \
+  for (i = 0; i < LANES; i++) {                                              \
+    ctr = counter + (increment ? (uint64_t)i : 0);                           \
+    ctr_lo[i] = (uint32_t)ctr;                                               \
+    ctr_hi[i] = (uint32_t)(ctr >> 32);                                       \
+  }                                                                          \
+  for (i = 0; i < 8; i++)                                                    \
+    h[i] = SET1((int)blake3_iv[i]);                                          \
+                                                                             \
+  for (b = 0; b < nblocks; b++) {                                            \
+    MSG(&in[b*BLAKE3_BLOCK_LEN], stride, m);                                 \
+                                                                             \
+    block_flags = flags | (b == 0 ? flags_start : 0) |                       \
+                  (b == nblocks-1 ? flags_end : 0);                          \
+    for (i = 0; i < 8; i++)                                                  \
+      v[i] = h[i];                                                           \
+    for (i = 0; i < 4; i++)                                                  \
+      v[8+i] = SET1((int)blake3_iv[i]);                                      \
+    v[12] = LOAD(ctr_lo);                                                    \
+    v[13] = LOAD(ctr_hi);                                                    \
+    v[14] = SET1(BLAKE3_BLOCK_LEN);                                          \
+    v[15] = SET1(block_flags);                                               \
+                                                                             \
+    for (r = 0; r < 7; r++) {                                                \
+      BLAKE3_ROUND(ADD, XOR, ROTR, v, m, blake3_schedule[r])                 \
+    }                                                                        \
+    for (i = 0; i < 8; i++)                                                  \
+      h[i] = XOR(v[i], v[i+8]);                                              \
+  }                                                                          \
+                                                                             \
+  for (i = 0; i < 8; i++)                                                    \
+    STORE(words[i], h[i]);                                                   \
+  for (i = 0; i < LANES; i++)                                                \
+    for (j = 0; j < 8; j++)                                                  \
+      memcpy(&out[i*BLAKE3_OUT_LEN + 4*j], &words[j][i], 4);
+
+#define WORD_ADD(a, b)    ((a) + (b))
+#define WORD_XOR(a, b)    ((a) ^ (b))
+#define WORD_ROTR(x, c)   (((x) >> (c)) | ((x) << (32 - (c))))
+
+#define SSE_SET1(x)       _mm_set1_epi32(x)
+#define SSE_LOAD(p)       _mm_load_si128((const __m128i *)(p))
+#define SSE_STORE(p, x)   _mm_store_si128((__m128i *)(p), x)
+#define SSE_ADD(a, b)     _mm_add_epi32(a, b)
+#define SSE_XOR(a, b)     _mm_xor_si128(a, b)
+#define SSE_ROTR(x, c)    _mm_or_si128(_mm_srli_epi32(x, c),                 \
+                                       _mm_slli_epi32(x, 32 - (c)))
+
+#define AVX2_SET1(x)      _mm256_set1_epi32(x)
+#define AVX2_LOAD(p)      _mm256_load_si256((const __m256i *)(p))
+#define AVX2_STORE(p, x)  _mm256_store_si256((__m256i *)(p), x)
+#define AVX2_ADD(a, b)    _mm256_add_epi32(a, b)
+#define AVX2_XOR(a, b)    _mm256_xor_si256(a, b)
+#define AVX2_ROTR(x, c)   _mm256_or_si256(_mm256_srli_epi32(x, c),           \
+                                          _mm256_slli_epi32(x, 32 - (c)))
+
+#define AVX512_SET1(x)      _mm512_set1_epi32(x)
+#define AVX512_LOAD(p)      _mm512_load_si512((const void *)(p))
+#define AVX512_STORE(p, x)  _mm512_store_si512((void *)(p), x)
+#define AVX512_ADD(a, b)    _mm512_add_epi32(a, b)
+#define AVX512_XOR(a, b)    _mm512_xor_si512(a, b)
+#define AVX512_ROTR(x, c)   _mm512_ror_epi32(x, c)
+
+// private functions
+uint32_t blake3_load32(const uint8_t *p);
+void blake3_compress(const uint32_t cv[8], const uint8_t *block,
+                     uint32_t block_len, uint64_t counter, uint8_t flags,
+                     uint32_t out[8]);
+void blake3_chunk_cv(const uint8_t *in, uint64_t len, uint64_t counter,
+                     uint8_t flags, uint32_t cv[8]);
+void blake3_many(const uint8_t *in, uint64_t stride, uint64_t n, int nblocks,
+                 uint64_t counter, int increment, uint8_t flags,
+                 uint8_t flags_start, uint8_t flags_end, uint8_t *out);
+void blake3_msg_sse41(const uint8_t *in, uint64_t stride, __m128i m[16]);
+void blake3_msg_avx2(const uint8_t *in, uint64_t stride, __m256i m[16]);
+void blake3_msg_avx512(const uint8_t *in, uint64_t stride, __m512i m[16]);
+void blake3_many_sse41(const uint8_t *in, uint64_t stride, int nblocks,
+                       uint64_t counter, int increment, uint8_t flags,
+                       uint8_t flags_start, uint8_t flags_end, uint8_t *out);
+void blake3_many_avx2(const uint8_t *in, uint64_t stride, int nblocks,
+                      uint64_t counter, int increment, uint8_t flags,
+                      uint8_t flags_start, uint8_t flags_end, uint8_t *out);
+void blake3_many_avx512(const uint8_t *in, uint64_t stride, int nblocks,
+                        uint64_t counter, int increment, uint8_t flags,
+                        uint8_t flags_start, uint8_t flags_end, uint8_t *out);
+void blake3_push(Blake3Hasher *this, const uint8_t *cv, int level);
+
+void blake3_hash(const uint8_t *buf, uint64_t buf_sz, uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: Hash any buffer with BLAKE3. This is the incremental hasher fed the
+//       whole buffer at once, so the only memory used is its fixed stack of
+//       BLAKE3_MAX_DEPTH chaining values and nothing is allocated.
+// Args: buf - the buffer we want to hash
+//       buf_sz - the size of the buffer
+//       hash - BLAKE3_OUT_LEN bytes of output
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blake3Hasher hasher;
+
+  blake3_init(&hasher);
+  blake3_update(&hasher, buf, buf_sz);
+  blake3_final(&hasher, hash);
+}
+
+void blake3_init(Blake3Hasher *this)
+// -----------------------------------------------------------------------------
+// Func: Start an incremental hash
+// Args: this - a pointer to the hasher
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  this->depth = 0;
+  this->chunks = 0;
+  this->buf_len = 0;
+}
+
+void blake3_update(Blake3Hasher *this, const uint8_t *buf, uint64_t buf_sz)
+// -----------------------------------------------------------------------------
+// Func: Hash more input. Whole chunks that are not the last are compressed
+//       straight from buf, a batch at a time, and a batch that fills an
+//       aligned subtree has its parents reduced in the vector unit as well.
+// Args: this - a pointer to the hasher
+//       buf - the input
+//       buf_sz - its size
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t cvs[BLAKE3_BATCH*BLAKE3_OUT_LEN];
+  uint32_t cv[8];
+  uint64_t n, i;
+
+  while (buf_sz > 0) {
+    // a full chunk followed by more input is not the last, push it
+    if (this->buf_len == BLAKE3_CHUNK_LEN) {
+      blake3_chunk_cv(this->buf, BLAKE3_CHUNK_LEN, this->chunks, 0, cv);
+      blake3_push(this, (uint8_t *)cv, 0);
+      this->buf_len = 0;
+    }
+
+    // whole chunks with input after them skip the buffer
+    if (this->buf_len == 0 && buf_sz > BLAKE3_CHUNK_LEN) {
+      n = (buf_sz - 1) / BLAKE3_CHUNK_LEN;
+      // stop at a batch boundary so later batches are aligned subtrees
+      if (n > BLAKE3_BATCH - (this->chunks & (BLAKE3_BATCH-1)))
+        n = BLAKE3_BATCH - (this->chunks & (BLAKE3_BATCH-1));
+      blake3_many(buf, BLAKE3_CHUNK_LEN, n, BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN,
+                  this->chunks, 1, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END,
+                  cvs);
+      if (n == BLAKE3_BATCH) { // a whole subtree, reduce it level by level
+        for (i = BLAKE3_BATCH; i > 1; i /= 2)
+          blake3_many(cvs, BLAKE3_BLOCK_LEN, i/2, 1, 0, 0, BLAKE3_PARENT, 0, 0,
+                      cvs);
+        blake3_push(this, cvs, BLAKE3_BATCH_LOG);
+      }
+      else {
+        for (i = 0; i < n; i++)
+          blake3_push(this, &cvs[i*BLAKE3_OUT_LEN], 0);
+      }
+      buf += n*BLAKE3_CHUNK_LEN;
+      buf_sz -= n*BLAKE3_CHUNK_LEN;
+      continue;
+    }
+
+    n = BLAKE3_CHUNK_LEN - this->buf_len;
+    if (n > buf_sz)
+      n = buf_sz;
+    memcpy(&this->buf[this->buf_len], buf, n);
+    this->buf_len += n;
+    buf += n;
+    buf_sz -= n;
+  }
+}
+
+void blake3_final(Blake3Hasher *this, uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: Finish the hash. The held back chunk is the last one; it is the root
+//       if nothing was pushed, else it is merged up the stack and the last
+//       merge is the root.
+// Args: this - a pointer to the hasher
+//       hash - BLAKE3_OUT_LEN bytes of output
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint32_t cv[8];
+  int d;
+
+  if (this->depth == 0) {
+    blake3_chunk_cv(this->buf, this->buf_len, this->chunks, BLAKE3_ROOT, cv);
+    memcpy(hash, cv, BLAKE3_OUT_LEN);
+    return;
+  }
+
+  blake3_chunk_cv(this->buf, this->buf_len, this->chunks, 0, cv);
+  for (d = this->depth - 1; d >= 0; d--) {
+    memcpy(block, this->stack[d], BLAKE3_OUT_LEN);
+    memcpy(&block[BLAKE3_OUT_LEN], cv, BLAKE3_OUT_LEN);
+    blake3_compress(blake3_iv, block, BLAKE3_BLOCK_LEN, 0,
+                    BLAKE3_PARENT | (d == 0 ? BLAKE3_ROOT : 0), cv);
+  }
+  memcpy(hash, cv, BLAKE3_OUT_LEN);
+}
+
+void blake3_push(Blake3Hasher *this, const uint8_t *cv, int level)
+// -----------------------------------------------------------------------------
+// Func: Push the chaining value of a subtree of 2^level chunks known not to
+//       hold the last chunk, merging every larger subtree it completes. More
+//       chunks follow, so none of these merges is the root.
+// Args: this - a pointer to the hasher
+//       cv - the subtree's chaining value, BLAKE3_OUT_LEN bytes
+//       level - log2 of its chunk count; the chunks before it must be a
+//               multiple of its size
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint32_t parent[8];
+  uint64_t total;
+
+  memcpy(&block[BLAKE3_OUT_LEN], cv, BLAKE3_OUT_LEN);
+  this->chunks += (uint64_t)1 << level;
+  for (total = this->chunks >> level; (total & 1) == 0; total >>= 1) {
+    memcpy(block, this->stack[--this->depth], BLAKE3_OUT_LEN);
+    blake3_compress(blake3_iv, block, BLAKE3_BLOCK_LEN, 0, BLAKE3_PARENT,
+                    parent);
+    memcpy(&block[BLAKE3_OUT_LEN], parent, BLAKE3_OUT_LEN);
+  }
+  memcpy(this->stack[this->depth++], &block[BLAKE3_OUT_LEN], BLAKE3_OUT_LEN);
+}
+
+uint32_t blake3_load32(const uint8_t *p)
+// -----------------------------------------------------------------------------
+// Func: Load a little endian word (the host order, like the block frames)
+// Args: p - 4 bytes
+// Retn: the word
+// -----------------------------------------------------------------------------
+{
+  uint32_t w;
+
+  memcpy(&w, p, 4);
+  return w;
+}
+
+void blake3_compress(const uint32_t cv[8], const uint8_t *block,
+                     uint32_t block_len, uint64_t counter, uint8_t flags,
+                     uint32_t out[8])
+// -----------------------------------------------------------------------------
+// Func: The BLAKE3 compression function, one block, portable
+// Args: cv - input chaining value
+//       block - BLAKE3_BLOCK_LEN bytes, zero padded past block_len
+//       block_len - bytes of the block in use
+//       counter - chunk counter (0 for parents)
+//       flags - domain flags
+//       out - output chaining value, may alias cv
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint32_t v[16], m[16];
+  int i, r;
+
+  for (i = 0; i < 16; i++)
+    m[i] = blake3_load32(&block[4*i]);
+
+  for (i = 0; i < 8; i++)
+    v[i] = cv[i];
+  for (i = 0; i < 4; i++)
+    v[8+i] = blake3_iv[i];
+  v[12] = (uint32_t)counter;
+  v[13] = (uint32_t)(counter >> 32);
+  v[14] = block_len;
+  v[15] = flags;
+
+  for (r = 0; r < 7; r++) {
+    BLAKE3_ROUND(WORD_ADD, WORD_XOR, WORD_ROTR, v, m, blake3_schedule[r])
+  }
+
+  for (i = 0; i < 8; i++)
+    out[i] = v[i] ^ v[i+8];
+}
+
+void blake3_chunk_cv(const uint8_t *in, uint64_t len, uint64_t counter,
+                     uint8_t flags, uint32_t cv[8])
+// -----------------------------------------------------------------------------
+// Func: Chaining value of one chunk of up to BLAKE3_CHUNK_LEN bytes
+// Args: in - the chunk
+//       len - its length, 0 allowed
+//       counter - the chunk's index in the input
+//       flags - extra flags for the last block (BLAKE3_ROOT or 0)
+//       cv - the result
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint64_t nblocks = len ? (len + BLAKE3_BLOCK_LEN - 1) / BLAKE3_BLOCK_LEN : 1;
+  uint64_t b, block_len;
+  uint8_t block_flags;
+
+  memcpy(cv, blake3_iv, sizeof(blake3_iv));
+
+  for (b = 0; b < nblocks; b++) {
+    block_len = b == nblocks-1 ? len - b*BLAKE3_BLOCK_LEN : BLAKE3_BLOCK_LEN;
+    memset(block, 0, BLAKE3_BLOCK_LEN);
+    memcpy(block, &in[b*BLAKE3_BLOCK_LEN], block_len);
+
+    block_flags = (b == 0 ? BLAKE3_CHUNK_START : 0) |
+                  (b == nblocks-1 ? BLAKE3_CHUNK_END | flags : 0);
+    blake3_compress(cv, block, (uint32_t)block_len, counter, block_flags, cv);
+  }
+}
+
+void blake3_many(const uint8_t *in, uint64_t stride, uint64_t n, int nblocks,
+                 uint64_t counter, int increment, uint8_t flags,
+                 uint8_t flags_start, uint8_t flags_end, uint8_t *out)
+// -----------------------------------------------------------------------------
+// Func: Chaining values of n equal length inputs, using the widest vector
+//       unit the cpu has and narrower ones for the remainder
+// Args: in - first input, input i at in + i*stride
+//       stride - distance between inputs
+//       n - number of inputs
+//       nblocks - blocks per input, all full
+//       counter - counter of the first input
+//       increment - 1 if input i uses counter + i (chunks), 0 if not (parents)
+//       flags - flags for every block
+//       flags_start, flags_end - extra flags for the first and last block
+//       out - n*BLAKE3_OUT_LEN bytes, may overlap in as long as output i
+//             ends before input i+1 starts
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  static int detected = 0;
+  uint32_t cv[8];
+  uint64_t step;
+  int lanes, b;
+
+  // every thread that races here computes the same width, so a relaxed
+  // store is enough to publish it
+  if ((lanes = __atomic_load_n(&detected, __ATOMIC_RELAXED)) == 0) {
+    __builtin_cpu_init();
+    lanes = __builtin_cpu_supports("avx512f") ? 16 :
+            __builtin_cpu_supports("avx2") ? 8 :
+            __builtin_cpu_supports("sse4.1") ? 4 : 1;
+    __atomic_store_n(&detected, lanes, __ATOMIC_RELAXED);
+  }
+
+  for (; n > 0; n -= step) {
+    if (lanes >= 16 && n >= 16) {
+      step = 16;
+      blake3_many_avx512(in, stride, nblocks, counter, increment, flags,
+                         flags_start, flags_end, out);
+    }
+    else if (lanes >= 8 && n >= 8) {
+      step = 8;
+      blake3_many_avx2(in, stride, nblocks, counter, increment, flags,
+                       flags_start, flags_end, out);
+    }
+    else if (lanes >= 4 && n >= 4) {
+      step = 4;
+      blake3_many_sse41(in, stride, nblocks, counter, increment, flags,
+                        flags_start, flags_end, out);
+    }
+    else {
+      step = 1;
+      memcpy(cv, blake3_iv, sizeof(blake3_iv));
+      for (b = 0; b < nblocks; b++)
+        blake3_compress(cv, &in[b*BLAKE3_BLOCK_LEN], BLAKE3_BLOCK_LEN, counter,
+                        flags | (b == 0 ? flags_start : 0) |
+                        (b == nblocks-1 ? flags_end : 0), cv);
+      memcpy(out, cv, BLAKE3_OUT_LEN);
+    }
+
+    in += step*stride;
+    out += step*BLAKE3_OUT_LEN;
+    counter += increment ? step : 0;
+  }
+}
+
+__attribute__((target("sse4.1")))
+void blake3_msg_sse41(const uint8_t *in, uint64_t stride, __m128i m[16])
+// -----------------------------------------------------------------------------
+// Func: Load one block of 4 inputs, transposed four words at a time
+// Args: in - the block of the first input, input i at in + i*stride
+//       stride - distance between inputs
+//       m - m[j] gets word j of every input
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  __m128i v0, v1, v2, v3, t0, t1, t2, t3;
+  int q;
+
+  for (q = 0; q < 4; q++) {
+    v0 = _mm_loadu_si128((const __m128i *)&in[0*stride + 16*q]);
+    v1 = _mm_loadu_si128((const __m128i *)&in[1*stride + 16*q]);
+    v2 = _mm_loadu_si128((const __m128i *)&in[2*stride + 16*q]);
+    v3 = _mm_loadu_si128((const __m128i *)&in[3*stride + 16*q]);
+
+    t0 = _mm_unpacklo_epi32(v0, v1);
+    t1 = _mm_unpackhi_epi32(v0, v1);
+    t2 = _mm_unpacklo_epi32(v2, v3);
+    t3 = _mm_unpackhi_epi32(v2, v3);
+
+    m[4*q+0] = _mm_unpacklo_epi64(t0, t2);
+    m[4*q+1] = _mm_unpackhi_epi64(t0, t2);
+    m[4*q+2] = _mm_unpacklo_epi64(t1, t3);
+    m[4*q+3] = _mm_unpackhi_epi64(t1, t3);
+  }
+}
+
+__attribute__((target("avx2")))
+void blake3_msg_avx2(const uint8_t *in, uint64_t stride, __m256i m[16])
+// -----------------------------------------------------------------------------
+// Func: Load one block of 8 inputs, as two 8x8 word transposes
+// Args: in - the block of the first input, input i at in + i*stride
+//       stride - distance between inputs
+//       m - m[j] gets word j of every input
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  __m256i v[8], t[8], u[8];
+  int half, i;
+
+  for (half = 0; half < 2; half++) {
+    for (i = 0; i < 8; i++)
+      v[i] = _mm256_loadu_si256((const __m256i *)&in[i*stride + 32*half]);
+
+    // pairs of inputs, words {0,1,4,5} and {2,3,6,7}
+    for (i = 0; i < 4; i++) {
+      t[2*i] = _mm256_unpacklo_epi32(v[2*i], v[2*i+1]);
+      t[2*i+1] = _mm256_unpackhi_epi32(v[2*i], v[2*i+1]);
+    }
+    // quads of inputs, one word per 128 bit half
+    for (i = 0; i < 2; i++) {
+      u[4*i+0] = _mm256_unpacklo_epi64(t[4*i], t[4*i+2]);
+      u[4*i+1] = _mm256_unpackhi_epi64(t[4*i], t[4*i+2]);
+      u[4*i+2] = _mm256_unpacklo_epi64(t[4*i+1], t[4*i+3]);
+      u[4*i+3] = _mm256_unpackhi_epi64(t[4*i+1], t[4*i+3]);
+    }
+    // join the two quads
+    for (i = 0; i < 4; i++) {
+      m[8*half+i] = _mm256_permute2x128_si256(u[i], u[4+i], 0x20);
+      m[8*half+4+i] = _mm256_permute2x128_si256(u[i], u[4+i], 0x31);
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+void blake3_msg_avx512(const uint8_t *in, uint64_t stride, __m512i m[16])
+// -----------------------------------------------------------------------------
+// Func: Load one block of 16 inputs, as a 16x16 word transpose
+// Args: in - the block of the first input, input i at in + i*stride
+//       stride - distance between inputs
+//       m - m[j] gets word j of every input
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  __m512i v[16], t[16], x[16], a, b, c, d;
+  int i, g, w;
+
+  for (i = 0; i < 16; i++)
+    v[i] = _mm512_loadu_si512((const void *)&in[i*stride]);
+
+  // pairs of inputs, words {4k,4k+1} and {4k+2,4k+3} in 128 bit lane k
+  for (i = 0; i < 8; i++) {
+    t[2*i] = _mm512_unpacklo_epi32(v[2*i], v[2*i+1]);
+    t[2*i+1] = _mm512_unpackhi_epi32(v[2*i], v[2*i+1]);
+  }
+  // x[4g+w] holds word 4k+w of inputs 4g..4g+3 in 128 bit lane k
+  for (g = 0; g < 4; g++) {
+    x[4*g+0] = _mm512_unpacklo_epi64(t[4*g], t[4*g+2]);
+    x[4*g+1] = _mm512_unpackhi_epi64(t[4*g], t[4*g+2]);
+    x[4*g+2] = _mm512_unpacklo_epi64(t[4*g+1], t[4*g+3]);
+    x[4*g+3] = _mm512_unpackhi_epi64(t[4*g+1], t[4*g+3]);
+  }
+  // transpose the 128 bit lanes across the four groups
+  for (w = 0; w < 4; w++) {
+    a = _mm512_shuffle_i32x4(x[w], x[4+w], 0x44);
+    b = _mm512_shuffle_i32x4(x[w], x[4+w], 0xee);
+    c = _mm512_shuffle_i32x4(x[8+w], x[12+w], 0x44);
+    d = _mm512_shuffle_i32x4(x[8+w], x[12+w], 0xee);
+    m[w] = _mm512_shuffle_i32x4(a, c, 0x88);
+    m[4+w] = _mm512_shuffle_i32x4(a, c, 0xdd);
+    m[8+w] = _mm512_shuffle_i32x4(b, d, 0x88);
+    m[12+w] = _mm512_shuffle_i32x4(b, d, 0xdd);
+  }
+}
+
+__attribute__((target("sse4.1")))
+void blake3_many_sse41(const uint8_t *in, uint64_t stride, int nblocks,
+                       uint64_t counter, int increment, uint8_t flags,
+                       uint8_t flags_start, uint8_t flags_end, uint8_t *out)
+// -----------------------------------------------------------------------------
+// Func: blake3_many for exactly 4 inputs
+// -----------------------------------------------------------------------------
+{
+  BLAKE3_MANY_BODY(4, __m128i, SSE_SET1, SSE_LOAD, SSE_STORE,
+                   SSE_ADD, SSE_XOR, SSE_ROTR, blake3_msg_sse41)
+}
+
+__attribute__((target("avx2")))
+void blake3_many_avx2(const uint8_t *in, uint64_t stride, int nblocks,
+                      uint64_t counter, int increment, uint8_t flags,
+                      uint8_t flags_start, uint8_t flags_end, uint8_t *out)
+// -----------------------------------------------------------------------------
+// Func: blake3_many for exactly 8 inputs
+// -----------------------------------------------------------------------------
+{
+  BLAKE3_MANY_BODY(8, __m256i, AVX2_SET1, AVX2_LOAD, AVX2_STORE,
+                   AVX2_ADD, AVX2_XOR, AVX2_ROTR, blake3_msg_avx2)
+}
+
+__attribute__((target("avx512f")))
+void blake3_many_avx512(const uint8_t *in, uint64_t stride, int nblocks,
+                        uint64_t counter, int increment, uint8_t flags,
+                        uint8_t flags_start, uint8_t flags_end, uint8_t *out)
+// -----------------------------------------------------------------------------
+// Func: blake3_many for exactly 16 inputs
+// -----------------------------------------------------------------------------
+{
+  BLAKE3_MANY_BODY(16, __m512i, AVX512_SET1, AVX512_LOAD, AVX512_STORE,
+                   AVX512_ADD, AVX512_XOR, AVX512_ROTR, blake3_msg_avx512)
+}
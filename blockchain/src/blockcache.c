@@ -0,0 +1,356 @@
+/*
+blockcache.c: sharded cache of framed blocks read back from disk
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blockcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// private functions, access through BlockCache object
+uint8_t *blockcache_get(BlockCache *this, uint64_t index,
+                        BlockCacheEntry **pin);
+void blockcache_release(BlockCache *this, BlockCacheEntry *pin);
+
+// private functions
+BlockCacheEntry **blockcache_find(BlockCacheShard *shard, uint64_t index);
+int blockcache_evict(BlockCacheShard *shard);
+int blockcache_insert(BlockCacheShard *shard, BlockCacheEntry *entry);
+int blockcache_rehash(BlockCacheShard *shard);
+
+int blockcache_init(BlockCache *this, Blockchain *chain, uint64_t budget)
+// -----------------------------------------------------------------------------
+// Func: Initialize an empty cache in front of a chain
+// Args: this - a pointer to the new cache
+//       chain - the chain it reads from, must outlive the cache
+//       budget - most frame bytes cached, split evenly between shards
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  BlockCacheShard *shard;
+  int s;
+
+  this->chain = chain;
+
+  for (s = 0; s < BLOCKCACHE_SHARDS; s++) {
+    shard = &this->shards[s];
+    shard->nbuckets = BLOCKCACHE_BUCKETS;
+    if ((shard->buckets = calloc(shard->nbuckets,
+                                 sizeof(BlockCacheEntry *))) == NULL) {
+      while (s-- > 0) {
+        free(this->shards[s].buckets);
+        pthread_mutex_destroy(&this->shards[s].lock);
+      }
+      return -1;
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->clock = NULL;
+    shard->count = 0;
+    shard->cap = 0;
+    shard->hand = 0;
+    shard->bytes = 0;
+    shard->budget = budget / BLOCKCACHE_SHARDS;
+    shard->hits = 0;
+    shard->misses = 0;
+    shard->evictions = 0;
+  }
+
+  this->get = &blockcache_get;
+  this->release = &blockcache_release;
+
+  return 0;
+}
+
+void blockcache_destroy(BlockCache *this)
+// -----------------------------------------------------------------------------
+// Func: Destroy a cache. Nothing may still be pinned.
+// Args: this - a pointer to the cache
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  BlockCacheShard *shard;
+  uint64_t i;
+  int s;
+
+  for (s = 0; s < BLOCKCACHE_SHARDS; s++) {
+    shard = &this->shards[s];
+    for (i = 0; i < shard->count; i++) {
+      free(shard->clock[i]->frame);
+      free(shard->clock[i]);
+    }
+    free(shard->clock);
+    free(shard->buckets);
+    shard->clock = NULL;
+    shard->buckets = NULL;
+    shard->count = 0;
+    shard->bytes = 0;
+    pthread_mutex_destroy(&shard->lock);
+  }
+}
+
+void blockcache_stats(BlockCache *this, uint64_t *hits, uint64_t *misses,
+                      uint64_t *evictions, uint64_t *bytes)
+// -----------------------------------------------------------------------------
+// Func: Sum the counters of every shard
+// Args: this - a pointer to the cache
+//       hits, misses, evictions - lookup counters since init
+//       bytes - frame bytes cached right now
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  BlockCacheShard *shard;
+  int s;
+
+  *hits = *misses = *evictions = *bytes = 0;
+  for (s = 0; s < BLOCKCACHE_SHARDS; s++) {
+    shard = &this->shards[s];
+    pthread_mutex_lock(&shard->lock);
+    *hits += shard->hits;
+    *misses += shard->misses;
+    *evictions += shard->evictions;
+    *bytes += shard->bytes;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+uint8_t *blockcache_get(BlockCache *this, uint64_t index,
+                        BlockCacheEntry **pin)
+// -----------------------------------------------------------------------------
+// Func: Get a framed block from the cache, else copy it into the cache from
+//       the chain (resident) or from disk (pruned). Resident frames are
+//       copied too, since the chain may prune and free them while the caller
+//       still holds them.
+// Args: this - a pointer to the cache
+//       index - the index of the block
+//       pin - set to the pinned entry, to be given back to release; NULL
+//             if there is no block
+// Retn: the framed block, NULL if out of range or the record was dropped
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain = this->chain;
+  BlockCacheShard *shard = &this->shards[index & (BLOCKCACHE_SHARDS-1)];
+  BlockCacheEntry *entry, *found;
+  uint8_t *header;
+  int err;
+
+  // appends move the headers and pruning frees frames, keep both still
+  *pin = NULL;
+  pthread_rwlock_rdlock(&chain->lock);
+  if ((header = blockchain_get_header(chain, index)) == NULL) {
+    pthread_rwlock_unlock(&chain->lock);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&shard->lock);
+  if ((found = *blockcache_find(shard, index)) != NULL) {
+    shard->hits++;
+    found->ref = 1;
+    found->pins++;
+    pthread_mutex_unlock(&shard->lock);
+    pthread_rwlock_unlock(&chain->lock);
+    *pin = found;
+    return found->frame;
+  }
+  shard->misses++;
+  pthread_mutex_unlock(&shard->lock);
+
+  // copy without holding the shard lock, other blocks in it stay available
+  err = (entry = malloc(sizeof(BlockCacheEntry))) == NULL;
+  if (!err) {
+    entry->size = blockframe_size(header);
+    err = (entry->frame = malloc(entry->size)) == NULL ||
+          blockchain_read_frame(chain, index, entry->frame);
+    if (err) {
+      free(entry->frame);
+      free(entry);
+    }
+  }
+  pthread_rwlock_unlock(&chain->lock);
+  if (err)
+    return NULL;
+  entry->index = index;
+  entry->pins = 1;
+  entry->ref = 0;
+  entry->cached = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  if ((found = *blockcache_find(shard, index)) != NULL) { // lost a race
+    found->ref = 1;
+    found->pins++;
+    pthread_mutex_unlock(&shard->lock);
+    free(entry->frame);
+    free(entry);
+    *pin = found;
+    return found->frame;
+  }
+  blockcache_insert(shard, entry); // uncached if it can't fit, see release
+  pthread_mutex_unlock(&shard->lock);
+
+  *pin = entry;
+  return entry->frame;
+}
+
+void blockcache_release(BlockCache *this, BlockCacheEntry *pin)
+// -----------------------------------------------------------------------------
+// Func: Unpin a block returned by get
+// Args: this - a pointer to the cache
+//       pin - the entry get returned, NULL is fine
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  BlockCacheShard *shard;
+  int dead;
+
+  if (pin == NULL)
+    return;
+
+  shard = &this->shards[pin->index & (BLOCKCACHE_SHARDS-1)];
+  pthread_mutex_lock(&shard->lock);
+  dead = --pin->pins == 0 && !pin->cached;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (dead) {
+    free(pin->frame);
+    free(pin);
+  }
+}
+
+BlockCacheEntry **blockcache_find(BlockCacheShard *shard, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Find where a block is, or would be linked, in the shard's table
+// Args: shard - the shard, locked
+//       index - the index of the block
+// Retn: pointer to the link holding the entry, or to the NULL ending its chain
+// -----------------------------------------------------------------------------
+{
+  BlockCacheEntry **link;
+
+  link = &shard->buckets[(index >> BLOCKCACHE_SHARD_BITS) &
+                         (shard->nbuckets-1)];
+  while (*link != NULL && (*link)->index != index)
+    link = &(*link)->next;
+
+  return link;
+}
+
+int blockcache_evict(BlockCacheShard *shard)
+// -----------------------------------------------------------------------------
+// Func: Evict one entry with the CLOCK policy: sweep the hand, clearing
+//       reference bits, until an unreferenced, unpinned entry comes up
+// Args: shard - the shard, locked
+// Retn: 0 if an entry was evicted, -1 if everything is pinned
+// -----------------------------------------------------------------------------
+{
+  BlockCacheEntry *victim, **link;
+  uint64_t steps;
+
+  for (steps = 0; steps < 2*shard->count; steps++) {
+    victim = shard->clock[shard->hand];
+
+    if (victim->pins == 0 && !victim->ref) {
+      link = blockcache_find(shard, victim->index);
+      *link = victim->next;
+
+      // the last entry on the clock takes the victim's place
+      shard->clock[shard->hand] = shard->clock[--shard->count];
+      shard->clock[shard->hand]->slot = shard->hand;
+      if (shard->hand >= shard->count)
+        shard->hand = 0;
+
+      shard->bytes -= victim->size;
+      shard->evictions++;
+      free(victim->frame);
+      free(victim);
+      return 0;
+    }
+
+    victim->ref = 0;
+    shard->hand = (shard->hand + 1) % shard->count;
+  }
+
+  return -1;
+}
+
+int blockcache_insert(BlockCacheShard *shard, BlockCacheEntry *entry)
+// -----------------------------------------------------------------------------
+// Func: Make room for an entry within the shard's budget and cache it
+// Args: shard - the shard, locked
+//       entry - a new entry, not cached yet
+// Retn: 0 if cached, -1 if it can't be (too big, everything pinned, or no
+//       memory); the entry is then freed by its last release
+// -----------------------------------------------------------------------------
+{
+  BlockCacheEntry **clock, **link;
+  uint64_t cap;
+
+  if (entry->size > shard->budget)
+    return -1;
+
+  while (shard->bytes + entry->size > shard->budget)
+    if (blockcache_evict(shard))
+      return -1;
+
+  if (shard->count == shard->cap) {
+    cap = shard->cap ? 2*shard->cap : 64;
+    if ((clock = realloc(shard->clock, cap*sizeof(BlockCacheEntry *))) == NULL)
+      return -1;
+    shard->clock = clock;
+    shard->cap = cap;
+  }
+  if (shard->count == shard->nbuckets && blockcache_rehash(shard))
+    return -1;
+
+  entry->slot = shard->count;
+  shard->clock[shard->count++] = entry;
+  link = blockcache_find(shard, entry->index); // the NULL ending the chain
+  entry->next = NULL;
+  *link = entry;
+  entry->cached = 1;
+  shard->bytes += entry->size;
+
+  return 0;
+}
+
+int blockcache_rehash(BlockCacheShard *shard)
+// -----------------------------------------------------------------------------
+// Func: Double the shard's table, so chains stay short as the cache grows
+// Args: shard - the shard, locked
+// Retn: 0 on success, -1 on allocation failure (the table is unchanged)
+// -----------------------------------------------------------------------------
+{
+  BlockCacheEntry **buckets, **link, *entry;
+  uint64_t i, nbuckets = 2*shard->nbuckets;
+
+  if ((buckets = calloc(nbuckets, sizeof(BlockCacheEntry *))) == NULL)
+    return -1;
+
+  // every cached entry is on the clock
+  for (i = 0; i < shard->count; i++) {
+    entry = shard->clock[i];
+    link = &buckets[(entry->index >> BLOCKCACHE_SHARD_BITS) & (nbuckets-1)];
+    entry->next = *link;
+    *link = entry;
+  }
+
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+
+  return 0;
+}
@@ -20,11 +20,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "blockchain.h"
 #include "util.h"
+#include "blake3.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 //----------------------//
 // "PRIVATE" PROTOTYPES //
@@ -32,81 +36,579 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 // LinkedList "inherited" functions
 // int blockchain_delete_front(Blockchain *this);
-void blockchain_insert_front(Blockchain *this,
+int blockchain_insert_front(Blockchain *this,
                uint8_t *record,
                uint64_t record_sz);
+int blockchain_append(Blockchain *this, uint8_t *record, uint64_t record_sz);
 void *blockchain_peek_front(Blockchain *this);
 void *blockchain_get(Blockchain *this, uint64_t index);
 
 // Blockchain functions
-int blockchain_verify_block(Block *new_block, Block *old_block);
+int blockchain_verify_block(Block *new_block, Block *old_block,
+                            uint8_t hash_alg);
+int blockchain_verify_links(Block *block, Block *prev_block);
 int blockchain_verify_chain(Blockchain *this);
 void blockchain_root(Blockchain *this);
+Node *blockchain_node(Blockchain *this, uint64_t index);
+void blockchain_prune(Blockchain *this);
+int blockchain_index(Blockchain *this, uint8_t *blockframe, uint64_t blocksize);
 // Block functions
-void block_hash(Block *this, uint8_t *hash);
 void block_frame(Block *this, uint8_t *buf);
 // BlockFrame functions
+void blockheader_decode(uint8_t *header, Block *block);
 void blockframe_decode(uint8_t *blockframe, Block *block);
 void blockframe_print(uint8_t *this);
+uint64_t blockframe_size(uint8_t *blockframe);
 
 //-----------------//
 // IMPLEMENTATIONS //
 //-----------------//
 
-// wrapper for the linked list implementation of get
-void *blockchain_get(Blockchain *this, uint64_t index) {
-  return this->ll->get(this->ll, index);
+Node *blockchain_node(Blockchain *this, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Look up the list node holding a block through the page directory
+// Args: this - a pointer to the blockchain
+//       index - the index of the block, must be in range
+// Retn: the node
+// -----------------------------------------------------------------------------
+{
+  return this->pages[index >> BLOCKCHAIN_PAGE_BITS]
+                    [index & (BLOCKCHAIN_PAGE_SZ-1)];
 }
 
-int blockchain_verify_block(Block *block, Block *prev_block) {
-  uint64_t blocksize = BLOCK_HEADER_SZ + block->record_sz;
-  uint8_t buf[blocksize];
-  uint8_t hash[HASH_SZ];
+void *blockchain_get(Blockchain *this, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Look up a framed block by index through the page directory, O(1)
+// Args: this - a pointer to the blockchain
+//       index - the index of the block
+// Retn: Pointer to framed block, or NULL if index is past the front or the
+//       block has been pruned (see blockchain_read_frame)
+// -----------------------------------------------------------------------------
+{
+  if (index >= this->length || index < this->pruned)
+    return NULL;
 
-  util_buf_hash(buf, blocksize, hash);
+  return blockchain_node(this, index)->data;
+}
 
-  if (prev_block->index + 1 != block->index+1)
+uint8_t *blockchain_get_header(Blockchain *this, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Look up a block's header, available even when the block is pruned
+// Args: this - a pointer to the blockchain
+//       index - the index of the block
+// Retn: Pointer to BLOCK_HEADER_SZ bytes, or NULL if index is past the front.
+//       Only valid until the next append.
+// -----------------------------------------------------------------------------
+{
+  if (index >= this->length)
+    return NULL;
+
+  return &this->headers[index*BLOCK_HEADER_SZ];
+}
+
+int blockchain_read_frame(Blockchain *this, uint64_t index, uint8_t *buf)
+// -----------------------------------------------------------------------------
+// Func: Copy a full framed block into the caller's buffer, reading the record
+//       back from the spill file or the chunk store if the block has been
+//       pruned
+// Args: this - a pointer to the blockchain
+//       index - the index of the block
+//       buf - at least blockframe_size(blockchain_get_header(...)) bytes
+// Retn: 0 on success, -1 if out of range or the record was dropped
+// -----------------------------------------------------------------------------
+{
+  uint8_t *header = blockchain_get_header(this, index);
+  uint64_t record_sz, done;
+  ssize_t n;
+
+  if (header == NULL)
+    return -1;
+
+  if (index >= this->pruned) {
+    memcpy(buf, blockchain_node(this, index)->data, blockframe_size(header));
+    return 0;
+  }
+
+  if (this->spill_off[index] == BLOCKCHAIN_NOT_SPILLED)
+    return -1;
+
+  memcpy(buf, header, BLOCK_HEADER_SZ);
+  if (this->spill_off[index] & BLOCKCHAIN_CHUNKED)
+    return this->chunk_store->read(this->chunk_store,
+                                   this->spill_off[index] & ~BLOCKCHAIN_CHUNKED,
+                                   &buf[RECORD_POS]);
+
+  record_sz = blockframe_size(header) - BLOCK_HEADER_SZ;
+  for (done = 0; done < record_sz; done += n) {
+    n = pread(this->spill_fd, &buf[RECORD_POS + done], record_sz - done,
+              this->spill_off[index] + done);
+    if (n <= 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+int blockchain_verify_links(Block *block, Block *prev_block)
+// -----------------------------------------------------------------------------
+// Func: The cheap part of block verification, header fields only. Blocks
+//       never go back in time.
+// Args: block - the decoded block being checked
+//       prev_block - the decoded block that precedes it in the chain
+// Retn: 1 if block points at prev_block, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  if (prev_block->index + 1 != block->index)
     return 0;
-  else if (prev_block->hash != block->prevhash)
+  else if (prev_block->timestamp > block->timestamp)
     return 0;
-  else if (!strncmp((char *)hash, (char *)block->hash,  HASH_SZ))
+  else if (memcmp(prev_block->hash, block->prevhash, HASH_SZ))
     return 0;
 
   return 1;
+}
+
+int blockchain_verify_block(Block *block, Block *prev_block, uint8_t hash_alg)
+// -----------------------------------------------------------------------------
+// Func: Check that block correctly extends prev_block
+// Args: block - the decoded block being checked
+//       prev_block - the decoded block that precedes it in the chain
+//       hash_alg - the chain's hash function, BLOCKCHAIN_HASH_*
+// Retn: 1 if the block is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  Block unhashed;
+  uint8_t hash[HASH_SZ];
+
+  if (!blockchain_verify_links(block, prev_block))
+    return 0;
+
+  // the hash was computed with a zeroed hash field
+  unhashed = *block;
+  memset(unhashed.hash, 0, HASH_SZ);
+  block_hash(&unhashed, hash_alg, hash);
+
+  if (memcmp(hash, block->hash, HASH_SZ))
+    return 0;
+
+  return 1;
+}
+
+int blockchain_verify_root(Block *block)
+// -----------------------------------------------------------------------------
+// Func: Check the root block, which has no predecessor. It is hashed with
+//       whichever function its record names.
+// Args: block - the decoded root block
+// Retn: 1 if the block is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  Block unhashed;
+  uint8_t zero[HASH_SZ];
+  uint8_t hash[HASH_SZ];
+
+  memset(zero, 0, HASH_SZ);
+  if (block->index != 0 || memcmp(block->prevhash, zero, HASH_SZ))
+    return 0;
+
+  unhashed = *block;
+  memset(unhashed.hash, 0, HASH_SZ);
+  block_hash(&unhashed, blockchain_root_hash_alg(block), hash);
+
+  return !memcmp(hash, block->hash, HASH_SZ);
+}
+
+uint8_t blockchain_root_hash_alg(Block *root)
+// -----------------------------------------------------------------------------
+// Func: Read the hash function a chain uses from its root block's record,
+//       the root message followed by an optional tag (see blockchain_root)
+// Args: root - the decoded root block, record included
+// Retn: BLOCKCHAIN_HASH_BLAKE3 if tagged, BLOCKCHAIN_HASH_SHA256 otherwise
+// -----------------------------------------------------------------------------
+{
+  const char *record = (const char *)root->record;
+  uint64_t msg_sz = strnlen(record, root->record_sz) + 1;
+
+  if (msg_sz < root->record_sz &&
+      root->record_sz - msg_sz == sizeof(BLOCKCHAIN_ROOT_BLAKE3) &&
+      !memcmp(&record[msg_sz], BLOCKCHAIN_ROOT_BLAKE3,
+              sizeof(BLOCKCHAIN_ROOT_BLAKE3)))
+    return BLOCKCHAIN_HASH_BLAKE3;
+
+  return BLOCKCHAIN_HASH_SHA256;
+}
+
+int blockchain_verify_headers(Blockchain *this)
+// -----------------------------------------------------------------------------
+// Func: Check the prevhash links, indices and timestamps of every header,
+//       without hashing any records. Works on fully pruned history.
+// Args: this - a pointer to the blockchain
+// Retn: 1 if every header links to its predecessor, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint8_t zero[HASH_SZ];
+  Block root;
+
+  memset(zero, 0, HASH_SZ);
+  blockheader_decode(blockchain_get_header(this, 0), &root);
+  if (root.index != 0 || memcmp(root.prevhash, zero, HASH_SZ))
+    return 0;
+
+  // the same checks as blockchain_verify_links, over the header arrays
+  return this->links.verify_links(&this->links, 0, this->length);
+}
+
+int blockchain_verify_chain(Blockchain *this)
+// -----------------------------------------------------------------------------
+// Func: Verify every block in the chain against its predecessor. Pruned
+//       blocks are rehashed from the spill file; blocks whose record was
+//       dropped can only have their header links checked.
+// Args: this - a pointer to the blockchain
+// Retn: 1 if the whole chain is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  if (!blockchain_verify_headers(this))
+    return 0;
 
+  return blockchain_verify_range(this, 0, this->length) &&
+         blockchain_verify_signatures(this);
 }
 
-int blockchain_verify_chain(Blockchain *this) {
+int blockchain_verify_range(Blockchain *this, uint64_t lo, uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: Rehash the blocks in [lo, hi) and check each against its
+//       predecessor, newest first. Header links across the whole chain are
+//       checked separately, by blockchain_verify_headers, and signatures by
+//       blockchain_verify_signature_range.
+// Args: this - a pointer to the blockchain
+//       lo - first block
+//       hi - one past the last block, clipped to the chain's length
+// Retn: 1 if every block in range is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
   uint64_t i;
-  uint64_t length = this->length;
-  uint8_t *frame;
-  Block old_block, new_block;
+  uint8_t *frame, *tmp;
+  uint8_t *buf = NULL;
+  Block block, prev_block;
+  int valid = 1;
+
+  if (hi > this->length)
+    hi = this->length;
+
+  for (i = hi; valid && i-- > lo; ) {
+    if ((frame = (uint8_t *) this->get(this, i)) == NULL) {
+      if (this->spill_off[i] == BLOCKCHAIN_NOT_SPILLED)
+        continue; // links were checked above, nothing left to hash
 
-  for (i = length-1; i >= 1; i--) {
-    frame = (uint8_t *) this->get(this, i);
-    blockframe_decode(frame, &new_block);
+      // a block that can't be read back is not known to be valid
+      tmp = realloc(buf, blockframe_size(blockchain_get_header(this, i)));
+      if (tmp == NULL) {
+        valid = 0;
+        break;
+      }
+      buf = tmp;
+      if (blockchain_read_frame(this, i, buf)) {
+        valid = 0;
+        break;
+      }
+      frame = buf;
+    }
 
-    // get the previous one
-    frame = (uint8_t *) this->get(this, i-1);
-    blockframe_decode(frame, &old_block);
+    // decode without copying the record, hashing reads it in place
+    blockheader_decode(frame, &block);
+    block.record = &frame[RECORD_POS];
 
-    if (!blockchain_verify_block(&new_block, &old_block))
-      return 0;
+    if (i == 0) {
+      valid = blockchain_verify_root(&block);
+    }
+    else {
+      blockheader_decode(blockchain_get_header(this, i-1), &prev_block);
+      valid = blockchain_verify_block(&block, &prev_block, this->hash_alg);
+    }
   }
 
-  return 1;
+  free(buf);
+  return valid;
 }
 
-void blockchain_init(Blockchain *this)
+void blockchain_set_signatures(Blockchain *this, SigCache *cache,
+                               ThreadPool *pool)
 // -----------------------------------------------------------------------------
-// Func: Initialize a new blockchain
+// Func: Give the chain a verification cache and a pool for signature checks.
+//       Records verified on append go into the cache, so a later
+//       blockchain_verify_chain only has to look them up.
+// Args: this - a pointer to the blockchain
+//       cache - verification cache, or NULL; must outlive the chain
+//       pool - thread pool for batches, or NULL; must outlive the chain
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  this->sig_cache = cache;
+  this->sig_pool = pool;
+}
+
+int blockchain_verify_signatures(Blockchain *this)
+// -----------------------------------------------------------------------------
+// Func: Check the signature of every signed record still available
+// Args: this - a pointer to the blockchain
+// Retn: 1 if every signature is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  return blockchain_verify_signature_range(this, 0, this->length);
+}
+
+int blockchain_verify_signature_range(Blockchain *this, uint64_t lo,
+                                      uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: Check the signatures of the signed records in [lo, hi) that are
+//       still available, in batches of BLOCKCHAIN_SIG_BATCH on the chain's
+//       signature pool. Spilled records are read back; dropped ones can't be
+//       checked.
+// Args: this - a pointer to the blockchain
+//       lo - first block
+//       hi - one past the last block, clipped to the chain's length
+// Retn: 1 if every signature is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint8_t **records, **owned, *frame;
+  uint64_t *sizes;
+  uint64_t i, n, nowned, k;
+  int valid = 1;
+
+  records = malloc(BLOCKCHAIN_SIG_BATCH*sizeof(uint8_t *));
+  owned = malloc(BLOCKCHAIN_SIG_BATCH*sizeof(uint8_t *));
+  sizes = malloc(BLOCKCHAIN_SIG_BATCH*sizeof(uint64_t));
+  if (records == NULL || owned == NULL || sizes == NULL) {
+    free(records);
+    free(owned);
+    free(sizes);
+    return 0;
+  }
+
+  if (hi > this->length)
+    hi = this->length;
+
+  for (i = lo; valid && i < hi; ) {
+    for (n = 0, nowned = 0; n < BLOCKCHAIN_SIG_BATCH && i < hi; i++) {
+      if ((frame = (uint8_t *) this->get(this, i)) == NULL) {
+        if (this->spill_off[i] == BLOCKCHAIN_NOT_SPILLED)
+          continue;
+
+        frame = malloc(blockframe_size(blockchain_get_header(this, i)));
+        if (frame == NULL || blockchain_read_frame(this, i, frame)) {
+          free(frame);
+          valid = 0;
+          break;
+        }
+        owned[nowned++] = frame;
+      }
+
+      records[n] = &frame[RECORD_POS];
+      sizes[n] = blockframe_size(frame) - BLOCK_HEADER_SZ;
+      if (signature_present(records[n], sizes[n]))
+        n++;
+      else if (nowned > 0 && owned[nowned-1] == frame)
+        free(owned[--nowned]); // plain records don't go through the batch
+    }
+
+    valid = valid && signature_verify_batch(this->sig_cache, this->sig_pool,
+                                            records, sizes, n);
+
+    for (k = 0; k < nowned; k++)
+      free(owned[k]);
+  }
+
+  free(records);
+  free(owned);
+  free(sizes);
+  return valid;
+}
+
+int blockchain_set_pruning(Blockchain *this, uint64_t depth, uint64_t budget,
+                           const char *spill_path)
+// -----------------------------------------------------------------------------
+// Func: Bound the memory held by record bodies. Once a block falls more than
+//       depth blocks behind the front, or resident records exceed budget
+//       bytes, the oldest records are moved to the chunk store or the spill
+//       file (or dropped if there is neither). Headers are always kept, and
+//       the front block is never pruned.
+// Args: this - a pointer to the blockchain
+//       depth - number of recent blocks that keep their record, 0 = no limit
+//       budget - max resident record bytes, 0 = no limit
+//       spill_path - file for pruned records, NULL to drop them instead (or
+//                    to keep the current one). Once records have been
+//                    spilled the file is kept as it is, and only the same
+//                    path is accepted.
+// Retn: 0 on success, -1 if the spill file could not be opened, is not the
+//       one already holding records, or the chain is pinned (see
+//       blockchain_pin) and pruning would be turned on
+// -----------------------------------------------------------------------------
+{
+  struct stat cur, want;
+  int err = 0;
+
+  pthread_rwlock_wrlock(&this->lock);
+  if (this->pins > 0 && (depth || budget))
+    err = -1;
+  if (!err && spill_path != NULL && this->spill_sz > 0) {
+    // the spill offsets point into this file, truncating it loses records
+    if (fstat(this->spill_fd, &cur) || stat(spill_path, &want) ||
+        cur.st_dev != want.st_dev || cur.st_ino != want.st_ino)
+      err = -1;
+  }
+  else if (!err && spill_path != NULL) {
+    if (this->spill_fd >= 0)
+      close(this->spill_fd);
+    this->spill_fd = open(spill_path, O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0666);
+    if (this->spill_fd < 0)
+      err = -1;
+  }
+  if (!err) {
+    this->prune_depth = depth;
+    this->prune_budget = budget;
+    blockchain_prune(this);
+  }
+  pthread_rwlock_unlock(&this->lock);
+
+  return err;
+}
+
+int blockchain_pin(Blockchain *this)
+// -----------------------------------------------------------------------------
+// Func: Keep every record in memory until the matching blockchain_unpin, for
+//       readers that walk frames on other threads. Pruning can't be turned on
+//       while the chain is pinned.
+// Args: this - a pointer to the blockchain
+// Retn: 0 on success, -1 if pruning is configured or has already happened
+// -----------------------------------------------------------------------------
+{
+  int err = 0;
+
+  pthread_rwlock_wrlock(&this->lock);
+  if (this->prune_depth || this->prune_budget || this->pruned > 0)
+    err = -1;
+  else
+    this->pins++;
+  pthread_rwlock_unlock(&this->lock);
+
+  return err;
+}
+
+void blockchain_unpin(Blockchain *this)
+// -----------------------------------------------------------------------------
+// Func: Drop a pin taken by blockchain_pin
+// Args: this - a pointer to the blockchain
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  pthread_rwlock_wrlock(&this->lock);
+  this->pins--;
+  pthread_rwlock_unlock(&this->lock);
+}
+
+void blockchain_set_chunk_store(Blockchain *this, ChunkStore *store)
+// -----------------------------------------------------------------------------
+// Func: Keep pruned records deduplicated in a chunk store instead of the spill
+//       file, so records that repeat earlier ones mostly cost a chunk list.
+//       Takes effect for blocks pruned from now on; set the pruning depth
+//       (blockchain_set_pruning) to choose how many recent blocks stay whole.
+// Args: this - a pointer to the blockchain
+//       store - the chunk store, must outlive the chain once it holds a
+//               record; NULL to prune to the spill file again
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  this->chunk_store = store;
+}
+
+void blockchain_prune(Blockchain *this)
+// -----------------------------------------------------------------------------
+// Func: Prune the oldest resident records until the limits set by
+//       blockchain_set_pruning are met
+// Args: this - a pointer to the blockchain
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Node *node;
+  uint64_t record_sz, done, recipe;
+  uint64_t *spill_off;
+  ssize_t n;
+
+  while (this->pruned + 1 < this->length &&
+         ((this->prune_depth && this->length - this->pruned > this->prune_depth)
+          || (this->prune_budget && this->resident_sz > this->prune_budget))) {
+    node = blockchain_node(this, this->pruned);
+    record_sz = blockframe_size(node->data) - BLOCK_HEADER_SZ;
+
+    if ((this->pruned & (this->pruned - 1)) == 0) { // grow at powers of two
+      spill_off = realloc(this->spill_off,
+                          (this->pruned ? 2*this->pruned : 1)*sizeof(uint64_t));
+      if (spill_off == NULL)
+        return; // keep the record resident, try again on the next append
+      this->spill_off = spill_off;
+    }
+
+    this->spill_off[this->pruned] = BLOCKCHAIN_NOT_SPILLED;
+    if (this->chunk_store != NULL) {
+      if (this->chunk_store->put(this->chunk_store,
+                                 &((uint8_t *)node->data)[RECORD_POS],
+                                 record_sz, &recipe))
+        return; // keep the record resident, try again on the next append
+      this->spill_off[this->pruned] = recipe | BLOCKCHAIN_CHUNKED;
+    }
+    else if (this->spill_fd >= 0) {
+      for (done = 0; done < record_sz; done += n) {
+        n = pwrite(this->spill_fd, &((uint8_t *)node->data)[RECORD_POS + done],
+                   record_sz - done, this->spill_sz + done);
+        if (n <= 0)
+          return; // keep the record resident, try again on the next append
+      }
+      this->spill_off[this->pruned] = this->spill_sz;
+      this->spill_sz += record_sz;
+    }
+
+    free(node->data); // the header lives on in this->headers
+    node->data = NULL;
+    this->resident_sz -= record_sz;
+    this->pruned++;
+  }
+}
+
+void blockchain_init_empty(Blockchain *this)
+// -----------------------------------------------------------------------------
+// Func: Initialize a blockchain with no blocks, not even the root. Callers
+//       must blockchain_store a root block before using the chain.
 // Args: this - a pointer to the new chain object
 // Retn: None
 // -----------------------------------------------------------------------------
 {
   this->ll = malloc(sizeof(LinkedList));
   this->length = 0;
+  this->hash_alg = BLOCKCHAIN_HASH_SHA256; // until a root says otherwise
   linkedlist_init(this->ll); // blockchain is just a fancy linkedlist
+
+  if ((this->pages = calloc(BLOCKCHAIN_MAX_PAGES, sizeof(Node **))) == NULL) {
+    exit(1); // TODO critical failure
+  }
+
+  this->headers = NULL;
+  this->headers_cap = 0;
+  headerstore_init(&this->links);
+
+  this->prune_depth = 0; // pruning is off until blockchain_set_pruning
+  this->prune_budget = 0;
+  this->resident_sz = 0;
+  this->pruned = 0;
+  this->spill_off = NULL;
+  this->spill_sz = 0;
+  this->spill_fd = -1;
+  this->chunk_store = NULL;
+  this->pins = 0;
+
+  pthread_rwlock_init(&this->lock, NULL);
+  this->nhooks = 0;
+
+  this->sig_cache = NULL;
+  this->sig_pool = NULL;
   
   // Override/map methods
   this->insert_front = &blockchain_insert_front;
@@ -114,10 +616,176 @@ void blockchain_init(Blockchain *this)
   this->peek_front = &blockchain_peek_front;
   this->get = &blockchain_get;
   this->verify_block = &blockchain_verify_block;
+  this->blockchain_verify_chain = &blockchain_verify_chain;
+}
 
+void blockchain_init(Blockchain *this)
+// -----------------------------------------------------------------------------
+// Func: Initialize a new blockchain
+// Args: this - a pointer to the new chain object
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  blockchain_init_hash(this, BLOCKCHAIN_HASH_SHA256);
+}
 
+void blockchain_init_hash(Blockchain *this, uint8_t hash_alg)
+// -----------------------------------------------------------------------------
+// Func: Initialize a new blockchain that hashes its blocks with hash_alg
+// Args: this - a pointer to the new chain object
+//       hash_alg - BLOCKCHAIN_HASH_SHA256 or BLOCKCHAIN_HASH_BLAKE3
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  blockchain_init_empty(this);
+  this->hash_alg = hash_alg;
   blockchain_root(this); // build and attach the root block
-  this->length = 1;
+}
+
+int blockchain_store(Blockchain *this, uint8_t *blockframe, uint64_t blocksize)
+// -----------------------------------------------------------------------------
+// Func: Append a framed block to the list and index it, then run the
+//       registered hooks. No hashing or verification is done here.
+// Args: this - a pointer to the blockchain
+//       blockframe - the framed block, copied into the chain
+//       blocksize - size of the framed block in bytes
+// Retn: 0 on success, -1 if the index is full
+// -----------------------------------------------------------------------------
+{
+  BlockchainHook hooks[BLOCKCHAIN_MAX_HOOKS];
+  void *hook_ctx[BLOCKCHAIN_MAX_HOOKS];
+  int i, nhooks, err;
+
+  // the hooks registered when the block is indexed are the ones that see it
+  pthread_rwlock_wrlock(&this->lock);
+  err = blockchain_index(this, blockframe, blocksize);
+  nhooks = this->nhooks;
+  memcpy(hooks, this->hooks, nhooks*sizeof(BlockchainHook));
+  memcpy(hook_ctx, this->hook_ctx, nhooks*sizeof(void *));
+  pthread_rwlock_unlock(&this->lock);
+  if (err)
+    return -1;
+
+  for (i = 0; i < nhooks; i++)
+    hooks[i](hook_ctx[i], this, blockframe);
+
+  pthread_rwlock_wrlock(&this->lock);
+  blockchain_prune(this);
+  pthread_rwlock_unlock(&this->lock);
+
+  return 0;
+}
+
+int blockchain_index(Blockchain *this, uint8_t *blockframe, uint64_t blocksize)
+// -----------------------------------------------------------------------------
+// Func: The part of blockchain_store done under the chain's lock: copy the
+//       header and the frame in and index them
+// Args: this - a pointer to the blockchain, locked exclusive
+//       blockframe - the framed block
+//       blocksize - size of the framed block in bytes
+// Retn: 0 on success, -1 if the index is full or out of memory
+// -----------------------------------------------------------------------------
+{
+  uint64_t page = this->length >> BLOCKCHAIN_PAGE_BITS;
+  uint8_t *headers;
+  Block root;
+
+  if (page >= BLOCKCHAIN_MAX_PAGES)
+    return -1;
+
+  if (this->pages[page] == NULL &&
+      (this->pages[page] = malloc(BLOCKCHAIN_PAGE_SZ*sizeof(Node *))) == NULL)
+    return -1;
+
+  if (this->length == this->headers_cap) {
+    headers = realloc(this->headers, (this->headers_cap ? 2*this->headers_cap
+                                      : BLOCKCHAIN_PAGE_SZ)*BLOCK_HEADER_SZ);
+    if (headers == NULL)
+      return -1;
+    this->headers = headers;
+    this->headers_cap = this->headers_cap ? 2*this->headers_cap
+                                          : BLOCKCHAIN_PAGE_SZ;
+  }
+  if (this->links.append(&this->links, blockframe))
+    return -1;
+  memcpy(&this->headers[this->length*BLOCK_HEADER_SZ], blockframe,
+         BLOCK_HEADER_SZ);
+
+  if (this->length == 0) { // the root decides the hash for the whole chain
+    blockheader_decode(blockframe, &root);
+    root.record = &blockframe[RECORD_POS];
+    this->hash_alg = blockchain_root_hash_alg(&root);
+  }
+
+  this->ll->insert_front(this->ll, blockframe, blocksize); // append to the list
+
+  // the node that was just inserted sits right behind the head
+  this->pages[page][this->length & (BLOCKCHAIN_PAGE_SZ-1)] = this->ll->head->prev;
+  this->length++;
+  this->resident_sz += blocksize - BLOCK_HEADER_SZ;
+
+  return 0;
+}
+
+int blockchain_add_hook(Blockchain *this, BlockchainHook hook, void *ctx)
+// -----------------------------------------------------------------------------
+// Func: Register a function to be called after every block is stored
+// Args: this - a pointer to the blockchain
+//       hook - called as hook(ctx, this, blockframe)
+//       ctx - passed through to hook
+// Retn: 0 on success, -1 if BLOCKCHAIN_MAX_HOOKS are already registered
+// -----------------------------------------------------------------------------
+{
+  int err;
+
+  pthread_rwlock_wrlock(&this->lock);
+  err = blockchain_add_hook_locked(this, hook, ctx);
+  pthread_rwlock_unlock(&this->lock);
+
+  return err;
+}
+
+int blockchain_add_hook_locked(Blockchain *this, BlockchainHook hook,
+                               void *ctx)
+// -----------------------------------------------------------------------------
+// Func: blockchain_add_hook for a caller that already holds the chain's lock
+//       exclusive, so it can catch up on the blocks stored so far and then
+//       register without an append slipping in between
+// Args: see blockchain_add_hook
+// Retn: see blockchain_add_hook
+// -----------------------------------------------------------------------------
+{
+  if (this->nhooks == BLOCKCHAIN_MAX_HOOKS)
+    return -1;
+
+  this->hooks[this->nhooks] = hook;
+  this->hook_ctx[this->nhooks] = ctx;
+  this->nhooks++;
+
+  return 0;
+}
+
+void blockchain_remove_hook(Blockchain *this, BlockchainHook hook, void *ctx)
+// -----------------------------------------------------------------------------
+// Func: Unregister a hook added with blockchain_add_hook
+// Args: this - a pointer to the blockchain
+//       hook, ctx - the same pair that was registered
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  int i;
+
+  pthread_rwlock_wrlock(&this->lock);
+  for (i = 0; i < this->nhooks; i++) {
+    if (this->hooks[i] == hook && this->hook_ctx[i] == ctx) {
+      for (this->nhooks--; i < this->nhooks; i++) { // keep registration order
+        this->hooks[i] = this->hooks[i+1];
+        this->hook_ctx[i] = this->hook_ctx[i+1];
+      }
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&this->lock);
 }
 
 void *blockchain_peek_front(Blockchain *this)
@@ -131,49 +799,92 @@ void *blockchain_peek_front(Blockchain *this)
   return this->ll->peek_front(this->ll);
 }
 
-void blockchain_insert_front(Blockchain *this,
+int blockchain_insert_front(Blockchain *this,
                        uint8_t *record,
                        uint64_t record_sz)
 // -----------------------------------------------------------------------------
-// Func: Append a record to the blockchain
+// Func: Append a record to the blockchain. A signed record is only appended
+//       if its signature checks out.
 // Args: this - a pointer to the blockchain
 //       record - the record that we'd like to append
 //       record_sz - the size of the record
-// Retn: None
+// Retn: 0 on success, -1 if the signature is bad or the chain is full
+// -----------------------------------------------------------------------------
+{
+  if (!signature_verify_batch(this->sig_cache, NULL, &record, &record_sz, 1))
+    return -1;
+
+  return blockchain_append(this, record, record_sz);
+}
+
+int blockchain_append_batch(Blockchain *this, uint8_t **records,
+                            const uint64_t *record_sz, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append several records, checking all of their signatures first as
+//       one batch on the chain's signature pool
+// Args: this - a pointer to the blockchain
+//       records - the records, in chain order
+//       record_sz - their sizes
+//       n - number of records
+// Retn: 0 on success, -1 if any signature is bad (nothing is appended) or
+//       the chain filled up part way
 // -----------------------------------------------------------------------------
 {
+  uint64_t i;
+
+  if (!signature_verify_batch(this->sig_cache, this->sig_pool, records,
+                              record_sz, n))
+    return -1;
+
+  for (i = 0; i < n; i++)
+    if (blockchain_append(this, records[i], record_sz[i]))
+      return -1;
+
+  return 0;
+}
+
+int blockchain_append(Blockchain *this, uint8_t *record, uint64_t record_sz)
+// -----------------------------------------------------------------------------
+// Func: Build the next block around a record and store it, no checks
+// Args: this - a pointer to the blockchain
+//       record - the record that we'd like to append
+//       record_sz - the size of the record
+// Retn: 0 on success, -1 if the chain is full
+// -----------------------------------------------------------------------------
+{
+  int err;
   Block block;
   Block prev_block;
 
   uint64_t blocksize = BLOCK_HEADER_SZ + record_sz;
-  uint8_t buf[blocksize];
+  uint8_t *buf = malloc(blocksize);
   uint8_t hash[HASH_SZ];
 
   // get a pointer to the previous block
   uint8_t *prev_blockframe = (uint8_t *)this->peek_front(this);
-  prev_block.record = malloc(prev_blockframe[RECORD_SZ_POS]);
-  blockframe_decode(prev_blockframe, &prev_block);
+  blockheader_decode(prev_blockframe, &prev_block); // only need the header
 
   block.record_sz = record_sz;
   block.record = malloc(block.record_sz);
   memcpy(block.record, record, block.record_sz); // copy record into block
 
   block.timestamp = time(NULL);
+  if (block.timestamp < prev_block.timestamp) // the clock was set back
+    block.timestamp = prev_block.timestamp;
   block.index = prev_block.index+1; // increment index
 
   memcpy(block.prevhash, prev_block.hash, HASH_SZ); // copy the prev blocks hash
   memset(block.hash, 0, HASH_SZ); // set the hash field to 0
 
-  block_hash(&block, hash); // hash the block
+  block_hash(&block, this->hash_alg, hash); // hash the block
   memcpy(&block.hash, hash, HASH_SZ); // copy the hash into the hash field
   block_frame(&block, buf); // frame for storage
 
-
- 
-  this->ll->insert_front(this->ll, buf, blocksize); // append to the chain
-  this->length++;
+  err = blockchain_store(this, buf, blocksize); // append to the chain
   free(block.record); // free the local copy
+  free(buf);
 
+  return err;
 }
 
 // int blockchain_delete_front(Blockchain *this) 
@@ -183,18 +894,28 @@ void blockchain_insert_front(Blockchain *this,
 
 void blockchain_root(Blockchain *this)
 // -----------------------------------------------------------------------------
-// Func: Construct the blockchain's root block (must be hardcoded)
-// Args: this - the blockchain for which we need a root
+// Func: Construct the blockchain's root block (must be hardcoded). The record
+//       is the root message, followed by a tag naming the hash function on
+//       chains that don't use SHA256, so SHA256 roots are unchanged.
+// Args: this - the blockchain for which we need a root, with hash_alg set
 // Retn: None
 // -----------------------------------------------------------------------------
 {
   Block block;
-  uint8_t *record = (uint8_t *)"this is the first block"; // message can change
-  uint64_t record_sz = strlen((char *)record)+1; // count the null character
-  uint64_t blocksize = BLOCK_HEADER_SZ + record_sz;
-  uint8_t buf[blocksize];
+  uint8_t record[sizeof(BLOCKCHAIN_ROOT_MSG) + sizeof(BLOCKCHAIN_ROOT_BLAKE3)];
+  uint64_t record_sz = sizeof(BLOCKCHAIN_ROOT_MSG); // count the null character
+  uint64_t blocksize;
+  uint8_t buf[BLOCK_HEADER_SZ + sizeof(record)];
   uint8_t hash[HASH_SZ];
 
+  memcpy(record, BLOCKCHAIN_ROOT_MSG, sizeof(BLOCKCHAIN_ROOT_MSG));
+  if (this->hash_alg == BLOCKCHAIN_HASH_BLAKE3) {
+    memcpy(&record[record_sz], BLOCKCHAIN_ROOT_BLAKE3,
+           sizeof(BLOCKCHAIN_ROOT_BLAKE3));
+    record_sz += sizeof(BLOCKCHAIN_ROOT_BLAKE3);
+  }
+  blocksize = BLOCK_HEADER_SZ + record_sz;
+
   block.record_sz = record_sz;
   block.record = malloc(block.record_sz);
   memcpy(block.record, record, block.record_sz);
@@ -206,11 +927,11 @@ void blockchain_root(Blockchain *this)
   memset(block.hash, 0, HASH_SZ);
 
   // this will hash the whole block, with 0's in the prevhash and hash fields
-  block_hash(&block, hash); 
+  block_hash(&block, this->hash_alg, hash);
   memcpy(&block.hash, hash, HASH_SZ); // fill the hash field with the result 
   block_frame(&block, buf); // frame it to remove 0-padding 
 
-  this->ll->insert_front(this->ll, buf, blocksize); // add the framed block to the chain
+  blockchain_store(this, buf, blocksize); // add the framed block to the chain
   free(block.record); // free the local copy
 
 }
@@ -222,8 +943,26 @@ void blockchain_destroy(Blockchain *this)
 // Retn: None
 // -----------------------------------------------------------------------------
 {
-  linkedlist_destroy(this->ll); // just need to destroy the list
+  uint64_t i;
+
+  linkedlist_destroy(this->ll); // destroy the list, then the index
   free(this->ll);
+
+  for (i = 0; i < BLOCKCHAIN_MAX_PAGES && this->pages[i] != NULL; i++)
+    free(this->pages[i]);
+  free(this->pages);
+  this->pages = NULL;
+  this->length = 0;
+
+  free(this->headers);
+  headerstore_destroy(&this->links);
+  pthread_rwlock_destroy(&this->lock);
+  free(this->spill_off);
+  if (this->spill_fd >= 0)
+    close(this->spill_fd);
+  this->headers = NULL;
+  this->spill_off = NULL;
+  this->spill_fd = -1;
 }
 
 
@@ -236,7 +975,7 @@ void blockframe_print(uint8_t *blockframe)
 {
   Block block;
 
-  block.record = malloc(blockframe[RECORD_SZ_POS]);
+  block.record = malloc(blockframe_size(blockframe) - BLOCK_HEADER_SZ);
   blockframe_decode(blockframe, &block);
 
   printf("-------------------------------------------------------------------------\n");
@@ -251,6 +990,22 @@ void blockframe_print(uint8_t *blockframe)
   free(block.record);
 }
 
+void blockheader_decode(uint8_t *header, Block *block)
+// -----------------------------------------------------------------------------
+// Func: Like blockframe_decode, but only the header fields are filled in. The
+//       record pointer is left untouched.
+// Args: header - a pointer to a header or a full frame
+//       block - the block to fill in
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  memcpy(block->prevhash, &header[PREVHASH_POS], HASH_SZ);
+  memcpy(block->hash, &header[CURRHASH_POS], HASH_SZ);
+  memcpy(&block->index, &header[INDEX_POS], WORD_SZ);
+  memcpy(&block->timestamp, &header[TS_POS], WORD_SZ);
+  memcpy(&block->record_sz, &header[RECORD_SZ_POS], WORD_SZ);
+}
+
 void blockframe_decode(uint8_t *blockframe, Block *block)
 // -----------------------------------------------------------------------------
 // Func: Inverse of block_frame function. Takes a block frame and extracts its 
@@ -273,6 +1028,19 @@ void blockframe_decode(uint8_t *blockframe, Block *block)
   memcpy(block->record, &blockframe[RECORD_POS], block->record_sz);
 }
 
+uint64_t blockframe_size(uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Size of a framed block, header included
+// Args: blockframe - pointer to framed block
+// Retn: size in bytes
+// -----------------------------------------------------------------------------
+{
+  uint64_t record_sz;
+
+  memcpy(&record_sz, &blockframe[RECORD_SZ_POS], WORD_SZ);
+  return BLOCK_HEADER_SZ + record_sz;
+}
+
 // frames a block (stores all members in a buffer with no padding)
 void block_frame(Block *this, uint8_t *buf)
 // -----------------------------------------------------------------------------
@@ -290,15 +1058,21 @@ void block_frame(Block *this, uint8_t *buf)
   memcpy(&buf[RECORD_POS], this->record, this->record_sz);
 }
 
-void block_hash(Block *this, uint8_t *hash)
+void block_hash(Block *this, uint8_t hash_alg, uint8_t *hash)
 // -----------------------------------------------------------------------------
 // Func: Hash the the block after removing struct 0 padding
 // Args: this - a pointer to the block
+//       hash_alg - BLOCKCHAIN_HASH_SHA256 or BLOCKCHAIN_HASH_BLAKE3
 //       hash - a pointer to the hash of the block
 // Retn: None
 // -----------------------------------------------------------------------------
 {
-  uint8_t buf[BLOCK_HEADER_SZ + this->record_sz]; // record size is variable
+  // record size is variable and may be large, keep it off the stack
+  uint8_t *buf = malloc(BLOCK_HEADER_SZ + this->record_sz);
   block_frame(this, buf);
-  util_buf_hash(buf, BLOCK_HEADER_SZ + this->record_sz, hash);
+  if (hash_alg == BLOCKCHAIN_HASH_BLAKE3)
+    blake3_hash(buf, BLOCK_HEADER_SZ + this->record_sz, hash);
+  else
+    util_buf_hash(buf, BLOCK_HEADER_SZ + this->record_sz, hash);
+  free(buf);
 }
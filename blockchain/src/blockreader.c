@@ -0,0 +1,807 @@
+/*
+blockreader.c: asynchronous block reads from snapshot files
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blockreader.h"
+#include "blockchain.h"
+#include "chainlog.h"
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define BLOCKREADER_MAX_THREADS 32 // pread workers for the thread backend
+#define BLOCKREADER_CANCEL_TAG UINT64_MAX // user_data of cancel requests
+
+// private functions, access through BlockReader object
+uint64_t blockreader_frame_size(BlockReader *this, uint64_t index);
+int blockreader_submit(BlockReader *this, uint64_t index, uint8_t *buf,
+                       void *tag);
+int blockreader_reap(BlockReader *this, BlockReadResult *results, int min,
+                     int max);
+
+// private functions
+int blockreader_load_index(BlockReader *this);
+int blockreader_load_log(BlockReader *this, const char *pathname);
+int blockreader_log_record(void *ctx, uint64_t index, uint8_t *blockframe,
+                           uint64_t blocksize, uint64_t offset, uint32_t crc);
+void blockreader_free_index(BlockReader *this);
+int blockreader_cancel(BlockReader *this);
+int blockreader_finish(BlockReader *this, int slot, BlockReadResult *result);
+int blockreader_uring_setup(BlockReader *this);
+void blockreader_uring_teardown(BlockReader *this);
+void blockreader_uring_push(BlockReader *this, int slot);
+int blockreader_uring_enter(BlockReader *this, uint32_t min_complete);
+int blockreader_uring_reap(BlockReader *this, BlockReadResult *results,
+                           int min, int max);
+int blockreader_uring_cancel(BlockReader *this);
+void blockreader_pread_task(void *arg);
+int blockreader_pool_reap(BlockReader *this, BlockReadResult *results,
+                          int min, int max);
+
+int blockreader_open(BlockReader *this, const char *pathname, int depth,
+                     int backend)
+// -----------------------------------------------------------------------------
+// Func: Open a snapshot file or a chain log for asynchronous reads. A chain
+//       log is opened read only (see chainlog_open_readonly) and indexed up
+//       to its last intact record; the file is never changed.
+// Args: this - a pointer to the new reader
+//       pathname - the snapshot file or chain log
+//       depth - most reads in flight, clamped to [1, BLOCKREADER_MAX_DEPTH]
+//       backend - BLOCKREADER_AUTO, BLOCKREADER_URING or BLOCKREADER_THREADS
+// Retn: 0 on success, -1 if the file is malformed or the backend can't start
+// -----------------------------------------------------------------------------
+{
+  char magic[WORD_SZ];
+  int i, nthreads, err;
+
+  depth = depth < 1 ? 1 : depth > BLOCKREADER_MAX_DEPTH ? BLOCKREADER_MAX_DEPTH
+                                                         : depth;
+  this->depth = depth;
+  this->inflight = 0;
+  this->offsets = NULL;
+  this->sizes = NULL;
+  this->crcs = NULL;
+  this->skip = WORD_SZ;
+  this->ring_fd = -1;
+  this->to_submit = 0;
+  this->ndone = 0;
+
+  if ((this->fd = open(pathname, O_RDONLY)) < 0)
+    return -1;
+  err = pread(this->fd, magic, WORD_SZ, 0) != WORD_SZ;
+  if (!err && !memcmp(magic, CHAINLOG_MAGIC, WORD_SZ))
+    err = blockreader_load_log(this, pathname);
+  else if (!err)
+    err = blockreader_load_index(this);
+  if (err) {
+    close(this->fd);
+    blockreader_free_index(this);
+    return -1;
+  }
+  posix_fadvise(this->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  this->reqs = malloc(depth*sizeof(BlockReadRequest));
+  this->free_slots = malloc(depth*sizeof(int));
+  this->done_slots = malloc(depth*sizeof(int));
+  err = this->reqs == NULL || this->free_slots == NULL ||
+        this->done_slots == NULL;
+  for (i = 0; !err && i < depth; i++) {
+    this->free_slots[i] = depth - 1 - i;
+    this->reqs[i].reader = this;
+  }
+  this->nfree = depth;
+
+  this->backend = BLOCKREADER_THREADS;
+  if (!err && backend != BLOCKREADER_THREADS) {
+    if (blockreader_uring_setup(this) == 0)
+      this->backend = BLOCKREADER_URING;
+    else if (backend == BLOCKREADER_URING)
+      err = 1;
+  }
+  if (!err && this->backend == BLOCKREADER_THREADS) {
+    nthreads = depth < BLOCKREADER_MAX_THREADS ? depth
+                                               : BLOCKREADER_MAX_THREADS;
+    err = threadpool_init(&this->pool, nthreads) != 0;
+    pthread_mutex_init(&this->lock, NULL);
+    pthread_cond_init(&this->finished, NULL);
+  }
+
+  if (err) {
+    free(this->reqs);
+    free(this->free_slots);
+    free(this->done_slots);
+    blockreader_free_index(this);
+    close(this->fd);
+    return -1;
+  }
+
+  this->frame_size = &blockreader_frame_size;
+  this->submit = &blockreader_submit;
+  this->reap = &blockreader_reap;
+
+  return 0;
+}
+
+void blockreader_close(BlockReader *this)
+// -----------------------------------------------------------------------------
+// Func: Wait for every outstanding read and close the reader
+// Args: this - a pointer to the reader
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  BlockReadResult result;
+
+  while (this->inflight > 0)
+    if (this->reap(this, &result, 1, 1) < 0)
+      break;
+
+  if (this->backend == BLOCKREADER_URING) {
+    blockreader_uring_teardown(this);
+  }
+  else {
+    threadpool_destroy(&this->pool);
+    pthread_mutex_destroy(&this->lock);
+    pthread_cond_destroy(&this->finished);
+  }
+
+  free(this->reqs);
+  free(this->free_slots);
+  free(this->done_slots);
+  blockreader_free_index(this);
+  close(this->fd);
+  this->fd = -1;
+}
+
+int blockreader_load_index(BlockReader *this)
+// -----------------------------------------------------------------------------
+// Func: Read and check the snapshot's header, trailer and index
+// Args: this - a pointer to the reader, with fd open
+// Retn: 0 on success, -1 if the file is malformed
+// -----------------------------------------------------------------------------
+{
+  uint8_t header[SNAPSHOT_HEADER_SZ], trailer[SNAPSHOT_TRAILER_SZ];
+  struct stat st;
+  uint64_t file_sz, version, count, trailer_count, i, end;
+
+  if (fstat(this->fd, &st) ||
+      st.st_size < SNAPSHOT_HEADER_SZ + SNAPSHOT_TRAILER_SZ)
+    return -1;
+  file_sz = (uint64_t)st.st_size;
+
+  if (pread(this->fd, header, SNAPSHOT_HEADER_SZ, 0) != SNAPSHOT_HEADER_SZ ||
+      pread(this->fd, trailer, SNAPSHOT_TRAILER_SZ,
+            file_sz - SNAPSHOT_TRAILER_SZ) != SNAPSHOT_TRAILER_SZ)
+    return -1;
+
+  memcpy(&version, &header[WORD_SZ], WORD_SZ);
+  memcpy(&count, &header[2*WORD_SZ], WORD_SZ);
+  memcpy(&this->index_off, trailer, WORD_SZ);
+  memcpy(&trailer_count, &trailer[WORD_SZ], WORD_SZ);
+  if (memcmp(header, SNAPSHOT_MAGIC, WORD_SZ) || version != SNAPSHOT_VERSION ||
+      memcmp(&trailer[2*WORD_SZ], SNAPSHOT_INDEX_MAGIC, WORD_SZ) ||
+      trailer_count != count || count == 0 ||
+      count > (file_sz - SNAPSHOT_TRAILER_SZ) / WORD_SZ ||
+      this->index_off != file_sz - SNAPSHOT_TRAILER_SZ - count*WORD_SZ)
+    return -1;
+
+  this->count = count;
+  if ((this->offsets = malloc(count*sizeof(uint64_t))) == NULL ||
+      pread(this->fd, this->offsets, count*WORD_SZ, this->index_off) !=
+      (ssize_t)(count*WORD_SZ))
+    return -1;
+
+  // frames are back to back, so each one ends where the next begins
+  for (i = 0; i < count; i++) {
+    end = i+1 < count ? this->offsets[i+1] : this->index_off;
+    if (this->offsets[i] < SNAPSHOT_HEADER_SZ || end > this->index_off ||
+        end < this->offsets[i] + WORD_SZ + BLOCK_HEADER_SZ)
+      return -1;
+  }
+
+  return 0;
+}
+
+int blockreader_load_log(BlockReader *this, const char *pathname)
+// -----------------------------------------------------------------------------
+// Func: Recover a chain log without changing it and index its records.
+//       Only headers and trailers are read here; each record's crc is kept
+//       and checked when the record itself is read.
+// Args: this - a pointer to the reader
+//       pathname - the log file
+// Retn: 0 on success, -1 if the log is empty, malformed or out of memory
+// -----------------------------------------------------------------------------
+{
+  ChainLog log;
+  int err;
+
+  if (chainlog_open_readonly(&log, pathname))
+    return -1;
+
+  this->count = log.count;
+  this->skip = 0;
+  this->offsets = malloc(log.count*sizeof(uint64_t));
+  this->sizes = malloc(log.count*sizeof(uint64_t));
+  this->crcs = malloc(log.count*sizeof(uint32_t));
+  err = log.count == 0 || this->offsets == NULL || this->sizes == NULL ||
+        this->crcs == NULL ||
+        chainlog_walk(&log, 0, &blockreader_log_record, this) != 0;
+  chainlog_close(&log);
+
+  return err ? -1 : 0;
+}
+
+int blockreader_log_record(void *ctx, uint64_t index, uint8_t *blockframe,
+                           uint64_t blocksize, uint64_t offset, uint32_t crc)
+// -----------------------------------------------------------------------------
+// Func: ChainLogFunc, puts one record in the reader's index
+// Args: ctx - the reader
+//       index, blockframe, blocksize, offset, crc - see ChainLogFunc
+// Retn: 0, never stops the walk
+// -----------------------------------------------------------------------------
+{
+  BlockReader *this = (BlockReader *)ctx;
+
+  (void)blockframe;
+  this->offsets[index] = offset;
+  this->sizes[index] = blocksize;
+  this->crcs[index] = crc;
+
+  return 0;
+}
+
+void blockreader_free_index(BlockReader *this)
+// -----------------------------------------------------------------------------
+// Func: Free the index of either kind of file
+// Args: this - a pointer to the reader
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  free(this->offsets);
+  free(this->sizes);
+  free(this->crcs);
+  this->offsets = NULL;
+  this->sizes = NULL;
+  this->crcs = NULL;
+}
+
+uint64_t blockreader_frame_size(BlockReader *this, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Size of a block's frame, so the caller can size its buffer
+// Args: this - a pointer to the reader
+//       index - the index of the block
+// Retn: size in bytes, 0 if index is out of range
+// -----------------------------------------------------------------------------
+{
+  uint64_t end;
+
+  if (index >= this->count)
+    return 0;
+  if (this->sizes != NULL)
+    return this->sizes[index];
+
+  end = index+1 < this->count ? this->offsets[index+1] : this->index_off;
+  return end - this->offsets[index] - WORD_SZ;
+}
+
+int blockreader_submit(BlockReader *this, uint64_t index, uint8_t *buf,
+                       void *tag)
+// -----------------------------------------------------------------------------
+// Func: Start reading a block's frame into buf. With io_uring, reads queued
+//       since the last reap are handed to the kernel together at the next
+//       reap.
+// Args: this - a pointer to the reader
+//       index - the index of the block
+//       buf - at least frame_size(index) bytes, untouched until reaped
+//       tag - returned with the result
+// Retn: 0 on success, -1 if index is out of range or depth reads are already
+//       in flight
+// -----------------------------------------------------------------------------
+{
+  BlockReadRequest *req;
+  int slot;
+
+  if (index >= this->count || this->nfree == 0)
+    return -1;
+
+  slot = this->free_slots[--this->nfree];
+  req = &this->reqs[slot];
+  req->index = index;
+  req->buf = buf;
+  req->size = blockreader_frame_size(this, index);
+  req->off = this->offsets[index] + this->skip;
+  req->done = 0;
+  req->tag = tag;
+  req->res = 0;
+  this->inflight++;
+
+  if (this->backend == BLOCKREADER_URING) {
+    blockreader_uring_push(this, slot);
+  }
+  else if (this->pool.submit(&this->pool, &blockreader_pread_task, req)) {
+    blockreader_pread_task(req); // run it here instead
+  }
+
+  return 0;
+}
+
+int blockreader_reap(BlockReader *this, BlockReadResult *results, int min,
+                     int max)
+// -----------------------------------------------------------------------------
+// Func: Collect finished reads, in completion order
+// Args: this - a pointer to the reader
+//       results - room for max results
+//       min - wait until at least this many are done (capped at the number
+//             in flight), 0 to only poll
+//       max - most results returned
+// Retn: number of results, -1 on a ring error
+// -----------------------------------------------------------------------------
+{
+  if (min > this->inflight)
+    min = this->inflight;
+  if (max < min)
+    max = min;
+
+  if (this->backend == BLOCKREADER_URING)
+    return blockreader_uring_reap(this, results, min, max);
+
+  return blockreader_pool_reap(this, results, min, max);
+}
+
+int blockreader_cancel(BlockReader *this)
+// -----------------------------------------------------------------------------
+// Func: Abandon every read in flight and wait until none of them can touch
+//       its buffer any more. Pool reads can't be stopped and are waited for.
+// Args: this - a pointer to the reader
+// Retn: 0 once nothing is in flight, -1 if the ring failed first, the buffers
+//       of the reads left in flight must then never be freed
+// -----------------------------------------------------------------------------
+{
+  BlockReadResult results[64];
+
+  if (this->backend == BLOCKREADER_URING)
+    return blockreader_uring_cancel(this);
+
+  while (this->inflight > 0)
+    blockreader_pool_reap(this, results, 1, 64);
+
+  return 0;
+}
+
+int blockreader_finish(BlockReader *this, int slot, BlockReadResult *result)
+// -----------------------------------------------------------------------------
+// Func: Turn a finished request into a result and free its slot
+// Args: this - a pointer to the reader
+//       slot - the request's slot
+//       result - filled in
+// Retn: 1, the number of results produced
+// -----------------------------------------------------------------------------
+{
+  BlockReadRequest *req = &this->reqs[slot];
+
+  result->index = req->index;
+  result->buf = req->buf;
+  result->tag = req->tag;
+  result->res = req->res;
+  if (result->res == 0 && blockframe_size(req->buf) != req->size)
+    result->res = -1; // the frame's own size must match the index
+  if (result->res == 0 && this->crcs != NULL &&
+      chainlog_crc(req->buf, req->size) != this->crcs[req->index])
+    result->res = -1;
+
+  this->free_slots[this->nfree++] = slot;
+  this->inflight--;
+
+  return 1;
+}
+
+int blockreader_uring_setup(BlockReader *this)
+// -----------------------------------------------------------------------------
+// Func: Create an io_uring with depth entries and map its rings
+// Args: this - a pointer to the reader
+// Retn: 0 on success, -1 if io_uring is unavailable
+// -----------------------------------------------------------------------------
+{
+  struct io_uring_params p;
+  uint8_t *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  this->ring_fd = (int)syscall(__NR_io_uring_setup, this->depth, &p);
+  if (this->ring_fd < 0)
+    return -1;
+
+  this->sq_ring_sz = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+  this->cq_ring_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) { // both rings in one mapping
+    if (this->cq_ring_sz > this->sq_ring_sz)
+      this->sq_ring_sz = this->cq_ring_sz;
+    this->cq_ring_sz = this->sq_ring_sz;
+  }
+  this->sqes_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+
+  this->sq_ring = mmap(NULL, this->sq_ring_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                       IORING_OFF_SQ_RING);
+  if (this->sq_ring == MAP_FAILED) {
+    close(this->ring_fd);
+    return -1;
+  }
+  this->cq_ring = this->sq_ring;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    this->cq_ring = mmap(NULL, this->cq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (this->cq_ring == MAP_FAILED) {
+      munmap(this->sq_ring, this->sq_ring_sz);
+      close(this->ring_fd);
+      return -1;
+    }
+  }
+  this->sqes = mmap(NULL, this->sqes_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQES);
+  if (this->sqes == MAP_FAILED) {
+    if (this->cq_ring != this->sq_ring)
+      munmap(this->cq_ring, this->cq_ring_sz);
+    munmap(this->sq_ring, this->sq_ring_sz);
+    close(this->ring_fd);
+    return -1;
+  }
+
+  sq = (uint8_t *)this->sq_ring;
+  cq = (uint8_t *)this->cq_ring;
+  this->sq_head = (uint32_t *)&sq[p.sq_off.head];
+  this->sq_tail = (uint32_t *)&sq[p.sq_off.tail];
+  this->sq_mask = (uint32_t *)&sq[p.sq_off.ring_mask];
+  this->sq_array = (uint32_t *)&sq[p.sq_off.array];
+  this->cq_head = (uint32_t *)&cq[p.cq_off.head];
+  this->cq_tail = (uint32_t *)&cq[p.cq_off.tail];
+  this->cq_mask = (uint32_t *)&cq[p.cq_off.ring_mask];
+  this->cqes = &cq[p.cq_off.cqes];
+
+  return 0;
+}
+
+void blockreader_uring_teardown(BlockReader *this)
+// -----------------------------------------------------------------------------
+// Func: Unmap the rings and close the io_uring
+// Args: this - a pointer to the reader
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  munmap(this->sqes, this->sqes_sz);
+  if (this->cq_ring != this->sq_ring)
+    munmap(this->cq_ring, this->cq_ring_sz);
+  munmap(this->sq_ring, this->sq_ring_sz);
+  close(this->ring_fd);
+  this->ring_fd = -1;
+}
+
+void blockreader_uring_push(BlockReader *this, int slot)
+// -----------------------------------------------------------------------------
+// Func: Queue a read for the rest of a request on the submission ring. There
+//       is always room, the ring has depth entries and a slot has at most
+//       one read queued.
+// Args: this - a pointer to the reader
+//       slot - the request's slot
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  BlockReadRequest *req = &this->reqs[slot];
+  struct io_uring_sqe *sqe;
+  uint32_t tail = *this->sq_tail;
+  uint32_t i = tail & *this->sq_mask;
+
+  sqe = &((struct io_uring_sqe *)this->sqes)[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = this->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&req->buf[req->done];
+  sqe->len = (uint32_t)(req->size - req->done);
+  sqe->off = req->off + req->done;
+  sqe->user_data = (uint64_t)slot;
+
+  this->sq_array[i] = i;
+  __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  this->to_submit++;
+}
+
+int blockreader_uring_enter(BlockReader *this, uint32_t min_complete)
+// -----------------------------------------------------------------------------
+// Func: Hand queued reads to the kernel and optionally wait for completions
+// Args: this - a pointer to the reader
+//       min_complete - completions to wait for, 0 to not wait
+// Retn: 0 on success, -1 on error
+// -----------------------------------------------------------------------------
+{
+  long ret;
+
+  do {
+    ret = syscall(__NR_io_uring_enter, this->ring_fd, this->to_submit,
+                  min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0,
+                  NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+    return -1;
+
+  this->to_submit -= (uint32_t)ret;
+  return 0;
+}
+
+int blockreader_uring_reap(BlockReader *this, BlockReadResult *results,
+                           int min, int max)
+// -----------------------------------------------------------------------------
+// Func: reap for the io_uring backend. Short reads are queued again for the
+//       remainder and don't count as finished.
+// Args: see blockreader_reap
+// Retn: number of results, -1 on a ring error
+// -----------------------------------------------------------------------------
+{
+  struct io_uring_cqe *cqe;
+  BlockReadRequest *req;
+  uint32_t head, tail;
+  int got = 0, slot;
+
+  if (this->to_submit > 0 && blockreader_uring_enter(this, 0))
+    return -1;
+
+  while (got < max) {
+    head = *this->cq_head;
+    tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (got >= min)
+        break;
+      if (blockreader_uring_enter(this, 1))
+        return -1;
+      continue;
+    }
+
+    cqe = &((struct io_uring_cqe *)this->cqes)[head & *this->cq_mask];
+    if (cqe->user_data == BLOCKREADER_CANCEL_TAG) { // left by a cancel
+      __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+      continue;
+    }
+    slot = (int)cqe->user_data;
+    req = &this->reqs[slot];
+    if (cqe->res <= 0) // error, or end of file before the frame ended
+      req->res = -1;
+    else
+      req->done += (uint64_t)cqe->res;
+    __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (req->res == 0 && req->done < req->size) {
+      blockreader_uring_push(this, slot);
+      if (blockreader_uring_enter(this, 0))
+        return -1;
+      continue;
+    }
+    got += blockreader_finish(this, slot, &results[got]);
+  }
+
+  return got;
+}
+
+int blockreader_uring_cancel(BlockReader *this)
+// -----------------------------------------------------------------------------
+// Func: cancel for the io_uring backend. Queued reads are handed to the kernel
+//       along with a cancel for each one, then completions are consumed until
+//       every slot is back; a read the kernel already started still runs to
+//       its end. Short reads are not queued again.
+// Args: see blockreader_cancel
+// Retn: see blockreader_cancel
+// -----------------------------------------------------------------------------
+{
+  struct io_uring_cqe *cqe;
+  struct io_uring_sqe *sqe;
+  uint8_t busy[BLOCKREADER_MAX_DEPTH];
+  uint32_t head, tail, entries = *this->sq_mask + 1;
+  int i, slot;
+
+  if (this->inflight == 0)
+    return 0;
+  if (this->to_submit > 0 && blockreader_uring_enter(this, 0))
+    return -1;
+
+  memset(busy, 1, this->depth);
+  for (i = 0; i < this->nfree; i++)
+    busy[this->free_slots[i]] = 0;
+
+  for (slot = 0; slot < this->depth; slot++) {
+    tail = *this->sq_tail;
+    if (!busy[slot] ||
+        tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) == entries)
+      continue; // a read without a cancel is only waited for
+    sqe = &((struct io_uring_sqe *)this->sqes)[tail & *this->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)slot; // the user_data of the read
+    sqe->user_data = BLOCKREADER_CANCEL_TAG;
+    this->sq_array[tail & *this->sq_mask] = tail & *this->sq_mask;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    this->to_submit++;
+  }
+
+  while (this->inflight > 0) {
+    head = *this->cq_head;
+    tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (blockreader_uring_enter(this, 1))
+        return -1;
+      continue;
+    }
+
+    cqe = &((struct io_uring_cqe *)this->cqes)[head & *this->cq_mask];
+    if (cqe->user_data != BLOCKREADER_CANCEL_TAG) {
+      this->free_slots[this->nfree++] = (int)cqe->user_data;
+      this->inflight--;
+    }
+    __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+  }
+
+  // the last cancels may still complete, they are dropped at the next reap
+  return 0;
+}
+
+void blockreader_pread_task(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Worker task for the thread backend, read a whole frame and queue the
+//       request as finished
+// Args: arg - a BlockReadRequest
+// Retn: None, the result is left in the request
+// -----------------------------------------------------------------------------
+{
+  BlockReadRequest *req = (BlockReadRequest *)arg;
+  BlockReader *this = req->reader;
+  ssize_t n;
+
+  for (; req->done < req->size; req->done += (uint64_t)n) {
+    n = pread(this->fd, &req->buf[req->done], req->size - req->done,
+              req->off + req->done);
+    if (n <= 0) {
+      req->res = -1;
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&this->lock);
+  this->done_slots[this->ndone++] = (int)(req - this->reqs);
+  pthread_cond_signal(&this->finished);
+  pthread_mutex_unlock(&this->lock);
+}
+
+int blockreader_pool_reap(BlockReader *this, BlockReadResult *results,
+                          int min, int max)
+// -----------------------------------------------------------------------------
+// Func: reap for the thread backend
+// Args: see blockreader_reap
+// Retn: number of results
+// -----------------------------------------------------------------------------
+{
+  int slots[BLOCKREADER_MAX_DEPTH];
+  int got, i;
+
+  pthread_mutex_lock(&this->lock);
+  while (this->ndone < min)
+    pthread_cond_wait(&this->finished, &this->lock);
+  got = this->ndone < max ? this->ndone : max;
+  this->ndone -= got;
+  memcpy(slots, &this->done_slots[this->ndone], got*sizeof(int));
+  pthread_mutex_unlock(&this->lock);
+
+  for (i = 0; i < got; i++)
+    blockreader_finish(this, slots[i], &results[i]);
+
+  return got;
+}
+
+int blockreader_scan(BlockReader *this, uint64_t lo, uint64_t hi,
+                     BlockScanFunc fn, void *ctx)
+// -----------------------------------------------------------------------------
+// Func: Read blocks [lo, hi) and hand them to fn in order. Up to depth reads
+//       run ahead of the block fn is looking at; block i always lives in
+//       buffer i % depth, so out of order completions wait there for their
+//       turn.
+// Args: this - a pointer to the reader, with nothing in flight
+//       lo, hi - the range of block indices
+//       fn - called with each frame, nonzero stops the scan
+//       ctx - passed through to fn
+// Retn: 0 if the whole range was scanned, 1 if fn stopped it, -1 on a read
+//       error
+// -----------------------------------------------------------------------------
+{
+  uint8_t **bufs, *buf;
+  uint64_t *caps, *ready;
+  uint64_t next = lo, cursor = lo, size;
+  BlockReadResult results[64];
+  int depth = this->depth, i, n, slot, ret = 0;
+
+  if (hi > this->count)
+    hi = this->count;
+
+  bufs = calloc(depth, sizeof(uint8_t *));
+  caps = calloc(depth, sizeof(uint64_t));
+  ready = calloc(depth, sizeof(uint64_t));
+  if (bufs == NULL || caps == NULL || ready == NULL) {
+    free(bufs);
+    free(caps);
+    free(ready);
+    return -1;
+  }
+
+  while (ret == 0 && cursor < hi) {
+    // keep the queue full ahead of the cursor
+    while (next < hi && next - cursor < (uint64_t)depth) {
+      slot = (int)(next % depth);
+      size = blockreader_frame_size(this, next);
+      if (size > caps[slot]) {
+        if ((buf = realloc(bufs[slot], size)) == NULL) {
+          ret = -1;
+          break;
+        }
+        bufs[slot] = buf;
+        caps[slot] = size;
+      }
+      if (this->submit(this, next, bufs[slot], (void *)(uintptr_t)slot)) {
+        ret = -1;
+        break;
+      }
+      next++;
+    }
+
+    slot = (int)(cursor % depth);
+    if (ret == 0 && ready[slot]) {
+      ready[slot] = 0;
+      if (fn(ctx, cursor, bufs[slot], blockreader_frame_size(this, cursor)))
+        ret = 1;
+      cursor++;
+      continue;
+    }
+
+    if (ret == 0) {
+      if ((n = this->reap(this, results, 1, 64)) < 0)
+        ret = -1;
+      for (i = 0; i < n; i++) {
+        if (results[i].res)
+          ret = -1;
+        ready[(uintptr_t)results[i].tag] = 1;
+      }
+    }
+  }
+
+  // nothing may still be reading into our buffers when they are freed; if
+  // the ring can't be drained they are leaked instead
+  if (blockreader_cancel(this))
+    ret = -1;
+  else
+    for (i = 0; i < depth; i++)
+      free(bufs[i]);
+  free(bufs);
+  free(caps);
+  free(ready);
+
+  return ret;
+}
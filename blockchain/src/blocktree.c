@@ -0,0 +1,443 @@
+/*
+blocktree.c: method definitions for the fork-aware block tree
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blocktree.h"
+#include "blockchain.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/rand.h>
+
+#define BLOCKTREE_INIT_BUCKETS 1024
+#define BLOCKTREE_INIT_MAIN    1024
+
+// private functions, access through BlockTree object
+int blocktree_add(BlockTree *this, uint8_t *blockframe);
+BlockTreeEntry *blocktree_find(BlockTree *this, const uint8_t *hash);
+uint8_t *blocktree_get(BlockTree *this, uint64_t height);
+
+BlockTreeEntry *blocktree_entry_new(uint8_t *blockframe);
+int blocktree_insert(BlockTree *this, BlockTreeEntry *entry);
+int blocktree_reserve_main(BlockTree *this, uint64_t height);
+int blocktree_better(BlockTree *this, BlockTreeEntry *a, BlockTreeEntry *b);
+uint64_t blocktree_bucket(BlockTree *this, const uint8_t *hash);
+uint64_t blocktree_skip_height(uint64_t height);
+
+int blocktree_init(BlockTree *this, uint8_t *root_frame, int rule)
+// -----------------------------------------------------------------------------
+// Func: Start a tree from a root block
+// Args: this - a pointer to this blocktree object
+//       root_frame - the framed root block, usually a chain's block 0
+//       rule - BLOCKTREE_LONGEST or BLOCKTREE_MOST_WORK
+// Retn: 0 on success, -1 if the root is invalid, on allocation failure or if
+//       no random seed could be had
+// -----------------------------------------------------------------------------
+{
+  Block root;
+  BlockTreeEntry *entry;
+
+  this->rule = rule;
+  this->on_reorg = NULL;
+  this->reorg_ctx = NULL;
+  this->nentries = 0;
+  this->nbuckets = BLOCKTREE_INIT_BUCKETS;
+  this->main_cap = 0;
+  this->main = NULL;
+  this->tip = NULL;
+
+  this->add = &blocktree_add;
+  this->find = &blocktree_find;
+  this->get = &blocktree_get;
+
+  if (RAND_bytes((unsigned char *)&this->seed, sizeof(this->seed)) != 1)
+    return -1;
+  this->buckets = calloc(this->nbuckets, sizeof(BlockTreeEntry *));
+  if (this->buckets == NULL)
+    return -1;
+
+  blockheader_decode(root_frame, &root);
+  root.record = &root_frame[RECORD_POS];
+  if (!blockchain_verify_root(&root) ||
+      (entry = blocktree_entry_new(root_frame)) == NULL) {
+    blocktree_destroy(this);
+    return -1;
+  }
+  entry->height = 0;
+  this->hash_alg = blockchain_root_hash_alg(&root);
+  entry->work = blocktree_work(entry->hash);
+
+  if (blocktree_reserve_main(this, 0) || blocktree_insert(this, entry)) {
+    free(entry->frame);
+    free(entry);
+    blocktree_destroy(this);
+    return -1;
+  }
+  this->main[0] = entry;
+  this->tip = entry;
+
+  return 0;
+}
+
+void blocktree_destroy(BlockTree *this)
+// -----------------------------------------------------------------------------
+// Func: Free every entry in the tree
+// Args: this - a pointer to this blocktree object
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  BlockTreeEntry *entry, *next;
+  uint64_t i;
+
+  for (i = 0; this->buckets != NULL && i < this->nbuckets; i++) {
+    for (entry = this->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      free(entry->frame);
+      free(entry);
+    }
+  }
+  free(this->buckets);
+  free(this->main);
+  this->buckets = NULL;
+  this->main = NULL;
+  this->tip = NULL;
+  this->nentries = 0;
+
+  this->add = NULL;
+  this->find = NULL;
+  this->get = NULL;
+}
+
+int blocktree_add(BlockTree *this, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Verify a block against its parent and store it, moving the tip to it
+//       if the fork choice rule prefers it. Ties keep the current tip.
+// Args: this - a pointer to this blocktree object
+//       blockframe - the framed block, copied into the tree
+// Retn: BLOCKTREE_EXTENDED, BLOCKTREE_SIDE, BLOCKTREE_REORG or
+//       BLOCKTREE_DUPLICATE; -1 if the parent is unknown, the block does not
+//       verify, or on allocation failure
+// -----------------------------------------------------------------------------
+{
+  Block block, prev_block;
+  BlockTreeEntry *parent, *entry, *old_tip, *e;
+  uint64_t work;
+
+  blockheader_decode(blockframe, &block);
+  block.record = &blockframe[RECORD_POS];
+
+  if (blocktree_find(this, block.hash) != NULL)
+    return BLOCKTREE_DUPLICATE;
+  if ((parent = blocktree_find(this, block.prevhash)) == NULL)
+    return -1; // orphans are not kept, the caller fetches the parent first
+
+  blockheader_decode(parent->frame, &prev_block);
+  if (!blockchain_verify_block(&block, &prev_block, this->hash_alg))
+    return -1;
+
+  if ((entry = blocktree_entry_new(blockframe)) == NULL)
+    return -1;
+  entry->parent = parent;
+  entry->height = parent->height + 1;
+  entry->skip = blocktree_get_ancestor(parent,
+                                       blocktree_skip_height(entry->height));
+  work = blocktree_work(entry->hash);
+  entry->work = parent->work + work < parent->work ? UINT64_MAX
+                                                   : parent->work + work;
+
+  if (blocktree_reserve_main(this, entry->height) ||
+      blocktree_insert(this, entry)) {
+    free(entry->frame);
+    free(entry);
+    return -1;
+  }
+
+  if (!blocktree_better(this, entry, this->tip))
+    return BLOCKTREE_SIDE;
+
+  old_tip = this->tip;
+  this->tip = entry;
+
+  if (parent == old_tip) {
+    this->main[entry->height] = entry;
+    return BLOCKTREE_EXTENDED;
+  }
+
+  // walk the new branch down to where it meets the old main chain, which
+  // touches only the blocks above the fork point
+  for (e = entry; e->height > old_tip->height || this->main[e->height] != e;
+       e = e->parent)
+    this->main[e->height] = e;
+
+  if (this->on_reorg != NULL)
+    this->on_reorg(this->reorg_ctx, this, e, old_tip, entry);
+
+  return BLOCKTREE_REORG;
+}
+
+BlockTreeEntry *blocktree_find(BlockTree *this, const uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: Look up any block in the tree, main chain or not, by its hash
+// Args: this - a pointer to this blocktree object
+//       hash - HASH_SZ bytes
+// Retn: the entry, NULL if the block is not in the tree
+// -----------------------------------------------------------------------------
+{
+  BlockTreeEntry *entry;
+
+  for (entry = this->buckets[blocktree_bucket(this, hash)]; entry != NULL;
+       entry = entry->next) {
+    if (!memcmp(entry->hash, hash, HASH_SZ))
+      return entry;
+  }
+
+  return NULL;
+}
+
+uint8_t *blocktree_get(BlockTree *this, uint64_t height)
+// -----------------------------------------------------------------------------
+// Func: The main chain block at a height
+// Args: this - a pointer to this blocktree object
+//       height - the height (block index)
+// Retn: the framed block, NULL above the tip
+// -----------------------------------------------------------------------------
+{
+  if (height > this->tip->height)
+    return NULL;
+
+  return this->main[height]->frame;
+}
+
+uint64_t blocktree_work(const uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: Work represented by a block hash, 2^(leading zero bits), so a chain
+//       of harder blocks outweighs a longer chain of easy ones
+// Args: hash - HASH_SZ bytes
+// Retn: the work, capped at 2^62
+// -----------------------------------------------------------------------------
+{
+  int i, zeros = 0;
+
+  for (i = 0; i < HASH_SZ && hash[i] == 0; i++)
+    zeros += 8;
+  if (i < HASH_SZ)
+    zeros += __builtin_clz(hash[i]) - 24; // clz counts from bit 31
+
+  return (uint64_t)1 << (zeros < 62 ? zeros : 62);
+}
+
+uint64_t blocktree_skip_height(uint64_t height)
+// -----------------------------------------------------------------------------
+// Func: Height that a block's skip pointer targets. Clearing low set bits
+//       spaces the targets exponentially, and the odd heights are offset so
+//       that walks can mix skips and single steps without getting stuck.
+// Args: height - the block's height
+// Retn: the skip target's height, always below height (0 for heights < 2)
+// -----------------------------------------------------------------------------
+{
+  if (height < 2)
+    return 0;
+
+  if (height & 1) {
+    height -= 1;
+    height &= height - 1;
+    return (height & (height - 1)) + 1;
+  }
+
+  return height & (height - 1);
+}
+
+BlockTreeEntry *blocktree_get_ancestor(BlockTreeEntry *entry, uint64_t height)
+// -----------------------------------------------------------------------------
+// Func: The ancestor of entry at a given height, following skip pointers
+//       where they do not overshoot, in O(log n) steps
+// Args: entry - where to start, on any branch
+//       height - the height wanted
+// Retn: the ancestor (entry itself at its own height), NULL if height is
+//       above entry
+// -----------------------------------------------------------------------------
+{
+  uint64_t skip, skip_prev;
+
+  if (entry == NULL || height > entry->height)
+    return NULL;
+
+  while (entry->height > height) {
+    skip = blocktree_skip_height(entry->height);
+    skip_prev = blocktree_skip_height(entry->height - 1);
+
+    // take the skip unless the parent's skip gets closer without overshooting
+    if (entry->skip != NULL &&
+        (skip == height ||
+         (skip > height && !(skip_prev + 2 < skip && skip_prev >= height))))
+      entry = entry->skip;
+    else
+      entry = entry->parent;
+  }
+
+  return entry;
+}
+
+BlockTreeEntry *blocktree_find_common_ancestor(BlockTreeEntry *a,
+                                               BlockTreeEntry *b)
+// -----------------------------------------------------------------------------
+// Func: The highest block that both a and b descend from. Both are brought
+//       to the same height, then walked up together. Equal heights have equal
+//       skip targets, so when the skip pointers differ the fork lies below
+//       them and both jump; when they agree the fork is at or above that
+//       height and both step to their parents. O(log n) steps without
+//       walking either branch.
+// Args: a, b - two entries of the same tree
+// Retn: the common ancestor, NULL if either is NULL
+// -----------------------------------------------------------------------------
+{
+  if (a == NULL || b == NULL)
+    return NULL;
+
+  if (a->height > b->height)
+    a = blocktree_get_ancestor(a, b->height);
+  else
+    b = blocktree_get_ancestor(b, a->height);
+
+  while (a != b && a != NULL && b != NULL) {
+    if (a->skip != NULL && a->skip != b->skip) {
+      a = a->skip;
+      b = b->skip;
+    }
+    else {
+      a = a->parent;
+      b = b->parent;
+    }
+  }
+
+  return a == b ? a : NULL;
+}
+
+BlockTreeEntry *blocktree_entry_new(uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Allocate an entry holding a copy of a framed block
+// Args: blockframe - the framed block
+// Retn: the entry, NULL on allocation failure
+// -----------------------------------------------------------------------------
+{
+  BlockTreeEntry *entry = malloc(sizeof(BlockTreeEntry));
+  uint64_t blocksize = blockframe_size(blockframe);
+
+  if (entry == NULL)
+    return NULL;
+  if ((entry->frame = malloc(blocksize)) == NULL) {
+    free(entry);
+    return NULL;
+  }
+  memcpy(entry->frame, blockframe, blocksize);
+  entry->hash = &entry->frame[CURRHASH_POS];
+  entry->parent = NULL;
+  entry->skip = NULL;
+  entry->next = NULL;
+
+  return entry;
+}
+
+int blocktree_insert(BlockTree *this, BlockTreeEntry *entry)
+// -----------------------------------------------------------------------------
+// Func: Add an entry to the hash table, doubling it at load factor 1
+// Args: this - a pointer to this blocktree object
+//       entry - the entry
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  BlockTreeEntry **buckets, **old = this->buckets;
+  BlockTreeEntry *e, *next;
+  uint64_t i, b, old_n = this->nbuckets;
+
+  if (this->nentries >= this->nbuckets) {
+    if ((buckets = calloc(2*old_n, sizeof(BlockTreeEntry *))) == NULL)
+      return -1;
+    this->buckets = buckets;
+    this->nbuckets = 2*old_n;
+    for (i = 0; i < old_n; i++) {
+      for (e = old[i]; e != NULL; e = next) {
+        next = e->next;
+        b = blocktree_bucket(this, e->hash);
+        e->next = buckets[b];
+        buckets[b] = e;
+      }
+    }
+    free(old);
+  }
+
+  b = blocktree_bucket(this, entry->hash);
+  entry->next = this->buckets[b];
+  this->buckets[b] = entry;
+  this->nentries++;
+
+  return 0;
+}
+
+int blocktree_reserve_main(BlockTree *this, uint64_t height)
+// -----------------------------------------------------------------------------
+// Func: Make sure the main chain array has a slot for height
+// Args: this - a pointer to this blocktree object
+//       height - the height
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  BlockTreeEntry **main;
+  uint64_t cap = this->main_cap ? this->main_cap : BLOCKTREE_INIT_MAIN;
+
+  while (cap <= height)
+    cap *= 2;
+  if (cap == this->main_cap)
+    return 0;
+
+  if ((main = realloc(this->main, cap*sizeof(BlockTreeEntry *))) == NULL)
+    return -1;
+  this->main = main;
+  this->main_cap = cap;
+
+  return 0;
+}
+
+int blocktree_better(BlockTree *this, BlockTreeEntry *a, BlockTreeEntry *b)
+// -----------------------------------------------------------------------------
+// Func: Fork choice, whether tip a beats tip b
+// Args: this - a pointer to this blocktree object
+//       a, b - the tips
+// Retn: 1 if a is strictly better under this->rule
+// -----------------------------------------------------------------------------
+{
+  if (this->rule == BLOCKTREE_MOST_WORK)
+    return a->work > b->work;
+
+  return a->height > b->height;
+}
+
+uint64_t blocktree_bucket(BlockTree *this, const uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: Hash table bucket of a block hash. Block hashes are not uniform, the
+//       leading bytes are zero for high work blocks and a peer can grind the
+//       rest, so the whole hash is rehashed under the tree's secret seed.
+// Args: this - a pointer to this blocktree object
+//       hash - HASH_SZ bytes
+// Retn: the bucket index
+// -----------------------------------------------------------------------------
+{
+  return util_buf_hash64(hash, HASH_SZ, this->seed) & (this->nbuckets - 1);
+}
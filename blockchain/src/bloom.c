@@ -0,0 +1,353 @@
+/*
+bloom.c: method definitions for the per-segment bloom filters
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bloom.h"
+#include "blockchain.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+// odd constants that spread one 32 bit hash over the 8 words of a block
+static const uint32_t bloom_salt[BLOOM_WORDS] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// private functions, access through SegmentBloom object
+int bloom_may_contain(SegmentBloom *this, uint64_t segment,
+                      const uint8_t *key, uint64_t key_sz);
+int64_t bloom_scan(SegmentBloom *this, const uint8_t *key, uint64_t key_sz,
+                   BloomMatchFunc match, void *ctx);
+void bloom_hook(void *ctx, Blockchain *chain, uint8_t *blockframe);
+int bloom_catch_up(SegmentBloom *this);
+int bloom_add(SegmentBloom *this, uint64_t index, uint8_t *blockframe);
+int bloom_probe_portable(const uint32_t *block, uint32_t h);
+int bloom_probe_avx2(const uint32_t *block, uint32_t h);
+int bloom_probe(SegmentBloom *this, uint64_t segment, uint64_t h);
+
+int bloom_init(SegmentBloom *this, Blockchain *chain, uint64_t seg_blocks,
+               RecordKeyFunc key, void *key_ctx)
+// -----------------------------------------------------------------------------
+// Func: Build filters for every block already in the chain and hook the chain
+//       so that new blocks are added as they are appended. Pruned blocks whose
+//       record was dropped cannot be added.
+// Args: this - a pointer to this bloom object
+//       chain - the chain to follow
+//       seg_blocks - chain blocks covered by one filter
+//       key - extracts the key of a record
+//       key_ctx - passed through to key
+// Retn: 0 on success, -1 on allocation failure or if the chain has no room
+//       for another hook
+// -----------------------------------------------------------------------------
+{
+  uint64_t bits;
+
+  this->chain = chain;
+  this->key = key;
+  this->key_ctx = key_ctx;
+  this->seg_blocks = seg_blocks ? seg_blocks : 1;
+  this->nsegs = 0;
+  this->cap = 0;
+  this->filters = NULL;
+  this->covered = 0;
+
+  // size for one key per block, rounded up to a power of two of blocks
+  bits = this->seg_blocks * BLOOM_BITS_PER_KEY;
+  for (this->filter_blocks = 1;
+       this->filter_blocks * BLOOM_BLOCK_BITS < bits;
+       this->filter_blocks *= 2)
+    ;
+
+  this->may_contain = &bloom_may_contain;
+  this->scan = &bloom_scan;
+
+  if (bloom_catch_up(this) || blockchain_add_hook(chain, &bloom_hook, this)) {
+    bloom_destroy(this);
+    return -1;
+  }
+
+  return 0;
+}
+
+void bloom_destroy(SegmentBloom *this)
+// -----------------------------------------------------------------------------
+// Func: Unhook from the chain and free the filters
+// Args: this - a pointer to this bloom object
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  blockchain_remove_hook(this->chain, &bloom_hook, this);
+  free(this->filters);
+  this->filters = NULL;
+  this->nsegs = 0;
+  this->cap = 0;
+  this->may_contain = NULL;
+  this->scan = NULL;
+}
+
+void bloom_hook(void *ctx, Blockchain *chain, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Chain hook, adds the key of a newly appended block. Hooks can't
+//       fail, so a block that can't be added is left past covered, where the
+//       next append picks it up again.
+// Args: ctx - this bloom object
+//       chain - the chain that was appended to
+//       blockframe - the new block
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  SegmentBloom *this = (SegmentBloom *)ctx;
+
+  if (this->covered == chain->length-1) {
+    if (bloom_add(this, this->covered, blockframe) == 0)
+      this->covered++;
+  }
+  else {
+    bloom_catch_up(this); // behind after a failure, redo from there
+  }
+}
+
+int bloom_catch_up(SegmentBloom *this)
+// -----------------------------------------------------------------------------
+// Func: Add the chain's blocks from this->covered up to its front. Pruned
+//       blocks whose record was dropped cannot be added and are skipped.
+// Args: this - a pointer to this bloom object
+// Retn: 0 on success, -1 on allocation failure (covered then stops at the
+//       block that could not be added)
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain = this->chain;
+  uint8_t *frame, *tmp;
+  uint8_t *buf = NULL;
+  uint64_t i;
+
+  for (i = this->covered; i < chain->length; i++) {
+    if ((frame = (uint8_t *)chain->get(chain, i)) == NULL) {
+      tmp = realloc(buf, blockframe_size(blockchain_get_header(chain, i)));
+      if (tmp == NULL)
+        break;
+      buf = tmp;
+      if (blockchain_read_frame(chain, i, buf))
+        continue; // record dropped by pruning, nothing to add
+      frame = buf;
+    }
+    if (bloom_add(this, i, frame))
+      break;
+  }
+  free(buf);
+  this->covered = i;
+
+  return i < chain->length ? -1 : 0;
+}
+
+int bloom_add(SegmentBloom *this, uint64_t index, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Set the bits for a block's key in its segment's filter
+// Args: this - a pointer to this bloom object
+//       index - the block's index in the chain
+//       blockframe - the framed block
+// Retn: 0 on success (or if the record has no key), -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  uint64_t segment = index / this->seg_blocks;
+  uint64_t filter_words = this->filter_blocks * BLOOM_WORDS;
+  uint64_t cap, key_sz, h;
+  uint32_t *filters, *block;
+  const uint8_t *key;
+  int i;
+
+  while (segment >= this->cap) { // grow by doubling, zeroing the new filters
+    cap = this->cap ? 2*this->cap : 8;
+    filters = aligned_alloc(64, cap*filter_words*sizeof(uint32_t));
+    if (filters == NULL)
+      return -1;
+    if (this->filters != NULL)
+      memcpy(filters, this->filters, this->cap*filter_words*sizeof(uint32_t));
+    memset(&filters[this->cap*filter_words], 0,
+           (cap - this->cap)*filter_words*sizeof(uint32_t));
+    free(this->filters);
+    this->filters = filters;
+    this->cap = cap;
+  }
+  if (segment >= this->nsegs)
+    this->nsegs = segment + 1;
+
+  if (this->key(this->key_ctx, &blockframe[RECORD_POS],
+                blockframe_size(blockframe) - BLOCK_HEADER_SZ, &key, &key_sz))
+    return 0; // no key in this record
+
+  // high half picks the block, low half picks one bit per word
+  h = util_buf_hash64(key, key_sz, 0);
+  block = &this->filters[segment*filter_words +
+                         ((h >> 32) & (this->filter_blocks-1))*BLOOM_WORDS];
+  for (i = 0; i < BLOOM_WORDS; i++)
+    block[i] |= (uint32_t)1 << (((uint32_t)h * bloom_salt[i]) >> 27);
+
+  return 0;
+}
+
+int bloom_probe_portable(const uint32_t *block, uint32_t h)
+// -----------------------------------------------------------------------------
+// Func: Check whether every bit for h is set in a filter block
+// Args: block - BLOOM_WORDS words
+//       h - low half of the key hash
+// Retn: 1 if the key might be present, 0 if it is definitely absent
+// -----------------------------------------------------------------------------
+{
+  uint32_t miss = 0;
+  int i;
+
+  for (i = 0; i < BLOOM_WORDS; i++)
+    miss |= ~block[i] & ((uint32_t)1 << ((h * bloom_salt[i]) >> 27));
+
+  return miss == 0;
+}
+
+__attribute__((target("avx2")))
+int bloom_probe_avx2(const uint32_t *block, uint32_t h)
+// -----------------------------------------------------------------------------
+// Func: bloom_probe_portable, all 8 words at once
+// Args: block - BLOOM_WORDS words, 32 byte aligned
+//       h - low half of the key hash
+// Retn: 1 if the key might be present, 0 if it is definitely absent
+// -----------------------------------------------------------------------------
+{
+  __m256i salt = _mm256_loadu_si256((const __m256i *)bloom_salt);
+  __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(h),
+                                                      salt), 27);
+  __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+
+  // testc: 1 if every bit of mask is also set in block
+  return _mm256_testc_si256(_mm256_load_si256((const __m256i *)block), mask);
+}
+
+int bloom_may_contain(SegmentBloom *this, uint64_t segment,
+                      const uint8_t *key, uint64_t key_sz)
+// -----------------------------------------------------------------------------
+// Func: Probe one segment's filter for a key
+// Args: this - a pointer to this bloom object
+//       segment - the segment, blocks [segment*seg_blocks, +seg_blocks)
+//       key - the key to look for
+//       key_sz - size of the key
+// Retn: 1 if some block in the segment might have the key, 0 if none does
+// -----------------------------------------------------------------------------
+{
+  uint64_t hi = (segment+1)*this->seg_blocks;
+
+  if (segment*this->seg_blocks >= this->chain->length)
+    return 0;
+  if ((hi < this->chain->length ? hi : this->chain->length) > this->covered)
+    return 1; // some of its blocks are not in the filter
+
+  return bloom_probe(this, segment, util_buf_hash64(key, key_sz, 0));
+}
+
+int bloom_probe(SegmentBloom *this, uint64_t segment, uint64_t h)
+// -----------------------------------------------------------------------------
+// Func: Probe one segment's filter for a key already hashed, so a scan
+//       hashes its key once for every segment
+// Args: this - a pointer to this bloom object
+//       segment - the segment, below nsegs
+//       h - util_buf_hash64 of the key
+// Retn: 1 if some block in the segment might have the key, 0 if none does
+// -----------------------------------------------------------------------------
+{
+  static int have_avx2 = -1;
+  int avx2 = __atomic_load_n(&have_avx2, __ATOMIC_RELAXED);
+  const uint32_t *block;
+
+  // scans may run on several threads, so the first calls may race to set this
+  if (avx2 < 0) {
+    avx2 = __builtin_cpu_supports("avx2") != 0;
+    __atomic_store_n(&have_avx2, avx2, __ATOMIC_RELAXED);
+  }
+
+  block = &this->filters[segment*this->filter_blocks*BLOOM_WORDS +
+                         ((h >> 32) & (this->filter_blocks-1))*BLOOM_WORDS];
+
+  return avx2 ? bloom_probe_avx2(block, (uint32_t)h)
+              : bloom_probe_portable(block, (uint32_t)h);
+}
+
+int64_t bloom_scan(SegmentBloom *this, const uint8_t *key, uint64_t key_sz,
+                   BloomMatchFunc match, void *ctx)
+// -----------------------------------------------------------------------------
+// Func: Find every block whose record key equals key, decoding only the
+//       blocks of segments whose filter might contain it, and every block
+//       not yet in a filter
+// Args: this - a pointer to this bloom object
+//       key - the key to look for
+//       key_sz - size of the key
+//       match - called for each matching block, may be NULL to just count
+//       ctx - passed through to match
+// Retn: the number of matching blocks, -1 on allocation failure or if a
+//       pruned record could not be read back (match may already have been
+//       called for some blocks)
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain = this->chain;
+  uint64_t segment, i, hi, rec_key_sz;
+  uint64_t h = util_buf_hash64(key, key_sz, 0);
+  const uint8_t *rec_key;
+  uint8_t *frame, *tmp;
+  uint8_t *buf = NULL;
+  int64_t found = 0;
+
+  for (segment = 0; segment*this->seg_blocks < chain->length && found >= 0;
+       segment++) {
+    hi = (segment+1)*this->seg_blocks;
+    if (hi > chain->length)
+      hi = chain->length;
+    if (hi <= this->covered && !bloom_probe(this, segment, h))
+      continue;
+
+    for (i = segment*this->seg_blocks; i < hi; i++) {
+      if ((frame = (uint8_t *)chain->get(chain, i)) == NULL) {
+        tmp = realloc(buf, blockframe_size(blockchain_get_header(chain, i)));
+        if (tmp == NULL) {
+          found = -1;
+          break;
+        }
+        buf = tmp;
+        if (blockchain_read_frame(chain, i, buf)) {
+          if (chain->spill_off[i] == BLOCKCHAIN_NOT_SPILLED)
+            continue; // dropped by pruning, nothing to match
+          found = -1;
+          break;
+        }
+        frame = buf;
+      }
+
+      if (this->key(this->key_ctx, &frame[RECORD_POS],
+                    blockframe_size(frame) - BLOCK_HEADER_SZ,
+                    &rec_key, &rec_key_sz) == 0 &&
+          rec_key_sz == key_sz && !memcmp(rec_key, key, key_sz)) {
+        found++;
+        if (match != NULL)
+          match(ctx, i, frame);
+      }
+    }
+  }
+  free(buf);
+
+  return found;
+}
@@ -0,0 +1,366 @@
+/*
+chainagg.c: running aggregates over the blocks of a chain
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chainagg.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const ChainAggPart chainagg_empty = {0, 0, UINT64_MAX, 0};
+
+// private functions, access through ChainAgg object
+void chainagg_total(ChainAgg *this, ChainAggPart *out);
+void chainagg_range(ChainAgg *this, uint64_t t0, uint64_t t1,
+                    ChainAggPart *out);
+uint64_t chainagg_series(ChainAgg *this, uint64_t t0, uint64_t t1,
+                         ChainAggPart *out, uint64_t max);
+
+// private functions
+void chainagg_hook(void *ctx, Blockchain *chain, uint8_t *blockframe);
+void chainagg_add(ChainAgg *this, const uint8_t *header);
+int chainagg_grow(ChainAgg *this, uint64_t need);
+uint64_t chainagg_find(ChainAgg *this, uint64_t id);
+void chainagg_fold(ChainAggPart *part, uint64_t record_sz);
+
+int chainagg_init(ChainAgg *this, Blockchain *chain, uint64_t width)
+// -----------------------------------------------------------------------------
+// Func: Aggregate the blocks already in the chain and hook the chain so that
+//       new blocks are added as they are appended. Only headers are read, so
+//       blocks whose record was pruned count like any other.
+// Args: this - a pointer to this aggregate object
+//       chain - the chain to follow
+//       width - seconds per time bucket, 0 for 1
+// Retn: 0 on success, -1 if the chain has no room for another hook
+// -----------------------------------------------------------------------------
+{
+  uint64_t i;
+  int err;
+
+  this->chain = chain;
+  this->width = width ? width : 1;
+  this->ids = NULL;
+  this->nbuckets = 0;
+  this->cap = 0;
+  this->nlevels = 0;
+  this->all = chainagg_empty;
+  this->lost = 0;
+  pthread_rwlock_init(&this->lock, NULL);
+
+  this->total = &chainagg_total;
+  this->range = &chainagg_range;
+  this->series = &chainagg_series;
+
+  // no block may be stored between the catch up and the hook
+  pthread_rwlock_wrlock(&chain->lock);
+  for (i = 0; i < chain->length; i++)
+    chainagg_add(this, blockchain_get_header(chain, i));
+  err = blockchain_add_hook_locked(chain, &chainagg_hook, this);
+  pthread_rwlock_unlock(&chain->lock);
+
+  if (err) {
+    chainagg_destroy(this);
+    return -1;
+  }
+
+  return 0;
+}
+
+void chainagg_destroy(ChainAgg *this)
+// -----------------------------------------------------------------------------
+// Func: Unhook from the chain and free the buckets
+// Args: this - a pointer to this aggregate object
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  int k;
+
+  blockchain_remove_hook(this->chain, &chainagg_hook, this);
+  for (k = 0; k < this->nlevels; k++)
+    free(this->levels[k]);
+  free(this->ids);
+  this->ids = NULL;
+  this->nlevels = 0;
+  this->nbuckets = 0;
+  this->cap = 0;
+  pthread_rwlock_destroy(&this->lock);
+}
+
+void chainagg_merge(ChainAggPart *into, const ChainAggPart *from)
+// -----------------------------------------------------------------------------
+// Func: Fold one aggregate into another
+// Args: into - the aggregate to add to
+//       from - the aggregate to add
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  into->count += from->count;
+  into->bytes += from->bytes;
+  if (from->min < into->min)
+    into->min = from->min;
+  if (from->max > into->max)
+    into->max = from->max;
+}
+
+double chainagg_mean(const ChainAggPart *part)
+// -----------------------------------------------------------------------------
+// Func: Mean record size of an aggregate
+// Args: part - the aggregate
+// Retn: the mean, 0 if it is empty
+// -----------------------------------------------------------------------------
+{
+  return part->count ? (double)part->bytes / part->count : 0;
+}
+
+void chainagg_total(ChainAgg *this, ChainAggPart *out)
+// -----------------------------------------------------------------------------
+// Func: Aggregate of every block in the chain, O(1)
+// Args: this - a pointer to this aggregate object
+//       out - set to the aggregate
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  pthread_rwlock_rdlock(&this->lock);
+  *out = this->all;
+  pthread_rwlock_unlock(&this->lock);
+}
+
+void chainagg_range(ChainAgg *this, uint64_t t0, uint64_t t1,
+                    ChainAggPart *out)
+// -----------------------------------------------------------------------------
+// Func: Aggregate of the blocks stamped in [t0, t1), widened to whole
+//       buckets, in O(log n) merges
+// Args: this - a pointer to this aggregate object
+//       t0 - start of the window, in seconds
+//       t1 - end of the window
+//       out - set to the aggregate
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t lo, hi;
+  int k;
+
+  *out = chainagg_empty;
+  lo = t0 / this->width;
+  hi = t1 / this->width + (t1 % this->width != 0);
+
+  pthread_rwlock_rdlock(&this->lock);
+  lo = chainagg_find(this, lo);
+  hi = chainagg_find(this, hi);
+
+  // climb the tree taking the nodes that stick out at either end
+  for (k = 0; lo < hi; k++, lo >>= 1, hi >>= 1) {
+    if (lo & 1)
+      chainagg_merge(out, &this->levels[k][lo++]);
+    if (hi & 1)
+      chainagg_merge(out, &this->levels[k][--hi]);
+  }
+  pthread_rwlock_unlock(&this->lock);
+}
+
+uint64_t chainagg_series(ChainAgg *this, uint64_t t0, uint64_t t1,
+                         ChainAggPart *out, uint64_t max)
+// -----------------------------------------------------------------------------
+// Func: One aggregate per bucket from the bucket holding t0 up to the one
+//       holding t1 - 1, for charts. out[i] covers the width seconds from
+//       (t0 / width + i) * width; buckets with no blocks are empty.
+// Args: this - a pointer to this aggregate object
+//       t0 - start of the window, in seconds
+//       t1 - end of the window
+//       out - room for max aggregates
+//       max - most buckets to return
+// Retn: number of aggregates written
+// -----------------------------------------------------------------------------
+{
+  uint64_t b, lo, n, pos;
+
+  if (t1 <= t0)
+    return 0;
+  lo = t0 / this->width;
+  n = (t1 - 1) / this->width - lo + 1;
+  if (n > max)
+    n = max;
+
+  pthread_rwlock_rdlock(&this->lock);
+  pos = chainagg_find(this, lo);
+  for (b = 0; b < n; b++) {
+    if (pos < this->nbuckets && this->ids[pos] == lo + b)
+      out[b] = this->levels[0][pos++];
+    else
+      out[b] = chainagg_empty;
+  }
+  pthread_rwlock_unlock(&this->lock);
+
+  return n;
+}
+
+void chainagg_hook(void *ctx, Blockchain *chain, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Chain hook, adds a newly appended block
+// Args: ctx - this aggregate object
+//       chain - the chain that was appended to
+//       blockframe - the new block
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  (void)chain;
+  chainagg_add((ChainAgg *)ctx, blockframe);
+}
+
+void chainagg_add(ChainAgg *this, const uint8_t *header)
+// -----------------------------------------------------------------------------
+// Func: Fold a block into its bucket and every tree node above it. A block
+//       stamped before the newest bucket, which a verified chain never has,
+//       goes in the newest bucket.
+// Args: this - a pointer to this aggregate object
+//       header - the block's header
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t ts, record_sz, b, pos;
+  int k, fresh;
+
+  memcpy(&ts, &header[TS_POS], WORD_SZ);
+  memcpy(&record_sz, &header[RECORD_SZ_POS], WORD_SZ);
+  b = ts / this->width;
+
+  // the hook is the only writer, so it may look at the buckets unlocked and
+  // grow them before taking the lock
+  fresh = this->nbuckets == 0 || b > this->ids[this->nbuckets-1];
+  if (fresh && this->nbuckets == this->cap &&
+      chainagg_grow(this, this->nbuckets + 1)) {
+    pthread_rwlock_wrlock(&this->lock);
+    chainagg_fold(&this->all, record_sz);
+    this->lost++;
+    pthread_rwlock_unlock(&this->lock);
+    return;
+  }
+
+  pthread_rwlock_wrlock(&this->lock);
+  chainagg_fold(&this->all, record_sz);
+  if (fresh)
+    this->ids[this->nbuckets++] = b;
+  pos = this->nbuckets - 1;
+  for (k = 0; k < this->nlevels; k++)
+    chainagg_fold(&this->levels[k][pos >> k], record_sz);
+  pthread_rwlock_unlock(&this->lock);
+}
+
+int chainagg_grow(ChainAgg *this, uint64_t need)
+// -----------------------------------------------------------------------------
+// Func: Double the buckets until there are need of them, and rebuild the
+//       levels above from them. Doubling keeps the rebuilds O(1) a block.
+//       The copies are built outside the lock, which is only taken to swap
+//       them in, so queries don't wait on the rebuild.
+// Args: this - a pointer to this aggregate object, called by the writer
+//       need - buckets wanted
+// Retn: 0 on success, -1 on allocation failure (nothing is changed)
+// -----------------------------------------------------------------------------
+{
+  ChainAggPart *levels[CHAINAGG_MAX_LEVELS];
+  ChainAggPart *old_levels[CHAINAGG_MAX_LEVELS];
+  uint64_t *ids, *old_ids;
+  uint64_t cap, j, n;
+  int k, nlevels, old_nlevels, err = 0;
+
+  if (need > (uint64_t)1 << (CHAINAGG_MAX_LEVELS-2))
+    return -1;
+  for (cap = this->cap ? this->cap : 64; cap < need; cap *= 2)
+    ;
+  for (nlevels = 1; (cap >> (nlevels-1)) > 1; nlevels++)
+    ;
+
+  if ((ids = malloc(cap*sizeof(uint64_t))) == NULL)
+    return -1;
+  for (k = 0; k < nlevels && !err; k++)
+    err = (levels[k] = malloc((cap >> k)*sizeof(ChainAggPart))) == NULL;
+  if (err) {
+    while (--k >= 0)
+      free(levels[k]);
+    free(ids);
+    return -1;
+  }
+
+  n = this->nbuckets;
+  if (n > 0) {
+    memcpy(ids, this->ids, n*sizeof(uint64_t));
+    memcpy(levels[0], this->levels[0], n*sizeof(ChainAggPart));
+  }
+  for (j = n; j < cap; j++)
+    levels[0][j] = chainagg_empty;
+  for (k = 1; k < nlevels; k++) {
+    for (j = 0; j < (cap >> k); j++) {
+      levels[k][j] = levels[k-1][2*j];
+      chainagg_merge(&levels[k][j], &levels[k-1][2*j+1]);
+    }
+  }
+
+  pthread_rwlock_wrlock(&this->lock);
+  old_ids = this->ids;
+  old_nlevels = this->nlevels;
+  memcpy(old_levels, this->levels, old_nlevels*sizeof(ChainAggPart *));
+  this->ids = ids;
+  memcpy(this->levels, levels, nlevels*sizeof(ChainAggPart *));
+  this->nlevels = nlevels;
+  this->cap = cap;
+  pthread_rwlock_unlock(&this->lock);
+
+  for (k = 0; k < old_nlevels; k++)
+    free(old_levels[k]);
+  free(old_ids);
+
+  return 0;
+}
+
+uint64_t chainagg_find(ChainAgg *this, uint64_t id)
+// -----------------------------------------------------------------------------
+// Func: Position of the first bucket at or after a bucket id, by bisection
+// Args: this - a pointer to this aggregate object, locked
+//       id - timestamp / width
+// Retn: the position, nbuckets if every bucket is before id
+// -----------------------------------------------------------------------------
+{
+  uint64_t lo = 0, hi = this->nbuckets, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (this->ids[mid] < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+void chainagg_fold(ChainAggPart *part, uint64_t record_sz)
+// -----------------------------------------------------------------------------
+// Func: Add one block to an aggregate
+// Args: part - the aggregate
+//       record_sz - the block's record size
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  part->count++;
+  part->bytes += record_sz;
+  if (record_sz < part->min)
+    part->min = record_sz;
+  if (record_sz > part->max)
+    part->max = record_sz;
+}
@@ -0,0 +1,649 @@
+/*
+chainexport.c: bulk export of blocks as hex, JSON lines or raw frames
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chainexport.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// upper bound on the bytes one block encodes to
+#define CHAINEXPORT_JSON_SZ(sz) (320 + 2*(sz))
+#define CHAINEXPORT_HEX_SZ(sz)  (2*(sz) + 1)
+
+// private functions
+int chainexport_start(ChainExport *job, int format, int fd, ThreadPool *pool);
+void chainexport_finish(ChainExport *job);
+ChainExportSeg *chainexport_next_seg(ChainExport *job);
+void chainexport_submit(ChainExport *job, ChainExportSeg *seg);
+void chainexport_retire(ChainExport *job);
+int chainexport_frame(void *ctx, uint64_t index, uint8_t *blockframe,
+                      uint64_t blocksize);
+int chainexport_verify(ChainExport *job, uint64_t index, uint8_t *frame,
+                       uint8_t *prev);
+const uint8_t *chainexport_hash_at(void *ctx, uint64_t height);
+void chainexport_task(void *arg);
+uint64_t chainexport_seg_end(Blockchain *chain, uint64_t lo, uint64_t hi);
+uint64_t chainexport_bound(int format, uint64_t size);
+uint8_t *chainexport_json(uint8_t *p, const uint8_t *frame, uint64_t size);
+uint8_t *chainexport_u64(uint8_t *p, uint64_t v);
+int chainexport_write(int fd, const uint8_t *buf, uint64_t len);
+
+int chainexport_run(Blockchain *chain, uint64_t lo, uint64_t hi, int format,
+                    int fd, ThreadPool *pool)
+// -----------------------------------------------------------------------------
+// Func: Write blocks [lo, hi) to a file descriptor in one of the
+//       CHAINEXPORT_* formats. With a pool, segments are encoded in parallel
+//       while earlier ones are written; the output is the same either way.
+//       The chain must not be appended to meanwhile.
+// Args: chain - the chain
+//       lo - first block
+//       hi - one past the last block, clipped to the chain's length
+//       format - CHAINEXPORT_HEX, CHAINEXPORT_JSON or CHAINEXPORT_RAW
+//       fd - where to write
+//       pool - the workers, NULL to encode on the calling thread
+// Retn: 0 on success, -1 if out of memory, a write fails or a pruned record
+//       was dropped (the output then stops at the segment before it)
+// -----------------------------------------------------------------------------
+{
+  ChainExport job;
+  ChainExportSeg *seg;
+  uint64_t next;
+
+  if (hi > chain->length)
+    hi = chain->length;
+  if (lo > hi)
+    lo = hi;
+
+  job.chain = chain;
+  job.reader = NULL;
+  if (chainexport_start(&job, format, fd, pool))
+    return -1;
+
+  for (next = lo; next < hi && !job.err; next = seg->hi) {
+    seg = chainexport_next_seg(&job);
+    seg->lo = next;
+    seg->hi = chainexport_seg_end(chain, next, hi);
+    chainexport_submit(&job, seg);
+  }
+  chainexport_finish(&job);
+
+  return job.err ? -1 : 0;
+}
+
+int chainexport_stream(BlockReader *reader, uint64_t lo, uint64_t hi,
+                       int format, int fd, ThreadPool *pool,
+                       const CheckpointSet *checkpoints)
+// -----------------------------------------------------------------------------
+// Func: chainexport_run for a snapshot or chain log on disk, without loading
+//       it: frames are read ahead through the reader into segments, and the
+//       workers verify each one against the block before it (from the newest
+//       checkpoint the file matches, see checkpoint.h) as they encode it.
+//       Blocks from the root up to hi are read, since each must link to the
+//       last.
+// Args: reader - a BlockReader over the file, with nothing in flight
+//       lo - first block written
+//       hi - one past the last block, clipped to the file's count
+//       format - CHAINEXPORT_HEX, CHAINEXPORT_JSON or CHAINEXPORT_RAW
+//       fd - where to write
+//       pool - the workers, NULL to encode on the calling thread
+//       checkpoints - trusted blocks, NULL to rehash every block
+// Retn: 0 on success, -1 if out of memory, a read or write fails, or a block
+//       fails verification (the output then stops at the segment before it)
+// -----------------------------------------------------------------------------
+{
+  ChainExport job;
+
+  if (hi > reader->count)
+    hi = reader->count;
+  if (lo > hi)
+    lo = hi;
+
+  job.chain = NULL;
+  job.reader = reader;
+  job.lo = lo;
+  job.hi = hi;
+  job.hash_alg = 0; // set from the root as it is read
+  job.assumed = checkpoints != NULL ?
+                checkpoints->find(checkpoints, reader->count,
+                                  &chainexport_hash_at, &job) : 0;
+  job.fill = NULL;
+  memset(job.last, 0, BLOCK_HEADER_SZ);
+  if (chainexport_start(&job, format, fd, pool))
+    return -1;
+
+  if (lo < hi && blockreader_scan(reader, 0, hi, &chainexport_frame, &job))
+    job.err = 1;
+  chainexport_finish(&job);
+
+  return job.err ? -1 : 0;
+}
+
+int chainexport_start(ChainExport *job, int format, int fd, ThreadPool *pool)
+// -----------------------------------------------------------------------------
+// Func: Set up the window of an export, the source is set by the caller
+// Args: job - the export
+//       format - one of CHAINEXPORT_*
+//       fd - where to write
+//       pool - the workers, NULL to encode on the calling thread
+// Retn: 0 on success, -1 if out of memory
+// -----------------------------------------------------------------------------
+{
+  job->format = format;
+  job->fd = fd;
+  job->pool = pool;
+  job->nsegs = pool != NULL ? CHAINEXPORT_AHEAD*pool->nthreads : 1;
+  job->submitted = 0;
+  job->written = 0;
+  job->err = 0;
+  if ((job->segs = calloc(job->nsegs, sizeof(ChainExportSeg))) == NULL)
+    return -1;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->done, NULL);
+
+  return 0;
+}
+
+void chainexport_finish(ChainExport *job)
+// -----------------------------------------------------------------------------
+// Func: Write the segments still in the window (only wait for them after a
+//       failure, nothing may be encoding into them when they are freed) and
+//       free it
+// Args: job - the export
+// Retn: None, job->err tells how it went
+// -----------------------------------------------------------------------------
+{
+  int i;
+
+  while (job->written < job->submitted)
+    chainexport_retire(job);
+
+  for (i = 0; i < job->nsegs; i++) {
+    free(job->segs[i].buf);
+    free(job->segs[i].frames);
+  }
+  free(job->segs);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->done);
+}
+
+ChainExportSeg *chainexport_next_seg(ChainExport *job)
+// -----------------------------------------------------------------------------
+// Func: The next segment to fill, once the window has room for it
+// Args: job - the export
+// Retn: the segment
+// -----------------------------------------------------------------------------
+{
+  while (job->submitted - job->written >= (uint64_t)job->nsegs)
+    chainexport_retire(job);
+
+  return &job->segs[job->submitted % job->nsegs];
+}
+
+void chainexport_submit(ChainExport *job, ChainExportSeg *seg)
+// -----------------------------------------------------------------------------
+// Func: Hand a filled in segment to the pool, or encode it here
+// Args: job - the export
+//       seg - the segment from chainexport_next_seg, lo and hi set
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  seg->job = job;
+  seg->done = 0;
+  seg->err = 0;
+  if (job->pool == NULL ||
+      job->pool->submit(job->pool, &chainexport_task, seg))
+    chainexport_task(seg);
+  job->submitted++;
+}
+
+void chainexport_retire(ChainExport *job)
+// -----------------------------------------------------------------------------
+// Func: Wait for the oldest segment in the window and write it, unless the
+//       export has already failed
+// Args: job - the export, with a segment submitted
+// Retn: None, sets job->err on failure
+// -----------------------------------------------------------------------------
+{
+  ChainExportSeg *seg = &job->segs[job->written % job->nsegs];
+
+  pthread_mutex_lock(&job->lock);
+  while (!seg->done)
+    pthread_cond_wait(&job->done, &job->lock);
+  pthread_mutex_unlock(&job->lock);
+
+  if (!job->err)
+    job->err = seg->err || chainexport_write(job->fd, seg->buf, seg->len);
+  job->written++;
+}
+
+int chainexport_frame(void *ctx, uint64_t index, uint8_t *blockframe,
+                      uint64_t blocksize)
+// -----------------------------------------------------------------------------
+// Func: BlockScanFunc for chainexport_stream, copies each frame into the
+//       segment being filled and submits it once full
+// Args: ctx - the export
+//       index, blockframe, blocksize - the block, in order from the root
+// Retn: 0 to go on, 1 once the export has failed
+// -----------------------------------------------------------------------------
+{
+  ChainExport *job = (ChainExport *)ctx;
+  ChainExportSeg *seg = job->fill;
+  uint8_t *grown;
+  uint64_t cap;
+  Block root;
+
+  if (index == 0) { // the workers need the chain's hash function
+    blockheader_decode(blockframe, &root);
+    root.record = &blockframe[RECORD_POS];
+    job->hash_alg = blockchain_root_hash_alg(&root);
+  }
+
+  if (seg == NULL) {
+    seg = job->fill = chainexport_next_seg(job);
+    seg->lo = seg->hi = index;
+    seg->frames_len = 0;
+    memcpy(seg->prev, job->last, BLOCK_HEADER_SZ);
+  }
+  if (job->err)
+    return 1;
+
+  if (seg->frames_len + blocksize > seg->frames_cap) {
+    cap = seg->frames_len + blocksize;
+    cap = cap < 2*seg->frames_cap ? 2*seg->frames_cap : cap;
+    if ((grown = realloc(seg->frames, cap)) == NULL) {
+      job->err = 1;
+      return 1;
+    }
+    seg->frames = grown;
+    seg->frames_cap = cap;
+  }
+  memcpy(&seg->frames[seg->frames_len], blockframe, blocksize);
+  seg->frames_len += blocksize;
+  seg->hi = index + 1;
+  memcpy(job->last, blockframe, BLOCK_HEADER_SZ);
+
+  if (seg->hi == job->hi || seg->hi - seg->lo == CHAINEXPORT_SEG_BLOCKS ||
+      seg->frames_len >= CHAINEXPORT_SEG_BYTES) {
+    chainexport_submit(job, seg);
+    job->fill = NULL;
+  }
+
+  return 0;
+}
+
+int chainexport_verify(ChainExport *job, uint64_t index, uint8_t *frame,
+                       uint8_t *prev)
+// -----------------------------------------------------------------------------
+// Func: Verify a streamed block against the one before it, as
+//       snapshot_import would. Below the checkpoint only the links are
+//       checked.
+// Args: job - the export
+//       index - the block's position in the file
+//       frame - the framed block
+//       prev - the header of block index-1, ignored for the root
+// Retn: 1 if the block checks out, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint8_t zero[HASH_SZ];
+  Block block, prev_block;
+
+  blockheader_decode(frame, &block);
+  block.record = &frame[RECORD_POS];
+
+  if (index == 0) {
+    memset(zero, 0, HASH_SZ);
+    return index < job->assumed ? block.index == 0 &&
+                                  !memcmp(block.prevhash, zero, HASH_SZ)
+                                : blockchain_verify_root(&block);
+  }
+
+  blockheader_decode(prev, &prev_block);
+  if (index < job->assumed)
+    return blockchain_verify_links(&block, &prev_block);
+
+  return blockchain_verify_block(&block, &prev_block, job->hash_alg);
+}
+
+const uint8_t *chainexport_hash_at(void *ctx, uint64_t height)
+// -----------------------------------------------------------------------------
+// Func: CheckpointHashFunc over the file a streamed export reads, one header
+//       read per call
+// Args: ctx - the export
+//       height - the block
+// Retn: the hash in the block's header, NULL if it can't be read
+// -----------------------------------------------------------------------------
+{
+  ChainExport *job = (ChainExport *)ctx;
+  BlockReader *reader = job->reader;
+
+  if (height >= reader->count ||
+      pread(reader->fd, job->header, BLOCK_HEADER_SZ,
+            reader->offsets[height] + reader->skip) != BLOCK_HEADER_SZ)
+    return NULL;
+
+  return &job->header[CURRHASH_POS];
+}
+
+int chainexport_cmd(int argc, char **argv)
+// -----------------------------------------------------------------------------
+// Func: The -e command: export a snapshot or chain log file
+//         main -e [-f hex|json|raw] [-j THREADS] [-r LO:HI] [-o OUT]
+//                 [-c CHECKPOINTS] FILE
+//       The file is streamed, not loaded, and its blocks are verified on the
+//       way from the newest built in or -c checkpoint they match. A chain
+//       log is read up to its last intact record and never changed, so one
+//       a writer is appending to can be exported. Output goes to stdout
+//       without -o.
+// Args: argc - arguments after -e
+//       argv - the arguments
+// Retn: 0 on success, -1 otherwise
+// -----------------------------------------------------------------------------
+{
+  BlockReader reader;
+  ThreadPool pool;
+  CheckpointSet checkpoints;
+  uint64_t lo = 0, hi = UINT64_MAX;
+  const char *out = NULL, *trusted = NULL;
+  int format = CHAINEXPORT_HEX, nthreads = 0, fd = STDOUT_FILENO;
+  int j, err = 0;
+
+  for (j = 0; j < argc - 1 && argv[j][0] == '-' && !err; j++) {
+    if (!strcmp(argv[j], "-f") && j + 2 < argc) {
+      j++;
+      if (!strcmp(argv[j], "hex"))
+        format = CHAINEXPORT_HEX;
+      else if (!strcmp(argv[j], "json"))
+        format = CHAINEXPORT_JSON;
+      else if (!strcmp(argv[j], "raw"))
+        format = CHAINEXPORT_RAW;
+      else
+        err = 1;
+    } else if (!strcmp(argv[j], "-j") && j + 2 < argc) {
+      nthreads = atoi(argv[++j]);
+    } else if (!strcmp(argv[j], "-r") && j + 2 < argc) {
+      j++;
+      if (sscanf(argv[j], "%lu:%lu", &lo, &hi) < 1)
+        err = 1;
+    } else if (!strcmp(argv[j], "-o") && j + 2 < argc) {
+      out = argv[++j];
+    } else if (!strcmp(argv[j], "-c") && j + 2 < argc) {
+      trusted = argv[++j];
+    } else {
+      err = 1;
+    }
+  }
+  if (err || j != argc - 1) {
+    fprintf(stderr, "usage: main -e [-f hex|json|raw] [-j THREADS] "
+                    "[-r LO:HI] [-o OUT] [-c CHECKPOINTS] FILE\n");
+    return -1;
+  }
+
+  if (checkpoint_init(&checkpoints))
+    return -1;
+  if (trusted != NULL && checkpoints.load(&checkpoints, trusted)) {
+    fprintf(stderr, "%s: bad checkpoint file\n", trusted);
+    checkpoint_destroy(&checkpoints);
+    return -1;
+  }
+  if (blockreader_open(&reader, argv[j], CHAINEXPORT_READ_DEPTH,
+                       BLOCKREADER_AUTO)) {
+    fprintf(stderr, "%s: not a valid snapshot or chain log\n", argv[j]);
+    checkpoint_destroy(&checkpoints);
+    return -1;
+  }
+
+  if (out != NULL &&
+      (fd = open(out, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0) {
+    fprintf(stderr, "%s: %s\n", out, strerror(errno));
+    blockreader_close(&reader);
+    checkpoint_destroy(&checkpoints);
+    return -1;
+  }
+
+  if (nthreads == 1) {
+    err = chainexport_stream(&reader, lo, hi, format, fd, NULL, &checkpoints);
+  } else if (threadpool_init(&pool, nthreads) == 0) {
+    err = chainexport_stream(&reader, lo, hi, format, fd, &pool,
+                             &checkpoints);
+    threadpool_destroy(&pool);
+  } else {
+    err = -1;
+  }
+  if (err)
+    fprintf(stderr, "export failed\n");
+
+  if (out != NULL && close(fd))
+    err = -1;
+  blockreader_close(&reader);
+  checkpoint_destroy(&checkpoints);
+
+  return err ? -1 : 0;
+}
+
+void chainexport_task(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Pool task: encode one segment into its buffer, sized up front from
+//       the headers so the encoders never check for room. Streamed frames
+//       are verified first, and only those from job->lo on are encoded.
+// Args: arg - the ChainExportSeg
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ChainExportSeg *seg = (ChainExportSeg *)arg;
+  ChainExport *job = seg->job;
+  Blockchain *chain = job->chain;
+  uint8_t *p, *frame, *prev, *grown, *buf = NULL;
+  uint64_t i, size, off, bound = 0, buf_sz = 0;
+  int err = 0;
+
+  for (i = seg->lo, off = 0; i < seg->hi; i++, off += size) {
+    size = chain != NULL ? blockframe_size(blockchain_get_header(chain, i))
+                         : blockframe_size(&seg->frames[off]);
+    if (chain != NULL || i >= job->lo)
+      bound += chainexport_bound(job->format, size);
+  }
+  if (bound > seg->cap) {
+    if ((grown = realloc(seg->buf, bound)) == NULL) {
+      err = 1;
+    } else {
+      seg->buf = grown;
+      seg->cap = bound;
+    }
+  }
+
+  p = seg->buf;
+  prev = seg->prev;
+  for (i = seg->lo, off = 0; i < seg->hi && !err; i++) {
+    if (chain == NULL) {
+      frame = &seg->frames[off];
+      size = blockframe_size(frame);
+      off += size;
+      if (!chainexport_verify(job, i, frame, prev)) {
+        err = 1;
+        break;
+      }
+      prev = frame;
+      if (i < job->lo)
+        continue;
+    }
+    else if ((frame = (uint8_t *)chain->get(chain, i)) == NULL) {
+      size = blockframe_size(blockchain_get_header(chain, i));
+      if (size > buf_sz) {
+        if ((grown = realloc(buf, size)) == NULL) {
+          err = 1;
+          break;
+        }
+        buf = grown;
+        buf_sz = size;
+      }
+      if (blockchain_read_frame(chain, i, buf)) {
+        err = 1;
+        break;
+      }
+      frame = buf;
+    }
+    else {
+      size = blockframe_size(frame);
+    }
+
+    switch (job->format) {
+      case CHAINEXPORT_RAW:
+        memcpy(p, frame, size);
+        p += size;
+        break;
+      case CHAINEXPORT_JSON:
+        p = chainexport_json(p, frame, size);
+        break;
+      default:
+        util_buf_hex((char *)p, frame, size);
+        p += 2*size;
+        *p++ = '\n';
+    }
+  }
+  free(buf);
+
+  pthread_mutex_lock(&job->lock);
+  seg->len = p - seg->buf;
+  seg->err = err;
+  seg->done = 1;
+  pthread_cond_broadcast(&job->done);
+  pthread_mutex_unlock(&job->lock);
+}
+
+uint64_t chainexport_seg_end(Blockchain *chain, uint64_t lo, uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: Where the segment starting at lo ends, see CHAINEXPORT_SEG_BLOCKS
+// Args: chain - the chain
+//       lo - the segment's first block
+//       hi - the end of the export
+// Retn: one past the segment's last block
+// -----------------------------------------------------------------------------
+{
+  uint64_t i, bytes = 0;
+
+  for (i = lo; i < hi && i - lo < CHAINEXPORT_SEG_BLOCKS &&
+       bytes < CHAINEXPORT_SEG_BYTES; i++)
+    bytes += blockframe_size(blockchain_get_header(chain, i));
+
+  return i;
+}
+
+uint64_t chainexport_bound(int format, uint64_t size)
+// -----------------------------------------------------------------------------
+// Func: Most bytes a block can encode to
+// Args: format - one of CHAINEXPORT_*
+//       size - the block's frame size
+// Retn: the bound
+// -----------------------------------------------------------------------------
+{
+  return format == CHAINEXPORT_JSON ? CHAINEXPORT_JSON_SZ(size)
+       : format == CHAINEXPORT_HEX ? CHAINEXPORT_HEX_SZ(size)
+       : size;
+}
+
+uint8_t *chainexport_json(uint8_t *p, const uint8_t *frame, uint64_t size)
+// -----------------------------------------------------------------------------
+// Func: Encode one block as a line of JSON:
+//         {"index":N,"timestamp":N,"prevhash":"..","hash":"..",
+//          "record_sz":N,"record":".."}
+//       with the hashes and the record in hex
+// Args: p - where to write, room for CHAINEXPORT_JSON_SZ(size) bytes
+//       frame - the framed block
+//       size - its size
+// Retn: p past the line
+// -----------------------------------------------------------------------------
+{
+  uint64_t v;
+
+#define CHAINEXPORT_PUT(s) (memcpy(p, s, sizeof(s) - 1), p += sizeof(s) - 1)
+
+  CHAINEXPORT_PUT("{\"index\":");
+  memcpy(&v, &frame[INDEX_POS], sizeof(v));
+  p = chainexport_u64(p, v);
+  CHAINEXPORT_PUT(",\"timestamp\":");
+  memcpy(&v, &frame[TS_POS], sizeof(v));
+  p = chainexport_u64(p, v);
+  CHAINEXPORT_PUT(",\"prevhash\":\"");
+  util_buf_hex((char *)p, &frame[PREVHASH_POS], HASH_SZ);
+  p += 2*HASH_SZ;
+  CHAINEXPORT_PUT("\",\"hash\":\"");
+  util_buf_hex((char *)p, &frame[CURRHASH_POS], HASH_SZ);
+  p += 2*HASH_SZ;
+  CHAINEXPORT_PUT("\",\"record_sz\":");
+  p = chainexport_u64(p, size - BLOCK_HEADER_SZ);
+  CHAINEXPORT_PUT(",\"record\":\"");
+  util_buf_hex((char *)p, &frame[RECORD_POS], size - BLOCK_HEADER_SZ);
+  p += 2*(size - BLOCK_HEADER_SZ);
+  CHAINEXPORT_PUT("\"}\n");
+
+#undef CHAINEXPORT_PUT
+
+  return p;
+}
+
+uint8_t *chainexport_u64(uint8_t *p, uint64_t v)
+// -----------------------------------------------------------------------------
+// Func: Write an unsigned integer in decimal
+// Args: p - where to write, room for 20 bytes
+//       v - the integer
+// Retn: p past the digits
+// -----------------------------------------------------------------------------
+{
+  uint8_t digits[20];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n)
+    *p++ = digits[--n];
+
+  return p;
+}
+
+int chainexport_write(int fd, const uint8_t *buf, uint64_t len)
+// -----------------------------------------------------------------------------
+// Func: Write a whole buffer, however many writes it takes
+// Args: fd - where to write
+//       buf - the buffer
+//       len - its length
+// Retn: 0 on success, -1 on a write error
+// -----------------------------------------------------------------------------
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, buf, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
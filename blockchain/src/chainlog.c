@@ -0,0 +1,528 @@
+/*
+chainlog.c: append-only chain file with crash recovery
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chainlog.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// bytes a frame takes in the log, padding included
+#define CHAINLOG_PAD(sz) (((sz) + 7) & ~(uint64_t)7)
+
+// private functions, access through ChainLog object
+int chainlog_flush(ChainLog *this);
+
+// private functions
+int chainlog_start(ChainLog *this, const char *pathname, int sync,
+                   int readonly);
+int chainlog_store(void *ctx, uint64_t index, uint8_t *blockframe,
+                   uint64_t blocksize, uint64_t offset, uint32_t crc);
+int chainlog_recover(ChainLog *this, uint64_t file_sz);
+int chainlog_intact(ChainLog *this, uint64_t end);
+int chainlog_record(ChainLog *this, uint64_t end, uint8_t *header,
+                    uint64_t *start);
+int chainlog_reserve(ChainLog *this, uint64_t size);
+int chainlog_append(ChainLog *this, uint8_t *blockframe, uint64_t blocksize);
+void chainlog_hook(void *ctx, Blockchain *chain, uint8_t *blockframe);
+
+int chainlog_open(ChainLog *this, const char *pathname, int sync)
+// -----------------------------------------------------------------------------
+// Func: Open a chain log, creating it if it does not exist, and recover it:
+//       the torn tail a crash may have left is truncated before anything in
+//       the log is trusted.
+// Args: this - a pointer to the new log
+//       pathname - the log file
+//       sync - 1 to make every append durable before the chain moves on
+// Retn: 0 on success, -1 if the file can't be opened or is not a chain log
+// -----------------------------------------------------------------------------
+{
+  return chainlog_start(this, pathname, sync, 0);
+}
+
+int chainlog_open_readonly(ChainLog *this, const char *pathname)
+// -----------------------------------------------------------------------------
+// Func: Open a chain log for reading only, leaving the file as it is: the
+//       log is taken to end at its last intact record and a torn tail is
+//       passed over, not truncated. Safe on a log a writer is appending to,
+//       whose last record may still be in flight.
+// Args: this - a pointer to the new log
+//       pathname - the log file
+// Retn: 0 on success, -1 if the file can't be opened or is not a chain log
+// -----------------------------------------------------------------------------
+{
+  return chainlog_start(this, pathname, 0, 1);
+}
+
+int chainlog_start(ChainLog *this, const char *pathname, int sync,
+                   int readonly)
+// -----------------------------------------------------------------------------
+// Func: Open and recover a chain log, see chainlog_open
+// Args: this - a pointer to the new log
+//       pathname - the log file
+//       sync - 1 to make every append durable before the chain moves on
+//       readonly - 1 to leave the file untouched, see chainlog_open_readonly
+// Retn: 0 on success, -1 if the file can't be opened or is not a chain log
+// -----------------------------------------------------------------------------
+{
+  char magic[CHAINLOG_HEADER_SZ];
+  struct stat st;
+  ssize_t got = -1;
+  int err = 0;
+
+  this->buf = NULL;
+  this->buf_sz = 0;
+  this->chain = NULL;
+  this->sync = sync;
+  this->readonly = readonly;
+  this->failed = 0;
+  this->flush = &chainlog_flush;
+
+  this->fd = readonly ? open(pathname, O_RDONLY|O_CLOEXEC)
+                      : open(pathname, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+  if (this->fd < 0)
+    return -1;
+  if (fstat(this->fd, &st) ||
+      (got = pread(this->fd, magic, CHAINLOG_HEADER_SZ, 0)) < 0)
+    err = 1;
+
+  if (!err && got < CHAINLOG_HEADER_SZ && readonly) {
+    err = 1; // nothing to read, and it can't be created here
+  } else if (!err && got < CHAINLOG_HEADER_SZ) {
+    // new, or its creation was cut short
+    if (memcmp(magic, CHAINLOG_MAGIC, got) ||
+        ftruncate(this->fd, 0) ||
+        pwrite(this->fd, CHAINLOG_MAGIC, CHAINLOG_HEADER_SZ, 0)
+          != CHAINLOG_HEADER_SZ ||
+        fsync(this->fd))
+      err = 1;
+    st.st_size = CHAINLOG_HEADER_SZ;
+  } else if (!err && memcmp(magic, CHAINLOG_MAGIC, CHAINLOG_HEADER_SZ)) {
+    err = 1;
+  }
+
+  if (err || chainlog_recover(this, st.st_size)) {
+    close(this->fd);
+    free(this->buf);
+    this->buf = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+void chainlog_close(ChainLog *this)
+// -----------------------------------------------------------------------------
+// Func: Unhook the attached chain, flush the log and close it
+// Args: this - a pointer to the log
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  if (this->chain != NULL)
+    blockchain_remove_hook(this->chain, &chainlog_hook, this);
+
+  if (!this->readonly)
+    fdatasync(this->fd);
+  close(this->fd);
+  free(this->buf);
+  this->fd = -1;
+  this->buf = NULL;
+  this->chain = NULL;
+  this->flush = NULL;
+}
+
+int chainlog_load(ChainLog *this, Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Store every block in the log into an empty chain. Records are checked
+//       against their crc and position only; hashes can be checked after
+//       with blockchain_verify_headers or verify_chain.
+// Args: this - a pointer to the log
+//       chain - a chain from blockchain_init_empty
+// Retn: 0 on success, -1 if the chain is not empty, a record in the body of
+//       the log is corrupt (not a torn tail, so it is left alone), or the
+//       chain can't hold the blocks
+// -----------------------------------------------------------------------------
+{
+  if (chain->length != 0)
+    return -1;
+
+  return chainlog_walk(this, 1, &chainlog_store, chain) ? -1 : 0;
+}
+
+int chainlog_store(void *ctx, uint64_t index, uint8_t *blockframe,
+                   uint64_t blocksize, uint64_t offset, uint32_t crc)
+// -----------------------------------------------------------------------------
+// Func: ChainLogFunc for chainlog_load, stores each block in the chain
+// Args: ctx - the chain
+//       index, blockframe, blocksize, offset, crc - see ChainLogFunc
+// Retn: 0 to go on, 1 if the chain can't hold the block
+// -----------------------------------------------------------------------------
+{
+  (void)index;
+  (void)offset;
+  (void)crc;
+
+  return blockchain_store((Blockchain *)ctx, blockframe, blocksize) != 0;
+}
+
+int chainlog_walk(ChainLog *this, int check, ChainLogFunc fn, void *ctx)
+// -----------------------------------------------------------------------------
+// Func: Hand every record of the log to fn in order, through a read only
+//       mapping. Each record's size, trailer and index are checked, and its
+//       crc if asked; without the crc only the pages holding headers and
+//       trailers are read.
+// Args: this - a pointer to the log
+//       check - 1 to also check every record's crc
+//       fn - called with each record, nonzero stops the walk
+//       ctx - passed through to fn
+// Retn: 0 if every record was walked, 1 if fn stopped it, -1 if the log
+//       can't be mapped or a record in its body is corrupt
+// -----------------------------------------------------------------------------
+{
+  uint8_t *map, *frame, *trailer;
+  uint64_t i, off, size, word, index;
+  uint32_t crc;
+  int ret = 0;
+
+  if (this->count == 0)
+    return 0;
+
+  map = mmap(NULL, this->end, PROT_READ, MAP_PRIVATE, this->fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  madvise(map, this->end, MADV_SEQUENTIAL);
+
+  off = CHAINLOG_HEADER_SZ;
+  for (i = 0; i < this->count && ret == 0; i++) {
+    frame = &map[off];
+    if (this->end - off < BLOCK_HEADER_SZ + CHAINLOG_TRAILER_SZ ||
+        (size = blockframe_size(frame)) > this->end - off ||
+        CHAINLOG_PAD(size) + CHAINLOG_TRAILER_SZ > this->end - off) {
+      ret = -1;
+      break;
+    }
+
+    trailer = &frame[CHAINLOG_PAD(size)];
+    memcpy(&word, trailer, sizeof(word));
+    memcpy(&crc, &trailer[8], sizeof(crc));
+    memcpy(&index, &frame[INDEX_POS], sizeof(index));
+    if (word != size || index != i ||
+        memcmp(&trailer[12], CHAINLOG_TAG, 4) ||
+        (check && crc != chainlog_crc(frame, size)))
+      ret = -1;
+    else if (fn(ctx, i, frame, size, off, crc))
+      ret = 1;
+
+    off = (uint64_t)(trailer - map) + CHAINLOG_TRAILER_SZ;
+  }
+
+  munmap(map, this->end);
+
+  return ret;
+}
+
+int chainlog_attach(ChainLog *this, Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Start logging a chain. Blocks the chain has beyond the end of the log
+//       are written first, so a new log can be attached to a running chain;
+//       from then on a hook writes each block as it is appended. If a write
+//       fails the log stops there and sets failed, since a hook can't refuse
+//       the block.
+// Args: this - a pointer to the log
+//       chain - the chain, whose first count blocks must be the log's
+// Retn: 0 on success, -1 if the chain is behind or not the log's, a pruned
+//       record was dropped, a write fails, or the chain has no room for a hook
+// -----------------------------------------------------------------------------
+{
+  uint8_t *frame, *buf = NULL, *grown;
+  uint64_t i, size, buf_sz = 0;
+  int err = 0;
+
+  if (this->readonly || this->chain != NULL || this->count > chain->length)
+    return -1;
+  if (this->count > 0 &&
+      memcmp(&blockchain_get_header(chain, this->count-1)[CURRHASH_POS],
+             this->tip, HASH_SZ))
+    return -1;
+
+  for (i = this->count; i < chain->length && !err; i++) {
+    size = blockframe_size(blockchain_get_header(chain, i));
+    if ((frame = (uint8_t *)chain->get(chain, i)) == NULL) {
+      if (size > buf_sz) {
+        if ((grown = realloc(buf, size)) == NULL) {
+          err = 1;
+          break;
+        }
+        buf = grown;
+        buf_sz = size;
+      }
+      if (blockchain_read_frame(chain, i, buf)) {
+        err = 1;
+        break;
+      }
+      frame = buf;
+    }
+    err = chainlog_append(this, frame, size) != 0;
+  }
+  free(buf);
+
+  if (err || chainlog_flush(this) || blockchain_add_hook(chain, &chainlog_hook,
+                                                         this))
+    return -1;
+  this->chain = chain;
+
+  return 0;
+}
+
+int chainlog_flush(ChainLog *this)
+// -----------------------------------------------------------------------------
+// Func: Make every record appended so far durable
+// Args: this - a pointer to the log
+// Retn: 0 on success, -1 if the sync fails or an append failed before
+// -----------------------------------------------------------------------------
+{
+  if (this->failed || fdatasync(this->fd))
+    return -1;
+
+  return 0;
+}
+
+int chainlog_recover(ChainLog *this, uint64_t file_sz)
+// -----------------------------------------------------------------------------
+// Func: Find the last intact record by walking back from the end of the file
+//       one trailer position at a time, then truncate whatever follows it.
+//       An intact log is settled by its last record alone.
+// Args: this - a pointer to the log
+//       file_sz - the size of the log file
+// Retn: 0 on success, -1 on an I/O error
+// -----------------------------------------------------------------------------
+{
+  uint8_t *win;
+  uint64_t pos, lo, t;
+  int found = 0;
+
+  if ((win = malloc(CHAINLOG_SCAN_BUF)) == NULL)
+    return -1;
+
+  this->end = CHAINLOG_HEADER_SZ;
+  this->count = 0;
+
+  pos = file_sz & ~(uint64_t)7;
+  while (!found && pos >= CHAINLOG_HEADER_SZ + CHAINLOG_TRAILER_SZ) {
+    lo = pos - CHAINLOG_HEADER_SZ > CHAINLOG_SCAN_BUF ? pos - CHAINLOG_SCAN_BUF
+                                                      : CHAINLOG_HEADER_SZ;
+    if (pread(this->fd, win, pos - lo, lo) != (ssize_t)(pos - lo)) {
+      free(win);
+      return -1;
+    }
+
+    // the tag ends every trailer, so most torn bytes are passed over here
+    for (t = pos; t >= lo + CHAINLOG_TRAILER_SZ; t -= 8)
+      if (!memcmp(&win[t - lo - 4], CHAINLOG_TAG, 4) &&
+          chainlog_intact(this, t)) {
+        found = 1;
+        break;
+      }
+
+    if (lo == CHAINLOG_HEADER_SZ)
+      break;
+    pos = lo + CHAINLOG_TRAILER_SZ - 8; // trailers straddling the window start
+  }
+  free(win);
+
+  this->torn = file_sz - this->end;
+  if (this->torn && !this->readonly &&
+      (ftruncate(this->fd, this->end) || fsync(this->fd)))
+    return -1;
+
+  return 0;
+}
+
+int chainlog_intact(ChainLog *this, uint64_t end)
+// -----------------------------------------------------------------------------
+// Func: Check for an intact record ending at end. Its crc must match and, so
+//       that a record body which happens to hold a valid looking record can't
+//       pass for one, it must follow the record before it by index and hash
+//       (or be the root, first in the log). Sets the log's end, count and tip
+//       when it is.
+// Args: this - a pointer to the log
+//       end - the offset just past a candidate trailer
+// Retn: 1 if the record is intact, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint8_t header[BLOCK_HEADER_SZ], prev[BLOCK_HEADER_SZ];
+  uint64_t start, index, prev_index;
+
+  if (chainlog_record(this, end, header, &start))
+    return 0;
+  memcpy(&index, &header[INDEX_POS], sizeof(index));
+
+  if (start == CHAINLOG_HEADER_SZ) {
+    if (index != 0)
+      return 0;
+  } else {
+    if (chainlog_record(this, start, prev, &start))
+      return 0;
+    memcpy(&prev_index, &prev[INDEX_POS], sizeof(prev_index));
+    if (prev_index + 1 != index ||
+        memcmp(&prev[CURRHASH_POS], &header[PREVHASH_POS], HASH_SZ))
+      return 0;
+  }
+
+  this->end = end;
+  this->count = index + 1;
+  memcpy(this->tip, &header[CURRHASH_POS], HASH_SZ);
+
+  return 1;
+}
+
+int chainlog_record(ChainLog *this, uint64_t end, uint8_t *header,
+                    uint64_t *start)
+// -----------------------------------------------------------------------------
+// Func: Read the record ending at end and check it against its trailer
+// Args: this - a pointer to the log
+//       end - the offset just past the trailer
+//       header - set to the record's block header
+//       start - set to the offset of the record's frame
+// Retn: 0 if the record is whole and its crc matches, -1 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint8_t trailer[CHAINLOG_TRAILER_SZ];
+  uint64_t size, room;
+  uint32_t crc;
+
+  if (end < CHAINLOG_HEADER_SZ + CHAINLOG_TRAILER_SZ ||
+      pread(this->fd, trailer, CHAINLOG_TRAILER_SZ, end - CHAINLOG_TRAILER_SZ)
+        != CHAINLOG_TRAILER_SZ ||
+      memcmp(&trailer[12], CHAINLOG_TAG, 4))
+    return -1;
+
+  memcpy(&size, trailer, sizeof(size));
+  memcpy(&crc, &trailer[8], sizeof(crc));
+  room = end - CHAINLOG_TRAILER_SZ - CHAINLOG_HEADER_SZ;
+  if (size < BLOCK_HEADER_SZ || size > room || CHAINLOG_PAD(size) > room)
+    return -1;
+
+  *start = end - CHAINLOG_TRAILER_SZ - CHAINLOG_PAD(size);
+  if (chainlog_reserve(this, size) ||
+      pread(this->fd, this->buf, size, *start) != (ssize_t)size ||
+      blockframe_size(this->buf) != size ||
+      chainlog_crc(this->buf, size) != crc)
+    return -1;
+
+  memcpy(header, this->buf, BLOCK_HEADER_SZ);
+
+  return 0;
+}
+
+uint32_t chainlog_crc(const uint8_t *blockframe, uint64_t blocksize)
+// -----------------------------------------------------------------------------
+// Func: The crc a record's trailer carries, over the frame and its size word
+// Args: blockframe - the framed block
+//       blocksize - its size
+// Retn: the crc
+// -----------------------------------------------------------------------------
+{
+  uint32_t crc = util_buf_crc32c(0, blockframe, blocksize);
+
+  return util_buf_crc32c(crc, (const uint8_t *)&blocksize, sizeof(blocksize));
+}
+
+int chainlog_reserve(ChainLog *this, uint64_t size)
+// -----------------------------------------------------------------------------
+// Func: Make the scratch buffer at least size bytes
+// Args: this - a pointer to the log
+//       size - bytes needed
+// Retn: 0 on success, -1 if out of memory
+// -----------------------------------------------------------------------------
+{
+  uint8_t *grown;
+
+  if (size <= this->buf_sz)
+    return 0;
+  if ((grown = realloc(this->buf, size)) == NULL)
+    return -1;
+  this->buf = grown;
+  this->buf_sz = size;
+
+  return 0;
+}
+
+int chainlog_append(ChainLog *this, uint8_t *blockframe, uint64_t blocksize)
+// -----------------------------------------------------------------------------
+// Func: Write one record at the end of the log, in a single write
+// Args: this - a pointer to the log
+//       blockframe - the framed block
+//       blocksize - its size
+// Retn: 0 on success, -1 if the write fails (failed is set and the partial
+//       record is cut off again, best effort)
+// -----------------------------------------------------------------------------
+{
+  uint64_t pad = CHAINLOG_PAD(blocksize);
+  uint64_t rec_sz = pad + CHAINLOG_TRAILER_SZ;
+  uint32_t crc;
+
+  if (this->failed || chainlog_reserve(this, rec_sz)) {
+    this->failed = 1;
+    return -1;
+  }
+
+  crc = chainlog_crc(blockframe, blocksize);
+  memcpy(this->buf, blockframe, blocksize);
+  memset(&this->buf[blocksize], 0, pad - blocksize);
+  memcpy(&this->buf[pad], &blocksize, sizeof(blocksize));
+  memcpy(&this->buf[pad + 8], &crc, sizeof(crc));
+  memcpy(&this->buf[pad + 12], CHAINLOG_TAG, 4);
+
+  if (pwrite(this->fd, this->buf, rec_sz, this->end) != (ssize_t)rec_sz ||
+      (this->sync && fdatasync(this->fd))) {
+    // cut the partial record off again; failing that, recovery drops it
+    // on the next open
+    this->failed = 1;
+    if (ftruncate(this->fd, this->end) == 0)
+      fdatasync(this->fd);
+    return -1;
+  }
+
+  this->end += rec_sz;
+  this->count++;
+  memcpy(this->tip, &blockframe[CURRHASH_POS], HASH_SZ);
+
+  return 0;
+}
+
+void chainlog_hook(void *ctx, Blockchain *chain, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Chain hook, logs a newly appended block
+// Args: ctx - the ChainLog
+//       chain - the chain
+//       blockframe - the block just stored
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ChainLog *this = (ChainLog *)ctx;
+
+  (void)chain;
+  chainlog_append(this, blockframe, blockframe_size(blockframe));
+}
@@ -0,0 +1,280 @@
+/*
+chainscan.c: parallel map/reduce over ranges of blocks
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chainscan.h"
+
+#include <stdlib.h>
+
+// forward declaration
+typedef struct ChainScanJob ChainScanJob;
+typedef struct ChainScanTask ChainScanTask;
+
+struct ChainScanJob
+// -----------------------------------------------------------------------------
+// Description
+//  A scan in progress, shared by its tasks
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  ThreadPool *pool;
+  const ChainScanOps *ops;
+  void *ctx;
+  uint64_t grain;
+  void **partials;          // one per worker, made on the worker's first task
+  int stop;                 // 1 once map asked to stop, -1 on failure
+
+  // tasks submit their halves, so count every submit and every finish; the
+  // scan is over at zero, whatever else the pool is running
+  pthread_mutex_t lock;
+  pthread_cond_t done;      // signalled when pending reaches 0
+  uint64_t pending;         // tasks submitted and not finished
+};
+
+struct ChainScanTask
+// -----------------------------------------------------------------------------
+// Description
+//  Blocks [lo, hi) of a scan, split further by whichever worker runs it
+// -----------------------------------------------------------------------------
+{
+  ChainScanJob *job;
+  uint64_t lo;
+  uint64_t hi;
+};
+
+// private functions
+void chainscan_task(void *arg);
+int chainscan_submit(ChainScanJob *job, ChainScanTask *task);
+int chainscan_range(ChainScanJob *job, void *partial, uint64_t lo,
+                    uint64_t hi);
+
+int chainscan_run(Blockchain *chain, ThreadPool *pool, uint64_t lo,
+                  uint64_t hi, const ChainScanOps *ops, void *ctx,
+                  void **result)
+// -----------------------------------------------------------------------------
+// Func: Map every block in [lo, hi) into per worker partial results on the
+//       pool, then merge them. The range is split in halves as workers pick
+//       it up, and idle workers steal the halves not started yet. Blocks
+//       whose record was pruned and dropped are skipped. The chain must not
+//       be appended to while the scan runs.
+// Args: chain - the chain to scan
+//       pool - the workers, NULL to scan on the calling thread
+//       lo - first block
+//       hi - one past the last block, clipped to the chain's length
+//       ops - what to do with the blocks
+//       ctx - passed to every op
+//       result - set to the merged result, to be freed with ops->free
+// Retn: 0 once every block is mapped, 1 if map stopped the scan (result then
+//       covers part of the range), -1 on failure (result is NULL)
+// -----------------------------------------------------------------------------
+{
+  ChainScanJob job;
+  ChainScanTask *task;
+  void *merged = NULL;
+  int i, nparts;
+
+  *result = NULL;
+  if (hi > chain->length)
+    hi = chain->length;
+  if (lo > hi)
+    lo = hi;
+
+  job.chain = chain;
+  job.pool = pool;
+  job.ops = ops;
+  job.ctx = ctx;
+  job.stop = 0;
+
+  if (pool == NULL || hi - lo <= CHAINSCAN_MIN_GRAIN) {
+    if ((merged = ops->init(ctx)) == NULL)
+      return -1;
+    chainscan_range(&job, merged, lo, hi);
+    if (job.stop < 0) {
+      ops->free(ctx, merged);
+      return -1;
+    }
+    *result = merged;
+    return job.stop;
+  }
+
+  // enough pieces that stealing can even out uneven blocks
+  nparts = pool->nthreads;
+  job.grain = (hi - lo) / (16*(uint64_t)nparts);
+  if (job.grain < CHAINSCAN_MIN_GRAIN)
+    job.grain = CHAINSCAN_MIN_GRAIN;
+
+  if ((job.partials = calloc(nparts, sizeof(void *))) == NULL ||
+      (task = malloc(sizeof(ChainScanTask))) == NULL) {
+    free(job.partials);
+    return -1;
+  }
+  task->job = &job;
+  task->lo = lo;
+  task->hi = hi;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.done, NULL);
+  job.pending = 0;
+  if (chainscan_submit(&job, task)) {
+    free(task);
+    free(job.partials);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done);
+    return -1;
+  }
+
+  pthread_mutex_lock(&job.lock);
+  while (job.pending > 0)
+    pthread_cond_wait(&job.done, &job.lock);
+  pthread_mutex_unlock(&job.lock);
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.done);
+
+  for (i = 0; i < nparts; i++) {
+    if (job.partials[i] == NULL)
+      continue;
+    if (merged == NULL) {
+      merged = job.partials[i];
+      continue;
+    }
+    ops->merge(ctx, merged, job.partials[i]);
+    ops->free(ctx, job.partials[i]);
+  }
+  free(job.partials);
+
+  if (job.stop < 0) {
+    if (merged != NULL)
+      ops->free(ctx, merged);
+    return -1;
+  }
+  if (merged == NULL && (merged = ops->init(ctx)) == NULL)
+    return -1;
+
+  *result = merged;
+  return job.stop;
+}
+
+void chainscan_task(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Pool task: give away the upper half of the range until it is small,
+//       then map what is left into this worker's partial
+// Args: arg - the ChainScanTask, freed here
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ChainScanTask *task = (ChainScanTask *)arg;
+  ChainScanTask *half;
+  ChainScanJob *job = task->job;
+  int id = threadpool_self(job->pool);
+  uint64_t mid;
+
+  while (task->hi - task->lo > job->grain &&
+         !__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) {
+    mid = task->lo + (task->hi - task->lo) / 2;
+    if ((half = malloc(sizeof(ChainScanTask))) == NULL)
+      break; // map the whole range here
+    half->job = job;
+    half->lo = mid;
+    half->hi = task->hi;
+    if (chainscan_submit(job, half)) {
+      free(half);
+      break;
+    }
+    task->hi = mid;
+  }
+
+  if (job->partials[id] == NULL &&
+      (job->partials[id] = job->ops->init(job->ctx)) == NULL)
+    __atomic_store_n(&job->stop, -1, __ATOMIC_RELAXED);
+  else
+    chainscan_range(job, job->partials[id], task->lo, task->hi);
+
+  free(task);
+
+  // the last thing touching the job, the caller may return once it is 0
+  pthread_mutex_lock(&job->lock);
+  if (--job->pending == 0)
+    pthread_cond_signal(&job->done);
+  pthread_mutex_unlock(&job->lock);
+}
+
+int chainscan_submit(ChainScanJob *job, ChainScanTask *task)
+// -----------------------------------------------------------------------------
+// Func: Count a task in the scan and queue it on the pool
+// Args: job - the scan
+//       task - the task, owned by the pool once queued
+// Retn: 0 on success, -1 if it could not be queued (it is not counted then)
+// -----------------------------------------------------------------------------
+{
+  pthread_mutex_lock(&job->lock);
+  job->pending++;
+  pthread_mutex_unlock(&job->lock);
+
+  if (job->pool->submit(job->pool, &chainscan_task, task)) {
+    pthread_mutex_lock(&job->lock);
+    job->pending--;
+    pthread_mutex_unlock(&job->lock);
+    return -1;
+  }
+
+  return 0;
+}
+
+int chainscan_range(ChainScanJob *job, void *partial, uint64_t lo,
+                    uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: Map blocks [lo, hi) into a partial, in place where they are resident
+// Args: job - the scan
+//       partial - the partial to fold into
+//       lo - first block
+//       hi - one past the last block
+// Retn: 0 on success, nonzero if the scan was stopped
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain = job->chain;
+  uint8_t *frame, *buf = NULL, *grown;
+  uint64_t i, size, buf_sz = 0;
+  int stop = 0, running = 0;
+
+  for (i = lo; i < hi && !stop; i++) {
+    if ((i & 255) == 0 && __atomic_load_n(&job->stop, __ATOMIC_RELAXED))
+      break;
+
+    size = blockframe_size(blockchain_get_header(chain, i));
+    if ((frame = (uint8_t *)chain->get(chain, i)) == NULL) {
+      if (size > buf_sz) {
+        if ((grown = realloc(buf, size)) == NULL) {
+          __atomic_store_n(&job->stop, -1, __ATOMIC_RELAXED);
+          break;
+        }
+        buf = grown;
+        buf_sz = size;
+      }
+      if (blockchain_read_frame(chain, i, buf))
+        continue; // dropped, nothing to map
+      frame = buf;
+    }
+
+    if ((stop = job->ops->map(job->ctx, partial, i, frame, size)))
+      __atomic_compare_exchange_n(&job->stop, &running, 1, 0, __ATOMIC_RELAXED,
+                                  __ATOMIC_RELAXED); // a failure stays -1
+  }
+  free(buf);
+
+  return __atomic_load_n(&job->stop, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,352 @@
+/*
+chaintail.c: subscriptions to blocks as they are appended
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chaintail.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <immintrin.h>
+
+// private functions, access through TailSubscriber object
+int chaintail_wait(TailSubscriber *this, int64_t timeout_ns);
+int chaintail_arm(TailSubscriber *this);
+uint64_t chaintail_drain(TailSubscriber *this, uint64_t max, TailFunc fn,
+                         void *ctx);
+
+// private functions
+void chaintail_hook(void *ctx, Blockchain *chain, uint8_t *blockframe);
+int chaintail_ready(TailSubscriber *this);
+
+int chaintail_init(ChainTail *this, Blockchain *chain, uint64_t ring_sz)
+// -----------------------------------------------------------------------------
+// Func: Start following the front of a chain. Only blocks appended from now
+//       on are published.
+// Args: this - a pointer to the new tail
+//       chain - the chain, must outlive the tail
+//       ring_sz - blocks a subscriber may fall behind before losing any,
+//                 rounded up to a power of two
+// Retn: 0 on success, -1 on allocation failure, if the chain has no room for
+//       a hook, or if it prunes (the chain stays pinned until destroy, see
+//       blockchain_pin)
+// -----------------------------------------------------------------------------
+{
+  uint64_t size, i;
+
+  for (size = 1; size < ring_sz; size *= 2)
+    ;
+  if (blockchain_pin(chain))
+    return -1;
+
+  if ((this->ring = malloc(size*sizeof(ChainTailSlot))) == NULL) {
+    blockchain_unpin(chain);
+    return -1;
+  }
+  for (i = 0; i < size; i++)
+    this->ring[i].index = UINT64_MAX;
+
+  this->chain = chain;
+  this->mask = size - 1;
+  this->published = chain->length;
+  this->seq = 0;
+  this->waiters = 0;
+  this->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CHAINTAIL_SPIN : 0;
+  this->nfds = 0;
+  pthread_mutex_init(&this->lock, NULL);
+
+  if (blockchain_add_hook(chain, &chaintail_hook, this)) {
+    pthread_mutex_destroy(&this->lock);
+    free(this->ring);
+    blockchain_unpin(chain);
+    return -1;
+  }
+
+  return 0;
+}
+
+void chaintail_destroy(ChainTail *this)
+// -----------------------------------------------------------------------------
+// Func: Stop following the chain. Every subscriber must have unsubscribed.
+// Args: this - a pointer to the tail
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  blockchain_remove_hook(this->chain, &chaintail_hook, this);
+  blockchain_unpin(this->chain);
+  pthread_mutex_destroy(&this->lock);
+  free(this->ring);
+  this->ring = NULL;
+}
+
+int chaintail_subscribe(ChainTail *this, TailSubscriber *sub, int want_fd)
+// -----------------------------------------------------------------------------
+// Func: Add a subscriber, positioned after the last published block
+// Args: this - a pointer to the tail
+//       sub - the new subscriber
+//       want_fd - 1 to also get an eventfd for poll/epoll, see arm
+// Retn: 0 on success, -1 if the eventfd can't be made or there are already
+//       CHAINTAIL_MAX_FDS of them
+// -----------------------------------------------------------------------------
+{
+  sub->tail = this;
+  sub->cursor = __atomic_load_n(&this->published, __ATOMIC_ACQUIRE);
+  sub->lost = 0;
+  sub->fd = -1;
+  sub->armed = 0;
+
+  sub->wait = &chaintail_wait;
+  sub->arm = &chaintail_arm;
+  sub->drain = &chaintail_drain;
+
+  if (!want_fd)
+    return 0;
+
+  if ((sub->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    return -1;
+
+  pthread_mutex_lock(&this->lock);
+  if (this->nfds == CHAINTAIL_MAX_FDS) {
+    pthread_mutex_unlock(&this->lock);
+    close(sub->fd);
+    sub->fd = -1;
+    return -1;
+  }
+  this->fds[this->nfds] = sub;
+  __atomic_store_n(&this->nfds, this->nfds + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&this->lock);
+
+  return 0;
+}
+
+void chaintail_unsubscribe(ChainTail *this, TailSubscriber *sub)
+// -----------------------------------------------------------------------------
+// Func: Remove a subscriber, closing its eventfd
+// Args: this - a pointer to the tail
+//       sub - the subscriber
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  int i;
+
+  if (sub->fd < 0)
+    return;
+
+  pthread_mutex_lock(&this->lock);
+  for (i = 0; i < this->nfds && this->fds[i] != sub; i++)
+    ;
+  if (i < this->nfds) {
+    this->fds[i] = this->fds[this->nfds - 1];
+    __atomic_store_n(&this->nfds, this->nfds - 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&this->lock);
+
+  close(sub->fd);
+  sub->fd = -1;
+}
+
+int chaintail_ready(TailSubscriber *this)
+// -----------------------------------------------------------------------------
+// Func: Check for blocks past the subscriber's cursor
+// Args: this - a pointer to the subscriber
+// Retn: 1 if there are some, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  return __atomic_load_n(&this->tail->published, __ATOMIC_SEQ_CST) >
+         this->cursor;
+}
+
+int chaintail_wait(TailSubscriber *this, int64_t timeout_ns)
+// -----------------------------------------------------------------------------
+// Func: Block until a block past the cursor is published: poll the tail for
+//       a while (on more than one cpu), then sleep on the futex
+// Args: this - a pointer to the subscriber
+//       timeout_ns - longest wait, negative for no limit
+// Retn: 0 if blocks are ready, 1 on timeout
+// -----------------------------------------------------------------------------
+{
+  ChainTail *tail = this->tail;
+  struct timespec deadline, now, left;
+  uint32_t seq;
+  int i;
+
+  for (i = 0; i < tail->spin; i++) {
+    if (chaintail_ready(this))
+      return 0;
+    _mm_pause();
+  }
+
+  if (timeout_ns >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ns / 1000000000;
+    deadline.tv_nsec += timeout_ns % 1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  for (;;) {
+    // announce the wait before the last look, the appender checks waiters
+    // after publishing, so one of the two sees the other
+    seq = __atomic_load_n(&tail->seq, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&tail->waiters, 1, __ATOMIC_SEQ_CST);
+    if (chaintail_ready(this)) {
+      __atomic_sub_fetch(&tail->waiters, 1, __ATOMIC_SEQ_CST);
+      return 0;
+    }
+
+    if (timeout_ns >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left.tv_sec = deadline.tv_sec - now.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000;
+      }
+      if (left.tv_sec < 0) {
+        __atomic_sub_fetch(&tail->waiters, 1, __ATOMIC_SEQ_CST);
+        return 1;
+      }
+    }
+
+    // returns at once if seq moved since it was read
+    syscall(SYS_futex, &tail->seq, FUTEX_WAIT_PRIVATE, seq,
+            timeout_ns >= 0 ? &left : NULL, NULL, 0);
+    __atomic_sub_fetch(&tail->waiters, 1, __ATOMIC_SEQ_CST);
+
+    if (chaintail_ready(this))
+      return 0;
+  }
+}
+
+int chaintail_arm(TailSubscriber *this)
+// -----------------------------------------------------------------------------
+// Func: Ask for a write to the eventfd on the next publish, before polling
+//       the fd. The write comes once per arm.
+// Args: this - a pointer to the subscriber, with an eventfd
+// Retn: 1 if blocks are already ready (don't poll), 0 once armed
+// -----------------------------------------------------------------------------
+{
+  __atomic_store_n(&this->armed, 1, __ATOMIC_SEQ_CST);
+  if (chaintail_ready(this)) {
+    __atomic_store_n(&this->armed, 0, __ATOMIC_RELAXED);
+    return 1;
+  }
+
+  return 0;
+}
+
+uint64_t chaintail_drain(TailSubscriber *this, uint64_t max, TailFunc fn,
+                         void *ctx)
+// -----------------------------------------------------------------------------
+// Func: Deliver the blocks published since the cursor, in order, in place.
+//       Blocks the ring has already overwritten are skipped and counted in
+//       lost.
+// Args: this - a pointer to the subscriber
+//       max - most blocks to deliver, 0 for no limit
+//       fn - called with each block
+//       ctx - passed to fn
+// Retn: number of blocks delivered
+// -----------------------------------------------------------------------------
+{
+  ChainTail *tail = this->tail;
+  ChainTailSlot *slot;
+  uint64_t published, index, check, size, n = 0;
+  uint8_t *frame;
+  uint64_t count;
+
+  if (this->fd >= 0 && read(this->fd, &count, sizeof(count)) < 0)
+    count = 0; // the eventfd had not been written, nothing to reset
+
+  published = __atomic_load_n(&tail->published, __ATOMIC_ACQUIRE);
+  if (published - this->cursor > tail->mask + 1) {
+    this->lost += published - (tail->mask + 1) - this->cursor;
+    this->cursor = published - (tail->mask + 1);
+  }
+
+  for (; this->cursor < published && (max == 0 || n < max); this->cursor++) {
+    slot = &tail->ring[this->cursor & tail->mask];
+    index = __atomic_load_n(&slot->index, __ATOMIC_ACQUIRE);
+    frame = __atomic_load_n(&slot->frame, __ATOMIC_RELAXED);
+    size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    check = __atomic_load_n(&slot->index, __ATOMIC_RELAXED);
+
+    if (index != this->cursor || check != this->cursor) {
+      this->lost++; // lapped while we were behind
+      continue;
+    }
+
+    n++;
+    if (fn(ctx, this->cursor, frame, size)) {
+      this->cursor++;
+      break;
+    }
+  }
+
+  return n;
+}
+
+void chaintail_hook(void *ctx, Blockchain *chain, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Chain hook, publishes a newly appended block and wakes subscribers.
+//       Never waits on them.
+// Args: ctx - this tail
+//       chain - the chain that was appended to
+//       blockframe - the new block, as passed in (not the stored copy)
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ChainTail *this = (ChainTail *)ctx;
+  uint64_t index = chain->length - 1;
+  ChainTailSlot *slot = &this->ring[index & this->mask];
+  TailSubscriber *sub;
+  uint64_t one = 1;
+  int i;
+
+  // the slot is invalid while it is rewritten
+  __atomic_store_n(&slot->index, UINT64_MAX, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&slot->frame, (uint8_t *)chain->get(chain, index),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->size, blockframe_size(blockframe), __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->index, index, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&this->published, index + 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&this->seq, 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&this->waiters, __ATOMIC_SEQ_CST) > 0)
+    syscall(SYS_futex, &this->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+
+  if (__atomic_load_n(&this->nfds, __ATOMIC_ACQUIRE) == 0)
+    return;
+  pthread_mutex_lock(&this->lock);
+  for (i = 0; i < this->nfds; i++) {
+    sub = this->fds[i];
+    if (__atomic_exchange_n(&sub->armed, 0, __ATOMIC_SEQ_CST))
+      if (write(sub->fd, &one, sizeof(one)) < 0)
+        continue; // counter full, the subscriber has plenty to read
+  }
+  pthread_mutex_unlock(&this->lock);
+}
@@ -0,0 +1,395 @@
+/*
+checkpoint.c: trusted checkpoints that let old history skip rehashing
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "checkpoint.h"
+#include "signature.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Checkpoints compiled into every build, oldest first. A release pins the
+// blocks it shipped with here, or points CHECKPOINT_BUILTIN_FILE at a file
+// of the same initializers, e.g.
+//   make CPPFLAGS+='-DCHECKPOINT_BUILTIN_FILE=\"checkpoints.inc\"'
+// with lines like
+//   { 1000000, "0c5f...e1" },
+static const struct {
+  uint64_t height;
+  const char *hash;        // 2*HASH_SZ hex digits
+} checkpoint_builtin[] = {
+#ifdef CHECKPOINT_BUILTIN_FILE
+#include CHECKPOINT_BUILTIN_FILE
+#endif
+  { 0, NULL } // end of table
+};
+
+// private functions, access through CheckpointSet object
+int checkpoint_add(CheckpointSet *this, uint64_t height, const uint8_t *hash);
+int checkpoint_load(CheckpointSet *this, const char *pathname);
+uint64_t checkpoint_find(const CheckpointSet *this, uint64_t length,
+                         CheckpointHashFunc hash_at, void *ctx);
+
+// private functions
+int checkpoint_parse_hash(const char *hex, uint8_t *hash);
+const uint8_t *checkpoint_chain_hash(void *ctx, uint64_t height);
+void *deepverify_run(void *arg);
+int deepverify_range(DeepVerify *this, Node ***pages, uint64_t lo,
+                     uint64_t hi);
+
+int checkpoint_init(CheckpointSet *this)
+// -----------------------------------------------------------------------------
+// Func: Start a set with the built in checkpoints
+// Args: this - a pointer to this checkpoint set
+// Retn: 0 on success, -1 on allocation failure or a malformed built in
+// -----------------------------------------------------------------------------
+{
+  uint8_t hash[HASH_SZ];
+  int i;
+
+  this->points = NULL;
+  this->n = 0;
+  this->cap = 0;
+
+  this->add = &checkpoint_add;
+  this->load = &checkpoint_load;
+  this->find = &checkpoint_find;
+
+  for (i = 0; checkpoint_builtin[i].hash != NULL; i++) {
+    if (checkpoint_parse_hash(checkpoint_builtin[i].hash, hash) ||
+        checkpoint_add(this, checkpoint_builtin[i].height, hash)) {
+      checkpoint_destroy(this);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void checkpoint_destroy(CheckpointSet *this)
+// -----------------------------------------------------------------------------
+// Func: Free the checkpoints
+// Args: this - a pointer to this checkpoint set
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  free(this->points);
+  this->points = NULL;
+  this->n = 0;
+  this->cap = 0;
+}
+
+int checkpoint_verify_chain(const CheckpointSet *this, Blockchain *chain,
+                            uint64_t *assumed)
+// -----------------------------------------------------------------------------
+// Func: blockchain_verify_chain, except that blocks below the newest
+//       matching checkpoint only have their header links checked
+// Args: this - a pointer to this checkpoint set
+//       chain - the chain
+//       assumed - if not NULL, set to the number of blocks not rehashed
+// Retn: 1 if the chain is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint64_t lo = 0;
+  int valid;
+
+  // the links tie the checkpoint's hash to every header below it
+  if ((valid = blockchain_verify_headers(chain)))
+    lo = checkpoint_assumed(this, chain);
+  if (assumed != NULL)
+    *assumed = lo;
+
+  return valid &&
+         blockchain_verify_range(chain, lo, chain->length) &&
+         blockchain_verify_signature_range(chain, lo, chain->length);
+}
+
+uint64_t checkpoint_assumed(const CheckpointSet *this, Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: How many blocks at the start of a chain the set vouches for
+// Args: this - a pointer to this checkpoint set
+//       chain - the chain
+// Retn: the height of the newest checkpoint the chain matches, 0 if none
+// -----------------------------------------------------------------------------
+{
+  return checkpoint_find(this, chain->length, &checkpoint_chain_hash, chain);
+}
+
+int checkpoint_add(CheckpointSet *this, uint64_t height, const uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: Trust a block, replacing any checkpoint at the same height
+// Args: this - a pointer to this checkpoint set
+//       height - the block's index
+//       hash - the block's hash
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  Checkpoint *points;
+  uint64_t i, cap;
+
+  for (i = this->n; i > 0 && this->points[i-1].height > height; i--)
+    ;
+  if (i > 0 && this->points[i-1].height == height) {
+    memcpy(this->points[i-1].hash, hash, HASH_SZ);
+    return 0;
+  }
+
+  if (this->n == this->cap) {
+    cap = this->cap ? 2*this->cap : 16;
+    if ((points = realloc(this->points, cap*sizeof(Checkpoint))) == NULL)
+      return -1;
+    this->points = points;
+    this->cap = cap;
+  }
+
+  memmove(&this->points[i+1], &this->points[i],
+          (this->n - i)*sizeof(Checkpoint));
+  this->points[i].height = height;
+  memcpy(this->points[i].hash, hash, HASH_SZ);
+  this->n++;
+
+  return 0;
+}
+
+int checkpoint_load(CheckpointSet *this, const char *pathname)
+// -----------------------------------------------------------------------------
+// Func: Add the checkpoints listed in a file, one "HEIGHT HASH" per line
+//       with the hash in hex. Blank lines and lines starting with # are
+//       skipped.
+// Args: this - a pointer to this checkpoint set
+//       pathname - the file
+// Retn: 0 on success, -1 if the file can't be read or a line is malformed
+//       (checkpoints on the lines before it are kept)
+// -----------------------------------------------------------------------------
+{
+  FILE *fp;
+  char line[256], hex[2*HASH_SZ + 2];
+  uint8_t hash[HASH_SZ];
+  uint64_t height;
+  char *p;
+  int err = 0;
+
+  if ((fp = fopen(pathname, "r")) == NULL)
+    return -1;
+
+  while (!err && fgets(line, sizeof(line), fp) != NULL) {
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    if (*p == '\0' || *p == '#')
+      continue;
+    err = sscanf(p, "%lu %65s", &height, hex) != 2 ||
+          checkpoint_parse_hash(hex, hash) ||
+          checkpoint_add(this, height, hash);
+  }
+
+  err |= ferror(fp);
+  fclose(fp);
+
+  return err ? -1 : 0;
+}
+
+uint64_t checkpoint_find(const CheckpointSet *this, uint64_t length,
+                         CheckpointHashFunc hash_at, void *ctx)
+// -----------------------------------------------------------------------------
+// Func: Find the newest checkpoint that a chain of length blocks matches
+// Args: this - a pointer to this checkpoint set
+//       length - blocks in the chain
+//       hash_at - reads the hash in a block's header
+//       ctx - passed through to hash_at
+// Retn: its height, 0 if none matches
+// -----------------------------------------------------------------------------
+{
+  const uint8_t *hash;
+  uint64_t i;
+
+  for (i = this->n; i-- > 0; ) {
+    if (this->points[i].height >= length)
+      continue;
+    hash = hash_at(ctx, this->points[i].height);
+    if (hash != NULL && !memcmp(hash, this->points[i].hash, HASH_SZ))
+      return this->points[i].height;
+  }
+
+  return 0;
+}
+
+int checkpoint_parse_hash(const char *hex, uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: Decode a hash written in hex
+// Args: hex - exactly 2*HASH_SZ hex digits, nul terminated
+//       hash - set to the HASH_SZ bytes
+// Retn: 0 on success, -1 if hex is malformed
+// -----------------------------------------------------------------------------
+{
+  int i, hi, lo;
+
+  if (strlen(hex) != 2*HASH_SZ)
+    return -1;
+
+  for (i = 0; i < HASH_SZ; i++) {
+    hi = tolower((unsigned char)hex[2*i]);
+    lo = tolower((unsigned char)hex[2*i+1]);
+    if (!isxdigit(hi) || !isxdigit(lo))
+      return -1;
+    hash[i] = (isdigit(hi) ? hi - '0' : hi - 'a' + 10) << 4 |
+              (isdigit(lo) ? lo - '0' : lo - 'a' + 10);
+  }
+
+  return 0;
+}
+
+const uint8_t *checkpoint_chain_hash(void *ctx, uint64_t height)
+// -----------------------------------------------------------------------------
+// Func: CheckpointHashFunc over the headers of a chain
+// Args: ctx - the Blockchain
+//       height - the block
+// Retn: the block's hash
+// -----------------------------------------------------------------------------
+{
+  return &blockchain_get_header((Blockchain *)ctx, height)[CURRHASH_POS];
+}
+
+int deepverify_start(DeepVerify *this, Blockchain *chain, uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: Start rehashing blocks [0, hi) on a thread of their own, typically
+//       the ones a checkpoint let startup skip. Frames are reached through
+//       the chain's page directory, whose pages never move, so appends may
+//       go on meanwhile; pruning may not, as it frees the frames, so the
+//       chain stays pinned until the thread is done.
+// Args: this - a pointer to this deep verify object
+//       chain - the chain, which must not prune (see blockchain_pin)
+//       hi - one past the last block to check, clipped to the chain's length
+// Retn: 0 if the thread started, -1 if pruning is configured or on failure
+// -----------------------------------------------------------------------------
+{
+  this->chain = chain;
+  this->hi = hi < chain->length ? hi : chain->length;
+  this->done = 0;
+  this->valid = -1;
+  this->cancel = 0;
+
+  if (blockchain_pin(chain))
+    return -1;
+
+  if (pthread_create(&this->thread, NULL, &deepverify_run, this)) {
+    blockchain_unpin(chain);
+    return -1;
+  }
+
+  return 0;
+}
+
+int deepverify_wait(DeepVerify *this)
+// -----------------------------------------------------------------------------
+// Func: Wait for the thread to finish
+// Args: this - a pointer to this deep verify object
+// Retn: 1 if every block checked out, 0 if one did not, -1 if cancelled
+// -----------------------------------------------------------------------------
+{
+  pthread_join(this->thread, NULL);
+
+  return this->valid;
+}
+
+void deepverify_cancel(DeepVerify *this)
+// -----------------------------------------------------------------------------
+// Func: Stop the thread within CHECKPOINT_DEEP_STEP blocks and wait for it
+// Args: this - a pointer to this deep verify object
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  __atomic_store_n(&this->cancel, 1, __ATOMIC_RELAXED);
+  pthread_join(this->thread, NULL);
+}
+
+void *deepverify_run(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Thread body, check blocks oldest first, CHECKPOINT_DEEP_STEP at a time
+// Args: arg - the DeepVerify
+// Retn: NULL, the result is left in valid
+// -----------------------------------------------------------------------------
+{
+  DeepVerify *this = (DeepVerify *)arg;
+  Node ***pages = this->chain->pages;
+  uint64_t lo, hi;
+  int valid = 1;
+
+  for (lo = 0; valid && lo < this->hi; lo = hi) {
+    if (__atomic_load_n(&this->cancel, __ATOMIC_RELAXED)) {
+      valid = -1;
+      break;
+    }
+    hi = this->hi - lo > CHECKPOINT_DEEP_STEP ? lo + CHECKPOINT_DEEP_STEP
+                                              : this->hi;
+    valid = deepverify_range(this, pages, lo, hi);
+    __atomic_store_n(&this->done, hi, __ATOMIC_RELAXED);
+  }
+
+  blockchain_unpin(this->chain);
+  __atomic_store_n(&this->valid, valid, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+int deepverify_range(DeepVerify *this, Node ***pages, uint64_t lo,
+                     uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: Rehash blocks [lo, hi) and check their signatures, reading frames
+//       only, never the chain's header array, which moves as it grows
+// Args: this - a pointer to this deep verify object
+//       pages - the chain's page directory
+//       lo - first block
+//       hi - one past the last block
+// Retn: 1 if every block is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint8_t *records[CHECKPOINT_DEEP_STEP];
+  uint64_t sizes[CHECKPOINT_DEEP_STEP];
+  uint8_t *frame, *prev_frame;
+  Block block, prev_block;
+  uint64_t i, n = 0;
+  int valid = 1;
+
+  for (i = lo; valid && i < hi; i++) {
+    frame = pages[i >> BLOCKCHAIN_PAGE_BITS]
+                 [i & (BLOCKCHAIN_PAGE_SZ-1)]->data;
+    blockheader_decode(frame, &block);
+    block.record = &frame[RECORD_POS];
+
+    if (i == 0) {
+      valid = blockchain_verify_root(&block);
+    } else {
+      prev_frame = pages[(i-1) >> BLOCKCHAIN_PAGE_BITS]
+                        [(i-1) & (BLOCKCHAIN_PAGE_SZ-1)]->data;
+      blockheader_decode(prev_frame, &prev_block);
+      valid = blockchain_verify_block(&block, &prev_block,
+                                      this->chain->hash_alg);
+    }
+
+    if (signature_present(block.record, block.record_sz)) {
+      records[n] = block.record;
+      sizes[n++] = block.record_sz;
+    }
+  }
+
+  // the cache locks, the chain's pool is left to the appender
+  return valid && signature_verify_batch(this->chain->sig_cache, NULL,
+                                         records, sizes, n);
+}
@@ -0,0 +1,401 @@
+/*
+chunkstore.c: content-defined chunking and a deduplicating chunk store
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chunkstore.h"
+#include "blake3.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// private functions, access through ChunkStore object
+int chunkstore_put(ChunkStore *this, const uint8_t *record, uint64_t record_sz,
+                   uint64_t *recipe);
+int chunkstore_read(ChunkStore *this, uint64_t recipe, uint8_t *buf);
+
+// private functions
+uint32_t *chunkstore_find(ChunkStore *this, const uint8_t *digest);
+int chunkstore_add(ChunkStore *this, const uint8_t *digest,
+                   const uint8_t *data, uint32_t len, uint32_t *id);
+int chunkstore_grow_table(ChunkStore *this);
+uint64_t chunkstore_mask(int bits);
+
+int chunkstore_init(ChunkStore *this, uint32_t avg_sz)
+// -----------------------------------------------------------------------------
+// Func: Initialize an empty chunk store. Chunks are cut at no less than a
+//       quarter and no more than eight times the average size.
+// Args: this - a pointer to the new store
+//       avg_sz - target average chunk size, a power of two between
+//                CHUNKSTORE_MIN_AVG and CHUNKSTORE_MAX_AVG
+// Retn: 0 on success, -1 if avg_sz is out of range or on allocation failure
+// -----------------------------------------------------------------------------
+{
+  uint64_t seed = 0x9e3779b97f4a7c15ULL, z;
+  int bits, i;
+
+  if (avg_sz < CHUNKSTORE_MIN_AVG || avg_sz > CHUNKSTORE_MAX_AVG ||
+      (avg_sz & (avg_sz - 1)))
+    return -1;
+  for (bits = 0; ((uint32_t)1 << bits) < avg_sz; bits++)
+    ;
+
+  this->avg_sz = avg_sz;
+  this->min_sz = avg_sz / 4;
+  this->max_sz = avg_sz * 8;
+  // normalized chunking: harder to cut before the average, easier after
+  this->mask_s = chunkstore_mask(bits + 2);
+  this->mask_l = chunkstore_mask(bits - 2);
+
+  // fixed pseudo random gear table (splitmix64), so cuts are reproducible
+  for (i = 0; i < 256; i++) {
+    z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    this->gear[i] = z ^ (z >> 31);
+  }
+
+  this->slabs = NULL;
+  this->nslabs = 0;
+  this->slab_used = CHUNKSTORE_SLAB_SZ; // no room, the first add opens one
+  this->chunks = NULL;
+  this->nchunks = 0;
+  this->chunks_cap = 0;
+  this->table = NULL;
+  this->table_cap = 0;
+  this->list = NULL;
+  this->nlist = 0;
+  this->list_cap = 0;
+  this->nrecipes = 0;
+  this->recipes_cap = 64;
+  this->logical_sz = 0;
+  this->stored_sz = 0;
+
+  if ((this->start = malloc((this->recipes_cap + 1)*sizeof(uint64_t))) == NULL)
+    return -1;
+  this->start[0] = 0;
+
+  if (chunkstore_grow_table(this)) {
+    free(this->start);
+    return -1;
+  }
+
+  pthread_rwlock_init(&this->lock, NULL);
+  this->put = &chunkstore_put;
+  this->read = &chunkstore_read;
+
+  return 0;
+}
+
+void chunkstore_destroy(ChunkStore *this)
+// -----------------------------------------------------------------------------
+// Func: Free every chunk and recipe
+// Args: this - a pointer to the store
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t i;
+
+  for (i = 0; i < this->nslabs; i++)
+    free(this->slabs[i]);
+  free(this->slabs);
+  free(this->chunks);
+  free(this->table);
+  free(this->list);
+  free(this->start);
+  this->slabs = NULL;
+  this->chunks = NULL;
+  this->table = NULL;
+  this->list = NULL;
+  this->start = NULL;
+  this->nslabs = this->nchunks = this->nlist = this->nrecipes = 0;
+  pthread_rwlock_destroy(&this->lock);
+}
+
+void chunkstore_stats(ChunkStore *this, uint64_t *logical, uint64_t *stored,
+                      uint64_t *chunks)
+// -----------------------------------------------------------------------------
+// Func: Report how well records deduplicate
+// Args: this - a pointer to the store
+//       logical - bytes of every record put
+//       stored - bytes of unique chunks held
+//       chunks - number of unique chunks
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  pthread_rwlock_rdlock(&this->lock);
+  *logical = this->logical_sz;
+  *stored = this->stored_sz;
+  *chunks = this->nchunks;
+  pthread_rwlock_unlock(&this->lock);
+}
+
+uint64_t chunkstore_cut(ChunkStore *this, const uint8_t *buf, uint64_t buf_sz)
+// -----------------------------------------------------------------------------
+// Func: Find the end of the first chunk of buf with the FastCDC gear hash.
+//       Bit k of the hash depends on the last k+1 bytes, so the masks test
+//       high bits, which cover a 64 byte window.
+// Args: this - a pointer to the store
+//       buf - the bytes to cut
+//       buf_sz - their size
+// Retn: length of the first chunk
+// -----------------------------------------------------------------------------
+{
+  uint64_t h = 0, i, normal, end;
+
+  if (buf_sz <= this->min_sz)
+    return buf_sz;
+
+  end = buf_sz < this->max_sz ? buf_sz : this->max_sz;
+  normal = end < this->avg_sz ? end : this->avg_sz;
+
+  for (i = this->min_sz; i < normal; i++) {
+    h = (h << 1) + this->gear[buf[i]];
+    if (!(h & this->mask_s))
+      return i + 1;
+  }
+  for (; i < end; i++) {
+    h = (h << 1) + this->gear[buf[i]];
+    if (!(h & this->mask_l))
+      return i + 1;
+  }
+
+  return end;
+}
+
+int chunkstore_put(ChunkStore *this, const uint8_t *record, uint64_t record_sz,
+                   uint64_t *recipe)
+// -----------------------------------------------------------------------------
+// Func: Store a record as its chunks, adding the ones not seen before. Cuts
+//       and digests are computed before the lock is taken.
+// Args: this - a pointer to the store
+//       record - the record
+//       record_sz - its size
+//       recipe - set to the handle read takes
+// Retn: 0 on success, -1 on allocation failure (nothing is added)
+// -----------------------------------------------------------------------------
+{
+  uint8_t (*digests)[CHUNKSTORE_DIGEST_SZ] = NULL;
+  uint32_t *lens = NULL;
+  uint64_t n = 0, cap = 0, off, i, *start;
+  uint32_t *list, id;
+  void *p;
+  int err = 0;
+
+  for (off = 0; off < record_sz && !err; off += lens[n++]) {
+    if (n == cap) {
+      cap = cap ? 2*cap : 16;
+      if ((p = realloc(digests, cap*CHUNKSTORE_DIGEST_SZ)) != NULL)
+        digests = p;
+      if (p == NULL || (p = realloc(lens, cap*sizeof(uint32_t))) == NULL) {
+        err = 1;
+        break;
+      }
+      lens = p;
+    }
+    lens[n] = chunkstore_cut(this, &record[off], record_sz - off);
+    blake3_hash(&record[off], lens[n], digests[n]);
+  }
+
+  pthread_rwlock_wrlock(&this->lock);
+
+  if (!err && this->nlist + n > this->list_cap) {
+    for (cap = this->list_cap ? this->list_cap : 1024;
+         cap < this->nlist + n; cap *= 2)
+      ;
+    if ((list = realloc(this->list, cap*sizeof(uint32_t))) == NULL)
+      err = 1;
+    else {
+      this->list = list;
+      this->list_cap = cap;
+    }
+  }
+  if (!err && this->nrecipes == this->recipes_cap) {
+    start = realloc(this->start, (2*this->recipes_cap + 1)*sizeof(uint64_t));
+    if (start == NULL)
+      err = 1;
+    else {
+      this->start = start;
+      this->recipes_cap *= 2;
+    }
+  }
+
+  // chunks added before a failure stay, they are just not referenced yet
+  for (i = 0, off = 0; i < n && !err; off += lens[i++]) {
+    if ((err = chunkstore_add(this, digests[i], &record[off], lens[i], &id)))
+      break;
+    this->list[this->nlist + i] = id;
+  }
+
+  if (!err) {
+    this->nlist += n;
+    *recipe = this->nrecipes++;
+    this->start[this->nrecipes] = this->nlist;
+    this->logical_sz += record_sz;
+  }
+
+  pthread_rwlock_unlock(&this->lock);
+
+  free(digests);
+  free(lens);
+  return err ? -1 : 0;
+}
+
+int chunkstore_read(ChunkStore *this, uint64_t recipe, uint8_t *buf)
+// -----------------------------------------------------------------------------
+// Func: Reassemble a record from its chunks
+// Args: this - a pointer to the store
+//       recipe - as set by put
+//       buf - room for the whole record
+// Retn: 0 on success, -1 if there is no such recipe
+// -----------------------------------------------------------------------------
+{
+  ChunkRef *chunk;
+  uint64_t i;
+
+  pthread_rwlock_rdlock(&this->lock);
+  if (recipe >= this->nrecipes) {
+    pthread_rwlock_unlock(&this->lock);
+    return -1;
+  }
+
+  for (i = this->start[recipe]; i < this->start[recipe + 1]; i++) {
+    chunk = &this->chunks[this->list[i]];
+    memcpy(buf, &this->slabs[chunk->loc / CHUNKSTORE_SLAB_SZ]
+                            [chunk->loc % CHUNKSTORE_SLAB_SZ], chunk->len);
+    buf += chunk->len;
+  }
+  pthread_rwlock_unlock(&this->lock);
+
+  return 0;
+}
+
+uint32_t *chunkstore_find(ChunkStore *this, const uint8_t *digest)
+// -----------------------------------------------------------------------------
+// Func: Find the table slot of a digest, or the empty slot it would take
+// Args: this - a pointer to the store, locked
+//       digest - the chunk's digest
+// Retn: pointer to the slot, 0 if empty, else the chunk's id + 1
+// -----------------------------------------------------------------------------
+{
+  uint64_t h;
+  uint32_t *slot;
+
+  memcpy(&h, digest, sizeof(h)); // the digest is already uniform
+  for (;;) {
+    slot = &this->table[h & (this->table_cap - 1)];
+    if (*slot == 0 ||
+        !memcmp(this->chunks[*slot - 1].digest, digest, CHUNKSTORE_DIGEST_SZ))
+      return slot;
+    h++;
+  }
+}
+
+int chunkstore_add(ChunkStore *this, const uint8_t *digest,
+                   const uint8_t *data, uint32_t len, uint32_t *id)
+// -----------------------------------------------------------------------------
+// Func: Look a chunk up by digest, storing it if it is new
+// Args: this - a pointer to the store, write locked
+//       digest - the chunk's digest
+//       data - the chunk's bytes
+//       len - their size
+//       id - set to the chunk's id
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  uint32_t *slot;
+  uint8_t **slabs;
+  ChunkRef *chunks;
+  uint64_t cap;
+
+  if (*(slot = chunkstore_find(this, digest)) != 0) {
+    *id = *slot - 1;
+    return 0;
+  }
+
+  if (2*(this->nchunks + 1) > this->table_cap) {
+    if (chunkstore_grow_table(this))
+      return -1;
+    slot = chunkstore_find(this, digest);
+  }
+  if (this->nchunks == this->chunks_cap) {
+    cap = this->chunks_cap ? 2*this->chunks_cap : 1024;
+    if ((chunks = realloc(this->chunks, cap*sizeof(ChunkRef))) == NULL)
+      return -1;
+    this->chunks = chunks;
+    this->chunks_cap = cap;
+  }
+  if (this->slab_used + len > CHUNKSTORE_SLAB_SZ) {
+    if ((slabs = realloc(this->slabs, (this->nslabs + 1)*sizeof(uint8_t *)))
+        == NULL)
+      return -1;
+    this->slabs = slabs;
+    if ((slabs[this->nslabs] = malloc(CHUNKSTORE_SLAB_SZ)) == NULL)
+      return -1;
+    this->nslabs++;
+    this->slab_used = 0;
+  }
+
+  memcpy(&this->slabs[this->nslabs - 1][this->slab_used], data, len);
+  memcpy(this->chunks[this->nchunks].digest, digest, CHUNKSTORE_DIGEST_SZ);
+  this->chunks[this->nchunks].loc = (this->nslabs - 1)*CHUNKSTORE_SLAB_SZ +
+                                    this->slab_used;
+  this->chunks[this->nchunks].len = len;
+  this->slab_used += len;
+  this->stored_sz += len;
+
+  *id = this->nchunks++;
+  *slot = *id + 1;
+
+  return 0;
+}
+
+int chunkstore_grow_table(ChunkStore *this)
+// -----------------------------------------------------------------------------
+// Func: Double the digest table and rehash every chunk into it
+// Args: this - a pointer to the store, write locked
+// Retn: 0 on success, -1 on allocation failure (the table is unchanged)
+// -----------------------------------------------------------------------------
+{
+  uint32_t *old = this->table;
+  uint64_t old_cap = this->table_cap;
+  uint64_t i;
+
+  this->table_cap = old_cap ? 2*old_cap : 4096;
+  if ((this->table = calloc(this->table_cap, sizeof(uint32_t))) == NULL) {
+    this->table = old;
+    this->table_cap = old_cap;
+    return -1;
+  }
+
+  for (i = 0; i < this->nchunks; i++)
+    *chunkstore_find(this, this->chunks[i].digest) = i + 1;
+  free(old);
+
+  return 0;
+}
+
+uint64_t chunkstore_mask(int bits)
+// -----------------------------------------------------------------------------
+// Func: A mask of the top bits of a 64 bit hash
+// Args: bits - how many bits, a cut happens with probability 2^-bits
+// Retn: the mask
+// -----------------------------------------------------------------------------
+{
+  return ~(uint64_t)0 << (64 - bits);
+}
@@ -0,0 +1,388 @@
+/*
+filehash.c: parallel hashing of files and directory trees
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "filehash.h"
+#include "blake3.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// openssl header files
+#include <openssl/evp.h>
+
+// private functions
+int filehash_walk(FileHash **files, uint64_t *nfiles, uint64_t *cap,
+                  const char *path, uint8_t hash_alg, int top);
+int filehash_add(FileHash **files, uint64_t *nfiles, uint64_t *cap,
+                 const char *path, uint8_t hash_alg, int err);
+void filehash_task(void *arg);
+int filehash_read(int fd, uint8_t hash_alg, uint8_t *hash);
+int filehash_sha256(const uint8_t *map, uint64_t size, uint8_t *hash);
+void filehash_print(const FileHash *f, uint8_t *line);
+
+int filehash_cmd(int argc, char **argv)
+// -----------------------------------------------------------------------------
+// Func: The -h command: hash files, and every file under directories, on a
+//       thread pool and print them like sha256sum (or b3sum with -b), in
+//       the order given, directories in sorted order:
+//         main -h [-b] [-j THREADS] [PATH ...]
+//       No paths, or "-", hashes standard input.
+// Args: argc - arguments after -h
+//       argv - the arguments
+// Retn: 0 if every file was hashed, -1 otherwise (the failures are reported
+//       on stderr and the rest still printed)
+// -----------------------------------------------------------------------------
+{
+  FileHash *files = NULL;
+  ThreadPool pool;
+  uint8_t hash_alg = BLOCKCHAIN_HASH_SHA256;
+  uint8_t *line;
+  uint64_t nfiles = 0, cap = 0, i;
+  int nthreads = 0, err = 0, j;
+
+  for (j = 0; j < argc && argv[j][0] == '-' && argv[j][1] != '\0'; j++) {
+    if (!strcmp(argv[j], "--")) {
+      j++;
+      break;
+    } else if (!strcmp(argv[j], "-b")) {
+      hash_alg = BLOCKCHAIN_HASH_BLAKE3;
+    } else if (!strcmp(argv[j], "-j") && j + 1 < argc) {
+      nthreads = atoi(argv[++j]);
+    } else {
+      fprintf(stderr, "usage: main -h [-b] [-j THREADS] [PATH ...]\n");
+      return -1;
+    }
+  }
+
+  if (j == argc)
+    err |= filehash_add(&files, &nfiles, &cap, "-", hash_alg, 0);
+  for (; j < argc; j++)
+    err |= filehash_walk(&files, &nfiles, &cap, argv[j], hash_alg, 1);
+
+  if (err || threadpool_init(&pool, nthreads)) {
+    for (i = 0; i < nfiles; i++)
+      free(files[i].path);
+    free(files);
+    return -1;
+  }
+  for (i = 0; i < nfiles; i++)
+    if (!files[i].err && pool.submit(&pool, &filehash_task, &files[i]))
+      filehash_task(&files[i]); // couldn't queue it, hash it here
+  pool.wait(&pool);
+  threadpool_destroy(&pool);
+
+  line = malloc(2*HASH_SZ + 4);
+  for (i = 0; i < nfiles; i++) {
+    if (files[i].err) {
+      fprintf(stderr, "%s: %s\n", files[i].path, strerror(files[i].err));
+      err = 1;
+    } else if (line != NULL) {
+      filehash_print(&files[i], line);
+    }
+    free(files[i].path);
+  }
+  free(line);
+  free(files);
+  fflush(stdout);
+
+  return err ? -1 : 0;
+}
+
+int filehash_fd(int fd, uint8_t hash_alg, uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: Hash everything readable from a file descriptor. Regular files of
+//       FILEHASH_MMAP_MIN bytes or more are mapped and hashed in place;
+//       anything else is read FILEHASH_CHUNK_SZ bytes at a time.
+// Args: fd - an open file
+//       hash_alg - BLOCKCHAIN_HASH_SHA256 or BLOCKCHAIN_HASH_BLAKE3
+//       hash - set to the HASH_SZ byte digest
+// Retn: 0 on success, -1 with errno set otherwise
+// -----------------------------------------------------------------------------
+{
+  struct stat st;
+  uint8_t *map;
+  int err = 0;
+
+  if (fstat(fd, &st))
+    return -1;
+  if (!S_ISREG(st.st_mode) || st.st_size < FILEHASH_MMAP_MIN)
+    return filehash_read(fd, hash_alg, hash);
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return filehash_read(fd, hash_alg, hash);
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  if (hash_alg == BLOCKCHAIN_HASH_BLAKE3)
+    blake3_hash(map, st.st_size, hash);
+  else
+    err = filehash_sha256(map, st.st_size, hash);
+  munmap(map, st.st_size);
+
+  return err;
+}
+
+int filehash_sha256(const uint8_t *map, uint64_t size, uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: SHA256 of a mapped file, FILEHASH_CHUNK_SZ bytes at a time
+// Args: map - the mapping
+//       size - its size
+//       hash - set to the digest
+// Retn: 0 on success, -1 with errno set if OpenSSL fails
+// -----------------------------------------------------------------------------
+{
+  EVP_MD_CTX *ctx;
+  uint64_t off, n;
+  int ok;
+
+  if ((ctx = EVP_MD_CTX_new()) == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+  for (off = 0; ok && off < size; off += n) {
+    n = size - off < FILEHASH_CHUNK_SZ ? size - off : FILEHASH_CHUNK_SZ;
+    ok = EVP_DigestUpdate(ctx, &map[off], n);
+  }
+  ok = ok && EVP_DigestFinal_ex(ctx, hash, NULL);
+  EVP_MD_CTX_free(ctx);
+
+  if (!ok)
+    errno = EIO;
+  return ok ? 0 : -1;
+}
+
+int filehash_read(int fd, uint8_t hash_alg, uint8_t *hash)
+// -----------------------------------------------------------------------------
+// Func: filehash_fd with read(), streaming either hash through one
+//       FILEHASH_CHUNK_SZ buffer
+// Args: fd - an open file
+//       hash_alg - BLOCKCHAIN_HASH_SHA256 or BLOCKCHAIN_HASH_BLAKE3
+//       hash - set to the digest
+// Retn: 0 on success, -1 with errno set otherwise
+// -----------------------------------------------------------------------------
+{
+  EVP_MD_CTX *ctx = NULL;
+  Blake3Hasher *b3 = NULL;
+  uint8_t *buf;
+  ssize_t n;
+  int blake3 = hash_alg == BLOCKCHAIN_HASH_BLAKE3;
+  int ok;
+
+  buf = malloc(FILEHASH_CHUNK_SZ);
+  if (blake3)
+    ok = buf != NULL && (b3 = malloc(sizeof(Blake3Hasher))) != NULL;
+  else
+    ok = buf != NULL && (ctx = EVP_MD_CTX_new()) != NULL &&
+         EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+  if (!ok)
+    errno = ENOMEM;
+  if (b3 != NULL)
+    blake3_init(b3);
+
+  while (ok) {
+    if ((n = read(fd, buf, FILEHASH_CHUNK_SZ)) < 0) {
+      if (errno == EINTR)
+        continue;
+      ok = 0;
+    }
+    else if (n == 0) {
+      break;
+    }
+    else if (blake3) {
+      blake3_update(b3, buf, n);
+    }
+    else if (!EVP_DigestUpdate(ctx, buf, n)) {
+      errno = EIO;
+      ok = 0;
+    }
+  }
+
+  if (ok && blake3)
+    blake3_final(b3, hash);
+  else if (ok && !EVP_DigestFinal_ex(ctx, hash, NULL)) {
+    errno = EIO;
+    ok = 0;
+  }
+
+  EVP_MD_CTX_free(ctx);
+  free(b3);
+  free(buf);
+
+  return ok ? 0 : -1;
+}
+
+int filehash_walk(FileHash **files, uint64_t *nfiles, uint64_t *cap,
+                  const char *path, uint8_t hash_alg, int top)
+// -----------------------------------------------------------------------------
+// Func: List a path's files: the path itself, or for a directory every file
+//       under it in sorted order. Symbolic links named on the command line
+//       are followed; inside a tree, links to files are hashed and links to
+//       directories skipped, so the walk can't loop.
+// Args: files - the list, grown as needed
+//       nfiles - number of files listed
+//       cap - capacity of the list
+//       path - the path
+//       hash_alg - how to hash the files
+//       top - 1 for a path from the command line
+// Retn: 0 on success, -1 if out of memory. Paths that can't be read are
+//       listed with their error.
+// -----------------------------------------------------------------------------
+{
+  struct dirent **ents;
+  struct stat st;
+  char *child;
+  size_t len = strlen(path);
+  int i, n, err = 0;
+
+  if (!strcmp(path, "-"))
+    return filehash_add(files, nfiles, cap, path, hash_alg, 0);
+  if ((top ? stat(path, &st) : lstat(path, &st)) != 0)
+    return filehash_add(files, nfiles, cap, path, hash_alg, errno);
+
+  if (S_ISLNK(st.st_mode) && (stat(path, &st) || S_ISDIR(st.st_mode)))
+    return 0; // dangling, or a directory
+  if (!S_ISDIR(st.st_mode))
+    return filehash_add(files, nfiles, cap, path, hash_alg, 0);
+
+  if ((n = scandir(path, &ents, NULL, &alphasort)) < 0)
+    return filehash_add(files, nfiles, cap, path, hash_alg, errno);
+
+  for (i = 0; i < n; i++) {
+    if (!err && strcmp(ents[i]->d_name, ".") && strcmp(ents[i]->d_name, "..")) {
+      if ((child = malloc(len + strlen(ents[i]->d_name) + 2)) == NULL) {
+        err = 1;
+      } else {
+        sprintf(child, len && path[len-1] == '/' ? "%s%s" : "%s/%s", path,
+                ents[i]->d_name);
+        err = filehash_walk(files, nfiles, cap, child, hash_alg, 0) != 0;
+        free(child);
+      }
+    }
+    free(ents[i]);
+  }
+  free(ents);
+
+  return err ? -1 : 0;
+}
+
+int filehash_add(FileHash **files, uint64_t *nfiles, uint64_t *cap,
+                 const char *path, uint8_t hash_alg, int err)
+// -----------------------------------------------------------------------------
+// Func: Append a file to the list
+// Args: files - the list, grown as needed
+//       nfiles - number of files listed
+//       cap - capacity of the list
+//       path - the file's path, copied
+//       hash_alg - how to hash it
+//       err - errno if the file could not be listed, else 0
+// Retn: 0 on success, -1 if out of memory
+// -----------------------------------------------------------------------------
+{
+  FileHash *grown;
+  char *copy;
+
+  if (*nfiles == *cap) {
+    grown = realloc(*files, (*cap ? 2*(*cap) : 64)*sizeof(FileHash));
+    if (grown == NULL)
+      return -1;
+    *files = grown;
+    *cap = *cap ? 2*(*cap) : 64;
+  }
+  if ((copy = strdup(path)) == NULL)
+    return -1;
+
+  (*files)[*nfiles].path = copy;
+  (*files)[*nfiles].hash_alg = hash_alg;
+  (*files)[*nfiles].err = err;
+  (*nfiles)++;
+
+  return 0;
+}
+
+void filehash_task(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Pool task: hash one listed file, unless listing it failed
+// Args: arg - the FileHash
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  FileHash *f = (FileHash *)arg;
+  int fd;
+
+  if (f->err)
+    return;
+
+  if (!strcmp(f->path, "-"))
+    fd = STDIN_FILENO;
+  else if ((fd = open(f->path, O_RDONLY|O_CLOEXEC)) < 0) {
+    f->err = errno;
+    return;
+  }
+
+  if (filehash_fd(fd, f->hash_alg, f->hash))
+    f->err = errno ? errno : EIO;
+  if (fd != STDIN_FILENO)
+    close(fd);
+}
+
+void filehash_print(const FileHash *f, uint8_t *line)
+// -----------------------------------------------------------------------------
+// Func: Print a file's line the way sha256sum does: digest, two spaces, path.
+//       A path with a backslash or newline in it is escaped and the line
+//       marked with a leading backslash.
+// Args: f - the hashed file
+//       line - scratch space for the digest, 2*HASH_SZ + 4 bytes
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  static const char hex[] = "0123456789abcdef";
+  const char *p;
+  int i, escape = strpbrk(f->path, "\\\n") != NULL;
+
+  for (i = 0; i < HASH_SZ; i++) {
+    line[2*i] = hex[f->hash[i] >> 4];
+    line[2*i+1] = hex[f->hash[i] & 15];
+  }
+  line[2*HASH_SZ] = ' ';
+  line[2*HASH_SZ+1] = ' ';
+
+  if (escape)
+    putchar('\\');
+  fwrite(line, 1, 2*HASH_SZ + 2, stdout);
+  for (p = f->path; *p; p++) {
+    if (escape && *p == '\\')
+      fputs("\\\\", stdout);
+    else if (escape && *p == '\n')
+      fputs("\\n", stdout);
+    else
+      putchar(*p);
+  }
+  putchar('\n');
+}
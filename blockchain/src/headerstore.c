@@ -0,0 +1,224 @@
+/*
+headerstore.c: block header link fields stored as parallel arrays
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "headerstore.h"
+#include "blockchain.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+// private functions, access through HeaderStore object
+int headerstore_append(HeaderStore *this, const uint8_t *header);
+int headerstore_verify_links(HeaderStore *this, uint64_t lo, uint64_t hi);
+
+// private functions
+int headerstore_grow(HeaderStore *this);
+int headerstore_links_portable(HeaderStore *this, uint64_t lo, uint64_t hi);
+int headerstore_links_avx2(HeaderStore *this, uint64_t lo, uint64_t hi);
+
+int headerstore_init(HeaderStore *this)
+// -----------------------------------------------------------------------------
+// Func: Initialize an empty header store
+// Args: this - a pointer to the new store
+// Retn: 0 on success
+// -----------------------------------------------------------------------------
+{
+  this->count = 0;
+  this->cap = 0;
+  this->hashes = NULL;
+  this->prevhashes = NULL;
+  this->indices = NULL;
+  this->timestamps = NULL;
+
+  this->append = &headerstore_append;
+  this->verify_links = &headerstore_verify_links;
+
+  return 0;
+}
+
+void headerstore_destroy(HeaderStore *this)
+// -----------------------------------------------------------------------------
+// Func: Free the arrays of a header store
+// Args: this - a pointer to the store
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  free(this->hashes);
+  free(this->prevhashes);
+  free(this->indices);
+  free(this->timestamps);
+  this->hashes = NULL;
+  this->prevhashes = NULL;
+  this->indices = NULL;
+  this->timestamps = NULL;
+  this->count = 0;
+  this->cap = 0;
+}
+
+int headerstore_append(HeaderStore *this, const uint8_t *header)
+// -----------------------------------------------------------------------------
+// Func: Split a block header into the arrays
+// Args: this - a pointer to the store
+//       header - BLOCK_HEADER_SZ bytes, as framed
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  if (this->count == this->cap && headerstore_grow(this))
+    return -1;
+
+  memcpy(&this->hashes[this->count*HASH_SZ], &header[CURRHASH_POS], HASH_SZ);
+  memcpy(&this->prevhashes[this->count*HASH_SZ], &header[PREVHASH_POS],
+         HASH_SZ);
+  memcpy(&this->indices[this->count], &header[INDEX_POS], WORD_SZ);
+  memcpy(&this->timestamps[this->count], &header[TS_POS], WORD_SZ);
+  this->count++;
+
+  return 0;
+}
+
+int headerstore_verify_links(HeaderStore *this, uint64_t lo, uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: Check that every header in [lo, hi) after the first links to the one
+//       before it: prevhash[i] == hash[i-1], index[i] == index[i-1] + 1 and
+//       timestamp[i] >= timestamp[i-1]. Checked a chunk at a time, so a bad
+//       link stops the pass early.
+// Args: this - a pointer to the store
+//       lo - first header of the range
+//       hi - one past the last header of the range
+// Retn: 1 if every link holds, 0 otherwise or if hi is past the store
+// -----------------------------------------------------------------------------
+{
+  int (*links)(HeaderStore *, uint64_t, uint64_t);
+  uint64_t i, end;
+
+  if (hi > this->count)
+    return 0;
+
+  links = __builtin_cpu_supports("avx2") ? &headerstore_links_avx2
+                                         : &headerstore_links_portable;
+
+  for (i = lo + 1; i < hi; i = end) {
+    end = hi - i > HEADERSTORE_CHUNK ? i + HEADERSTORE_CHUNK : hi;
+    if (!links(this, i, end))
+      return 0;
+  }
+
+  return 1;
+}
+
+int headerstore_grow(HeaderStore *this)
+// -----------------------------------------------------------------------------
+// Func: Double the capacity of every array
+// Args: this - a pointer to the store
+// Retn: 0 on success, -1 on allocation failure (the store is unchanged)
+// -----------------------------------------------------------------------------
+{
+  uint64_t cap = this->cap ? 2*this->cap : BLOCKCHAIN_PAGE_SZ;
+  void *p;
+
+  // arrays that did grow are just bigger than they need to be on failure
+  if ((p = realloc(this->hashes, cap*HASH_SZ)) == NULL)
+    return -1;
+  this->hashes = p;
+  if ((p = realloc(this->prevhashes, cap*HASH_SZ)) == NULL)
+    return -1;
+  this->prevhashes = p;
+  if ((p = realloc(this->indices, cap*sizeof(uint64_t))) == NULL)
+    return -1;
+  this->indices = p;
+  if ((p = realloc(this->timestamps, cap*sizeof(uint64_t))) == NULL)
+    return -1;
+  this->timestamps = p;
+
+  this->cap = cap;
+  return 0;
+}
+
+int headerstore_links_portable(HeaderStore *this, uint64_t lo, uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: Check the links of headers [lo, hi) to their predecessors
+// Args: this - a pointer to the store
+//       lo - first header checked, at least 1
+//       hi - one past the last header checked
+// Retn: 1 if every link holds, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint64_t i;
+
+  // prevhashes [lo, hi) must equal hashes [lo-1, hi-1), byte for byte
+  if (memcmp(&this->prevhashes[lo*HASH_SZ], &this->hashes[(lo-1)*HASH_SZ],
+             (hi - lo)*HASH_SZ))
+    return 0;
+
+  for (i = lo; i < hi; i++)
+    if (this->indices[i] != this->indices[i-1] + 1 ||
+        this->timestamps[i] < this->timestamps[i-1])
+      return 0;
+
+  return 1;
+}
+
+__attribute__((target("avx2")))
+int headerstore_links_avx2(HeaderStore *this, uint64_t lo, uint64_t hi)
+// -----------------------------------------------------------------------------
+// Func: headerstore_links_portable, four headers per iteration. Mismatches
+//       are accumulated over the whole range and tested once at the end.
+// Args: this - a pointer to the store
+//       lo - first header checked, at least 1
+//       hi - one past the last header checked
+// Retn: 1 if every link holds, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  const uint8_t *prev = this->prevhashes;
+  const uint8_t *hash = this->hashes;
+  const uint64_t *idx = this->indices;
+  const uint64_t *ts = this->timestamps;
+  __m256i one = _mm256_set1_epi64x(1);
+  __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  __m256i same = _mm256_set1_epi8(-1); // hash and index lanes still equal
+  __m256i late = _mm256_setzero_si256(); // timestamp lanes gone backwards
+  __m256i a, b;
+  uint64_t i;
+  int k;
+
+  for (i = lo; i + 4 <= hi; i += 4) {
+    for (k = 0; k < 4; k++) {
+      a = _mm256_loadu_si256((const __m256i *)&prev[(i+k)*HASH_SZ]);
+      b = _mm256_loadu_si256((const __m256i *)&hash[(i+k-1)*HASH_SZ]);
+      same = _mm256_and_si256(same, _mm256_cmpeq_epi8(a, b));
+    }
+
+    a = _mm256_loadu_si256((const __m256i *)&idx[i]);
+    b = _mm256_loadu_si256((const __m256i *)&idx[i-1]);
+    same = _mm256_and_si256(same,
+                            _mm256_cmpeq_epi64(a, _mm256_add_epi64(b, one)));
+
+    // unsigned compare by flipping the sign bits
+    a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&ts[i]), sign);
+    b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&ts[i-1]), sign);
+    late = _mm256_or_si256(late, _mm256_cmpgt_epi64(b, a));
+  }
+
+  if (_mm256_movemask_epi8(same) != -1 || !_mm256_testz_si256(late, late))
+    return 0;
+
+  return i < hi ? headerstore_links_portable(this, i, hi) : 1;
+}
@@ -0,0 +1,232 @@
+/*
+histogram.c: HDR style latency histograms
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "histogram.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define HISTOGRAM_SUB_COUNT  ((uint64_t)1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT ((uint64_t)1 << (HISTOGRAM_SUB_BITS - 1))
+
+// lines printed per halving of the remaining tail, see histogram_print
+#define HISTOGRAM_TICKS      5
+
+// private functions, access through Histogram object
+void histogram_record(Histogram *this, uint64_t value);
+void histogram_merge(Histogram *this, const Histogram *from);
+uint64_t histogram_percentile(const Histogram *this, double p);
+double histogram_mean(const Histogram *this);
+void histogram_print(const Histogram *this, FILE *fp, double scale);
+
+// private functions
+uint64_t histogram_index(uint64_t value);
+uint64_t histogram_highest(uint64_t index);
+
+int histogram_init(Histogram *this, uint64_t max)
+// -----------------------------------------------------------------------------
+// Func: Initialize an empty histogram
+// Args: this - a pointer to the histogram
+//       max - the largest value that needs to be told apart
+// Retn: 0 on success, -1 if out of memory
+// -----------------------------------------------------------------------------
+{
+  this->max = max;
+  this->ncounts = histogram_index(max) + 1;
+  if ((this->counts = calloc(this->ncounts, sizeof(uint64_t))) == NULL)
+    return -1;
+
+  this->total = 0;
+  this->clamped = 0;
+  this->min_seen = UINT64_MAX;
+  this->max_seen = 0;
+  this->sum = 0;
+
+  this->record = &histogram_record;
+  this->merge = &histogram_merge;
+  this->percentile = &histogram_percentile;
+  this->mean = &histogram_mean;
+  this->print = &histogram_print;
+
+  return 0;
+}
+
+void histogram_destroy(Histogram *this)
+// -----------------------------------------------------------------------------
+// Func: Free the histogram's counts
+// Args: this - a pointer to the histogram
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  free(this->counts);
+  this->counts = NULL;
+  this->ncounts = 0;
+}
+
+void histogram_record(Histogram *this, uint64_t value)
+// -----------------------------------------------------------------------------
+// Func: Count one value
+// Args: this - a pointer to the histogram
+//       value - the value, clamped to max
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  if (value > this->max) {
+    value = this->max;
+    this->clamped++;
+  }
+
+  this->counts[histogram_index(value)]++;
+  this->total++;
+  this->sum += value;
+  if (value < this->min_seen)
+    this->min_seen = value;
+  if (value > this->max_seen)
+    this->max_seen = value;
+}
+
+void histogram_merge(Histogram *this, const Histogram *from)
+// -----------------------------------------------------------------------------
+// Func: Add another histogram's counts to this one
+// Args: this - a pointer to the histogram
+//       from - a histogram with the same max
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t i, n = from->ncounts < this->ncounts ? from->ncounts : this->ncounts;
+
+  for (i = 0; i < n; i++)
+    this->counts[i] += from->counts[i];
+
+  this->total += from->total;
+  this->clamped += from->clamped;
+  this->sum += from->sum;
+  if (from->min_seen < this->min_seen)
+    this->min_seen = from->min_seen;
+  if (from->max_seen > this->max_seen)
+    this->max_seen = from->max_seen;
+}
+
+uint64_t histogram_percentile(const Histogram *this, double p)
+// -----------------------------------------------------------------------------
+// Func: The value at a percentile, as the top of its bucket
+// Args: this - a pointer to the histogram
+//       p - the percentile, 0 to 100
+// Retn: the smallest value at or above which p percent of the values lie,
+//       0 if nothing was recorded
+// -----------------------------------------------------------------------------
+{
+  uint64_t i, seen = 0, want;
+
+  if (this->total == 0)
+    return 0;
+
+  want = (uint64_t)ceil(p / 100.0 * (double)this->total);
+  if (want < 1)
+    want = 1;
+  if (want >= this->total)
+    return this->max_seen;
+
+  for (i = 0; i < this->ncounts; i++) {
+    seen += this->counts[i];
+    if (seen >= want)
+      break;
+  }
+
+  i = histogram_highest(i);
+  return i < this->max_seen ? i : this->max_seen;
+}
+
+double histogram_mean(const Histogram *this)
+// -----------------------------------------------------------------------------
+// Func: The mean of the recorded values
+// Args: this - a pointer to the histogram
+// Retn: the mean, 0 if nothing was recorded
+// -----------------------------------------------------------------------------
+{
+  return this->total ? this->sum / (double)this->total : 0;
+}
+
+void histogram_print(const Histogram *this, FILE *fp, double scale)
+// -----------------------------------------------------------------------------
+// Func: Write the percentile distribution in HdrHistogram's text format, so
+//       the usual plotting tools read it. Percentiles get denser towards the
+//       tail: HISTOGRAM_TICKS lines each time the remaining fraction halves.
+// Args: this - a pointer to the histogram
+//       fp - where to write
+//       scale - values are divided by this (1000 to print ns as us)
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  double p, left;
+  uint64_t v;
+  int k;
+
+  fprintf(fp, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+          "1/(1-Percentile)");
+
+  for (k = 0;; k++) {
+    left = pow(0.5, (double)k / HISTOGRAM_TICKS);
+    p = 100.0 * (1.0 - left);
+    if (left * (double)this->total < 1.0)
+      break;
+    v = this->percentile(this, p);
+    fprintf(fp, "%12.3f %14.12f %10lu %14.2f\n", (double)v / scale, p / 100.0,
+            (unsigned long)ceil(p / 100.0 * (double)this->total), 1.0 / left);
+  }
+  fprintf(fp, "%12.3f %14.12f %10lu\n", (double)this->max_seen / scale, 1.0,
+          (unsigned long)this->total);
+
+  fprintf(fp, "#[Mean    = %12.3f, Max         = %12.3f]\n",
+          this->mean(this) / scale, (double)this->max_seen / scale);
+  fprintf(fp, "#[Total count    = %12lu, Clamped     = %12lu]\n",
+          (unsigned long)this->total, (unsigned long)this->clamped);
+}
+
+uint64_t histogram_index(uint64_t value)
+// -----------------------------------------------------------------------------
+// Func: Bucket of a value. Values below HISTOGRAM_SUB_COUNT each get their
+//       own; above that, each power of two is split in HISTOGRAM_HALF_COUNT.
+// Args: value - the value
+// Retn: its index in counts
+// -----------------------------------------------------------------------------
+{
+  int b = 63 - __builtin_clzll(value | (HISTOGRAM_SUB_COUNT - 1)) -
+          (HISTOGRAM_SUB_BITS - 1);
+
+  return (uint64_t)b*HISTOGRAM_HALF_COUNT + (value >> b);
+}
+
+uint64_t histogram_highest(uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Largest value that lands in a bucket
+// Args: index - the bucket
+// Retn: the value
+// -----------------------------------------------------------------------------
+{
+  uint64_t b, sub;
+
+  b = index < HISTOGRAM_SUB_COUNT ? 0
+      : (index >> (HISTOGRAM_SUB_BITS - 1)) - 1;
+  sub = index - b*HISTOGRAM_HALF_COUNT;
+
+  return (sub << b) + ((uint64_t)1 << b) - 1;
+}
@@ -0,0 +1,369 @@
+/*
+ingest.c: lock-free submission of records to a sequencer thread
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ingest.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <immintrin.h>
+
+// private functions, access through IngestQueue object
+int ingest_submit(IngestQueue *this, uint8_t *record, uint64_t record_sz,
+                  IngestFuture *future);
+int ingest_wait(IngestQueue *this, IngestFuture *future);
+
+// private functions
+void *ingest_run(void *arg);
+uint64_t ingest_append(IngestQueue *this, uint64_t head, uint64_t n);
+int ingest_idle(IngestQueue *this, uint64_t head);
+void ingest_room(IngestQueue *this, IngestSlot *slot, uint64_t ticket);
+void ingest_wake(uint32_t *word, int n);
+
+int ingest_init(IngestQueue *this, Blockchain *chain, uint64_t ring_sz,
+                uint64_t batch)
+// -----------------------------------------------------------------------------
+// Func: Start the sequencer thread. From now on only it appends to the chain.
+// Args: this - a pointer to the new queue
+//       chain - the chain, must outlive the queue
+//       ring_sz - records that may wait at once, rounded up to a power of two;
+//                 producers block while the ring is full
+//       batch - most records appended at once, 0 for the ring size
+// Retn: 0 on success, -1 on failure
+// -----------------------------------------------------------------------------
+{
+  uint64_t size, i;
+
+  for (size = 2; size < ring_sz; size *= 2)
+    ;
+
+  this->chain = chain;
+  this->mask = size - 1;
+  this->batch = batch && batch < size ? batch : size;
+  this->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? INGEST_SPIN : 0;
+  this->stop = 0;
+  this->tail = 0;
+  this->posted = 0;
+  this->idle = 0;
+  this->head = 0;
+  this->freed = 0;
+  this->blocked = 0;
+
+  this->submit = &ingest_submit;
+  this->wait = &ingest_wait;
+
+  this->ring = aligned_alloc(INGEST_LINE, size*sizeof(IngestSlot));
+  this->records = malloc(this->batch*sizeof(uint8_t *));
+  this->record_sz = malloc(this->batch*sizeof(uint64_t));
+  this->where = malloc(this->batch*sizeof(uint64_t));
+  if (this->ring == NULL || this->records == NULL ||
+      this->record_sz == NULL || this->where == NULL) {
+    free(this->ring);
+    free(this->records);
+    free(this->record_sz);
+    free(this->where);
+    return -1;
+  }
+  for (i = 0; i < size; i++)
+    this->ring[i].seq = i;
+
+  if (pthread_create(&this->thread, NULL, &ingest_run, this)) {
+    free(this->ring);
+    free(this->records);
+    free(this->record_sz);
+    free(this->where);
+    return -1;
+  }
+
+  return 0;
+}
+
+void ingest_destroy(IngestQueue *this)
+// -----------------------------------------------------------------------------
+// Func: Append everything already submitted, then stop the sequencer. No
+//       submit may start once this is called.
+// Args: this - a pointer to the queue
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  __atomic_store_n(&this->stop, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&this->posted, 1, __ATOMIC_SEQ_CST);
+  ingest_wake(&this->posted, 1);
+  pthread_join(this->thread, NULL);
+
+  free(this->ring);
+  free(this->records);
+  free(this->record_sz);
+  free(this->where);
+  this->ring = NULL;
+  this->submit = NULL;
+  this->wait = NULL;
+}
+
+int ingest_submit(IngestQueue *this, uint8_t *record, uint64_t record_sz,
+                  IngestFuture *future)
+// -----------------------------------------------------------------------------
+// Func: Queue a record to be appended. Never takes a lock; waits only while
+//       the ring is full.
+// Args: this - a pointer to the queue
+//       record - the record, left untouched and in place until the future
+//                completes
+//       record_sz - its size
+//       future - completed once the record is appended or rejected
+// Retn: 0 once queued, -1 if the queue is stopping
+// -----------------------------------------------------------------------------
+{
+  IngestSlot *slot;
+  uint64_t ticket;
+
+  if (__atomic_load_n(&this->stop, __ATOMIC_RELAXED))
+    return -1;
+
+  ticket = __atomic_fetch_add(&this->tail, 1, __ATOMIC_RELAXED);
+  slot = &this->ring[ticket & this->mask];
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ticket)
+    ingest_room(this, slot, ticket); // a lap behind, the ring is full
+
+  future->state = INGEST_PENDING;
+  slot->record = record;
+  slot->record_sz = record_sz;
+  slot->future = future;
+
+  // publish, then look for a sleeping sequencer; it sets idle before its
+  // last look at the ring, so one of the two sees the other
+  __atomic_store_n(&slot->seq, ticket + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&this->idle, __ATOMIC_SEQ_CST)) {
+    __atomic_add_fetch(&this->posted, 1, __ATOMIC_SEQ_CST);
+    ingest_wake(&this->posted, 1);
+  }
+
+  return 0;
+}
+
+int ingest_wait(IngestQueue *this, IngestFuture *future)
+// -----------------------------------------------------------------------------
+// Func: Block until a future completes: poll it for a while (on more than
+//       one cpu), then sleep on its state
+// Args: this - a pointer to the queue
+//       future - a submitted future
+// Retn: 0 if the record was appended, -1 if it was rejected
+// -----------------------------------------------------------------------------
+{
+  uint32_t state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+  int i;
+
+  for (i = 0; i < this->spin && state < INGEST_DONE; i++) {
+    _mm_pause();
+    state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+  }
+
+  while (state < INGEST_DONE) {
+    // tell the sequencer to wake us, unless it finished in the meantime
+    if (state == INGEST_PENDING &&
+        !__atomic_compare_exchange_n(&future->state, &state, INGEST_SLEEPING,
+                                     0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+      continue;
+    syscall(SYS_futex, &future->state, FUTEX_WAIT_PRIVATE, INGEST_SLEEPING,
+            NULL, NULL, 0);
+    state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+  }
+
+  return state == INGEST_DONE ? 0 : -1;
+}
+
+void *ingest_run(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Sequencer thread: append runs of published records until stopped
+// Args: arg - the IngestQueue
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  IngestQueue *this = (IngestQueue *)arg;
+  IngestSlot *slot;
+  uint64_t head = 0, n;
+
+  for (;;) {
+    for (n = 0; n < this->batch; n++) {
+      slot = &this->ring[(head + n) & this->mask];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + n + 1)
+        break;
+      this->records[n] = slot->record;
+      this->record_sz[n] = slot->record_sz;
+    }
+
+    if (n == 0) {
+      if (ingest_idle(this, head))
+        break;
+      continue;
+    }
+
+    head += ingest_append(this, head, n);
+    __atomic_store_n(&this->head, head, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+uint64_t ingest_append(IngestQueue *this, uint64_t head, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append the n records gathered at the head, complete their futures
+//       and hand their slots back to producers. The batch goes in with one
+//       signature check; if that fails the records are appended one at a
+//       time, so only the bad ones are rejected.
+// Args: this - a pointer to the queue
+//       head - the ticket of the first record
+//       n - records gathered
+// Retn: n
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain = this->chain;
+  IngestSlot *slot;
+  IngestFuture *future;
+  uint64_t i, start = chain->length;
+  uint32_t state;
+
+  if (blockchain_append_batch(chain, this->records, this->record_sz, n) == 0) {
+    for (i = 0; i < n; i++)
+      this->where[i] = start + i;
+  } else {
+    for (i = 0; i < n; i++) { // nothing went in, or the chain filled up
+      if (start + i < chain->length)
+        this->where[i] = start + i;
+      else if (chain->insert_front(chain, this->records[i],
+                                   this->record_sz[i]) == 0)
+        this->where[i] = chain->length - 1;
+      else
+        this->where[i] = UINT64_MAX;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    slot = &this->ring[(head + i) & this->mask];
+    future = slot->future;
+    state = INGEST_FAILED;
+    if (this->where[i] != UINT64_MAX) {
+      future->index = this->where[i];
+      memcpy(future->hash,
+             &blockchain_get_header(chain, this->where[i])[CURRHASH_POS],
+             HASH_SZ);
+      state = INGEST_DONE;
+    }
+    if (__atomic_exchange_n(&future->state, state, __ATOMIC_RELEASE) ==
+        INGEST_SLEEPING)
+      ingest_wake(&future->state, INT_MAX);
+
+    // free for the ticket one lap on
+    __atomic_store_n(&slot->seq, head + i + this->mask + 1, __ATOMIC_SEQ_CST);
+  }
+
+  if (__atomic_load_n(&this->blocked, __ATOMIC_SEQ_CST) > 0) {
+    __atomic_add_fetch(&this->freed, 1, __ATOMIC_SEQ_CST);
+    ingest_wake(&this->freed, INT_MAX);
+  }
+
+  return n;
+}
+
+int ingest_idle(IngestQueue *this, uint64_t head)
+// -----------------------------------------------------------------------------
+// Func: Wait for the slot at the head to be published: poll it for a while,
+//       then sleep on posted until a producer wakes us
+// Args: this - a pointer to the queue
+//       head - the sequencer's next ticket
+// Retn: 1 if the queue is stopping and every ticket has been appended, else 0
+// -----------------------------------------------------------------------------
+{
+  IngestSlot *slot = &this->ring[head & this->mask];
+  uint32_t posted;
+  int i;
+
+  for (i = 0; i < this->spin; i++) {
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == head + 1)
+      return 0;
+    _mm_pause();
+  }
+
+  posted = __atomic_load_n(&this->posted, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&this->idle, 1, __ATOMIC_SEQ_CST);
+
+  // a ticket taken but not yet published will be, so wait for it too
+  if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != head + 1) {
+    if (__atomic_load_n(&this->stop, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&this->tail, __ATOMIC_SEQ_CST) == head) {
+      __atomic_store_n(&this->idle, 0, __ATOMIC_RELAXED);
+      return 1;
+    }
+    // returns at once if posted moved since it was read
+    syscall(SYS_futex, &this->posted, FUTEX_WAIT_PRIVATE, posted,
+            NULL, NULL, 0);
+  }
+
+  __atomic_store_n(&this->idle, 0, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+void ingest_room(IngestQueue *this, IngestSlot *slot, uint64_t ticket)
+// -----------------------------------------------------------------------------
+// Func: Wait until the sequencer frees a slot for a ticket: poll it for a
+//       while, then sleep on freed
+// Args: this - a pointer to the queue
+//       slot - the ticket's slot
+//       ticket - the ticket
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint32_t freed;
+  int i;
+
+  for (i = 0; i < this->spin; i++) {
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == ticket)
+      return;
+    _mm_pause();
+  }
+
+  for (;;) {
+    // announce the wait before the last look, the sequencer checks blocked
+    // after freeing slots
+    freed = __atomic_load_n(&this->freed, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&this->blocked, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == ticket) {
+      __atomic_sub_fetch(&this->blocked, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+    syscall(SYS_futex, &this->freed, FUTEX_WAIT_PRIVATE, freed, NULL, NULL, 0);
+    __atomic_sub_fetch(&this->blocked, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == ticket)
+      return;
+  }
+}
+
+void ingest_wake(uint32_t *word, int n)
+// -----------------------------------------------------------------------------
+// Func: Wake threads sleeping on a futex word
+// Args: word - the futex word
+//       n - most threads to wake
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
@@ -0,0 +1,774 @@
+/*
+keyindex.c: method definitions for the record key index
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "keyindex.h"
+#include "blockchain.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define KEYINDEX_HEADER_SZ (4*WORD_SZ + HASH_SZ)
+
+// forward declaration
+typedef struct KeyIndexInsert KeyIndexInsert;
+
+struct KeyIndexInsert
+// -----------------------------------------------------------------------------
+// Description
+//  A new key on its way into the tree, with everything the insert needs
+//  allocated beforehand
+// -----------------------------------------------------------------------------
+{
+  uint64_t key_sz;
+  uint64_t index;
+  uint8_t *copy;        // the key, owned by the tree once inserted
+  uint64_t *indices;    // its postings, room for one block
+  uint8_t *sep;         // the full leaf's middle key, NULL if it won't split
+};
+
+// private functions, access through KeyIndex object
+int keyindex_latest(KeyIndex *this, const uint8_t *key, uint64_t key_sz,
+                    uint64_t *index);
+const uint64_t *keyindex_lookup(KeyIndex *this, const uint8_t *key,
+                                uint64_t key_sz, uint64_t *n);
+uint64_t keyindex_prefix_scan(KeyIndex *this, const uint8_t *prefix,
+                              uint64_t prefix_sz, KeyIndexScanFunc fn,
+                              void *ctx);
+int keyindex_save(KeyIndex *this, const char *pathname);
+
+void keyindex_setup(KeyIndex *this, Blockchain *chain, RecordKeyFunc key,
+                    void *key_ctx);
+int keyindex_catch_up(KeyIndex *this);
+void keyindex_hook(void *ctx, Blockchain *chain, uint8_t *blockframe);
+int keyindex_add_block(KeyIndex *this, uint64_t index, uint8_t *blockframe);
+int keyindex_insert(KeyIndex *this, const uint8_t *key, uint64_t key_sz,
+                    uint64_t index);
+KeyIndexNode *keyindex_insert_node(KeyIndex *this, KeyIndexNode *node,
+                                   KeyIndexInsert *ins, uint8_t **sep,
+                                   uint64_t *sep_sz);
+int keyindex_reserve(KeyIndex *this, int n);
+KeyIndexNode *keyindex_take(KeyIndex *this, int leaf);
+KeyIndexNode *keyindex_node_new(int leaf);
+void keyindex_node_free(KeyIndexNode *node);
+KeyIndexNode *keyindex_leaf(KeyIndex *this, const uint8_t *key,
+                            uint64_t key_sz);
+int keyindex_cmp(const uint8_t *a, uint64_t a_sz,
+                 const uint8_t *b, uint64_t b_sz);
+int keyindex_lower_bound(KeyIndexNode *node, const uint8_t *key,
+                         uint64_t key_sz);
+int keyindex_upper_bound(KeyIndexNode *node, const uint8_t *key,
+                         uint64_t key_sz);
+int keyindex_postings_add(KeyIndexPostings *postings, uint64_t index);
+
+int keyindex_init(KeyIndex *this, Blockchain *chain, RecordKeyFunc key,
+                  void *key_ctx)
+// -----------------------------------------------------------------------------
+// Func: Index every block already in the chain, then hook the chain so new
+//       blocks are indexed as they are appended
+// Args: this - a pointer to this keyindex object
+//       chain - the chain to index
+//       key - extracts the key of a record
+//       key_ctx - passed through to key
+// Retn: 0 on success, -1 on allocation failure or if the chain has no room
+//       for another hook
+// -----------------------------------------------------------------------------
+{
+  keyindex_setup(this, chain, key, key_ctx);
+
+  if (this->root == NULL || keyindex_catch_up(this) ||
+      blockchain_add_hook(chain, &keyindex_hook, this)) {
+    keyindex_destroy(this);
+    return -1;
+  }
+
+  return 0;
+}
+
+int keyindex_load(KeyIndex *this, Blockchain *chain, RecordKeyFunc key,
+                  void *key_ctx, const char *pathname)
+// -----------------------------------------------------------------------------
+// Func: Load an index written by save. It must have been built from this
+//       chain: the hash of the last block it covers has to match. Blocks
+//       appended since it was saved are indexed before hooking the chain.
+// Args: this - a pointer to this keyindex object
+//       chain - the chain the index was saved from
+//       key - extracts the key of a record, must be the one used to save
+//       key_ctx - passed through to key
+//       pathname - the saved index
+// Retn: 0 on success, -1 if the file is unreadable, malformed or belongs to
+//       another chain (keyindex_init will rebuild it from scratch)
+// -----------------------------------------------------------------------------
+{
+  FILE *fp;
+  uint8_t header[KEYINDEX_HEADER_SZ];
+  uint8_t *key_buf = NULL;
+  uint8_t *tip;
+  uint64_t version, covered, nkeys, k, i, key_sz, n, index;
+  int err = 0;
+
+  if ((fp = fopen(pathname, "rb")) == NULL)
+    return -1;
+
+  keyindex_setup(this, chain, key, key_ctx);
+
+  if (this->root == NULL || fread(header, KEYINDEX_HEADER_SZ, 1, fp) != 1) {
+    fclose(fp);
+    keyindex_destroy(this);
+    return -1;
+  }
+  memcpy(&version, &header[WORD_SZ], WORD_SZ);
+  memcpy(&covered, &header[2*WORD_SZ], WORD_SZ);
+  memcpy(&nkeys, &header[3*WORD_SZ + HASH_SZ], WORD_SZ);
+
+  tip = blockchain_get_header(chain, covered-1); // NULL if covered is 0
+  if (memcmp(header, KEYINDEX_MAGIC, WORD_SZ) || version != KEYINDEX_VERSION ||
+      covered > chain->length || tip == NULL ||
+      memcmp(&tip[CURRHASH_POS], &header[3*WORD_SZ], HASH_SZ)) {
+    fclose(fp);
+    keyindex_destroy(this);
+    return -1;
+  }
+
+  for (k = 0; !err && k < nkeys; k++) {
+    err |= fread(&key_sz, WORD_SZ, 1, fp) != 1;
+    err |= err || (key_buf = realloc(key_buf, key_sz + 1)) == NULL;
+    err |= err || (key_sz && fread(key_buf, key_sz, 1, fp) != 1);
+    err |= err || fread(&n, WORD_SZ, 1, fp) != 1;
+    for (i = 0; !err && i < n; i++) {
+      err |= fread(&index, WORD_SZ, 1, fp) != 1 || index >= covered;
+      err |= err || keyindex_insert(this, key_buf, key_sz, index);
+    }
+  }
+  free(key_buf);
+  fclose(fp);
+
+  this->covered = covered;
+  if (err || keyindex_catch_up(this) ||
+      blockchain_add_hook(chain, &keyindex_hook, this)) {
+    keyindex_destroy(this);
+    return -1;
+  }
+
+  return 0;
+}
+
+void keyindex_destroy(KeyIndex *this)
+// -----------------------------------------------------------------------------
+// Func: Unhook from the chain and free the tree
+// Args: this - a pointer to this keyindex object
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  blockchain_remove_hook(this->chain, &keyindex_hook, this);
+  keyindex_node_free(this->root);
+  while (this->nspare > 0)
+    free(this->spare[--this->nspare]); // empty, nothing below them
+  this->root = NULL;
+  this->nkeys = 0;
+  this->covered = 0;
+
+  this->latest = NULL;
+  this->lookup = NULL;
+  this->prefix_scan = NULL;
+  this->save = NULL;
+}
+
+int keyindex_save(KeyIndex *this, const char *pathname)
+// -----------------------------------------------------------------------------
+// Func: Write the index out, keys in order, tagged with the hash of the last
+//       block it covers so that load can tell whether it still fits the chain.
+//       It is written next to pathname and renamed over it once complete, so
+//       a crash never leaves a torn index behind.
+// Args: this - a pointer to this keyindex object
+//       pathname - the file to create, conventionally next to the chain's
+//                  snapshot
+// Retn: 0 on success, -1 on any I/O error or if the index covers no block
+//       yet, as there is no hash to tag it with (pathname is then untouched)
+// -----------------------------------------------------------------------------
+{
+  FILE *fp;
+  KeyIndexNode *leaf;
+  char *tmp_path;
+  uint8_t *tip;
+  uint64_t version = KEYINDEX_VERSION;
+  int i, err = 0;
+
+  if (this->covered == 0 ||
+      (tip = blockchain_get_header(this->chain, this->covered-1)) == NULL)
+    return -1;
+  if ((tmp_path = malloc(strlen(pathname) + 5)) == NULL)
+    return -1;
+  sprintf(tmp_path, "%s.tmp", pathname);
+  if ((fp = fopen(tmp_path, "wb")) == NULL) {
+    free(tmp_path);
+    return -1;
+  }
+
+  err |= fwrite(KEYINDEX_MAGIC, WORD_SZ, 1, fp) != 1;
+  err |= fwrite(&version, WORD_SZ, 1, fp) != 1;
+  err |= fwrite(&this->covered, WORD_SZ, 1, fp) != 1;
+  err |= fwrite(&tip[CURRHASH_POS], HASH_SZ, 1, fp) != 1;
+  err |= fwrite(&this->nkeys, WORD_SZ, 1, fp) != 1;
+
+  for (leaf = keyindex_leaf(this, NULL, 0); !err && leaf; leaf = leaf->next) {
+    for (i = 0; !err && i < leaf->n; i++) {
+      err |= fwrite(&leaf->key_sz[i], WORD_SZ, 1, fp) != 1;
+      err |= leaf->key_sz[i] && fwrite(leaf->keys[i], leaf->key_sz[i], 1, fp) != 1;
+      err |= fwrite(&leaf->postings[i].n, WORD_SZ, 1, fp) != 1;
+      err |= fwrite(leaf->postings[i].indices, WORD_SZ,
+                    leaf->postings[i].n, fp) != leaf->postings[i].n;
+    }
+  }
+
+  err |= fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+  err |= fclose(fp) != 0;
+  err |= err || rename(tmp_path, pathname) != 0;
+  if (err)
+    remove(tmp_path);
+  free(tmp_path);
+
+  return err ? -1 : 0;
+}
+
+const uint64_t *keyindex_lookup(KeyIndex *this, const uint8_t *key,
+                                uint64_t key_sz, uint64_t *n)
+// -----------------------------------------------------------------------------
+// Func: Every block carrying a key
+// Args: this - a pointer to this keyindex object
+//       key - the key to look up
+//       key_sz - size of the key
+//       n - set to the number of blocks, 0 if the key is unknown
+// Retn: the block indices in ascending order, owned by the index and only
+//       valid until the next append. NULL if the key is unknown.
+// -----------------------------------------------------------------------------
+{
+  KeyIndexNode *leaf = keyindex_leaf(this, key, key_sz);
+  int i = keyindex_lower_bound(leaf, key, key_sz);
+
+  if (i == leaf->n ||
+      keyindex_cmp(leaf->keys[i], leaf->key_sz[i], key, key_sz)) {
+    *n = 0;
+    return NULL;
+  }
+
+  *n = leaf->postings[i].n;
+  return leaf->postings[i].indices;
+}
+
+int keyindex_latest(KeyIndex *this, const uint8_t *key, uint64_t key_sz,
+                    uint64_t *index)
+// -----------------------------------------------------------------------------
+// Func: The most recent block carrying a key
+// Args: this - a pointer to this keyindex object
+//       key - the key to look up
+//       key_sz - size of the key
+//       index - set to the block index
+// Retn: 0 if found, -1 if the key is unknown
+// -----------------------------------------------------------------------------
+{
+  uint64_t n;
+  const uint64_t *indices = keyindex_lookup(this, key, key_sz, &n);
+
+  if (indices == NULL)
+    return -1;
+
+  *index = indices[n-1];
+  return 0;
+}
+
+uint64_t keyindex_prefix_scan(KeyIndex *this, const uint8_t *prefix,
+                              uint64_t prefix_sz, KeyIndexScanFunc fn,
+                              void *ctx)
+// -----------------------------------------------------------------------------
+// Func: Visit every key starting with prefix, in key order
+// Args: this - a pointer to this keyindex object
+//       prefix - the prefix, prefix_sz 0 visits every key
+//       prefix_sz - size of the prefix
+//       fn - called with each key and its blocks
+//       ctx - passed through to fn
+// Retn: the number of keys visited
+// -----------------------------------------------------------------------------
+{
+  KeyIndexNode *leaf = keyindex_leaf(this, prefix, prefix_sz);
+  int i = keyindex_lower_bound(leaf, prefix, prefix_sz);
+  uint64_t visited = 0;
+
+  for (; leaf != NULL; leaf = leaf->next, i = 0) {
+    for (; i < leaf->n; i++) {
+      if (leaf->key_sz[i] < prefix_sz ||
+          memcmp(leaf->keys[i], prefix, prefix_sz))
+        return visited; // sorted, so nothing further can match
+
+      fn(ctx, leaf->keys[i], leaf->key_sz[i],
+         leaf->postings[i].indices, leaf->postings[i].n);
+      visited++;
+    }
+  }
+
+  return visited;
+}
+
+void keyindex_setup(KeyIndex *this, Blockchain *chain, RecordKeyFunc key,
+                    void *key_ctx)
+// -----------------------------------------------------------------------------
+// Func: Shared part of init and load, an empty tree over no blocks
+// Args: see keyindex_init
+// Retn: None, this->root is NULL on allocation failure
+// -----------------------------------------------------------------------------
+{
+  this->chain = chain;
+  this->key = key;
+  this->key_ctx = key_ctx;
+  this->root = keyindex_node_new(1);
+  this->nkeys = 0;
+  this->covered = 0;
+  this->nspare = 0;
+
+  this->latest = &keyindex_latest;
+  this->lookup = &keyindex_lookup;
+  this->prefix_scan = &keyindex_prefix_scan;
+  this->save = &keyindex_save;
+}
+
+int keyindex_catch_up(KeyIndex *this)
+// -----------------------------------------------------------------------------
+// Func: Index the chain's blocks from this->covered up to its front
+// Args: this - a pointer to this keyindex object
+// Retn: 0 on success, -1 on allocation failure (covered then stops at the
+//       block that could not be indexed)
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain = this->chain;
+  uint8_t *frame, *tmp;
+  uint8_t *buf = NULL;
+  uint64_t i;
+
+  for (i = this->covered; i < chain->length; i++) {
+    if ((frame = (uint8_t *)chain->get(chain, i)) == NULL) {
+      tmp = realloc(buf, blockframe_size(blockchain_get_header(chain, i)));
+      if (tmp == NULL)
+        break;
+      buf = tmp;
+      if (blockchain_read_frame(chain, i, buf))
+        continue; // record dropped by pruning, nothing to index
+      frame = buf;
+    }
+    if (keyindex_add_block(this, i, frame))
+      break;
+  }
+  free(buf);
+  this->covered = i;
+
+  return i < chain->length ? -1 : 0;
+}
+
+void keyindex_hook(void *ctx, Blockchain *chain, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Chain hook, indexes a newly appended block. Hooks can't fail, so a
+//       block that can't be indexed is left past covered, where the next
+//       append or keyindex_sync picks it up again.
+// Args: ctx - this keyindex object
+//       chain - the chain that was appended to
+//       blockframe - the new block
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  KeyIndex *this = (KeyIndex *)ctx;
+
+  if (this->covered == chain->length-1) {
+    if (keyindex_add_block(this, this->covered, blockframe) == 0)
+      this->covered++;
+  }
+  else {
+    keyindex_catch_up(this); // behind after a failure, redo from there
+  }
+}
+
+int keyindex_sync(KeyIndex *this)
+// -----------------------------------------------------------------------------
+// Func: Index the blocks an earlier failure left out, if any. Callers that
+//       need every block indexed check this after appending.
+// Args: this - a pointer to this keyindex object
+// Retn: 0 if the index covers the whole chain, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  return keyindex_catch_up(this);
+}
+
+int keyindex_add_block(KeyIndex *this, uint64_t index, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Extract a block's key and record the block under it
+// Args: this - a pointer to this keyindex object
+//       index - the block's index in the chain
+//       blockframe - the framed block
+// Retn: 0 on success (or if the record has no key), -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  const uint8_t *key;
+  uint64_t key_sz;
+
+  if (this->key(this->key_ctx, &blockframe[RECORD_POS],
+                blockframe_size(blockframe) - BLOCK_HEADER_SZ, &key, &key_sz))
+    return 0;
+
+  return keyindex_insert(this, key, key_sz, index);
+}
+
+int keyindex_insert(KeyIndex *this, const uint8_t *key, uint64_t key_sz,
+                    uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Add a block to a key's postings, growing the tree at the root when
+//       the root splits. A new key may split its leaf and every level above,
+//       so the key, its postings, the leaf's separator and a node per level
+//       are allocated first; once the tree is touched nothing can fail.
+// Args: this - a pointer to this keyindex object
+//       key, key_sz - the key
+//       index - the block index
+// Retn: 0 on success, -1 on allocation failure (the tree is unchanged)
+// -----------------------------------------------------------------------------
+{
+  KeyIndexInsert ins;
+  KeyIndexNode *node, *right, *root;
+  uint8_t *sep = NULL;
+  uint64_t sep_sz;
+  int pos, depth = 1, mid = KEYINDEX_ORDER/2;
+
+  for (node = this->root; !node->leaf; depth++)
+    node = node->children[keyindex_upper_bound(node, key, key_sz)];
+  pos = keyindex_lower_bound(node, key, key_sz);
+  if (pos < node->n && !keyindex_cmp(node->keys[pos], node->key_sz[pos],
+                                     key, key_sz))
+    return keyindex_postings_add(&node->postings[pos], index);
+
+  ins.key_sz = key_sz;
+  ins.index = index;
+  ins.copy = malloc(key_sz + 1);
+  ins.indices = malloc(sizeof(uint64_t));
+  ins.sep = NULL;
+  if (node->n == KEYINDEX_ORDER)
+    ins.sep = malloc(node->key_sz[mid] + 1);
+  if (ins.copy == NULL || ins.indices == NULL ||
+      (node->n == KEYINDEX_ORDER && ins.sep == NULL) ||
+      keyindex_reserve(this, depth + 1)) {
+    free(ins.copy);
+    free(ins.indices);
+    free(ins.sep);
+    return -1;
+  }
+  memcpy(ins.copy, key, key_sz);
+  if (ins.sep != NULL)
+    memcpy(ins.sep, node->keys[mid], node->key_sz[mid]);
+
+  right = keyindex_insert_node(this, this->root, &ins, &sep, &sep_sz);
+  this->nkeys++;
+
+  if (right != NULL) {
+    root = keyindex_take(this, 0);
+    root->n = 1;
+    root->keys[0] = sep;
+    root->key_sz[0] = sep_sz;
+    root->children[0] = this->root;
+    root->children[1] = right;
+    this->root = root;
+  }
+
+  return 0;
+}
+
+KeyIndexNode *keyindex_insert_node(KeyIndex *this, KeyIndexNode *node,
+                                   KeyIndexInsert *ins, uint8_t **sep,
+                                   uint64_t *sep_sz)
+// -----------------------------------------------------------------------------
+// Func: Insert a new key below node. A full node is split before inserting
+//       into it, taking its sibling from the spares.
+// Args: this - a pointer to this keyindex object
+//       node - the subtree
+//       ins - the key and what keyindex_insert allocated for it
+//       sep, sep_sz - set to the new sibling's separator key when node splits
+// Retn: the new right sibling if node split, otherwise NULL
+// -----------------------------------------------------------------------------
+{
+  KeyIndexNode *right = NULL, *target, *child_right;
+  uint8_t *child_sep;
+  uint64_t child_sep_sz;
+  int i, pos, mid = KEYINDEX_ORDER/2;
+
+  if (node->leaf) {
+    pos = keyindex_lower_bound(node, ins->copy, ins->key_sz);
+
+    target = node;
+    if (node->n == KEYINDEX_ORDER) { // split, upper half moves right
+      right = keyindex_take(this, 1);
+      right->n = node->n - mid;
+      memcpy(right->keys, &node->keys[mid], right->n*sizeof(uint8_t *));
+      memcpy(right->key_sz, &node->key_sz[mid], right->n*sizeof(uint64_t));
+      memcpy(right->postings, &node->postings[mid],
+             right->n*sizeof(KeyIndexPostings));
+      node->n = mid;
+      right->next = node->next;
+      node->next = right;
+
+      *sep = ins->sep; // a copy of right->keys[0]
+      *sep_sz = right->key_sz[0];
+
+      if (pos > mid) { // keys between the halves stay left
+        target = right;
+        pos -= mid;
+      }
+    }
+
+    for (i = target->n; i > pos; i--) {
+      target->keys[i] = target->keys[i-1];
+      target->key_sz[i] = target->key_sz[i-1];
+      target->postings[i] = target->postings[i-1];
+    }
+    target->keys[pos] = ins->copy;
+    target->key_sz[pos] = ins->key_sz;
+    target->postings[pos].indices = ins->indices;
+    target->postings[pos].indices[0] = ins->index;
+    target->postings[pos].n = 1;
+    target->postings[pos].cap = 1;
+    target->n++;
+
+    return right;
+  }
+
+  pos = keyindex_upper_bound(node, ins->copy, ins->key_sz);
+  child_right = keyindex_insert_node(this, node->children[pos], ins,
+                                     &child_sep, &child_sep_sz);
+  if (child_right == NULL)
+    return NULL;
+
+  target = node;
+  if (node->n == KEYINDEX_ORDER) { // split, the middle key moves up
+    right = keyindex_take(this, 0);
+    right->n = node->n - mid - 1;
+    memcpy(right->keys, &node->keys[mid+1], right->n*sizeof(uint8_t *));
+    memcpy(right->key_sz, &node->key_sz[mid+1], right->n*sizeof(uint64_t));
+    memcpy(right->children, &node->children[mid+1],
+           (right->n+1)*sizeof(KeyIndexNode *));
+    *sep = node->keys[mid];
+    *sep_sz = node->key_sz[mid];
+    node->n = mid;
+
+    if (pos > mid) {
+      target = right;
+      pos -= mid + 1;
+    }
+  }
+
+  for (i = target->n; i > pos; i--) {
+    target->keys[i] = target->keys[i-1];
+    target->key_sz[i] = target->key_sz[i-1];
+    target->children[i+1] = target->children[i];
+  }
+  target->keys[pos] = child_sep;
+  target->key_sz[pos] = child_sep_sz;
+  target->children[pos+1] = child_right;
+  target->n++;
+
+  return right;
+}
+
+int keyindex_reserve(KeyIndex *this, int n)
+// -----------------------------------------------------------------------------
+// Func: Make sure n spare nodes are set aside. Splits are rare, so this
+//       usually has nothing to do.
+// Args: this - a pointer to this keyindex object
+//       n - nodes wanted
+// Retn: 0 on success, -1 on allocation failure or if n is too deep
+// -----------------------------------------------------------------------------
+{
+  KeyIndexNode *node;
+
+  if (n > KEYINDEX_MAX_DEPTH+1)
+    return -1;
+
+  while (this->nspare < n) {
+    if ((node = keyindex_node_new(0)) == NULL)
+      return -1;
+    this->spare[this->nspare++] = node;
+  }
+
+  return 0;
+}
+
+KeyIndexNode *keyindex_take(KeyIndex *this, int leaf)
+// -----------------------------------------------------------------------------
+// Func: Take an empty node from the spares set aside by keyindex_reserve
+// Args: this - a pointer to this keyindex object
+//       leaf - 1 for a leaf, 0 for an internal node
+// Retn: the node
+// -----------------------------------------------------------------------------
+{
+  KeyIndexNode *node = this->spare[--this->nspare];
+
+  node->leaf = leaf;
+  node->n = 0;
+  node->next = NULL;
+
+  return node;
+}
+
+KeyIndexNode *keyindex_node_new(int leaf)
+// -----------------------------------------------------------------------------
+// Func: Allocate an empty node
+// Args: leaf - 1 for a leaf, 0 for an internal node
+// Retn: the node, NULL on allocation failure
+// -----------------------------------------------------------------------------
+{
+  KeyIndexNode *node = malloc(sizeof(KeyIndexNode));
+
+  if (node != NULL) {
+    node->leaf = leaf;
+    node->n = 0;
+    node->next = NULL;
+  }
+
+  return node;
+}
+
+void keyindex_node_free(KeyIndexNode *node)
+// -----------------------------------------------------------------------------
+// Func: Free a subtree, its keys and postings
+// Args: node - the subtree, may be NULL
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  int i;
+
+  if (node == NULL)
+    return;
+
+  for (i = 0; i < node->n; i++) {
+    free(node->keys[i]);
+    if (node->leaf)
+      free(node->postings[i].indices);
+  }
+  if (!node->leaf) {
+    for (i = 0; i <= node->n; i++)
+      keyindex_node_free(node->children[i]);
+  }
+  free(node);
+}
+
+KeyIndexNode *keyindex_leaf(KeyIndex *this, const uint8_t *key,
+                            uint64_t key_sz)
+// -----------------------------------------------------------------------------
+// Func: Descend to the leaf where key is or would be
+// Args: this - a pointer to this keyindex object
+//       key, key_sz - the key, key_sz 0 finds the leftmost leaf
+// Retn: the leaf
+// -----------------------------------------------------------------------------
+{
+  KeyIndexNode *node = this->root;
+
+  while (!node->leaf)
+    node = node->children[keyindex_upper_bound(node, key, key_sz)];
+
+  return node;
+}
+
+int keyindex_cmp(const uint8_t *a, uint64_t a_sz,
+                 const uint8_t *b, uint64_t b_sz)
+// -----------------------------------------------------------------------------
+// Func: Lexicographic byte string comparison, shorter prefix sorts first
+// Args: a, a_sz - the first key
+//       b, b_sz - the second key
+// Retn: <0, 0, >0 like memcmp
+// -----------------------------------------------------------------------------
+{
+  uint64_t n = a_sz < b_sz ? a_sz : b_sz;
+  int c = n ? memcmp(a, b, n) : 0; // save looks up the NULL empty key
+
+  if (c != 0)
+    return c;
+
+  return (a_sz > b_sz) - (a_sz < b_sz);
+}
+
+int keyindex_lower_bound(KeyIndexNode *node, const uint8_t *key,
+                         uint64_t key_sz)
+// -----------------------------------------------------------------------------
+// Func: Position of the first key in node that is >= key
+// Args: node - the node
+//       key, key_sz - the key
+// Retn: 0 to node->n
+// -----------------------------------------------------------------------------
+{
+  int lo = 0, hi = node->n, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (keyindex_cmp(node->keys[mid], node->key_sz[mid], key, key_sz) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+int keyindex_upper_bound(KeyIndexNode *node, const uint8_t *key,
+                         uint64_t key_sz)
+// -----------------------------------------------------------------------------
+// Func: Position of the first key in node that is > key
+// Args: node - the node
+//       key, key_sz - the key
+// Retn: 0 to node->n
+// -----------------------------------------------------------------------------
+{
+  int lo = 0, hi = node->n, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (keyindex_cmp(node->keys[mid], node->key_sz[mid], key, key_sz) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+int keyindex_postings_add(KeyIndexPostings *postings, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Append a block index to a postings list
+// Args: postings - the list
+//       index - the block index, larger than any already in the list
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  uint64_t *indices;
+  uint64_t cap;
+
+  if (postings->n == postings->cap) {
+    cap = postings->cap ? 2*postings->cap : 1;
+    if ((indices = realloc(postings->indices, cap*sizeof(uint64_t))) == NULL)
+      return -1;
+    postings->indices = indices;
+    postings->cap = cap;
+  }
+  postings->indices[postings->n++] = index;
+
+  return 0;
+}
@@ -0,0 +1,808 @@
+/*
+loadgen.c: open loop load generator for the chain
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE // writer preferring rwlocks
+
+#include "loadgen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LOADGEN_IO_BUF_SZ (1 << 16)
+
+static const char *loadgen_op_names[LOADGEN_NOPS] = {"append", "read", "scan"};
+
+// private functions
+void *loadgen_worker(void *arg);
+int loadgen_worker_init(LoadGen *lg, LoadGenWorker *w, int id);
+void loadgen_worker_destroy(LoadGenWorker *w);
+int loadgen_op(LoadGenWorker *w, int op);
+int loadgen_pick(LoadGenWorker *w);
+uint64_t loadgen_record_size(LoadGenWorker *w);
+uint64_t loadgen_rand(LoadGenWorker *w);
+double loadgen_uniform(LoadGenWorker *w);
+uint64_t loadgen_now(void);
+void loadgen_sleep_until(uint64_t ns);
+int loadgen_connect(LoadGenWorker *w);
+int loadgen_http(LoadGenWorker *w, const char *method, const char *path,
+                 const uint8_t *body, uint64_t body_sz, uint64_t *value);
+int loadgen_send(int sock, struct iovec *iov, int niov);
+int loadgen_response(LoadGenWorker *w, uint64_t *value);
+void loadgen_report(LoadGen *lg);
+void loadgen_usage(void);
+
+int loadgen_cmd(int argc, char **argv)
+// -----------------------------------------------------------------------------
+// Func: The -l command: generate load as the arguments say and report
+// Args: argc - arguments after -l
+//       argv - the arguments, see loadgen_parse
+// Retn: 0 on success, -1 on bad arguments or if the run could not start
+// -----------------------------------------------------------------------------
+{
+  LoadGenConfig cfg;
+
+  if (loadgen_parse(&cfg, argc, argv)) {
+    loadgen_usage();
+    return -1;
+  }
+
+  return loadgen_run(&cfg);
+}
+
+int loadgen_parse(LoadGenConfig *cfg, int argc, char **argv)
+// -----------------------------------------------------------------------------
+// Func: Fill in a configuration from key=value arguments, defaults for the
+//       rest. The keys are listed by loadgen_usage.
+// Args: cfg - the configuration to fill in
+//       argc - number of arguments
+//       argv - the arguments
+// Retn: 0 on success, -1 on an unknown key or bad value
+// -----------------------------------------------------------------------------
+{
+  char *key, *val, *colon;
+  int i;
+
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->threads = 1;
+  cfg->duration = 10;
+  cfg->mix[LOADGEN_APPEND] = 50;
+  cfg->mix[LOADGEN_READ] = 45;
+  cfg->mix[LOADGEN_SCAN] = 5;
+  cfg->size_dist = LOADGEN_SIZE_FIXED;
+  cfg->size_a = 256;
+  cfg->scan_len = 100;
+  cfg->preload = 10000;
+  cfg->seed = 1;
+  cfg->hash_alg = BLOCKCHAIN_HASH_SHA256;
+
+  for (i = 0; i < argc; i++) {
+    key = argv[i];
+    if ((val = strchr(key, '=')) == NULL)
+      return -1;
+    val++;
+
+    if (!strncmp(key, "threads=", 8)) {
+      cfg->threads = atoi(val);
+    } else if (!strncmp(key, "rate=", 5)) {
+      cfg->rate = atof(val);
+    } else if (!strncmp(key, "arrival=", 8)) {
+      if (!strcmp(val, "poisson"))
+        cfg->poisson = 1;
+      else if (strcmp(val, "fixed"))
+        return -1;
+    } else if (!strncmp(key, "duration=", 9)) {
+      cfg->duration = atof(val);
+    } else if (!strncmp(key, "mix=", 4)) {
+      if (sscanf(val, "%u:%u:%u", &cfg->mix[LOADGEN_APPEND],
+                 &cfg->mix[LOADGEN_READ], &cfg->mix[LOADGEN_SCAN]) != 3)
+        return -1;
+    } else if (!strncmp(key, "size=", 5)) {
+      if (!strncmp(val, "fixed:", 6)) {
+        cfg->size_dist = LOADGEN_SIZE_FIXED;
+        cfg->size_a = strtoull(val + 6, NULL, 10);
+      } else if (!strncmp(val, "uniform:", 8)) {
+        cfg->size_dist = LOADGEN_SIZE_UNIFORM;
+        if (sscanf(val + 8, "%lu-%lu", &cfg->size_a, &cfg->size_b) != 2 ||
+            cfg->size_b < cfg->size_a)
+          return -1;
+      } else if (!strncmp(val, "exp:", 4)) {
+        cfg->size_dist = LOADGEN_SIZE_EXP;
+        cfg->size_a = strtoull(val + 4, NULL, 10);
+      } else {
+        return -1;
+      }
+    } else if (!strncmp(key, "scan=", 5)) {
+      cfg->scan_len = strtoull(val, NULL, 10);
+    } else if (!strncmp(key, "preload=", 8)) {
+      cfg->preload = strtoull(val, NULL, 10);
+    } else if (!strncmp(key, "seed=", 5)) {
+      cfg->seed = strtoull(val, NULL, 10);
+    } else if (!strncmp(key, "hash=", 5)) {
+      if (!strcmp(val, "blake3"))
+        cfg->hash_alg = BLOCKCHAIN_HASH_BLAKE3;
+      else if (strcmp(val, "sha256"))
+        return -1;
+    } else if (!strncmp(key, "server=", 7)) {
+      if ((colon = strrchr(val, ':')) == NULL ||
+          colon - val >= (long)sizeof(cfg->host) ||
+          strlen(colon + 1) >= sizeof(cfg->port))
+        return -1;
+      memcpy(cfg->host, val, colon - val);
+      cfg->host[colon - val] = '\0';
+      strcpy(cfg->port, colon + 1);
+    } else if (!strncmp(key, "dump=", 5)) {
+      cfg->dump = val;
+    } else {
+      return -1;
+    }
+  }
+
+  if (cfg->threads < 1 || cfg->threads > LOADGEN_MAX_THREADS ||
+      cfg->rate < 0 || cfg->duration <= 0 || cfg->size_a == 0 ||
+      cfg->mix[0] + cfg->mix[1] + cfg->mix[2] == 0)
+    return -1;
+
+  return 0;
+}
+
+int loadgen_run(const LoadGenConfig *cfg)
+// -----------------------------------------------------------------------------
+// Func: Set up the chain or the connections, preload, run the workers for the
+//       configured duration and print the report to stdout
+// Args: cfg - what load to generate
+// Retn: 0 on success, -1 if the chain, a connection or a thread can't be set
+//       up or the preload fails
+// -----------------------------------------------------------------------------
+{
+  pthread_rwlockattr_t attr;
+  LoadGen *lg;
+  uint64_t i;
+  int n = 0, started = 0, err = 0;
+
+  if ((lg = calloc(1, sizeof(LoadGen))) == NULL)
+    return -1;
+  lg->cfg = *cfg;
+
+  if (cfg->host[0] == '\0') {
+    blockchain_init_hash(&lg->chain, cfg->hash_alg);
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lg->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+  }
+
+  for (n = 0; n < cfg->threads && !err; n++)
+    err = loadgen_worker_init(lg, &lg->workers[n], n) != 0;
+
+  if (!err && cfg->host[0] != '\0')
+    err = loadgen_http(&lg->workers[0], "GET", "/length", NULL, 0,
+                       &lg->length) != 200;
+  for (i = 0; i < cfg->preload && !err; i++)
+    err = loadgen_op(&lg->workers[0], LOADGEN_APPEND) != 0;
+
+  if (!err) {
+    lg->start_ns = loadgen_now() + 10000000; // let every thread get going
+    lg->end_ns = lg->start_ns + (uint64_t)(cfg->duration * 1e9);
+    for (started = 0; started < cfg->threads; started++)
+      if (pthread_create(&lg->workers[started].thread, NULL, &loadgen_worker,
+                         &lg->workers[started])) {
+        err = 1;
+        lg->end_ns = 0; // the ones already started stop at once
+        break;
+      }
+    while (started > 0)
+      pthread_join(lg->workers[--started].thread, NULL);
+  }
+
+  if (!err)
+    loadgen_report(lg);
+  else
+    fprintf(stderr, "loadgen: could not set up the %s\n",
+            cfg->host[0] ? "server connections" : "chain");
+
+  while (n > 0)
+    loadgen_worker_destroy(&lg->workers[--n]);
+  if (cfg->host[0] == '\0') {
+    pthread_rwlock_destroy(&lg->lock);
+    blockchain_destroy(&lg->chain);
+  }
+  free(lg);
+
+  return err ? -1 : 0;
+}
+
+void *loadgen_worker(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Worker thread: issue ops on this worker's schedule until the end of
+//       the run, then count the ones that were due but never sent as having
+//       waited until the end
+// Args: arg - the LoadGenWorker
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  LoadGenWorker *w = (LoadGenWorker *)arg;
+  LoadGen *lg = w->lg;
+  double gap = 0;
+  uint64_t due, sent, done;
+  int op, open = lg->cfg.rate > 0;
+
+  if (open) // this worker's share of the rate, staggered against the others
+    gap = 1e9 * lg->cfg.threads / lg->cfg.rate;
+  due = lg->start_ns + (uint64_t)(gap * w->id / lg->cfg.threads);
+
+  loadgen_sleep_until(lg->start_ns);
+  for (;;) {
+    if (open) {
+      if (due >= lg->end_ns || loadgen_now() >= lg->end_ns)
+        break;
+      loadgen_sleep_until(due);
+    } else if ((due = loadgen_now()) >= lg->end_ns) {
+      break;
+    }
+
+    op = loadgen_pick(w);
+    sent = loadgen_now();
+    if (loadgen_op(w, op))
+      w->errors[op]++;
+    done = loadgen_now();
+
+    w->ops[op]++;
+    w->service[op].record(&w->service[op], done - sent);
+    w->latency[op].record(&w->latency[op], done - due);
+
+    if (open)
+      due += (uint64_t)(lg->cfg.poisson ? -log(loadgen_uniform(w)) * gap
+                                        : gap);
+  }
+
+  // a generator that stops at the deadline would otherwise drop exactly the
+  // ops that were stuck behind a stall
+  while (open && due < lg->end_ns) {
+    op = loadgen_pick(w);
+    w->missed[op]++;
+    w->latency[op].record(&w->latency[op], lg->end_ns - due);
+    due += (uint64_t)(lg->cfg.poisson ? -log(loadgen_uniform(w)) * gap : gap);
+  }
+
+  return NULL;
+}
+
+int loadgen_worker_init(LoadGen *lg, LoadGenWorker *w, int id)
+// -----------------------------------------------------------------------------
+// Func: Initialize a worker, connecting it to the server if there is one
+// Args: lg - the run
+//       w - the worker
+//       id - its number
+// Retn: 0 on success, -1 if out of memory or the connection fails
+// -----------------------------------------------------------------------------
+{
+  uint64_t max_sz, i;
+  int op, err = 0;
+
+  w->lg = lg;
+  w->id = id;
+  w->sock = -1;
+  w->rng = lg->cfg.seed * 0x9e3779b97f4a7c15ULL + id + 1;
+
+  switch (lg->cfg.size_dist) {
+    case LOADGEN_SIZE_UNIFORM: max_sz = lg->cfg.size_b; break;
+    case LOADGEN_SIZE_EXP: max_sz = 16*lg->cfg.size_a; break;
+    default: max_sz = lg->cfg.size_a;
+  }
+
+  w->record = malloc(max_sz);
+  w->io = malloc(LOADGEN_IO_BUF_SZ);
+  for (op = 0; op < LOADGEN_NOPS; op++) {
+    err |= histogram_init(&w->latency[op], LOADGEN_MAX_LATENCY);
+    err |= histogram_init(&w->service[op], LOADGEN_MAX_LATENCY);
+  }
+  if (err || w->record == NULL || w->io == NULL) {
+    loadgen_worker_destroy(w);
+    return -1;
+  }
+  for (i = 0; i < max_sz; i++)
+    w->record[i] = (uint8_t)loadgen_rand(w);
+
+  if (lg->cfg.host[0] != '\0' && loadgen_connect(w)) {
+    loadgen_worker_destroy(w);
+    return -1;
+  }
+
+  return 0;
+}
+
+void loadgen_worker_destroy(LoadGenWorker *w)
+// -----------------------------------------------------------------------------
+// Func: Free a worker's buffers and histograms and close its connection
+// Args: w - the worker
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  int op;
+
+  for (op = 0; op < LOADGEN_NOPS; op++) {
+    histogram_destroy(&w->latency[op]);
+    histogram_destroy(&w->service[op]);
+  }
+  if (w->sock >= 0)
+    close(w->sock);
+  free(w->record);
+  free(w->io);
+  w->sock = -1;
+  w->record = NULL;
+  w->io = NULL;
+}
+
+int loadgen_op(LoadGenWorker *w, int op)
+// -----------------------------------------------------------------------------
+// Func: Issue one op against the chain or the server. Reads and scans start
+//       at a uniformly random block.
+// Args: w - the worker
+//       op - LOADGEN_APPEND, LOADGEN_READ or LOADGEN_SCAN
+// Retn: 0 on success, -1 if the op failed
+// -----------------------------------------------------------------------------
+{
+  LoadGen *lg = w->lg;
+  Blockchain *chain = &lg->chain;
+  uint64_t size, length, index, i, n, value;
+  uint8_t *frame;
+  char path[64];
+  volatile uint8_t sink = 0;
+  int err = 0;
+
+  if (op == LOADGEN_APPEND) {
+    size = loadgen_record_size(w);
+    value = loadgen_rand(w); // records differ even when their sizes don't
+    memcpy(w->record, &value, size < sizeof(value) ? size : sizeof(value));
+
+    if (lg->cfg.host[0] != '\0') {
+      if (loadgen_http(w, "POST", "/blocks", w->record, size, &index) != 201)
+        return -1;
+      // reads may go as far as the highest block any worker has seen
+      length = __atomic_load_n(&lg->length, __ATOMIC_RELAXED);
+      while (index + 1 > length &&
+             !__atomic_compare_exchange_n(&lg->length, &length, index + 1, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+      return 0;
+    }
+
+    pthread_rwlock_wrlock(&lg->lock);
+    err = chain->insert_front(chain, w->record, size) != 0;
+    pthread_rwlock_unlock(&lg->lock);
+    return err ? -1 : 0;
+  }
+
+  n = op == LOADGEN_SCAN ? lg->cfg.scan_len : 1;
+
+  if (lg->cfg.host[0] != '\0') {
+    length = __atomic_load_n(&lg->length, __ATOMIC_RELAXED);
+    index = loadgen_rand(w) % length;
+    for (i = 0; i < n && index + i < length && !err; i++) {
+      snprintf(path, sizeof(path), "/blocks/%lu", (unsigned long)(index + i));
+      err = loadgen_http(w, "GET", path, NULL, 0, NULL) != 200;
+    }
+    return err ? -1 : 0;
+  }
+
+  // touch the end of every frame so the read is real
+  pthread_rwlock_rdlock(&lg->lock);
+  index = loadgen_rand(w) % chain->length;
+  for (i = 0; i < n && index + i < chain->length; i++) {
+    if ((frame = (uint8_t *)chain->get(chain, index + i)) == NULL) {
+      err = 1;
+      break;
+    }
+    sink ^= frame[blockframe_size(frame) - 1];
+  }
+  pthread_rwlock_unlock(&lg->lock);
+  (void)sink;
+
+  return err ? -1 : 0;
+}
+
+int loadgen_pick(LoadGenWorker *w)
+// -----------------------------------------------------------------------------
+// Func: Draw the next op from the mix
+// Args: w - the worker
+// Retn: the op
+// -----------------------------------------------------------------------------
+{
+  const unsigned *mix = w->lg->cfg.mix;
+  uint64_t r = loadgen_rand(w) % (mix[0] + mix[1] + mix[2]);
+
+  if (r < mix[LOADGEN_APPEND])
+    return LOADGEN_APPEND;
+  if (r < mix[LOADGEN_APPEND] + mix[LOADGEN_READ])
+    return LOADGEN_READ;
+  return LOADGEN_SCAN;
+}
+
+uint64_t loadgen_record_size(LoadGenWorker *w)
+// -----------------------------------------------------------------------------
+// Func: Draw a record size from the configured distribution
+// Args: w - the worker
+// Retn: the size, at least 1
+// -----------------------------------------------------------------------------
+{
+  const LoadGenConfig *cfg = &w->lg->cfg;
+  uint64_t size;
+
+  switch (cfg->size_dist) {
+    case LOADGEN_SIZE_UNIFORM:
+      return cfg->size_a + loadgen_rand(w) % (cfg->size_b - cfg->size_a + 1);
+    case LOADGEN_SIZE_EXP:
+      size = (uint64_t)(-log(loadgen_uniform(w)) * (double)cfg->size_a);
+      if (size > 16*cfg->size_a)
+        size = 16*cfg->size_a;
+      return size ? size : 1;
+    default:
+      return cfg->size_a;
+  }
+}
+
+uint64_t loadgen_rand(LoadGenWorker *w)
+// -----------------------------------------------------------------------------
+// Func: xorshift64*, per worker so threads don't share random state
+// Args: w - the worker
+// Retn: 64 random bits
+// -----------------------------------------------------------------------------
+{
+  w->rng ^= w->rng >> 12;
+  w->rng ^= w->rng << 25;
+  w->rng ^= w->rng >> 27;
+
+  return w->rng * 0x2545f4914f6cdd1dULL;
+}
+
+double loadgen_uniform(LoadGenWorker *w)
+// -----------------------------------------------------------------------------
+// Func: A uniform random number in (0, 1], safe to take the log of
+// Args: w - the worker
+// Retn: the number
+// -----------------------------------------------------------------------------
+{
+  return ((loadgen_rand(w) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+uint64_t loadgen_now(void)
+// -----------------------------------------------------------------------------
+// Func: Monotonic time
+// Args: None
+// Retn: nanoseconds
+// -----------------------------------------------------------------------------
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void loadgen_sleep_until(uint64_t ns)
+// -----------------------------------------------------------------------------
+// Func: Sleep until a monotonic time, returning at once if it has passed
+// Args: ns - the time, as from loadgen_now
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  struct timespec ts;
+
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+    ; // interrupted
+}
+
+int loadgen_connect(LoadGenWorker *w)
+// -----------------------------------------------------------------------------
+// Func: Open the worker's keep-alive connection to the server
+// Args: w - the worker
+// Retn: 0 on success, -1 if the server can't be reached
+// -----------------------------------------------------------------------------
+{
+  struct addrinfo hints, *res, *ai;
+  int one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(w->lg->cfg.host, w->lg->cfg.port, &hints, &res))
+    return -1;
+
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    if ((w->sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                          ai->ai_protocol)) < 0)
+      continue;
+    if (connect(w->sock, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(w->sock);
+    w->sock = -1;
+  }
+  freeaddrinfo(res);
+
+  if (w->sock < 0)
+    return -1;
+  setsockopt(w->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return 0;
+}
+
+int loadgen_http(LoadGenWorker *w, const char *method, const char *path,
+                 const uint8_t *body, uint64_t body_sz, uint64_t *value)
+// -----------------------------------------------------------------------------
+// Func: One HTTP/1.1 request and its response on the worker's connection. A
+//       connection the server dropped while idle is reopened and the request
+//       sent again. The response body is read and thrown away, but for a
+//       number in it if asked for.
+// Args: w - the worker
+//       method - "GET" or "POST"
+//       path - the request path
+//       body - the request body, NULL for none
+//       body_sz - its size
+//       value - set to the first number in the response body, NULL if not
+//               needed (the server answers appends with {"index":n})
+// Retn: the response status, -1 if the exchange failed
+// -----------------------------------------------------------------------------
+{
+  char head[512];
+  struct iovec iov[2];
+  int hlen, attempt, status = -1;
+
+  hlen = snprintf(head, sizeof(head),
+                  "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                  "Content-Type: application/octet-stream\r\n"
+                  "Content-Length: %lu\r\n\r\n",
+                  method, path, w->lg->cfg.host, (unsigned long)body_sz);
+
+  for (attempt = 0; attempt < 2 && status < 0; attempt++) {
+    if (w->sock < 0 && loadgen_connect(w))
+      return -1;
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = body_sz;
+    if (loadgen_send(w->sock, iov, body_sz ? 2 : 1) == 0)
+      status = loadgen_response(w, value);
+
+    if (status < 0) {
+      close(w->sock);
+      w->sock = -1;
+    }
+  }
+
+  return status;
+}
+
+int loadgen_send(int sock, struct iovec *iov, int niov)
+// -----------------------------------------------------------------------------
+// Func: Write out a gathered buffer, however many writes it takes
+// Args: sock - the connection
+//       iov - the pieces, advanced as they are written
+//       niov - number of pieces
+// Retn: 0 on success, -1 if the connection failed
+// -----------------------------------------------------------------------------
+{
+  ssize_t n;
+
+  while (niov > 0) {
+    if ((n = writev(sock, iov, niov)) <= 0)
+      return -1;
+    while (niov > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+int loadgen_response(LoadGenWorker *w, uint64_t *value)
+// -----------------------------------------------------------------------------
+// Func: Read one response with a Content-Length body, see loadgen_http
+// Args: w - the worker
+//       value - set to the first number in the body, NULL if not needed
+// Retn: the response status, -1 if the response is cut off or malformed
+// -----------------------------------------------------------------------------
+{
+  char *io = w->io, *end = NULL, *line, *num;
+  uint64_t got = 0, have, body_sz = 0, room;
+  ssize_t n;
+  int status;
+
+  while (end == NULL) {
+    if (got == LOADGEN_IO_BUF_SZ - 1 ||
+        (n = recv(w->sock, &io[got], LOADGEN_IO_BUF_SZ - 1 - got, 0)) <= 0)
+      return -1;
+    got += n;
+    io[got] = '\0';
+    end = strstr(io, "\r\n\r\n");
+  }
+
+  if (sscanf(io, "HTTP/1.%*d %d", &status) != 1)
+    return -1;
+  for (line = strstr(io, "\r\n"); line != NULL && line < end;
+       line = strstr(line + 2, "\r\n"))
+    if (!strncasecmp(line + 2, "content-length:", 15))
+      body_sz = strtoull(line + 17, NULL, 10);
+
+  // small bodies are kept whole, so value can be read out of them
+  have = got - (uint64_t)(end + 4 - io);
+  while (have < body_sz && got < LOADGEN_IO_BUF_SZ - 1) {
+    if ((n = recv(w->sock, &io[got], LOADGEN_IO_BUF_SZ - 1 - got, 0)) <= 0)
+      return -1;
+    got += n;
+    have += n;
+  }
+  io[got] = '\0';
+
+  if (value != NULL) {
+    if ((num = strpbrk(end + 4, "0123456789")) == NULL)
+      return -1;
+    *value = strtoull(num, NULL, 10);
+  }
+
+  while (have < body_sz) {
+    room = body_sz - have < LOADGEN_IO_BUF_SZ ? body_sz - have
+                                              : LOADGEN_IO_BUF_SZ;
+    if ((n = recv(w->sock, io, room, 0)) <= 0)
+      return -1;
+    have += n;
+  }
+
+  return status;
+}
+
+void loadgen_report(LoadGen *lg)
+// -----------------------------------------------------------------------------
+// Func: Merge the workers' histograms and print throughput and percentiles
+//       per op, and the full distributions if a dump file was asked for
+// Args: lg - the finished run
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  const LoadGenConfig *cfg = &lg->cfg;
+  Histogram latency[LOADGEN_NOPS + 1], service[LOADGEN_NOPS + 1];
+  uint64_t ops[LOADGEN_NOPS + 1] = {0}, errors[LOADGEN_NOPS + 1] = {0};
+  uint64_t missed[LOADGEN_NOPS + 1] = {0};
+  double secs = cfg->duration, us = 1000.0;
+  const char *name;
+  FILE *fp;
+  int op, i, err = 0;
+
+  for (op = 0; op <= LOADGEN_NOPS; op++) {
+    err |= histogram_init(&latency[op], LOADGEN_MAX_LATENCY);
+    err |= histogram_init(&service[op], LOADGEN_MAX_LATENCY);
+  }
+
+  for (op = 0; op < LOADGEN_NOPS && !err; op++)
+    for (i = 0; i < cfg->threads; i++) {
+      latency[op].merge(&latency[op], &lg->workers[i].latency[op]);
+      service[op].merge(&service[op], &lg->workers[i].service[op]);
+      ops[op] += lg->workers[i].ops[op];
+      errors[op] += lg->workers[i].errors[op];
+      missed[op] += lg->workers[i].missed[op];
+    }
+  for (op = 0; op < LOADGEN_NOPS && !err; op++) {
+    latency[LOADGEN_NOPS].merge(&latency[LOADGEN_NOPS], &latency[op]);
+    service[LOADGEN_NOPS].merge(&service[LOADGEN_NOPS], &service[op]);
+    ops[LOADGEN_NOPS] += ops[op];
+    errors[LOADGEN_NOPS] += errors[op];
+    missed[LOADGEN_NOPS] += missed[op];
+  }
+
+  printf("%s, %d thread%s, %.1f s, ",
+         cfg->host[0] ? "server" : "in process", cfg->threads,
+         cfg->threads > 1 ? "s" : "", secs);
+  if (cfg->rate > 0)
+    printf("open loop at %.0f ops/s (%s arrivals)\n", cfg->rate,
+           cfg->poisson ? "poisson" : "fixed");
+  else
+    printf("closed loop\n");
+  printf("mix %u:%u:%u, scans of %lu blocks\n\n", cfg->mix[0], cfg->mix[1],
+         cfg->mix[2], (unsigned long)cfg->scan_len);
+
+  printf("%-7s %9s %10s %7s %7s | %-41s | %s\n", "", "", "", "", "",
+         "latency from due time (us)", "service time (us)");
+  printf("%-7s %9s %10s %7s %7s | %7s %7s %7s %7s %9s | %7s %7s %9s\n",
+         "op", "count", "ops/s", "errors", "missed", "p50", "p90", "p99",
+         "p99.9", "max", "p50", "p99", "max");
+  for (op = 0; op <= LOADGEN_NOPS && !err; op++) {
+    name = op < LOADGEN_NOPS ? loadgen_op_names[op] : "all";
+    if (op < LOADGEN_NOPS && ops[op] + missed[op] == 0)
+      continue;
+    printf("%-7s %9lu %10.1f %7lu %7lu | %7.1f %7.1f %7.1f %7.1f %9.1f | "
+           "%7.1f %7.1f %9.1f\n", name, (unsigned long)ops[op],
+           (double)ops[op] / secs, (unsigned long)errors[op],
+           (unsigned long)missed[op],
+           latency[op].percentile(&latency[op], 50) / us,
+           latency[op].percentile(&latency[op], 90) / us,
+           latency[op].percentile(&latency[op], 99) / us,
+           latency[op].percentile(&latency[op], 99.9) / us,
+           latency[op].max_seen / us,
+           service[op].percentile(&service[op], 50) / us,
+           service[op].percentile(&service[op], 99) / us,
+           service[op].max_seen / us);
+  }
+
+  if (!err && cfg->dump != NULL) {
+    if ((fp = fopen(cfg->dump, "w")) == NULL) {
+      fprintf(stderr, "loadgen: can't write %s\n", cfg->dump);
+    } else {
+      for (op = 0; op <= LOADGEN_NOPS; op++) {
+        name = op < LOADGEN_NOPS ? loadgen_op_names[op] : "all";
+        if (latency[op].total == 0)
+          continue;
+        fprintf(fp, "# %s latency from due time (us)\n", name);
+        latency[op].print(&latency[op], fp, us);
+        fprintf(fp, "\n# %s service time (us)\n", name);
+        service[op].print(&service[op], fp, us);
+        fprintf(fp, "\n");
+      }
+      fclose(fp);
+    }
+  }
+
+  for (op = 0; op <= LOADGEN_NOPS; op++) {
+    histogram_destroy(&latency[op]);
+    histogram_destroy(&service[op]);
+  }
+}
+
+void loadgen_usage(void)
+// -----------------------------------------------------------------------------
+// Func: Print the -l command's arguments, see loadgen_parse
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  fprintf(stderr,
+          "usage: main -l [key=value ...]\n"
+          "  threads=1          load threads\n"
+          "  rate=0             ops/s over all threads, 0 for closed loop\n"
+          "  arrival=fixed      fixed or poisson gaps between arrivals\n"
+          "  duration=10        seconds\n"
+          "  mix=50:45:5        weights of appends, reads and scans\n"
+          "  size=fixed:256     fixed:N, uniform:LO-HI or exp:MEAN bytes\n"
+          "  scan=100           blocks per scan\n"
+          "  preload=10000      blocks appended before the clock starts\n"
+          "  seed=1\n"
+          "  hash=sha256        sha256 or blake3 (in process)\n"
+          "  server=HOST:PORT   drive node/server.js instead\n"
+          "  dump=PATH          write the full distributions to PATH\n");
+}
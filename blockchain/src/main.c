@@ -30,6 +30,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "util.h"
 #include "linkedlist.h"
 #include "dynarray.h"
+#include "loadgen.h"
+#include "filehash.h"
+#include "chainexport.h"
 
 void ll_test() {
   LinkedList chain;
@@ -99,7 +102,9 @@ int main(int argc, char *argv[]) {
   if (argc > 1) { // process flags
     if (strlen(argv[1]) == 2 && argv[1][0] == '-') {
       switch (argv[1][1]) {
-        case 'h': util_cmd_hash(argv[2]); break;
+        case 'h': return filehash_cmd(argc-2, &argv[2]) ? 1 : 0;
+        case 'e': return chainexport_cmd(argc-2, &argv[2]) ? 1 : 0;
+        case 'l': return loadgen_cmd(argc-2, &argv[2]) ? 1 : 0;
         default: printf("Command line argument is not recognized\n");
       }
     }
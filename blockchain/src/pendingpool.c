@@ -0,0 +1,433 @@
+/*
+pendingpool.c: prioritized pool of records waiting to be appended
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pendingpool.h"
+#include "blake3.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PENDINGPOOL_INIT_CAP  1024
+
+// private functions, access through PendingPool object
+int pendingpool_add(PendingPool *this, const uint8_t *record,
+                    uint64_t record_sz, uint64_t priority);
+uint64_t pendingpool_pop(PendingPool *this, uint64_t n, uint64_t max_bytes,
+                         uint8_t **records, uint64_t *record_sz);
+
+// private functions
+int pendingpool_before(int which, PendingEntry *a, PendingEntry *b);
+void pendingpool_sift_up(PendingPool *this, int which, uint64_t i);
+void pendingpool_sift_down(PendingPool *this, int which, uint64_t i,
+                           uint64_t n);
+void pendingpool_heap_remove(PendingPool *this, int which, uint64_t i,
+                             uint64_t n);
+PendingEntry **pendingpool_slot(PendingPool *this, const uint8_t *digest);
+int pendingpool_grow(PendingPool *this);
+void pendingpool_unlink(PendingPool *this, PendingEntry *entry);
+
+int pendingpool_init(PendingPool *this, uint64_t budget)
+// -----------------------------------------------------------------------------
+// Func: Initialize an empty pool
+// Args: this - a pointer to the new pool
+//       budget - most record bytes held at once
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  this->count = 0;
+  this->cap = PENDINGPOOL_INIT_CAP;
+  this->nbuckets = PENDINGPOOL_INIT_CAP;
+  this->heaps[PENDINGPOOL_TOP] = malloc(this->cap*sizeof(PendingEntry *));
+  this->heaps[PENDINGPOOL_BOTTOM] = malloc(this->cap*sizeof(PendingEntry *));
+  this->buckets = calloc(this->nbuckets, sizeof(PendingEntry *));
+  if (this->heaps[PENDINGPOOL_TOP] == NULL ||
+      this->heaps[PENDINGPOOL_BOTTOM] == NULL || this->buckets == NULL) {
+    free(this->heaps[PENDINGPOOL_TOP]);
+    free(this->heaps[PENDINGPOOL_BOTTOM]);
+    free(this->buckets);
+    return -1;
+  }
+
+  this->bytes = 0;
+  this->budget = budget;
+  this->seq = 0;
+  this->added = 0;
+  this->duplicates = 0;
+  this->evicted = 0;
+  pthread_mutex_init(&this->lock, NULL);
+
+  this->add = &pendingpool_add;
+  this->pop = &pendingpool_pop;
+
+  return 0;
+}
+
+void pendingpool_destroy(PendingPool *this)
+// -----------------------------------------------------------------------------
+// Func: Destroy a pool and every record still pending
+// Args: this - a pointer to the pool
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t i;
+
+  for (i = 0; i < this->count; i++) {
+    free(this->heaps[PENDINGPOOL_TOP][i]->record);
+    free(this->heaps[PENDINGPOOL_TOP][i]);
+  }
+  free(this->heaps[PENDINGPOOL_TOP]);
+  free(this->heaps[PENDINGPOOL_BOTTOM]);
+  free(this->buckets);
+  this->heaps[PENDINGPOOL_TOP] = NULL;
+  this->heaps[PENDINGPOOL_BOTTOM] = NULL;
+  this->buckets = NULL;
+  this->count = 0;
+  this->bytes = 0;
+  pthread_mutex_destroy(&this->lock);
+}
+
+int pendingpool_add(PendingPool *this, const uint8_t *record,
+                    uint64_t record_sz, uint64_t priority)
+// -----------------------------------------------------------------------------
+// Func: Queue a copy of a record. If the pool goes over budget the lowest
+//       priority records are evicted, possibly this one.
+// Args: this - a pointer to the pool
+//       record - the record
+//       record_sz - its size
+//       priority - larger is more urgent
+// Retn: PENDINGPOOL_ADDED, PENDINGPOOL_DUPLICATE or PENDINGPOOL_EVICTED,
+//       -1 on allocation failure or if the record alone exceeds the budget
+// -----------------------------------------------------------------------------
+{
+  PendingEntry *entry, *victim, **slot;
+  int result = PENDINGPOOL_ADDED;
+
+  if (record_sz > this->budget)
+    return -1;
+
+  // hash and copy outside the lock, producers only contend on the heaps
+  if ((entry = malloc(sizeof(PendingEntry))) == NULL)
+    return -1;
+  if ((entry->record = malloc(record_sz ? record_sz : 1)) == NULL) {
+    free(entry);
+    return -1;
+  }
+  memcpy(entry->record, record, record_sz);
+  entry->record_sz = record_sz;
+  entry->priority = priority;
+  blake3_hash(record, record_sz, entry->digest);
+
+  pthread_mutex_lock(&this->lock);
+
+  if (*(slot = pendingpool_slot(this, entry->digest)) != NULL) {
+    this->duplicates++;
+    pthread_mutex_unlock(&this->lock);
+    free(entry->record);
+    free(entry);
+    return PENDINGPOOL_DUPLICATE;
+  }
+
+  if (this->count == this->cap && pendingpool_grow(this)) {
+    pthread_mutex_unlock(&this->lock);
+    free(entry->record);
+    free(entry);
+    return -1;
+  }
+  slot = pendingpool_slot(this, entry->digest); // the table may have moved
+
+  entry->seq = this->seq++;
+  entry->next = NULL;
+  *slot = entry;
+  this->heaps[PENDINGPOOL_TOP][this->count] = entry;
+  this->heaps[PENDINGPOOL_BOTTOM][this->count] = entry;
+  entry->pos[PENDINGPOOL_TOP] = this->count;
+  entry->pos[PENDINGPOOL_BOTTOM] = this->count;
+  this->count++;
+  pendingpool_sift_up(this, PENDINGPOOL_TOP, entry->pos[PENDINGPOOL_TOP]);
+  pendingpool_sift_up(this, PENDINGPOOL_BOTTOM,
+                      entry->pos[PENDINGPOOL_BOTTOM]);
+  this->bytes += record_sz;
+  this->added++;
+
+  while (this->bytes > this->budget) {
+    victim = this->heaps[PENDINGPOOL_BOTTOM][0];
+    if (victim == entry)
+      result = PENDINGPOOL_EVICTED;
+    pendingpool_unlink(this, victim);
+    this->evicted++;
+    free(victim->record);
+    free(victim);
+  }
+
+  pthread_mutex_unlock(&this->lock);
+  return result;
+}
+
+uint64_t pendingpool_pop(PendingPool *this, uint64_t n, uint64_t max_bytes,
+                         uint8_t **records, uint64_t *record_sz)
+// -----------------------------------------------------------------------------
+// Func: Take the most urgent records out of the pool, in priority order,
+//       stopping at n records or at the first one that would go past
+//       max_bytes, so a lower priority record never jumps the queue
+// Args: this - a pointer to the pool
+//       n - most records taken
+//       max_bytes - most record bytes taken
+//       records - filled with up to n records, owned by the caller
+//       record_sz - filled with their sizes
+// Retn: number of records taken
+// -----------------------------------------------------------------------------
+{
+  PendingEntry *entry;
+  uint64_t taken = 0, bytes = 0;
+
+  pthread_mutex_lock(&this->lock);
+
+  while (taken < n && this->count > 0) {
+    entry = this->heaps[PENDINGPOOL_TOP][0];
+    if (entry->record_sz > max_bytes - bytes)
+      break;
+
+    pendingpool_unlink(this, entry);
+    records[taken] = entry->record;
+    record_sz[taken] = entry->record_sz;
+    bytes += entry->record_sz;
+    taken++;
+    free(entry);
+  }
+
+  pthread_mutex_unlock(&this->lock);
+  return taken;
+}
+
+int pendingpool_flush(PendingPool *this, Blockchain *chain, uint64_t n,
+                      uint64_t max_bytes)
+// -----------------------------------------------------------------------------
+// Func: The appender's side, pop the top records and append them as one
+//       batch. If the batch is refused because of a bad signature the
+//       records the batch did not append are retried one by one, so only
+//       the bad ones are dropped. Must be the chain's only appender.
+// Args: this - a pointer to the pool
+//       chain - the chain to append to
+//       n - most records appended
+//       max_bytes - most record bytes appended
+// Retn: number of records appended, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  uint8_t **records;
+  uint64_t *record_sz;
+  uint64_t taken, appended, start, i;
+
+  records = malloc((n ? n : 1)*sizeof(uint8_t *));
+  record_sz = malloc((n ? n : 1)*sizeof(uint64_t));
+  if (records == NULL || record_sz == NULL) {
+    free(records);
+    free(record_sz);
+    return -1;
+  }
+
+  taken = this->pop(this, n, max_bytes, records, record_sz);
+
+  // this is the only appender, so whatever the chain grew by is ours
+  start = chain->length;
+  if (blockchain_append_batch(chain, records, record_sz, taken) == 0) {
+    appended = taken;
+  }
+  else {
+    appended = chain->length - start; // a failed batch may have gone in part
+    for (i = appended; i < taken; i++)
+      appended += chain->insert_front(chain, records[i], record_sz[i]) == 0;
+  }
+
+  for (i = 0; i < taken; i++)
+    free(records[i]);
+  free(records);
+  free(record_sz);
+
+  return (int)appended;
+}
+
+int pendingpool_before(int which, PendingEntry *a, PendingEntry *b)
+// -----------------------------------------------------------------------------
+// Func: Heap order
+// Args: which - PENDINGPOOL_TOP or PENDINGPOOL_BOTTOM
+//       a, b - two entries
+// Retn: 1 if a belongs above b in that heap
+// -----------------------------------------------------------------------------
+{
+  if (a->priority != b->priority)
+    return which == PENDINGPOOL_TOP ? a->priority > b->priority
+                                    : a->priority < b->priority;
+
+  return which == PENDINGPOOL_TOP ? a->seq < b->seq : a->seq > b->seq;
+}
+
+void pendingpool_sift_up(PendingPool *this, int which, uint64_t i)
+// -----------------------------------------------------------------------------
+// Func: Restore heap order above index i
+// Args: this - a pointer to the pool
+//       which - the heap
+//       i - index of an entry that may be out of place
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  PendingEntry **heap = this->heaps[which];
+  PendingEntry *entry = heap[i];
+
+  while (i > 0 && pendingpool_before(which, entry, heap[(i-1)/2])) {
+    heap[i] = heap[(i-1)/2];
+    heap[i]->pos[which] = i;
+    i = (i-1)/2;
+  }
+  heap[i] = entry;
+  entry->pos[which] = i;
+}
+
+void pendingpool_sift_down(PendingPool *this, int which, uint64_t i,
+                           uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Restore heap order below index i
+// Args: this - a pointer to the pool
+//       which - the heap
+//       i - index of an entry that may be out of place
+//       n - number of entries in the heap
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  PendingEntry **heap = this->heaps[which];
+  PendingEntry *entry = heap[i];
+  uint64_t child;
+
+  while ((child = 2*i + 1) < n) {
+    if (child + 1 < n && pendingpool_before(which, heap[child+1], heap[child]))
+      child++;
+    if (!pendingpool_before(which, heap[child], entry))
+      break;
+    heap[i] = heap[child];
+    heap[i]->pos[which] = i;
+    i = child;
+  }
+  heap[i] = entry;
+  entry->pos[which] = i;
+}
+
+void pendingpool_heap_remove(PendingPool *this, int which, uint64_t i,
+                             uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Remove the entry at index i from one heap
+// Args: this - a pointer to the pool
+//       which - the heap
+//       i - index of the entry
+//       n - number of entries in the heap before removal
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  PendingEntry **heap = this->heaps[which];
+
+  if (i == n-1)
+    return;
+
+  heap[i] = heap[n-1]; // the last entry fills the hole, then moves either way
+  heap[i]->pos[which] = i;
+  if (i > 0 && pendingpool_before(which, heap[i], heap[(i-1)/2]))
+    pendingpool_sift_up(this, which, i);
+  else
+    pendingpool_sift_down(this, which, i, n-1);
+}
+
+PendingEntry **pendingpool_slot(PendingPool *this, const uint8_t *digest)
+// -----------------------------------------------------------------------------
+// Func: Find where a digest is, or would be linked, in the hash table
+// Args: this - a pointer to the pool
+//       digest - the record digest
+// Retn: pointer to the link that holds the entry, or to the NULL at the end
+//       of its chain
+// -----------------------------------------------------------------------------
+{
+  PendingEntry **slot;
+  uint64_t h;
+
+  memcpy(&h, digest, sizeof(h));
+  slot = &this->buckets[h & (this->nbuckets - 1)];
+  while (*slot != NULL &&
+         memcmp((*slot)->digest, digest, PENDINGPOOL_DIGEST_SZ))
+    slot = &(*slot)->next;
+
+  return slot;
+}
+
+int pendingpool_grow(PendingPool *this)
+// -----------------------------------------------------------------------------
+// Func: Double the heaps and the hash table
+// Args: this - a pointer to the pool
+// Retn: 0 on success, -1 on allocation failure (the pool is unchanged)
+// -----------------------------------------------------------------------------
+{
+  PendingEntry **top, **bottom, **buckets, *entry, *next;
+  uint64_t h, i;
+
+  top = realloc(this->heaps[PENDINGPOOL_TOP],
+                2*this->cap*sizeof(PendingEntry *));
+  if (top == NULL)
+    return -1;
+  this->heaps[PENDINGPOOL_TOP] = top;
+
+  bottom = realloc(this->heaps[PENDINGPOOL_BOTTOM],
+                   2*this->cap*sizeof(PendingEntry *));
+  if (bottom == NULL)
+    return -1;
+  this->heaps[PENDINGPOOL_BOTTOM] = bottom;
+
+  if ((buckets = calloc(2*this->nbuckets, sizeof(PendingEntry *))) == NULL)
+    return -1;
+
+  this->cap *= 2;
+  for (i = 0; i < this->nbuckets; i++) {
+    for (entry = this->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      memcpy(&h, entry->digest, sizeof(h));
+      entry->next = buckets[h & (2*this->nbuckets - 1)];
+      buckets[h & (2*this->nbuckets - 1)] = entry;
+    }
+  }
+  free(this->buckets);
+  this->buckets = buckets;
+  this->nbuckets *= 2;
+
+  return 0;
+}
+
+void pendingpool_unlink(PendingPool *this, PendingEntry *entry)
+// -----------------------------------------------------------------------------
+// Func: Take an entry out of both heaps and the hash table, without freeing it
+// Args: this - a pointer to the pool
+//       entry - an entry in the pool
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  PendingEntry **slot = pendingpool_slot(this, entry->digest);
+
+  *slot = entry->next;
+  pendingpool_heap_remove(this, PENDINGPOOL_TOP, entry->pos[PENDINGPOOL_TOP],
+                          this->count);
+  pendingpool_heap_remove(this, PENDINGPOOL_BOTTOM,
+                          entry->pos[PENDINGPOOL_BOTTOM], this->count);
+  this->count--;
+  this->bytes -= entry->record_sz;
+}
@@ -0,0 +1,522 @@
+/*
+shardchain.c: sharded chains anchored to a root chain
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE // cpu affinity
+
+#include "shardchain.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+
+// private functions, access through ShardChain object
+int shardchain_submit(ShardChain *this, uint8_t *record, uint64_t record_sz);
+int shardchain_route(ShardChain *this, const uint8_t *record,
+                     uint64_t record_sz);
+int shardchain_flush(ShardChain *this);
+int shardchain_verify(ShardChain *this);
+
+// private functions
+void *shardchain_shard(void *arg);
+void *shardchain_coordinator(void *arg);
+int shardchain_anchor(ShardChain *this);
+void shardchain_stop(ShardChain *this, int nstarted);
+void shardchain_publish(Shard *s);
+
+int shardchain_init(ShardChain *this, int nshards, uint8_t hash_alg,
+                    uint64_t anchor_ns, RecordKeyFunc key, void *key_ctx)
+// -----------------------------------------------------------------------------
+// Func: Start nshards chains, each on its own pinned thread, and the
+//       coordinator that anchors them to the root chain. Shards are spread
+//       over the cpus this process may run on, one per cpu until they run
+//       out.
+// Args: this - a pointer to the new sharded chain
+//       nshards - number of shards, up to SHARDCHAIN_MAX_SHARDS
+//       hash_alg - BLOCKCHAIN_HASH_* for every chain
+//       anchor_ns - time between anchors, 0 to anchor only on flush
+//       key - pulls the routing key out of a record, NULL to route on the
+//             whole record; records without a key are routed whole too
+//       key_ctx - passed to key
+// Retn: 0 on success, -1 if out of memory or a thread can't be started
+// -----------------------------------------------------------------------------
+{
+  pthread_condattr_t attr;
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  int i, ncpus = 0, started, err = 0;
+  Shard *s;
+
+  if (nshards < 1 || nshards > SHARDCHAIN_MAX_SHARDS)
+    return -1;
+
+  this->shards = calloc(nshards, sizeof(Shard));
+  this->anchored = calloc(nshards, sizeof(uint64_t));
+  if (this->shards == NULL || this->anchored == NULL) {
+    free(this->shards);
+    free(this->anchored);
+    return -1;
+  }
+  this->nshards = nshards;
+  this->hash_alg = hash_alg;
+  this->key = key;
+  this->key_ctx = key_ctx;
+  this->anchor_ns = anchor_ns;
+  this->stop = 0;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    for (i = 0; i < CPU_SETSIZE; i++)
+      if (CPU_ISSET(i, &allowed))
+        cpus[ncpus++] = i;
+
+  blockchain_init_hash(&this->root, hash_alg);
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&this->tick, &attr);
+  pthread_condattr_destroy(&attr);
+
+  for (started = 0; started < nshards; started++) {
+    s = &this->shards[started];
+    s->sc = this;
+    s->cpu = ncpus ? cpus[started % ncpus] : -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->room, NULL);
+    if (pthread_create(&s->thread, NULL, &shardchain_shard, s)) {
+      pthread_mutex_destroy(&s->lock);
+      pthread_cond_destroy(&s->work);
+      pthread_cond_destroy(&s->room);
+      err = 1;
+      break;
+    }
+  }
+
+  // each shard makes its own root block on its own thread
+  for (i = 0; i < started; i++) {
+    s = &this->shards[i];
+    pthread_mutex_lock(&s->lock);
+    while (s->length == 0 && !s->failed)
+      pthread_cond_wait(&s->room, &s->lock);
+    err |= s->failed;
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  if (!err && anchor_ns > 0 &&
+      pthread_create(&this->coordinator, NULL, &shardchain_coordinator, this))
+    err = 1;
+
+  if (err) {
+    this->anchor_ns = 0; // no coordinator to stop
+    shardchain_stop(this, started);
+    for (i = 0; i < started; i++) {
+      s = &this->shards[i];
+      blockchain_destroy(&s->chain);
+      pthread_mutex_destroy(&s->lock);
+      pthread_cond_destroy(&s->work);
+      pthread_cond_destroy(&s->room);
+    }
+    blockchain_destroy(&this->root);
+    pthread_mutex_destroy(&this->lock);
+    pthread_cond_destroy(&this->tick);
+    free(this->shards);
+    free(this->anchored);
+    return -1;
+  }
+
+  this->submit = &shardchain_submit;
+  this->route = &shardchain_route;
+  this->flush = &shardchain_flush;
+  this->verify = &shardchain_verify;
+
+  return 0;
+}
+
+void shardchain_destroy(ShardChain *this)
+// -----------------------------------------------------------------------------
+// Func: Append every queued record, stop the threads, anchor the final tips
+//       and free every chain. Must not race with submit.
+// Args: this - a pointer to the sharded chain
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Shard *s;
+  int i;
+
+  shardchain_stop(this, this->nshards);
+  shardchain_anchor(this);
+
+  for (i = 0; i < this->nshards; i++) {
+    s = &this->shards[i];
+    blockchain_destroy(&s->chain);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->work);
+    pthread_cond_destroy(&s->room);
+    free(s->pending);
+    free(s->draining);
+  }
+  blockchain_destroy(&this->root);
+  pthread_mutex_destroy(&this->lock);
+  pthread_cond_destroy(&this->tick);
+  free(this->shards);
+  free(this->anchored);
+  this->shards = NULL;
+  this->anchored = NULL;
+}
+
+int shardchain_submit(ShardChain *this, uint8_t *record, uint64_t record_sz)
+// -----------------------------------------------------------------------------
+// Func: Queue a record on its shard, waiting while the shard has
+//       SHARDCHAIN_MAX_PENDING bytes queued already. Safe from any thread.
+// Args: this - a pointer to the sharded chain
+//       record - the record, copied
+//       record_sz - its size
+// Retn: 0 once queued, -1 if out of memory or the shard's chain has failed
+// -----------------------------------------------------------------------------
+{
+  Shard *s = &this->shards[this->route(this, record, record_sz)];
+  uint64_t need = sizeof(uint64_t) + record_sz, cap;
+  uint8_t *grown;
+  int err = 0;
+
+  pthread_mutex_lock(&s->lock);
+  while (!s->failed && s->pending_sz > 0 &&
+         s->pending_sz + need > SHARDCHAIN_MAX_PENDING)
+    pthread_cond_wait(&s->room, &s->lock);
+
+  if (!s->failed && s->pending_sz + need > s->pending_cap) {
+    cap = s->pending_cap ? s->pending_cap : 4096;
+    while (cap < s->pending_sz + need)
+      cap *= 2;
+    if ((grown = realloc(s->pending, cap)) == NULL) {
+      err = 1;
+    } else {
+      s->pending = grown;
+      s->pending_cap = cap;
+    }
+  }
+
+  if (s->failed || err) {
+    pthread_mutex_unlock(&s->lock);
+    return -1;
+  }
+
+  memcpy(&s->pending[s->pending_sz], &record_sz, sizeof(uint64_t));
+  memcpy(&s->pending[s->pending_sz + sizeof(uint64_t)], record, record_sz);
+  if (s->pending_sz == 0) // the shard only ever sleeps on an empty queue
+    pthread_cond_signal(&s->work);
+  s->pending_sz += need;
+  pthread_mutex_unlock(&s->lock);
+
+  return 0;
+}
+
+int shardchain_route(ShardChain *this, const uint8_t *record,
+                     uint64_t record_sz)
+// -----------------------------------------------------------------------------
+// Func: The shard a record belongs to. Records with the same key always go
+//       to the same shard, so their order is kept.
+// Args: this - a pointer to the sharded chain
+//       record - the record
+//       record_sz - its size
+// Retn: the shard's index
+// -----------------------------------------------------------------------------
+{
+  const uint8_t *key = record;
+  uint64_t key_sz = record_sz;
+
+  if (this->key != NULL &&
+      this->key(this->key_ctx, record, record_sz, &key, &key_sz)) {
+    key = record; // no key, route on the whole record
+    key_sz = record_sz;
+  }
+
+  return (int)(util_buf_hash64(key, key_sz, 0) % (uint64_t)this->nshards);
+}
+
+int shardchain_flush(ShardChain *this)
+// -----------------------------------------------------------------------------
+// Func: Wait until every record queued so far is in its shard's chain, then
+//       anchor the tips. Records submitted meanwhile may or may not be in.
+// Args: this - a pointer to the sharded chain
+// Retn: 0 on success, -1 if a shard has failed or the anchor can't be
+//       appended
+// -----------------------------------------------------------------------------
+{
+  Shard *s;
+  int i, err = 0;
+
+  for (i = 0; i < this->nshards; i++) {
+    s = &this->shards[i];
+    pthread_mutex_lock(&s->lock);
+    while ((s->pending_sz > 0 || s->busy) && !s->failed)
+      pthread_cond_wait(&s->room, &s->lock);
+    err |= s->failed;
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  pthread_mutex_lock(&this->lock);
+  err |= shardchain_anchor(this) != 0;
+  pthread_mutex_unlock(&this->lock);
+
+  return err ? -1 : 0;
+}
+
+int shardchain_verify(ShardChain *this)
+// -----------------------------------------------------------------------------
+// Func: Verify every shard and the root chain, and every anchor against the
+//       shards: each anchored tip must be the hash of that block in its
+//       shard, and no anchor may move a shard backwards. Call after flush,
+//       with no submits running.
+// Args: this - a pointer to the sharded chain
+// Retn: 1 if everything checks out, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  Block anchor;
+  uint64_t *seen, b, len, n;
+  uint8_t *frame, *entry;
+  int i, valid = 1;
+
+  for (i = 0; i < this->nshards && valid; i++)
+    valid = this->shards[i].chain.blockchain_verify_chain(
+              &this->shards[i].chain);
+  if (!valid || !this->root.blockchain_verify_chain(&this->root))
+    return 0;
+
+  if ((seen = calloc(this->nshards, sizeof(uint64_t))) == NULL)
+    return 0;
+
+  for (b = 1; b < this->root.length && valid; b++) {
+    frame = (uint8_t *)this->root.get(&this->root, b);
+    blockheader_decode(frame, &anchor);
+    anchor.record = &frame[RECORD_POS];
+    // the size first, a short record must not be read past its end
+    if (anchor.record_sz != SHARDCHAIN_ANCHOR_SZ(this->nshards) ||
+        memcmp(anchor.record, SHARDCHAIN_ANCHOR_MAGIC, 8)) {
+      valid = 0;
+      break;
+    }
+    memcpy(&n, &anchor.record[8], sizeof(n));
+    if (n != (uint64_t)this->nshards) {
+      valid = 0;
+      break;
+    }
+
+    for (i = 0; i < this->nshards && valid; i++) {
+      chain = &this->shards[i].chain;
+      entry = &anchor.record[SHARDCHAIN_ANCHOR_SZ(i)];
+      memcpy(&len, entry, sizeof(len));
+      valid = len > 0 && len >= seen[i] && len <= chain->length &&
+              !memcmp(&blockchain_get_header(chain, len-1)[CURRHASH_POS],
+                      &entry[8], HASH_SZ);
+      seen[i] = len;
+    }
+  }
+  free(seen);
+
+  return valid;
+}
+
+void *shardchain_shard(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Shard thread: pin to the shard's cpu, make the shard's chain, then
+//       append queued records a batch at a time until stopped and drained
+// Args: arg - the Shard
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  Shard *s = (Shard *)arg;
+  ShardChain *sc = s->sc;
+  cpu_set_t set;
+  uint8_t *batch;
+  uint64_t batch_sz, cap, off, rec_sz;
+  int err = 0, pinned = 0;
+
+  if (s->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(s->cpu, &set);
+    pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+  }
+  blockchain_init_hash(&s->chain, sc->hash_alg); // first touch, after pinning
+
+  pthread_mutex_lock(&s->lock);
+  if (!pinned)
+    s->cpu = -1;
+  shardchain_publish(s);
+  pthread_cond_broadcast(&s->room);
+
+  for (;;) {
+    while (s->pending_sz == 0 && !__atomic_load_n(&sc->stop, __ATOMIC_RELAXED))
+      pthread_cond_wait(&s->work, &s->lock);
+    if (s->pending_sz == 0)
+      break; // stopped, and nothing left
+
+    // swap buffers, so producers fill the other one meanwhile
+    batch = s->pending;
+    batch_sz = s->pending_sz;
+    cap = s->pending_cap;
+    s->pending = s->draining;
+    s->pending_cap = s->draining_cap;
+    s->pending_sz = 0;
+    s->draining = batch;
+    s->draining_cap = cap;
+    s->busy = 1;
+    pthread_cond_broadcast(&s->room);
+    pthread_mutex_unlock(&s->lock);
+
+    for (off = 0; off < batch_sz && !err; off += sizeof(uint64_t) + rec_sz) {
+      memcpy(&rec_sz, &batch[off], sizeof(uint64_t));
+      err = s->chain.insert_front(&s->chain, &batch[off + sizeof(uint64_t)],
+                                  rec_sz) != 0;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->busy = 0;
+    shardchain_publish(s);
+    if (err) { // nothing more will be appended, let waiting producers fail
+      s->failed = 1;
+      s->pending_sz = 0;
+    }
+    pthread_cond_broadcast(&s->room);
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  return NULL;
+}
+
+void shardchain_publish(Shard *s)
+// -----------------------------------------------------------------------------
+// Func: Record the shard chain's length and tip for the coordinator. Called
+//       by the shard thread with the shard locked.
+// Args: s - the shard
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  s->length = s->chain.length;
+  memcpy(s->tip, &((uint8_t *)s->chain.peek_front(&s->chain))[CURRHASH_POS],
+         HASH_SZ);
+}
+
+void *shardchain_coordinator(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Coordinator thread: anchor the shards every anchor_ns until stopped
+// Args: arg - the ShardChain
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  ShardChain *this = (ShardChain *)arg;
+  struct timespec deadline;
+  uint64_t ns;
+
+  pthread_mutex_lock(&this->lock);
+  while (!this->stop) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    ns = deadline.tv_nsec + this->anchor_ns;
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+    while (!this->stop &&
+           pthread_cond_timedwait(&this->tick, &this->lock, &deadline)
+             != ETIMEDOUT)
+      ;
+    if (!this->stop)
+      shardchain_anchor(this);
+  }
+  pthread_mutex_unlock(&this->lock);
+
+  return NULL;
+}
+
+int shardchain_anchor(ShardChain *this)
+// -----------------------------------------------------------------------------
+// Func: Append an anchor committing to every shard's current tip to the root
+//       chain, unless no shard has moved since the last one. Called with the
+//       sharded chain locked, or once its threads are stopped.
+// Args: this - a pointer to the sharded chain
+// Retn: 0 on success, -1 if out of memory or the root can't take the block
+// -----------------------------------------------------------------------------
+{
+  uint64_t n = this->nshards, sz = SHARDCHAIN_ANCHOR_SZ(n), i;
+  uint64_t *lengths;
+  uint8_t *record, *entry;
+  int moved = 0, err;
+  Shard *s;
+
+  record = malloc(sz);
+  lengths = malloc(n*sizeof(uint64_t));
+  if (record == NULL || lengths == NULL) {
+    free(record);
+    free(lengths);
+    return -1;
+  }
+
+  memcpy(record, SHARDCHAIN_ANCHOR_MAGIC, 8);
+  memcpy(&record[8], &n, sizeof(n));
+  for (i = 0; i < n; i++) {
+    s = &this->shards[i];
+    entry = &record[SHARDCHAIN_ANCHOR_SZ(i)];
+    pthread_mutex_lock(&s->lock);
+    lengths[i] = s->length;
+    memcpy(&entry[8], s->tip, HASH_SZ);
+    pthread_mutex_unlock(&s->lock);
+    memcpy(entry, &lengths[i], sizeof(uint64_t));
+    moved |= lengths[i] != this->anchored[i];
+  }
+
+  err = moved && this->root.insert_front(&this->root, record, sz) != 0;
+  if (moved && !err)
+    memcpy(this->anchored, lengths, n*sizeof(uint64_t));
+
+  free(record);
+  free(lengths);
+
+  return err ? -1 : 0;
+}
+
+void shardchain_stop(ShardChain *this, int nstarted)
+// -----------------------------------------------------------------------------
+// Func: Tell the coordinator and the first nstarted shard threads to stop and
+//       join them. Shards append what they have queued before they exit.
+// Args: this - a pointer to the sharded chain
+//       nstarted - shard threads that were started
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Shard *s;
+  int i;
+
+  pthread_mutex_lock(&this->lock);
+  __atomic_store_n(&this->stop, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&this->tick);
+  pthread_mutex_unlock(&this->lock);
+  if (this->anchor_ns > 0)
+    pthread_join(this->coordinator, NULL);
+
+  for (i = 0; i < nstarted; i++) {
+    s = &this->shards[i];
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+  }
+  for (i = 0; i < nstarted; i++)
+    pthread_join(this->shards[i].thread, NULL);
+}
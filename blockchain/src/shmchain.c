@@ -0,0 +1,316 @@
+/*
+shmchain.c: a live chain published to other processes through shared memory
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "shmchain.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+
+// private functions, access through ShmChain object
+int shmchain_tip(ShmChain *this, ShmChainTip *tip);
+uint8_t *shmchain_get(ShmChain *this, uint64_t index);
+
+// private functions
+int shmchain_map(ShmChain *this, const char *name, int writer, uint64_t size);
+void shmchain_hook(void *ctx, Blockchain *chain, uint8_t *blockframe);
+int shmchain_append(ShmChain *this, uint8_t *blockframe);
+
+int shmchain_publish(ShmChain *this, Blockchain *chain, const char *name,
+                     uint64_t max_blocks, uint64_t max_bytes)
+// -----------------------------------------------------------------------------
+// Func: Create a shared segment, copy the chain into it and hook the chain so
+//       that appends are published as they happen. The segment is sized for
+//       max_blocks frames and max_bytes of frame data up front; untouched
+//       pages of it cost nothing.
+// Args: this - a pointer to the new writer side
+//       chain - the chain to publish, must outlive this object
+//       name - the segment's name, as for shm_open ("/chain")
+//       max_blocks - most blocks the segment will hold
+//       max_bytes - most frame bytes the segment will hold
+// Retn: 0 on success, -1 if the segment can't be created, the chain doesn't
+//       fit, a pruned record was dropped, or the chain has no room for a hook
+// -----------------------------------------------------------------------------
+{
+  ShmChainHeader *header;
+  uint64_t offsets_off, data_off, i;
+  uint8_t *frame, *tmp, *buf = NULL;
+  int err = 0;
+
+  offsets_off = (sizeof(ShmChainHeader) + SHMCHAIN_LINE-1) &
+                ~(uint64_t)(SHMCHAIN_LINE-1);
+  data_off = (offsets_off + max_blocks*sizeof(uint64_t) + SHMCHAIN_LINE-1) &
+             ~(uint64_t)(SHMCHAIN_LINE-1);
+
+  if (shmchain_map(this, name, 1, data_off + max_bytes))
+    return -1;
+
+  header = this->header;
+  header->max_blocks = max_blocks;
+  header->max_bytes = max_bytes;
+  header->offsets_off = offsets_off;
+  header->data_off = data_off;
+  header->hash_alg = chain->hash_alg;
+  header->full = 0;
+  header->seq = 0;
+  memset(&header->tip, 0, sizeof(ShmChainTip));
+  this->offsets = (uint64_t *)(this->base + offsets_off);
+  this->data = this->base + data_off;
+  this->chain = chain;
+
+  for (i = 0; i < chain->length && !err; i++) {
+    if ((frame = (uint8_t *)chain->get(chain, i)) == NULL) {
+      tmp = realloc(buf, blockframe_size(blockchain_get_header(chain, i)));
+      err = tmp == NULL || blockchain_read_frame(chain, i, (buf = tmp));
+      frame = buf;
+    }
+    err = err || shmchain_append(this, frame);
+  }
+  free(buf);
+
+  if (err || blockchain_add_hook(chain, &shmchain_hook, this)) {
+    this->chain = NULL;
+    shmchain_detach(this);
+    return -1;
+  }
+
+  // readers check the magic, so it goes in once the segment is usable
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header->magic, SHMCHAIN_MAGIC, sizeof(header->magic));
+
+  return 0;
+}
+
+int shmchain_attach(ShmChain *this, const char *name)
+// -----------------------------------------------------------------------------
+// Func: Map a published chain read only
+// Args: this - a pointer to the new reader side
+//       name - the segment's name, as given to shmchain_publish
+// Retn: 0 on success, -1 if there is no such segment or it is not a chain
+// -----------------------------------------------------------------------------
+{
+  ShmChainHeader *header;
+
+  if (shmchain_map(this, name, 0, 0))
+    return -1;
+
+  header = this->header;
+  if (this->size < sizeof(ShmChainHeader) ||
+      memcmp(header->magic, SHMCHAIN_MAGIC, sizeof(header->magic)) ||
+      this->size < header->data_off + header->max_bytes ||
+      header->offsets_off + header->max_blocks*sizeof(uint64_t) >
+      header->data_off) {
+    shmchain_detach(this);
+    return -1;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  this->offsets = (uint64_t *)(this->base + header->offsets_off);
+  this->data = this->base + header->data_off;
+  this->chain = NULL;
+
+  return 0;
+}
+
+void shmchain_detach(ShmChain *this)
+// -----------------------------------------------------------------------------
+// Func: Unmap the segment. The writer also unhooks its chain and removes the
+//       segment's name; readers still attached keep their mapping.
+// Args: this - a pointer to either side
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  if (this->writer) {
+    if (this->chain != NULL)
+      blockchain_remove_hook(this->chain, &shmchain_hook, this);
+    shm_unlink(this->name);
+  }
+
+  munmap(this->base, this->size);
+  free(this->name);
+  this->name = NULL;
+  this->base = NULL;
+  this->header = NULL;
+  this->chain = NULL;
+  this->tip = NULL;
+  this->get = NULL;
+}
+
+int shmchain_tip(ShmChain *this, ShmChainTip *tip)
+// -----------------------------------------------------------------------------
+// Func: Read the front of the chain, retrying while the writer is changing it
+// Args: this - a pointer to either side
+//       tip - filled with a consistent copy of the tip
+// Retn: 1 if the segment is full and the tip will not move again, else 0
+// -----------------------------------------------------------------------------
+{
+  ShmChainHeader *header = this->header;
+  uint64_t seq;
+
+  for (;;) {
+    seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      _mm_pause();
+      continue;
+    }
+    memcpy(tip, &header->tip, sizeof(ShmChainTip));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq)
+      break;
+  }
+  this->length = tip->length;
+
+  return __atomic_load_n(&header->full, __ATOMIC_ACQUIRE);
+}
+
+uint8_t *shmchain_get(ShmChain *this, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Look up a published frame by index, in place in the segment
+// Args: this - a pointer to either side
+//       index - the index of the block
+// Retn: Pointer to the framed block, read only on the reader side, or NULL if
+//       it has not been published
+// -----------------------------------------------------------------------------
+{
+  ShmChainTip tip;
+
+  if (index >= this->length) // only look at the tip when past the last one
+    this->tip(this, &tip);
+  if (index >= this->length)
+    return NULL;
+
+  return this->data + this->offsets[index];
+}
+
+int shmchain_map(ShmChain *this, const char *name, int writer, uint64_t size)
+// -----------------------------------------------------------------------------
+// Func: Open and map a named segment. The writer unlinks any segment left
+//       under the name and creates a new one, rather than truncating a
+//       segment readers may still have mapped.
+// Args: this - a pointer to the object
+//       name - the segment's name
+//       writer - 1 to create it read write, 0 to map it read only
+//       size - the size to give a new segment, ignored for readers
+// Retn: 0 on success, -1 on failure (EEXIST if another writer created the
+//       name meanwhile)
+// -----------------------------------------------------------------------------
+{
+  struct stat st;
+  int fd;
+
+  this->writer = writer;
+  this->length = 0;
+  this->chain = NULL;
+  if ((this->name = strdup(name)) == NULL)
+    return -1;
+
+  if (writer) {
+    shm_unlink(name); // live readers keep the old segment
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  }
+  else
+    fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    free(this->name);
+    return -1;
+  }
+
+  if (writer ? ftruncate(fd, size) : fstat(fd, &st)) {
+    close(fd);
+    if (writer)
+      shm_unlink(name);
+    free(this->name);
+    return -1;
+  }
+  this->size = writer ? size : (uint64_t)st.st_size;
+
+  this->base = mmap(NULL, this->size, writer ? PROT_READ | PROT_WRITE
+                                             : PROT_READ,
+                    MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the segment open
+  if (this->base == MAP_FAILED) {
+    if (writer)
+      shm_unlink(name);
+    free(this->name);
+    return -1;
+  }
+
+  this->header = (ShmChainHeader *)this->base;
+  this->tip = &shmchain_tip;
+  this->get = &shmchain_get;
+
+  return 0;
+}
+
+void shmchain_hook(void *ctx, Blockchain *chain, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Chain hook, publishes a newly appended block
+// Args: ctx - this writer
+//       chain - the chain that was appended to
+//       blockframe - the new block
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  (void) chain;
+
+  shmchain_append((ShmChain *)ctx, blockframe);
+}
+
+int shmchain_append(ShmChain *this, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: Copy a frame into the segment, then move the tip past it. The frame
+//       and its offset are written before the seqlock is released, so a
+//       reader that sees the new tip also sees the frame.
+// Args: this - the writer
+//       blockframe - the next block of the chain
+// Retn: 0 on success, -1 if the segment is full
+// -----------------------------------------------------------------------------
+{
+  ShmChainHeader *header = this->header;
+  uint64_t size = blockframe_size(blockframe);
+  uint64_t length = header->tip.length;
+  uint64_t data_sz = header->tip.data_sz;
+  uint64_t seq = header->seq;
+
+  if (header->full || length == header->max_blocks ||
+      size > header->max_bytes - data_sz) {
+    __atomic_store_n(&header->full, 1, __ATOMIC_RELEASE);
+    return -1;
+  }
+
+  memcpy(this->data + data_sz, blockframe, size);
+  this->offsets[length] = data_sz;
+
+  __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  header->tip.length = length + 1;
+  header->tip.data_sz = data_sz + size;
+  memcpy(&header->tip.timestamp, blockframe + TS_POS, WORD_SZ);
+  memcpy(header->tip.hash, blockframe + CURRHASH_POS, HASH_SZ);
+  __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+
+  this->length = length + 1;
+
+  return 0;
+}
@@ -0,0 +1,402 @@
+/*
+signature.c: Ed25519 record signatures and verification cache implementation
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "signature.h"
+#include "blake3.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+typedef struct SignatureTask SignatureTask;
+typedef struct SignatureBatch SignatureBatch;
+
+struct SignatureBatch
+// -----------------------------------------------------------------------------
+// Description
+//  One call's tasks on the pool, so the caller waits for its own tasks only
+//  and not for whatever else the pool is running
+// -----------------------------------------------------------------------------
+{
+  pthread_mutex_t lock;
+  pthread_cond_t done;  // signalled when pending reaches 0
+  int pending;          // tasks submitted and not finished
+};
+
+struct SignatureTask
+// -----------------------------------------------------------------------------
+// Description
+//  A contiguous range of records [lo, hi) checked by one worker
+// -----------------------------------------------------------------------------
+{
+  SignatureBatch *batch;
+  SigCache *cache;
+  uint8_t **records;
+  const uint64_t *record_sz;
+  uint64_t lo;
+  uint64_t hi;
+  int valid;            // result, 1 if every record in range checked out
+};
+
+// private functions, access through SigCache object
+int sigcache_contains(SigCache *this, const uint8_t *digest);
+void sigcache_insert(SigCache *this, const uint8_t *digest);
+
+// private functions
+int signature_verify_one(SigCache *cache, EVP_MD_CTX *ctx,
+                         const uint8_t *record, uint64_t record_sz);
+void signature_verify_range(void *arg);
+void signature_verify_task(void *arg);
+
+int sigcache_init(SigCache *this, uint64_t nslots)
+// -----------------------------------------------------------------------------
+// Func: Initialize an empty verification cache
+// Args: this - a pointer to the new cache
+//       nslots - number of records remembered, rounded up to a power of two
+// Retn: 0 on success, -1 on allocation failure
+// -----------------------------------------------------------------------------
+{
+  this->nslots = SIGCACHE_WAYS;
+  while (this->nslots < nslots)
+    this->nslots <<= 1;
+
+  this->slots = malloc(this->nslots*SIGCACHE_DIGEST_SZ);
+  this->used = calloc(this->nslots, 1);
+  if (this->slots == NULL || this->used == NULL) {
+    free(this->slots);
+    free(this->used);
+    return -1;
+  }
+
+  this->hits = 0;
+  this->misses = 0;
+  this->seed = 0x853c49e6748fea9bULL;
+  pthread_mutex_init(&this->lock, NULL);
+
+  this->contains = &sigcache_contains;
+  this->insert = &sigcache_insert;
+
+  return 0;
+}
+
+void sigcache_destroy(SigCache *this)
+// -----------------------------------------------------------------------------
+// Func: Destroy a verification cache
+// Args: this - a pointer to the cache
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  free(this->slots);
+  free(this->used);
+  this->slots = NULL;
+  this->used = NULL;
+  this->nslots = 0;
+  pthread_mutex_destroy(&this->lock);
+}
+
+int sigcache_contains(SigCache *this, const uint8_t *digest)
+// -----------------------------------------------------------------------------
+// Func: Look a record up in the cache
+// Args: this - a pointer to the cache
+//       digest - SIGCACHE_DIGEST_SZ byte digest of the record
+// Retn: 1 if the record's signature was already verified, 0 if not
+// -----------------------------------------------------------------------------
+{
+  uint64_t set, i;
+  int found = 0;
+
+  memcpy(&set, digest, sizeof(set));
+  set &= (this->nslots - 1) & ~(uint64_t)(SIGCACHE_WAYS - 1);
+
+  pthread_mutex_lock(&this->lock);
+  for (i = set; !found && i < set + SIGCACHE_WAYS; i++)
+    found = this->used[i] &&
+            !memcmp(&this->slots[i*SIGCACHE_DIGEST_SZ], digest,
+                    SIGCACHE_DIGEST_SZ);
+  if (found)
+    this->hits++;
+  else
+    this->misses++;
+  pthread_mutex_unlock(&this->lock);
+
+  return found;
+}
+
+void sigcache_insert(SigCache *this, const uint8_t *digest)
+// -----------------------------------------------------------------------------
+// Func: Remember a record whose signature checked out
+// Args: this - a pointer to the cache
+//       digest - SIGCACHE_DIGEST_SZ byte digest of the record
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t set, i, victim;
+
+  memcpy(&set, digest, sizeof(set));
+  set &= (this->nslots - 1) & ~(uint64_t)(SIGCACHE_WAYS - 1);
+
+  pthread_mutex_lock(&this->lock);
+  for (i = set; i < set + SIGCACHE_WAYS && this->used[i]; i++)
+    ;
+  if (i == set + SIGCACHE_WAYS) { // set is full, replace a random slot
+    this->seed = this->seed*6364136223846793005ULL + 1442695040888963407ULL;
+    victim = this->seed >> 62;
+    i = set + victim % SIGCACHE_WAYS;
+  }
+  memcpy(&this->slots[i*SIGCACHE_DIGEST_SZ], digest, SIGCACHE_DIGEST_SZ);
+  this->used[i] = 1;
+  pthread_mutex_unlock(&this->lock);
+}
+
+int signature_keypair(uint8_t *seckey, uint8_t *pubkey)
+// -----------------------------------------------------------------------------
+// Func: Generate a new Ed25519 key pair
+// Args: seckey - SIGNATURE_SECKEY_SZ bytes, the private key seed
+//       pubkey - SIGNATURE_PUBKEY_SZ bytes
+// Retn: 0 on success, -1 on failure
+// -----------------------------------------------------------------------------
+{
+  EVP_PKEY_CTX *ctx;
+  EVP_PKEY *pkey = NULL;
+  size_t sec_sz = SIGNATURE_SECKEY_SZ;
+  size_t pub_sz = SIGNATURE_PUBKEY_SZ;
+  int err;
+
+  if ((ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL)) == NULL)
+    return -1;
+
+  err = EVP_PKEY_keygen_init(ctx) != 1 || EVP_PKEY_keygen(ctx, &pkey) != 1 ||
+        EVP_PKEY_get_raw_private_key(pkey, seckey, &sec_sz) != 1 ||
+        EVP_PKEY_get_raw_public_key(pkey, pubkey, &pub_sz) != 1;
+
+  EVP_PKEY_free(pkey);
+  EVP_PKEY_CTX_free(ctx);
+
+  return err ? -1 : 0;
+}
+
+int signature_sign(const uint8_t *seckey, const uint8_t *payload,
+                   uint64_t payload_sz, uint8_t *record)
+// -----------------------------------------------------------------------------
+// Func: Build a signed record, see signature.h for the layout
+// Args: seckey - the signer's private key
+//       payload - the application data
+//       payload_sz - its size
+//       record - payload_sz + SIGNATURE_TRAILER_SZ bytes, filled in
+// Retn: 0 on success, -1 on failure
+// -----------------------------------------------------------------------------
+{
+  EVP_PKEY *pkey;
+  EVP_MD_CTX *ctx;
+  uint8_t *pubkey = &record[payload_sz];
+  uint8_t *sig = &pubkey[SIGNATURE_PUBKEY_SZ];
+  size_t pub_sz = SIGNATURE_PUBKEY_SZ;
+  size_t sig_sz = SIGNATURE_SIG_SZ;
+  int err;
+
+  pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, seckey,
+                                      SIGNATURE_SECKEY_SZ);
+  if (pkey == NULL)
+    return -1;
+  if ((ctx = EVP_MD_CTX_new()) == NULL) {
+    EVP_PKEY_free(pkey);
+    return -1;
+  }
+
+  memmove(record, payload, payload_sz);
+  err = EVP_PKEY_get_raw_public_key(pkey, pubkey, &pub_sz) != 1 ||
+        EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey) != 1 ||
+        EVP_DigestSign(ctx, sig, &sig_sz, record, payload_sz) != 1;
+  memcpy(&sig[SIGNATURE_SIG_SZ], SIGNATURE_MAGIC, SIGNATURE_MAGIC_SZ);
+
+  EVP_MD_CTX_free(ctx);
+  EVP_PKEY_free(pkey);
+
+  return err ? -1 : 0;
+}
+
+int signature_present(const uint8_t *record, uint64_t record_sz)
+// -----------------------------------------------------------------------------
+// Func: Tell signed records from plain ones
+// Args: record - the record
+//       record_sz - its size
+// Retn: 1 if the record carries a signature trailer, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  return record_sz >= SIGNATURE_TRAILER_SZ &&
+         !memcmp(&record[record_sz - SIGNATURE_MAGIC_SZ], SIGNATURE_MAGIC,
+                 SIGNATURE_MAGIC_SZ);
+}
+
+int signature_verify_one(SigCache *cache, EVP_MD_CTX *ctx,
+                         const uint8_t *record, uint64_t record_sz)
+// -----------------------------------------------------------------------------
+// Func: Check one record, consulting and filling the cache
+// Args: cache - verification cache, or NULL
+//       ctx - a digest context owned by the calling thread
+//       record - the record
+//       record_sz - its size
+// Retn: 1 if the record is unsigned or its signature is valid, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  uint8_t digest[SIGCACHE_DIGEST_SZ];
+  uint64_t payload_sz;
+  const uint8_t *pubkey, *sig;
+  EVP_PKEY *pkey;
+  int valid;
+
+  if (!signature_present(record, record_sz))
+    return 1;
+
+  if (cache != NULL) {
+    blake3_hash(record, record_sz, digest);
+    if (cache->contains(cache, digest))
+      return 1;
+  }
+
+  payload_sz = record_sz - SIGNATURE_TRAILER_SZ;
+  pubkey = &record[payload_sz];
+  sig = &pubkey[SIGNATURE_PUBKEY_SZ];
+
+  pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, pubkey,
+                                     SIGNATURE_PUBKEY_SZ);
+  if (pkey == NULL)
+    return 0;
+
+  valid = EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+          EVP_DigestVerify(ctx, sig, SIGNATURE_SIG_SZ, record, payload_sz) == 1;
+  EVP_MD_CTX_reset(ctx);
+  EVP_PKEY_free(pkey);
+
+  if (valid && cache != NULL)
+    cache->insert(cache, digest);
+
+  return valid;
+}
+
+void signature_verify_range(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Worker task, check every record in [lo, hi)
+// Args: arg - a SignatureTask
+// Retn: None, result is left in the task
+// -----------------------------------------------------------------------------
+{
+  SignatureTask *task = (SignatureTask *)arg;
+  EVP_MD_CTX *ctx;
+  uint64_t i;
+
+  if ((ctx = EVP_MD_CTX_new()) == NULL) {
+    task->valid = 0;
+    return;
+  }
+
+  for (i = task->lo; task->valid && i < task->hi; i++)
+    task->valid = signature_verify_one(task->cache, ctx, task->records[i],
+                                       task->record_sz[i]);
+
+  EVP_MD_CTX_free(ctx);
+}
+
+void signature_verify_task(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Pool task, check the range and count it off its batch
+// Args: arg - a SignatureTask
+// Retn: None, result is left in the task
+// -----------------------------------------------------------------------------
+{
+  SignatureTask *task = (SignatureTask *)arg;
+  SignatureBatch *batch = task->batch;
+
+  signature_verify_range(task);
+
+  pthread_mutex_lock(&batch->lock);
+  if (--batch->pending == 0)
+    pthread_cond_signal(&batch->done);
+  pthread_mutex_unlock(&batch->lock);
+}
+
+int signature_verify_batch(SigCache *cache, ThreadPool *pool,
+                           uint8_t **records, const uint64_t *record_sz,
+                           uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Check the signatures of a batch of records, one contiguous range per
+//       worker. Unsigned records pass; cached records are not checked again.
+// Args: cache - verification cache, or NULL
+//       pool - thread pool, or NULL to run on the calling thread
+//       records - the records
+//       record_sz - their sizes
+//       n - number of records
+// Retn: 1 if every record passes, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  SignatureTask one, *tasks;
+  SignatureBatch batch;
+  uint64_t step;
+  int t, ntasks, valid = 1;
+
+  if (pool == NULL || pool->nthreads < 2 || n < 2) {
+    one.batch = NULL;
+    one.cache = cache;
+    one.records = records;
+    one.record_sz = record_sz;
+    one.lo = 0;
+    one.hi = n;
+    one.valid = 1;
+    signature_verify_range(&one);
+    return one.valid;
+  }
+
+  ntasks = pool->nthreads;
+  if ((tasks = malloc(ntasks*sizeof(SignatureTask))) == NULL)
+    return 0;
+
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.done, NULL);
+  batch.pending = 0;
+
+  step = (n + ntasks - 1) / ntasks;
+  for (t = 0; t < ntasks; t++) {
+    tasks[t].batch = &batch;
+    tasks[t].cache = cache;
+    tasks[t].records = records;
+    tasks[t].record_sz = record_sz;
+    tasks[t].lo = t*step < n ? t*step : n;
+    tasks[t].hi = (t+1)*step < n ? (t+1)*step : n;
+    tasks[t].valid = 1;
+    pthread_mutex_lock(&batch.lock);
+    batch.pending++;
+    pthread_mutex_unlock(&batch.lock);
+    if (pool->submit(pool, &signature_verify_task, &tasks[t]))
+      signature_verify_task(&tasks[t]); // run it here instead
+  }
+
+  pthread_mutex_lock(&batch.lock);
+  while (batch.pending > 0)
+    pthread_cond_wait(&batch.done, &batch.lock);
+  pthread_mutex_unlock(&batch.lock);
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.done);
+
+  for (t = 0; t < ntasks; t++)
+    valid &= tasks[t].valid;
+
+  free(tasks);
+  return valid;
+}
@@ -0,0 +1,357 @@
+/*
+snapshot.c: export a chain to a single file and import it back
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "snapshot.h"
+#include "blockchain.h"
+#include "threadpool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SNAPSHOT_IO_BUF_SZ (1 << 20)
+
+typedef struct SnapshotVerifyTask SnapshotVerifyTask;
+
+struct SnapshotVerifyTask
+// -----------------------------------------------------------------------------
+// Description
+//  A contiguous range of frames [lo, hi) checked by one worker
+// -----------------------------------------------------------------------------
+{
+  uint8_t *map;         // the mapped snapshot file
+  uint64_t map_sz;
+  uint64_t *offsets;    // the snapshot's index
+  uint64_t lo;
+  uint64_t hi;
+  uint8_t hash_alg;     // the chain's, read from the root frame
+  uint64_t assumed;     // frames below this only have their links checked
+  int valid;            // result, 1 if every frame in range checked out
+};
+
+// private functions
+void snapshot_verify_range(void *arg);
+const uint8_t *snapshot_frame_hash(void *ctx, uint64_t height);
+uint8_t *snapshot_frame(uint8_t *map, uint64_t map_sz, uint64_t offset,
+                        uint64_t *blocksize);
+
+int snapshot_export(Blockchain *chain, const char *pathname)
+// -----------------------------------------------------------------------------
+// Func: Write the whole chain out to a snapshot file, see snapshot.h
+// Args: chain - the blockchain to export
+//       pathname - the pathname of the file which will be created
+// Retn: 0 on success, -1 on any I/O error or if a pruned record was dropped
+// -----------------------------------------------------------------------------
+{
+  FILE *fp;
+  uint64_t i, blocksize, version, reserved, offset;
+  uint64_t *offsets;
+  uint8_t *frame, *tmp;
+  uint8_t *buf = NULL;
+  char *iobuf;
+  int err = 0;
+
+  if ((fp = fopen(pathname, "wb")) == NULL)
+    return -1;
+
+  iobuf = malloc(SNAPSHOT_IO_BUF_SZ);
+  offsets = malloc(chain->length*sizeof(uint64_t));
+  if (iobuf == NULL || offsets == NULL) {
+    fclose(fp);
+    free(iobuf);
+    free(offsets);
+    return -1;
+  }
+  setvbuf(fp, iobuf, _IOFBF, SNAPSHOT_IO_BUF_SZ);
+
+  version = SNAPSHOT_VERSION;
+  reserved = 0;
+  err |= fwrite(SNAPSHOT_MAGIC, WORD_SZ, 1, fp) != 1;
+  err |= fwrite(&version, WORD_SZ, 1, fp) != 1;
+  err |= fwrite(&chain->length, WORD_SZ, 1, fp) != 1;
+  err |= fwrite(&reserved, WORD_SZ, 1, fp) != 1;
+
+  offset = SNAPSHOT_HEADER_SZ;
+  for (i = 0; !err && i < chain->length; i++) {
+    if ((frame = (uint8_t *)chain->get(chain, i)) == NULL) { // pruned
+      blocksize = blockframe_size(blockchain_get_header(chain, i));
+      if ((tmp = realloc(buf, blocksize)) == NULL ||
+          blockchain_read_frame(chain, i, (buf = tmp))) {
+        err = 1;
+        break;
+      }
+      frame = buf;
+    }
+    blocksize = blockframe_size(frame);
+
+    offsets[i] = offset;
+    err |= fwrite(&blocksize, WORD_SZ, 1, fp) != 1;
+    err |= fwrite(frame, blocksize, 1, fp) != 1;
+    offset += WORD_SZ + blocksize;
+  }
+
+  // index footer, then the trailer that locates it
+  if (!err && chain->length > 0)
+    err |= fwrite(offsets, chain->length*WORD_SZ, 1, fp) != 1;
+  err |= fwrite(&offset, WORD_SZ, 1, fp) != 1;
+  err |= fwrite(&chain->length, WORD_SZ, 1, fp) != 1;
+  err |= fwrite(SNAPSHOT_INDEX_MAGIC, WORD_SZ, 1, fp) != 1; // includes the nul
+
+  err |= fclose(fp) != 0;
+  free(iobuf);
+  free(offsets);
+  free(buf);
+
+  return err ? -1 : 0;
+}
+
+int snapshot_import(Blockchain *chain, const char *pathname, int nthreads,
+                    const CheckpointSet *checkpoints)
+// -----------------------------------------------------------------------------
+// Func: Load a snapshot into a new chain. Frames are verified in batches,
+//       each batch split across a pool of workers, and a batch is only stored
+//       (and indexed) once all of its frames have checked out, so the file is
+//       read roughly once and hashing runs on every core. Frames below the
+//       newest checkpoint the snapshot matches are not rehashed, only
+//       checked to link up to it (see checkpoint.h).
+// Args: chain - an uninitialized blockchain, initialized here on success
+//       pathname - the snapshot file
+//       nthreads - number of verification threads, 0 for one per cpu
+//       checkpoints - trusted blocks, NULL to rehash every frame
+// Retn: 0 on success, -1 if the file is malformed or any block fails
+//       verification. On failure the chain is left uninitialized.
+// -----------------------------------------------------------------------------
+{
+  int fd;
+  struct stat st;
+  uint8_t *map, *frame;
+  uint64_t map_sz, version, count, index_off, i, lo, hi, step, blocksize;
+  uint64_t *offsets;
+  ThreadPool pool;
+  SnapshotVerifyTask *tasks, lookup;
+  Block root;
+  uint8_t hash_alg;
+  int t, ntasks, err = 0;
+
+  if ((fd = open(pathname, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) || st.st_size < SNAPSHOT_HEADER_SZ + SNAPSHOT_TRAILER_SZ) {
+    close(fd);
+    return -1;
+  }
+  map_sz = (uint64_t)st.st_size;
+  map = mmap(NULL, map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping holds its own reference
+  if (map == MAP_FAILED)
+    return -1;
+  madvise(map, map_sz, MADV_SEQUENTIAL);
+
+  // header and trailer must agree before any frame is trusted
+  memcpy(&version, &map[WORD_SZ], WORD_SZ);
+  memcpy(&count, &map[2*WORD_SZ], WORD_SZ);
+  memcpy(&index_off, &map[map_sz - SNAPSHOT_TRAILER_SZ], WORD_SZ);
+  memcpy(&i, &map[map_sz - SNAPSHOT_TRAILER_SZ + WORD_SZ], WORD_SZ);
+  if (memcmp(map, SNAPSHOT_MAGIC, WORD_SZ) || version != SNAPSHOT_VERSION ||
+      memcmp(&map[map_sz - WORD_SZ], SNAPSHOT_INDEX_MAGIC, WORD_SZ) ||
+      i != count || count == 0 ||
+      count > (map_sz - SNAPSHOT_TRAILER_SZ) / WORD_SZ ||
+      index_off != map_sz - SNAPSHOT_TRAILER_SZ - count*WORD_SZ) {
+    munmap(map, map_sz);
+    return -1;
+  }
+
+  offsets = malloc(count*sizeof(uint64_t));
+  if (offsets == NULL || threadpool_init(&pool, nthreads)) {
+    free(offsets);
+    munmap(map, map_sz);
+    return -1;
+  }
+  memcpy(offsets, &map[index_off], count*sizeof(uint64_t));
+
+  // every worker needs the chain's hash function before the root is stored
+  frame = snapshot_frame(map, index_off, offsets[0], &blocksize);
+  if (frame == NULL) {
+    threadpool_destroy(&pool);
+    free(offsets);
+    munmap(map, map_sz);
+    return -1;
+  }
+  blockheader_decode(frame, &root);
+  root.record = &frame[RECORD_POS];
+  hash_alg = blockchain_root_hash_alg(&root);
+
+  lookup.map = map;
+  lookup.map_sz = index_off;
+  lookup.offsets = offsets;
+  lookup.assumed = checkpoints != NULL ?
+                   checkpoints->find(checkpoints, count, &snapshot_frame_hash,
+                                     &lookup) : 0;
+
+  ntasks = pool.nthreads;
+  if ((tasks = malloc(ntasks*sizeof(SnapshotVerifyTask))) == NULL) {
+    threadpool_destroy(&pool);
+    free(offsets);
+    munmap(map, map_sz);
+    return -1;
+  }
+  blockchain_init_empty(chain);
+
+  for (lo = 0; !err && lo < count; lo = hi) {
+    hi = lo + SNAPSHOT_BATCH < count ? lo + SNAPSHOT_BATCH : count;
+    step = (hi - lo + ntasks - 1) / ntasks;
+
+    // verify pass, one range per worker
+    for (t = 0; t < ntasks; t++) {
+      tasks[t].map = map;
+      tasks[t].map_sz = index_off;
+      tasks[t].offsets = offsets;
+      tasks[t].lo = lo + t*step < hi ? lo + t*step : hi;
+      tasks[t].hi = lo + (t+1)*step < hi ? lo + (t+1)*step : hi;
+      tasks[t].hash_alg = hash_alg;
+      tasks[t].assumed = lookup.assumed;
+      tasks[t].valid = 1;
+      if (pool.submit(&pool, &snapshot_verify_range, &tasks[t]))
+        snapshot_verify_range(&tasks[t]); // run it here instead
+    }
+    pool.wait(&pool);
+
+    for (t = 0; t < ntasks; t++)
+      err |= !tasks[t].valid;
+
+    // store pass, builds the chain's index while the batch is still hot
+    for (i = lo; !err && i < hi; i++) {
+      frame = snapshot_frame(map, index_off, offsets[i], &blocksize);
+      err |= blockchain_store(chain, frame, blocksize) != 0;
+    }
+
+    madvise(map, offsets[lo] & ~(uint64_t)(sysconf(_SC_PAGESIZE)-1),
+            MADV_DONTNEED); // done with everything before this batch
+  }
+
+  threadpool_destroy(&pool);
+  free(tasks);
+  free(offsets);
+  munmap(map, map_sz);
+
+  if (err) {
+    blockchain_destroy(chain);
+    return -1;
+  }
+
+  return 0;
+}
+
+uint8_t *snapshot_frame(uint8_t *map, uint64_t map_sz, uint64_t offset,
+                        uint64_t *blocksize)
+// -----------------------------------------------------------------------------
+// Func: Locate a frame in the mapped file, bounds checked against the index
+// Args: map - the mapped snapshot
+//       map_sz - end of the frame area (start of the index footer)
+//       offset - offset of the frame's size word
+//       blocksize - set to the size of the framed block
+// Retn: pointer to the framed block, or NULL if it does not fit in the file
+// -----------------------------------------------------------------------------
+{
+  if (map_sz < SNAPSHOT_HEADER_SZ + WORD_SZ + BLOCK_HEADER_SZ ||
+      offset < SNAPSHOT_HEADER_SZ ||
+      offset > map_sz - WORD_SZ - BLOCK_HEADER_SZ)
+    return NULL;
+
+  memcpy(blocksize, &map[offset], WORD_SZ);
+  if (*blocksize < BLOCK_HEADER_SZ ||
+      *blocksize > map_sz - offset - WORD_SZ ||
+      blockframe_size(&map[offset + WORD_SZ]) != *blocksize)
+    return NULL;
+
+  return &map[offset + WORD_SZ];
+}
+
+void snapshot_verify_range(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Worker task, verify every frame in [lo, hi) against its predecessor.
+//       Headers are decoded from the mapping and records hashed in place,
+//       nothing is copied.
+// Args: arg - a SnapshotVerifyTask
+// Retn: None, result is left in the task
+// -----------------------------------------------------------------------------
+{
+  SnapshotVerifyTask *task = (SnapshotVerifyTask *)arg;
+  uint8_t *frame, *prev_frame;
+  uint64_t i, blocksize, prev_blocksize;
+  uint8_t zero[HASH_SZ];
+  Block block, prev_block;
+
+  memset(zero, 0, HASH_SZ);
+
+  for (i = task->lo; task->valid && i < task->hi; i++) {
+    frame = snapshot_frame(task->map, task->map_sz, task->offsets[i],
+                           &blocksize);
+    if (frame == NULL) {
+      task->valid = 0;
+      break;
+    }
+    blockheader_decode(frame, &block);
+    block.record = &frame[RECORD_POS];
+
+    if (i == 0) {
+      task->valid = i < task->assumed ? block.index == 0 &&
+                                        !memcmp(block.prevhash, zero, HASH_SZ)
+                                      : blockchain_verify_root(&block);
+      continue;
+    }
+
+    prev_frame = snapshot_frame(task->map, task->map_sz, task->offsets[i-1],
+                                &prev_blocksize);
+    if (prev_frame == NULL) {
+      task->valid = 0;
+      break;
+    }
+    blockheader_decode(prev_frame, &prev_block);
+
+    if (i < task->assumed) // below a checkpoint, headers only
+      task->valid = blockchain_verify_links(&block, &prev_block);
+    else
+      task->valid = blockchain_verify_block(&block, &prev_block,
+                                            task->hash_alg);
+  }
+}
+
+const uint8_t *snapshot_frame_hash(void *ctx, uint64_t height)
+// -----------------------------------------------------------------------------
+// Func: CheckpointHashFunc over the frames of a mapped snapshot
+// Args: ctx - a SnapshotVerifyTask with the map and its index
+//       height - the block
+// Retn: the hash in the block's header, NULL if its frame is malformed
+// -----------------------------------------------------------------------------
+{
+  SnapshotVerifyTask *lookup = (SnapshotVerifyTask *)ctx;
+  uint64_t blocksize;
+  uint8_t *frame;
+
+  frame = snapshot_frame(lookup->map, lookup->map_sz, lookup->offsets[height],
+                         &blocksize);
+
+  return frame != NULL ? &frame[CURRHASH_POS] : NULL;
+}
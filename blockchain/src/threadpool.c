@@ -0,0 +1,344 @@
+/*
+threadpool.c: method definitions for threadpool structure
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "threadpool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define THREADPOOL_INIT_CAP 64
+
+// the pool and worker running on this thread, so submit can find its deque
+static __thread ThreadPool *threadpool_current = NULL;
+static __thread int threadpool_current_id = -1;
+
+// private functions, access through ThreadPool object
+int threadpool_submit(ThreadPool *this, void (*fn)(void *), void *arg);
+void threadpool_wait(ThreadPool *this);
+
+// private functions
+void *threadpool_worker(void *arg);
+void threadpool_stop(ThreadPool *this, int nstarted);
+int threadpool_push(ThreadPoolDeque *deque, ThreadPoolTask *task);
+int threadpool_pop(ThreadPoolDeque *deque, int newest, ThreadPoolTask *task);
+int threadpool_take(ThreadPool *this, int id, ThreadPoolTask *task);
+
+int threadpool_init(ThreadPool *this, int nthreads)
+// -----------------------------------------------------------------------------
+// Func: Start the worker threads
+// Args: this - a pointer to this threadpool object
+//       nthreads - number of workers, 0 or less for one per online cpu
+// Retn: 0 on success, -1 if the workers could not be started
+// -----------------------------------------------------------------------------
+{
+  int i, err = 0;
+
+  if (nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+
+  this->nthreads = nthreads;
+  this->queued = 0;
+  this->pending = 0;
+  this->sleeping = 0;
+  this->stop = 0;
+
+  this->submit = &threadpool_submit;
+  this->wait = &threadpool_wait;
+
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->work, NULL);
+  pthread_cond_init(&this->idle, NULL);
+
+  // the shared queue sits after the workers' deques
+  this->threads = malloc(nthreads*sizeof(pthread_t));
+  this->deques = calloc(nthreads + 1, sizeof(ThreadPoolDeque));
+  if (this->threads == NULL || this->deques == NULL) {
+    free(this->deques);
+    this->deques = NULL;
+    threadpool_stop(this, 0);
+    return -1;
+  }
+  for (i = 0; i <= nthreads; i++) {
+    this->deques[i].pool = this;
+    pthread_mutex_init(&this->deques[i].lock, NULL);
+    this->deques[i].cap = THREADPOOL_INIT_CAP;
+    this->deques[i].tasks = malloc(THREADPOOL_INIT_CAP*sizeof(ThreadPoolTask));
+    err |= this->deques[i].tasks == NULL;
+  }
+  if (err) {
+    threadpool_stop(this, 0);
+    return -1;
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&this->threads[i], NULL, &threadpool_worker,
+                       &this->deques[i])) {
+      threadpool_stop(this, i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void threadpool_destroy(ThreadPool *this)
+// -----------------------------------------------------------------------------
+// Func: Finish all queued work, then stop and join the workers
+// Args: this - a pointer to this threadpool object
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  threadpool_stop(this, this->nthreads);
+}
+
+int threadpool_self(ThreadPool *this)
+// -----------------------------------------------------------------------------
+// Func: Tell which of this pool's workers is running the caller, so tasks can
+//       keep per worker state
+// Args: this - a pointer to this threadpool object
+// Retn: the worker's number in [0, nthreads), -1 off the pool's threads
+// -----------------------------------------------------------------------------
+{
+  return threadpool_current == this ? threadpool_current_id : -1;
+}
+
+int threadpool_submit(ThreadPool *this, void (*fn)(void *), void *arg)
+// -----------------------------------------------------------------------------
+// Func: Queue a task for the workers: on the caller's own deque when a task
+//       submits it, else on the shared queue
+// Args: this - a pointer to this threadpool object
+//       fn - the function to run
+//       arg - passed to fn
+// Retn: 0 on success, -1 if the queue could not grow
+// -----------------------------------------------------------------------------
+{
+  ThreadPoolTask task;
+  int id = threadpool_self(this);
+
+  task.fn = fn;
+  task.arg = arg;
+
+  // counted first, so the task can't finish before it is pending
+  __atomic_add_fetch(&this->pending, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&this->queued, 1, __ATOMIC_SEQ_CST);
+
+  if (threadpool_push(&this->deques[id >= 0 ? id : this->nthreads], &task)) {
+    __atomic_sub_fetch(&this->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_sub_fetch(&this->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+      pthread_mutex_lock(&this->lock);
+      pthread_cond_broadcast(&this->idle);
+      pthread_mutex_unlock(&this->lock);
+    }
+    return -1;
+  }
+
+  // a worker counts itself as sleeping before it last looks at queued
+  if (__atomic_load_n(&this->sleeping, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&this->lock);
+    pthread_cond_signal(&this->work);
+    pthread_mutex_unlock(&this->lock);
+  }
+
+  return 0;
+}
+
+void threadpool_wait(ThreadPool *this)
+// -----------------------------------------------------------------------------
+// Func: Block until every submitted task has finished running. Not to be
+//       called from a task.
+// Args: this - a pointer to this threadpool object
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  pthread_mutex_lock(&this->lock);
+  while (__atomic_load_n(&this->pending, __ATOMIC_SEQ_CST) > 0)
+    pthread_cond_wait(&this->idle, &this->lock);
+  pthread_mutex_unlock(&this->lock);
+}
+
+void *threadpool_worker(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Worker loop, runs tasks until the pool is stopped and drained
+// Args: arg - the worker's own deque
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  ThreadPoolDeque *own = (ThreadPoolDeque *)arg;
+  ThreadPool *this = own->pool;
+  int id = (int)(own - this->deques);
+  ThreadPoolTask task;
+  int done = 0;
+
+  threadpool_current = this;
+  threadpool_current_id = id;
+
+  while (!done) {
+    if (threadpool_take(this, id, &task)) {
+      task.fn(task.arg);
+      if (__atomic_sub_fetch(&this->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&this->lock);
+        pthread_cond_broadcast(&this->idle);
+        pthread_mutex_unlock(&this->lock);
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&this->lock);
+    __atomic_add_fetch(&this->sleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&this->queued, __ATOMIC_SEQ_CST) == 0 &&
+           !this->stop)
+      pthread_cond_wait(&this->work, &this->lock);
+    __atomic_sub_fetch(&this->sleeping, 1, __ATOMIC_SEQ_CST);
+    // stopped and nothing left to do
+    done = this->stop && __atomic_load_n(&this->queued, __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&this->lock);
+  }
+
+  return NULL;
+}
+
+void threadpool_stop(ThreadPool *this, int nstarted)
+// -----------------------------------------------------------------------------
+// Func: Stop and join the workers once the queues are drained, then free
+//       everything
+// Args: this - a pointer to this threadpool object
+//       nstarted - number of workers that were started
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  int i;
+
+  pthread_mutex_lock(&this->lock);
+  this->stop = 1;
+  pthread_cond_broadcast(&this->work);
+  pthread_mutex_unlock(&this->lock);
+
+  for (i = 0; i < nstarted; i++)
+    pthread_join(this->threads[i], NULL);
+
+  if (this->deques != NULL) {
+    for (i = 0; i <= this->nthreads; i++) {
+      pthread_mutex_destroy(&this->deques[i].lock);
+      free(this->deques[i].tasks);
+    }
+  }
+  pthread_mutex_destroy(&this->lock);
+  pthread_cond_destroy(&this->work);
+  pthread_cond_destroy(&this->idle);
+
+  free(this->threads);
+  free(this->deques);
+  this->threads = NULL;
+  this->deques = NULL;
+  this->nthreads = 0;
+
+  this->submit = NULL;
+  this->wait = NULL;
+}
+
+int threadpool_push(ThreadPoolDeque *deque, ThreadPoolTask *task)
+// -----------------------------------------------------------------------------
+// Func: Add a task at the tail of a deque
+// Args: deque - the deque
+//       task - the task, copied
+// Retn: 0 on success, -1 if the deque could not grow
+// -----------------------------------------------------------------------------
+{
+  ThreadPoolTask *tasks;
+  uint64_t i;
+
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->sz == deque->cap) { // unroll the ring into a buffer twice the size
+    if ((tasks = malloc(2*deque->cap*sizeof(ThreadPoolTask))) == NULL) {
+      pthread_mutex_unlock(&deque->lock);
+      return -1;
+    }
+    for (i = 0; i < deque->sz; i++)
+      tasks[i] = deque->tasks[(deque->head + i) % deque->cap];
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->head = 0;
+    deque->cap *= 2;
+  }
+
+  deque->tasks[(deque->head + deque->sz) % deque->cap] = *task;
+  __atomic_store_n(&deque->sz, deque->sz + 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock(&deque->lock);
+
+  return 0;
+}
+
+int threadpool_pop(ThreadPoolDeque *deque, int newest, ThreadPoolTask *task)
+// -----------------------------------------------------------------------------
+// Func: Take a task from either end of a deque
+// Args: deque - the deque
+//       newest - 1 for the tail (the owner), 0 for the head
+//       task - set to the task taken
+// Retn: 1 if a task was taken, 0 if the deque was empty
+// -----------------------------------------------------------------------------
+{
+  if (__atomic_load_n(&deque->sz, __ATOMIC_RELAXED) == 0)
+    return 0; // racy peek, saves the lock on empty deques
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->sz == 0) {
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+  }
+
+  if (newest) {
+    *task = deque->tasks[(deque->head + deque->sz - 1) % deque->cap];
+  } else {
+    *task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->cap;
+  }
+  __atomic_store_n(&deque->sz, deque->sz - 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock(&deque->lock);
+
+  return 1;
+}
+
+int threadpool_take(ThreadPool *this, int id, ThreadPoolTask *task)
+// -----------------------------------------------------------------------------
+// Func: Find a worker its next task: the newest on its own deque, else the
+//       oldest shared one, else the oldest task of another worker
+// Args: this - a pointer to this threadpool object
+//       id - the worker
+//       task - set to the task taken
+// Retn: 1 if a task was taken, 0 if there was none
+// -----------------------------------------------------------------------------
+{
+  int i, found;
+
+  found = threadpool_pop(&this->deques[id], 1, task) ||
+          threadpool_pop(&this->deques[this->nthreads], 0, task);
+  for (i = 1; !found && i < this->nthreads; i++)
+    found = threadpool_pop(&this->deques[(id + i) % this->nthreads], 0, task);
+
+  if (found)
+    __atomic_sub_fetch(&this->queued, 1, __ATOMIC_SEQ_CST);
+
+  return found;
+}
@@ -27,48 +27,140 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <immintrin.h>
 
 // openssl header files
 #include <openssl/crypto.h>
 #include <openssl/sha.h>
 
-void util_cmd_hash(const char *str) 
-// -----------------------------------------------------------------------------
-// Func: 
-// Args:
-// Retn:
-// -----------------------------------------------------------------------------
-{
-  uint8_t hash[SHA256_DIGEST_LENGTH];
-  int sz = strlen(str)+1; // include the null terminator
+#define UTIL_CRC32C_POLY  0x82f63b78 // Castagnoli, bit reflected
+#define UTIL_CRC32C_LANE  1024       // bytes per stream of the 3 stream kernel
 
-  util_buf_write_raw((uint8_t *)str, sz, "test/raw");
-  util_buf_print_hex((uint8_t *)str, sz, NULL, 1);
-  util_buf_hash((uint8_t*) str, sz, hash);
-  util_buf_print_hex(hash, SHA256_DIGEST_LENGTH, NULL, 1);
+// crc32c state, set up once by util_crc32c_init
+static pthread_once_t util_crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t util_crc32c_table[256];
+static uint32_t util_crc32c_shift1;  // x^(8*LANE) mod P
+static uint32_t util_crc32c_shift2;  // x^(16*LANE) mod P
+static uint32_t (*util_crc32c_kernel)(uint32_t, const uint8_t *, uint64_t);
 
-}
+// private functions
+void util_crc32c_init(void);
+uint32_t util_crc32c_xpow(uint64_t n);
+uint32_t util_crc32c_portable(uint32_t crc, const uint8_t *buf,
+                              uint64_t buf_sz);
+uint32_t util_crc32c_sse42(uint32_t crc, const uint8_t *buf, uint64_t buf_sz);
+uint32_t util_crc32c_pclmul(uint32_t crc, const uint8_t *buf,
+                            uint64_t buf_sz);
+uint32_t util_crc32c_mul(uint32_t a, uint32_t b);
+void util_buf_hex_portable(char *dest, const uint8_t *src, uint64_t src_sz);
+void util_buf_hex_avx2(char *dest, const uint8_t *src, uint64_t src_sz);
 
 void util_buf_print_hex(uint8_t *buf, uint64_t buf_sz, 
                         const char *label, const int newline)
 // -----------------------------------------------------------------------------
-// Func: 
-// Args:
-// Retn:
+// Func: Print a buffer in lowercase hex to stdout
+// Args: buf - the buffer
+//       buf_sz - the size of the buffer
+//       label - printed before the hex with a colon, NULL for none
+//       newline - 1 to end the line
+// Retn: None
 // -----------------------------------------------------------------------------
 {
-  uint64_t i;
+  char hex[4096];
+  uint64_t n;
 
   if (label != NULL)
     printf("%s: ", label);
 
-  for (i = 0; i < buf_sz; i++) 
-    printf("%02x", buf[i]);
+  for (; buf_sz > 0; buf += n, buf_sz -= n) {
+    n = buf_sz < sizeof(hex)/2 ? buf_sz : sizeof(hex)/2;
+    util_buf_hex(hex, buf, n);
+    fwrite(hex, 1, 2*n, stdout);
+  }
 
   if (newline)
     printf("\n");
 }
 
+void util_buf_hex(char *dest, const uint8_t *src, uint64_t src_sz)
+// -----------------------------------------------------------------------------
+// Func: Encode a buffer as lowercase hex, 32 bytes per step with AVX2 when
+//       the cpu has it. No terminator is written.
+// Args: dest - room for 2*src_sz characters
+//       src - the buffer
+//       src_sz - the size of the buffer
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  static int have_avx2 = -1;
+  int avx2 = __atomic_load_n(&have_avx2, __ATOMIC_RELAXED);
+
+  // encoders run on pool workers, so the first calls may race to set this
+  if (avx2 < 0) {
+    avx2 = __builtin_cpu_supports("avx2") != 0;
+    __atomic_store_n(&have_avx2, avx2, __ATOMIC_RELAXED);
+  }
+
+  if (avx2)
+    util_buf_hex_avx2(dest, src, src_sz);
+  else
+    util_buf_hex_portable(dest, src, src_sz);
+}
+
+void util_buf_hex_portable(char *dest, const uint8_t *src, uint64_t src_sz)
+// -----------------------------------------------------------------------------
+// Func: util_buf_hex, a byte at a time
+// Args: dest - room for 2*src_sz characters
+//       src - the buffer
+//       src_sz - the size of the buffer
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  static const char digits[] = "0123456789abcdef";
+  uint64_t i;
+
+  for (i = 0; i < src_sz; i++) {
+    dest[2*i] = digits[src[i] >> 4];
+    dest[2*i+1] = digits[src[i] & 15];
+  }
+}
+
+__attribute__((target("avx2")))
+void util_buf_hex_avx2(char *dest, const uint8_t *src, uint64_t src_sz)
+// -----------------------------------------------------------------------------
+// Func: util_buf_hex, 32 bytes per iteration. Both nibbles of every byte are
+//       looked up in a 16 entry table with one shuffle each, interleaved
+//       within each 128 bit lane and put back in order across lanes.
+// Args: dest - room for 2*src_sz characters
+//       src - the buffer
+//       src_sz - the size of the buffer
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6',
+    '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f', '0', '1', '2', '3', '4', '5',
+    '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i in, hi, lo, a, b;
+  uint64_t i;
+
+  for (i = 0; i + 32 <= src_sz; i += 32) {
+    in = _mm256_loadu_si256((const __m256i *)&src[i]);
+    hi = _mm256_shuffle_epi8(digits,
+                             _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble));
+    lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(in, nibble));
+    a = _mm256_unpacklo_epi8(hi, lo); // bytes 0-7 and 16-23
+    b = _mm256_unpackhi_epi8(hi, lo); // bytes 8-15 and 24-31
+    _mm256_storeu_si256((__m256i *)&dest[2*i],
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)&dest[2*i + 32],
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+
+  util_buf_hex_portable(&dest[2*i], &src[i], src_sz - i);
+}
+
 void util_buf_hash(uint8_t *buf, uint64_t buf_sz, uint8_t *hash) 
 // -----------------------------------------------------------------------------
 // Func: Hash any buffer
@@ -84,6 +176,194 @@ void util_buf_hash(uint8_t *buf, uint64_t buf_sz, uint8_t *hash)
   SHA256_Final(hash, &sha);
 }
 
+uint64_t util_buf_hash64(const uint8_t *buf, uint64_t buf_sz, uint64_t seed)
+// -----------------------------------------------------------------------------
+// Func: Fast non-cryptographic 64 bit hash, for hash tables and filters only.
+//       Never use this where util_buf_hash is expected.
+// Args: buf - the buffer we want to hash
+//       buf_sz - the size of the buffer
+//       seed - varies the hash, 0 is fine
+// Retn: the hash
+// -----------------------------------------------------------------------------
+{
+  const uint64_t m = 0x9e3779b97f4a7c15ULL;
+  uint64_t h = seed ^ (buf_sz * m);
+  uint64_t w;
+
+  for (; buf_sz >= 8; buf += 8, buf_sz -= 8) {
+    memcpy(&w, buf, 8);
+    h = (h ^ (w * m)) * 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+  }
+
+  w = 0;
+  memcpy(&w, buf, buf_sz); // the tail, up to 7 bytes
+  h = (h ^ (w * m)) * 0xbf58476d1ce4e5b9ULL;
+
+  // murmur3 finalizer
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+uint32_t util_buf_crc32c(uint32_t crc, const uint8_t *buf, uint64_t buf_sz)
+// -----------------------------------------------------------------------------
+// Func: CRC32C (Castagnoli) of a buffer, with the SSE4.2 crc32 instruction
+//       when the cpu has it. Catches torn and corrupted writes; like
+//       util_buf_hash64 it is no substitute for util_buf_hash.
+// Args: crc - the crc of the bytes before buf, 0 to start
+//       buf - the buffer
+//       buf_sz - the size of the buffer
+// Retn: the crc of everything up to the end of buf
+// -----------------------------------------------------------------------------
+{
+  pthread_once(&util_crc32c_once, &util_crc32c_init);
+
+  return ~util_crc32c_kernel(~crc, buf, buf_sz);
+}
+
+void util_crc32c_init(void)
+// -----------------------------------------------------------------------------
+// Func: Build the byte table and lane shift constants, and pick a kernel
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint32_t c;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    for (c = i, k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ UTIL_CRC32C_POLY : c >> 1;
+    util_crc32c_table[i] = c;
+  }
+  util_crc32c_shift1 = util_crc32c_xpow(8*UTIL_CRC32C_LANE);
+  util_crc32c_shift2 = util_crc32c_xpow(16*UTIL_CRC32C_LANE);
+
+  if (!__builtin_cpu_supports("sse4.2"))
+    util_crc32c_kernel = &util_crc32c_portable;
+  else if (!__builtin_cpu_supports("pclmul"))
+    util_crc32c_kernel = &util_crc32c_sse42;
+  else
+    util_crc32c_kernel = &util_crc32c_pclmul;
+}
+
+uint32_t util_crc32c_xpow(uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: x^n mod P, bit reflected like the crc register. Multiplying a crc by
+//       x^(8k) appends k zero bytes to the message it covers.
+// Args: n - the power
+// Retn: x^n mod P
+// -----------------------------------------------------------------------------
+{
+  uint32_t v = 0x80000000; // x^0
+
+  while (n--)
+    v = v & 1 ? (v >> 1) ^ UTIL_CRC32C_POLY : v >> 1;
+
+  return v;
+}
+
+uint32_t util_crc32c_portable(uint32_t crc, const uint8_t *buf,
+                              uint64_t buf_sz)
+// -----------------------------------------------------------------------------
+// Func: Raw crc32c register update, a byte at a time through the table
+// Args: crc - the register
+//       buf - the buffer
+//       buf_sz - the size of the buffer
+// Retn: the register after buf
+// -----------------------------------------------------------------------------
+{
+  while (buf_sz--)
+    crc = util_crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t util_crc32c_sse42(uint32_t crc, const uint8_t *buf, uint64_t buf_sz)
+// -----------------------------------------------------------------------------
+// Func: util_crc32c_portable, eight bytes per crc32 instruction
+// Args: crc - the register
+//       buf - the buffer
+//       buf_sz - the size of the buffer
+// Retn: the register after buf
+// -----------------------------------------------------------------------------
+{
+  uint64_t c = crc, w;
+
+  for (; buf_sz >= 8; buf += 8, buf_sz -= 8) {
+    memcpy(&w, buf, 8);
+    c = _mm_crc32_u64(c, w);
+  }
+  for (; buf_sz; buf++, buf_sz--)
+    c = _mm_crc32_u8((uint32_t)c, *buf);
+
+  return (uint32_t)c;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t util_crc32c_pclmul(uint32_t crc, const uint8_t *buf,
+                            uint64_t buf_sz)
+// -----------------------------------------------------------------------------
+// Func: util_crc32c_sse42 over three independent streams at once. The crc32
+//       instruction has a latency of three cycles but issues every cycle, so
+//       one stream leaves it two thirds idle. Each block of three lanes is
+//       folded back into one crc with two carry-less multiplies.
+// Args: crc - the register
+//       buf - the buffer
+//       buf_sz - the size of the buffer
+// Retn: the register after buf
+// -----------------------------------------------------------------------------
+{
+  const uint8_t *lane1, *lane2;
+  uint64_t c0, c1, c2, w0, w1, w2, i;
+
+  for (; buf_sz >= 3*UTIL_CRC32C_LANE;
+       buf += 3*UTIL_CRC32C_LANE, buf_sz -= 3*UTIL_CRC32C_LANE) {
+    lane1 = buf + UTIL_CRC32C_LANE;
+    lane2 = buf + 2*UTIL_CRC32C_LANE;
+    c0 = crc;
+    c1 = 0;
+    c2 = 0;
+    for (i = 0; i < UTIL_CRC32C_LANE; i += 8) {
+      memcpy(&w0, buf + i, 8);
+      memcpy(&w1, lane1 + i, 8);
+      memcpy(&w2, lane2 + i, 8);
+      c0 = _mm_crc32_u64(c0, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+    }
+    crc = util_crc32c_mul((uint32_t)c0, util_crc32c_shift2) ^
+          util_crc32c_mul((uint32_t)c1, util_crc32c_shift1) ^ (uint32_t)c2;
+  }
+
+  return util_crc32c_sse42(crc, buf, buf_sz);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t util_crc32c_mul(uint32_t a, uint32_t b)
+// -----------------------------------------------------------------------------
+// Func: a*b mod P, both bit reflected. The 64 bit carry-less product is
+//       reduced by feeding its low half through the crc32 instruction.
+// Args: a - a polynomial
+//       b - a polynomial
+// Retn: the product
+// -----------------------------------------------------------------------------
+{
+  __m128i prod;
+  uint64_t p;
+
+  prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b), 0);
+  p = (uint64_t)_mm_cvtsi128_si64(prod) << 1;
+
+  return _mm_crc32_u32(0, (uint32_t)p) ^ (uint32_t)(p >> 32);
+}
+
 int util_print_license(void) 
 // -----------------------------------------------------------------------------
 // Func: 
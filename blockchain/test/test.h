@@ -0,0 +1,59 @@
+/*
+test.h: checks shared by the unit tests, see make test
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+// record a failed check without stopping, so one run reports every failure
+#define TEST_CHECK(cond) test_check((cond) != 0, #cond, __FILE__, __LINE__)
+
+static int test_failures = 0;
+
+static void test_check(int ok, const char *cond, const char *file, int line)
+// -----------------------------------------------------------------------------
+// Func: Count and report a check
+// Args: ok - 1 if the check held
+//       cond - the check, as written
+//       file, line - where it is
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  if (!ok) {
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+    test_failures++;
+  }
+}
+
+static int test_report(const char *name)
+// -----------------------------------------------------------------------------
+// Func: Print the outcome of a test program
+// Args: name - the program
+// Retn: the exit status, 0 if every check held
+// -----------------------------------------------------------------------------
+{
+  printf("%s: %s (%d failed)\n", name, test_failures ? "FAIL" : "ok",
+         test_failures);
+
+  return test_failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,188 @@
+/*
+test_blake3.c: tests for BLAKE3 against the official test vectors
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blake3.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_LEN   1048577
+#define THREADS   4
+
+// the official vectors: input byte i is i % 251, the hash is the first
+// BLAKE3_OUT_LEN bytes of the default output. The lengths sit on and just
+// past the chunk boundaries and the 4, 8 and 16 chunk lane widths.
+static const struct {
+  uint64_t len;
+  const char *hash;
+} vectors[] = {
+  {0,      "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+  {1,      "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+  {1023,   "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11"},
+  {1024,   "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+  {1025,   "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+  {2048,   "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a"},
+  {2049,   "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+  {3072,   "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2"},
+  {3073,   "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3"},
+  {4096,   "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969"},
+  {4097,   "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995"},
+  {5120,   "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833"},
+  {5121,   "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff"},
+  {6144,   "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205"},
+  {6145,   "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f"},
+  {7168,   "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a"},
+  {7169,   "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817"},
+  {8192,   "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63"},
+  {8193,   "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b"},
+  {16384,  "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4"},
+  {31744,  "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47"},
+  {102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"},
+  // past the official lengths, digests from the reference implementation:
+  // just under, just over and several times a 256 chunk batch
+  {262144, "d57dc906e20d3fd326ffaa85535500486f46a0979f5a323f028dcabfd381fd4a"},
+  {263169, "5f939be9e0ff14200d35a1f37ac138d517c81ce2ddfd3b8b7a42c90be46e0105"},
+  {1048577,
+   "2f053cd7472cf0cd2f9adaf45c1180255b91b9a865404a63671a0ee5f792ed33"},
+};
+
+#define NVECTORS  (sizeof(vectors)/sizeof(vectors[0]))
+
+static uint8_t input[MAX_LEN];
+
+int matches(const uint8_t *hash, const char *hex)
+// -----------------------------------------------------------------------------
+// Func: Compare a digest with its hex form
+// Args: hash - BLAKE3_OUT_LEN bytes
+//       hex - 2*BLAKE3_OUT_LEN hex digits
+// Retn: 1 if they are the same, 0 if not
+// -----------------------------------------------------------------------------
+{
+  char buf[2*BLAKE3_OUT_LEN+1];
+  int i;
+
+  for (i = 0; i < BLAKE3_OUT_LEN; i++)
+    sprintf(&buf[2*i], "%02x", hash[i]);
+
+  return strcmp(buf, hex) == 0;
+}
+
+void *hash_all(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Thread body, hash every vector and count the mismatches
+// Args: arg - an int counter
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  uint8_t hash[BLAKE3_OUT_LEN];
+  uint64_t v;
+
+  for (v = 0; v < NVECTORS; v++) {
+    blake3_hash(input, vectors[v].len, hash);
+    if (!matches(hash, vectors[v].hash))
+      (*(int *)arg)++;
+  }
+
+  return NULL;
+}
+
+void test_threads(void)
+// -----------------------------------------------------------------------------
+// Func: The first hashes run in several threads at once, so they all race on
+//       the lazy choice of vector width
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  pthread_t threads[THREADS];
+  int errors[THREADS] = {0};
+  int i;
+
+  for (i = 0; i < THREADS; i++)
+    TEST_CHECK(pthread_create(&threads[i], NULL, hash_all, &errors[i]) == 0);
+  for (i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    TEST_CHECK(errors[i] == 0);
+  }
+}
+
+void test_oneshot(void)
+// -----------------------------------------------------------------------------
+// Func: blake3_hash gives every official digest
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t hash[BLAKE3_OUT_LEN];
+  uint64_t v;
+
+  for (v = 0; v < NVECTORS; v++) {
+    blake3_hash(input, vectors[v].len, hash);
+    if (!matches(hash, vectors[v].hash))
+      fprintf(stderr, "one shot, length %lu\n", vectors[v].len);
+    TEST_CHECK(matches(hash, vectors[v].hash));
+  }
+}
+
+void test_pieces(void)
+// -----------------------------------------------------------------------------
+// Func: The incremental hasher gives the same digests however the input is
+//       split, including pieces that end mid chunk and pieces that leave a
+//       batch off a 256 chunk boundary
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  static const uint64_t pieces[] = {1, 63, 64, 1000, 1024, 1025, 4095, 17408};
+  uint8_t hash[BLAKE3_OUT_LEN];
+  Blake3Hasher hasher;
+  uint64_t v, p, off, n;
+
+  for (p = 0; p < sizeof(pieces)/sizeof(pieces[0]); p++) {
+    for (v = 0; v < NVECTORS; v++) {
+      blake3_init(&hasher);
+      for (off = 0; off < vectors[v].len; off += n) {
+        n = vectors[v].len - off < pieces[p] ? vectors[v].len - off : pieces[p];
+        blake3_update(&hasher, &input[off], n);
+      }
+      blake3_final(&hasher, hash);
+      if (!matches(hash, vectors[v].hash))
+        fprintf(stderr, "pieces of %lu, length %lu\n", pieces[p],
+                vectors[v].len);
+      TEST_CHECK(matches(hash, vectors[v].hash));
+    }
+  }
+}
+
+int main(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_LEN; i++)
+    input[i] = i % 251;
+
+  test_threads();
+  test_oneshot();
+  test_pieces();
+
+  return test_report("test_blake3");
+}
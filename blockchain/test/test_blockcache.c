@@ -0,0 +1,157 @@
+/*
+test_blockcache.c: tests for the sharded block cache
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blockcache.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SPILL_PATH  "test_blockcache.spill"
+
+void append(Blockchain *chain, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append n blocks, each holding its index as text
+// Args: chain - the chain
+//       n - blocks to append
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(record, sizeof(record), "record %lu",
+             (unsigned long)chain->length);
+    TEST_CHECK(chain->insert_front(chain, (uint8_t *)record,
+                                   strlen(record) + 1) == 0);
+  }
+}
+
+int is_block(uint8_t *frame, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Check that a frame is the block appended at index
+// Args: frame - the frame
+//       index - the block
+// Retn: 1 if it is, 0 if not
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint64_t got;
+
+  snprintf(record, sizeof(record), "record %lu", (unsigned long)index);
+  memcpy(&got, &frame[INDEX_POS], sizeof(got));
+
+  return frame != NULL && got == index &&
+         strcmp((char *)&frame[RECORD_POS], record) == 0;
+}
+
+void test_pruned_under_reader(void)
+// -----------------------------------------------------------------------------
+// Func: A resident block got from the cache stays whole while appends prune
+//       it from the chain
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  BlockCache cache;
+  BlockCacheEntry *pin, *again;
+  uint8_t *frame;
+  uint64_t hits, misses, evictions, bytes;
+
+  blockchain_init(&chain);
+  TEST_CHECK(blockchain_set_pruning(&chain, 4, 0, SPILL_PATH) == 0);
+  append(&chain, 20);
+  TEST_CHECK(blockcache_init(&cache, &chain, 1 << 20) == 0);
+
+  frame = cache.get(&cache, 20, &pin);
+  TEST_CHECK(pin != NULL && is_block(frame, 20));
+  append(&chain, 10); // block 20 is pruned and its node freed
+  TEST_CHECK(chain.get(&chain, 20) == NULL);
+  TEST_CHECK(is_block(frame, 20));
+  TEST_CHECK(cache.get(&cache, 20, &again) == frame && again == pin);
+  cache.release(&cache, again);
+  cache.release(&cache, pin);
+
+  frame = cache.get(&cache, 5, &pin); // pruned, read from the spill file
+  TEST_CHECK(pin != NULL && is_block(frame, 5));
+  cache.release(&cache, pin);
+  TEST_CHECK(cache.get(&cache, chain.length, &pin) == NULL && pin == NULL);
+
+  blockcache_stats(&cache, &hits, &misses, &evictions, &bytes);
+  TEST_CHECK(hits == 1 && misses == 2 && evictions == 0 && bytes > 0);
+
+  blockcache_destroy(&cache);
+  blockchain_destroy(&chain);
+  unlink(SPILL_PATH);
+}
+
+void test_evict(void)
+// -----------------------------------------------------------------------------
+// Func: A budget smaller than the chain evicts unpinned blocks but never a
+//       pinned one, and every block still reads back right
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  BlockCache cache;
+  BlockCacheEntry *pin, *held;
+  uint8_t *frame, *kept;
+  uint64_t i, hits, misses, evictions, bytes;
+  int bad = 0;
+
+  blockchain_init(&chain);
+  TEST_CHECK(blockchain_set_pruning(&chain, 4, 0, SPILL_PATH) == 0);
+  append(&chain, 2000);
+  // room for a few frames per shard
+  TEST_CHECK(blockcache_init(&cache, &chain,
+                             BLOCKCACHE_SHARDS*4*(BLOCK_HEADER_SZ + 16)) == 0);
+
+  kept = cache.get(&cache, 16, &held);
+  for (i = 1; i < chain.length; i++) {
+    frame = cache.get(&cache, i, &pin);
+    bad += !is_block(frame, i);
+    cache.release(&cache, pin);
+  }
+  TEST_CHECK(bad == 0);
+  TEST_CHECK(is_block(kept, 16));
+  TEST_CHECK(cache.get(&cache, 16, &pin) == kept);
+  cache.release(&cache, pin);
+  cache.release(&cache, held);
+
+  blockcache_stats(&cache, &hits, &misses, &evictions, &bytes);
+  TEST_CHECK(evictions > 0);
+  TEST_CHECK(bytes <= BLOCKCACHE_SHARDS*4*(BLOCK_HEADER_SZ + 16));
+
+  blockcache_destroy(&cache);
+  blockchain_destroy(&chain);
+  unlink(SPILL_PATH);
+}
+
+int main(void)
+{
+  test_pruned_under_reader();
+  test_evict();
+
+  return test_report("test_blockcache");
+}
@@ -0,0 +1,139 @@
+/*
+test_blockchain.c: tests for record pruning and the spill file
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blockchain.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SPILL_PATH  "test_blockchain.spill"
+#define OTHER_PATH  "test_blockchain.other"
+
+void append(Blockchain *chain, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append n blocks, each holding its index as text
+// Args: chain - the chain
+//       n - blocks to append
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(record, sizeof(record), "record %lu",
+             (unsigned long)chain->length);
+    TEST_CHECK(chain->insert_front(chain, (uint8_t *)record,
+                                   strlen(record) + 1) == 0);
+  }
+}
+
+int check_records(Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Read every block back, pruned or not, and compare its record
+// Args: chain - the chain
+// Retn: number of blocks that could not be read or were wrong
+// -----------------------------------------------------------------------------
+{
+  uint8_t buf[BLOCK_HEADER_SZ + 32];
+  char record[32];
+  uint64_t i;
+  int bad = 0;
+
+  for (i = 1; i < chain->length; i++) {
+    snprintf(record, sizeof(record), "record %lu", (unsigned long)i);
+    if (blockchain_read_frame(chain, i, buf) ||
+        strcmp((char *)&buf[RECORD_POS], record) != 0)
+      bad++;
+  }
+
+  return bad;
+}
+
+void test_reprune(void)
+// -----------------------------------------------------------------------------
+// Func: Changing the pruning depth keeps the records already spilled, and a
+//       different spill file is refused once some are
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  uint64_t pruned;
+
+  blockchain_init(&chain);
+  TEST_CHECK(blockchain_set_pruning(&chain, 4, 0, SPILL_PATH) == 0);
+  append(&chain, 20);
+  pruned = chain.pruned;
+  TEST_CHECK(pruned > 5 && chain.spill_sz > 0);
+  TEST_CHECK(check_records(&chain) == 0);
+
+  TEST_CHECK(blockchain_set_pruning(&chain, 8, 0, SPILL_PATH) == 0);
+  TEST_CHECK(chain.pruned == pruned);
+  TEST_CHECK(check_records(&chain) == 0);
+  TEST_CHECK(chain.blockchain_verify_chain(&chain));
+
+  // later spills go after the earlier ones
+  append(&chain, 20);
+  TEST_CHECK(chain.pruned > pruned);
+  TEST_CHECK(check_records(&chain) == 0);
+  TEST_CHECK(chain.blockchain_verify_chain(&chain));
+
+  TEST_CHECK(blockchain_set_pruning(&chain, 8, 0, OTHER_PATH) == -1);
+  TEST_CHECK(blockchain_set_pruning(&chain, 2, 0, NULL) == 0);
+  append(&chain, 5);
+  TEST_CHECK(check_records(&chain) == 0);
+  TEST_CHECK(chain.blockchain_verify_chain(&chain));
+
+  blockchain_destroy(&chain);
+  unlink(SPILL_PATH);
+  unlink(OTHER_PATH);
+}
+
+void test_drop(void)
+// -----------------------------------------------------------------------------
+// Func: Without a spill file pruned records are gone, but headers are kept
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  uint8_t buf[BLOCK_HEADER_SZ + 32];
+
+  blockchain_init(&chain);
+  TEST_CHECK(blockchain_set_pruning(&chain, 4, 0, NULL) == 0);
+  append(&chain, 10);
+  TEST_CHECK(chain.pruned > 0);
+  TEST_CHECK(blockchain_get_header(&chain, 1) != NULL);
+  TEST_CHECK(blockchain_read_frame(&chain, 1, buf) == -1);
+  TEST_CHECK(blockchain_read_frame(&chain, chain.length - 1, buf) == 0);
+
+  blockchain_destroy(&chain);
+}
+
+int main(void)
+{
+  test_reprune();
+  test_drop();
+
+  return test_report("test_blockchain");
+}
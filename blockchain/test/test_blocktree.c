@@ -0,0 +1,416 @@
+/*
+test_blocktree.c: tests for skip pointers, ancestor queries and reorgs
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blocktree.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Reorg Reorg;
+
+struct Reorg
+// -----------------------------------------------------------------------------
+// Description
+//  What the last on_reorg call was given
+// -----------------------------------------------------------------------------
+{
+  int calls;
+  BlockTreeEntry *ancestor;
+  BlockTreeEntry *old_tip;
+  BlockTreeEntry *new_tip;
+};
+
+void reorg_record(void *ctx, BlockTree *tree, BlockTreeEntry *ancestor,
+                  BlockTreeEntry *old_tip, BlockTreeEntry *new_tip)
+// -----------------------------------------------------------------------------
+// Func: on_reorg callback, remembers its arguments
+// Args: ctx - the Reorg
+//       tree - the tree
+//       ancestor, old_tip, new_tip - see BlockTreeReorgFunc
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Reorg *r = (Reorg *)ctx;
+
+  (void)tree;
+  r->calls++;
+  r->ancestor = ancestor;
+  r->old_tip = old_tip;
+  r->new_tip = new_tip;
+}
+
+void append(Blockchain *chain, const char *tag, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append n blocks with records made from tag
+// Args: chain - the chain
+//       tag - distinguishes the branch, so forks get different hashes
+//       n - blocks to append
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  char record[64];
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(record, sizeof(record), "%s %lu", tag, (unsigned long)i);
+    TEST_CHECK(chain->insert_front(chain, (uint8_t *)record,
+                                   strlen(record) + 1) == 0);
+  }
+}
+
+void fork_chain(Blockchain *fork, Blockchain *chain, uint64_t shared,
+                const char *tag, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Make a chain that shares its first blocks with another, then goes
+//       its own way
+// Args: fork - the new chain
+//       chain - the chain forked from
+//       shared - blocks [0, shared) are copied from chain
+//       tag, n - see append
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t *frame;
+  uint64_t i;
+
+  blockchain_init_empty(fork);
+  for (i = 0; i < shared; i++) {
+    frame = (uint8_t *)chain->get(chain, i);
+    TEST_CHECK(blockchain_store(fork, frame, blockframe_size(frame)) == 0);
+  }
+  append(fork, tag, n);
+}
+
+int add_range(BlockTree *tree, Blockchain *chain, uint64_t from, uint64_t to,
+              int expect)
+// -----------------------------------------------------------------------------
+// Func: Add blocks [from, to) of a chain to a tree
+// Args: tree - the tree
+//       chain - where the blocks come from
+//       from, to - the range
+//       expect - what each add should return
+// Retn: number of adds that returned something else
+// -----------------------------------------------------------------------------
+{
+  uint64_t i;
+  int bad = 0;
+
+  for (i = from; i < to; i++)
+    bad += tree->add(tree, (uint8_t *)chain->get(chain, i)) != expect;
+
+  return bad;
+}
+
+BlockTreeEntry *tree_entry(BlockTree *tree, Blockchain *chain, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: The tree's entry for a block of a chain
+// Args: tree - the tree
+//       chain - the chain holding the block
+//       index - the block
+// Retn: the entry, NULL if the tree doesn't have it
+// -----------------------------------------------------------------------------
+{
+  return tree->find(tree, (uint8_t *)chain->get(chain, index) + CURRHASH_POS);
+}
+
+int check_ancestors(BlockTreeEntry *tip, Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Compare every skip pointer and skip walk from tip against walking
+//       parents one at a time
+// Args: tip - where to start
+//       chain - the chain tip belongs to, for the expected blocks
+// Retn: number of mismatches
+// -----------------------------------------------------------------------------
+{
+  BlockTreeEntry **line, *e;
+  uint64_t h;
+  int bad = 0;
+
+  line = malloc((tip->height + 1)*sizeof(BlockTreeEntry *));
+  for (e = tip; e != NULL; e = e->parent)
+    line[e->height] = e;
+
+  for (h = 0; h <= tip->height; h++) {
+    e = line[h];
+    bad += memcmp(e->frame, chain->get(chain, h), BLOCK_HEADER_SZ) != 0;
+    if (h >= 2)
+      bad += e->skip == NULL || e->skip->height >= h ||
+             e->skip != line[e->skip->height];
+    bad += blocktree_get_ancestor(tip, h) != e;
+    bad += blocktree_get_ancestor(e, h) != e;
+  }
+  bad += blocktree_get_ancestor(tip, tip->height + 1) != NULL;
+  free(line);
+
+  return bad;
+}
+
+void test_ancestors(void)
+// -----------------------------------------------------------------------------
+// Func: Skip walks on the main chain and a side branch reach the same blocks
+//       as parent walks, and the common ancestor of two branches is the
+//       fork point
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain a, b;
+  BlockTree tree;
+  BlockTreeEntry *ta, *tb, *e;
+
+  blockchain_init(&a);
+  append(&a, "main", 3000);
+  fork_chain(&b, &a, 1234, "side", 50);
+
+  TEST_CHECK(blocktree_init(&tree, (uint8_t *)a.get(&a, 0),
+                            BLOCKTREE_LONGEST) == 0);
+  TEST_CHECK(add_range(&tree, &a, 1, a.length, BLOCKTREE_EXTENDED) == 0);
+  TEST_CHECK(add_range(&tree, &b, 1234, b.length, BLOCKTREE_SIDE) == 0);
+
+  ta = tree.tip;
+  tb = tree_entry(&tree, &b, b.length - 1);
+  TEST_CHECK(ta->height == 3000 && tb != NULL && tb->height == 1283);
+  TEST_CHECK(check_ancestors(ta, &a) == 0);
+  TEST_CHECK(check_ancestors(tb, &b) == 0);
+
+  e = blocktree_find_common_ancestor(ta, tb);
+  TEST_CHECK(e != NULL && e->height == 1233 &&
+             e == tree_entry(&tree, &a, 1233));
+  TEST_CHECK(blocktree_find_common_ancestor(tb, ta) == e);
+  e = blocktree_get_ancestor(ta, 500);
+  TEST_CHECK(blocktree_find_common_ancestor(e, tb) == e);
+  TEST_CHECK(blocktree_find_common_ancestor(ta, ta) == ta);
+  TEST_CHECK(blocktree_find_common_ancestor(ta, tree.main[0]) == tree.main[0]);
+  TEST_CHECK(blocktree_find_common_ancestor(ta, NULL) == NULL);
+
+  blocktree_destroy(&tree);
+  blockchain_destroy(&b);
+  blockchain_destroy(&a);
+}
+
+void test_common_ancestor(void)
+// -----------------------------------------------------------------------------
+// Func: Branches forked at heights on and around the skip targets, and of
+//       different lengths (all shorter than the main chain), meet at their
+//       fork point
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  static const uint64_t forks[] = {1, 2, 3, 63, 64, 65, 1023, 1024, 1025,
+                                   1536, 2047, 2998};
+  Blockchain a, b;
+  BlockTree tree;
+  BlockTreeEntry *e, *tb;
+  char tag[16];
+  uint64_t f, shared;
+
+  blockchain_init(&a);
+  append(&a, "main", 3000);
+  TEST_CHECK(blocktree_init(&tree, (uint8_t *)a.get(&a, 0),
+                            BLOCKTREE_LONGEST) == 0);
+  TEST_CHECK(add_range(&tree, &a, 1, a.length, BLOCKTREE_EXTENDED) == 0);
+
+  for (f = 0; f < sizeof(forks)/sizeof(forks[0]); f++) {
+    shared = forks[f] + 1;
+    snprintf(tag, sizeof(tag), "side%lu", (unsigned long)f);
+    fork_chain(&b, &a, shared, tag, 1 + f*37 % (2999 - forks[f])); // shorter
+    TEST_CHECK(add_range(&tree, &b, shared, b.length, BLOCKTREE_SIDE) == 0);
+    tb = tree_entry(&tree, &b, b.length - 1);
+
+    e = blocktree_find_common_ancestor(tree.tip, tb);
+    TEST_CHECK(e != NULL && e->height == forks[f] &&
+               e == tree_entry(&tree, &a, forks[f]));
+    TEST_CHECK(blocktree_find_common_ancestor(tb, tree.tip) == e);
+    TEST_CHECK(blocktree_find_common_ancestor(
+                 blocktree_get_ancestor(tree.tip, tb->height), tb) == e);
+    blockchain_destroy(&b);
+  }
+
+  blocktree_destroy(&tree);
+  blockchain_destroy(&a);
+}
+
+void test_find(void)
+// -----------------------------------------------------------------------------
+// Func: Every block is found by its hash, unknown hashes are not, blocks
+//       already there are duplicates and orphans are refused
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain a;
+  BlockTree tree;
+  BlockTreeEntry *e;
+  uint8_t hash[HASH_SZ];
+  uint64_t i;
+  int bad = 0;
+
+  blockchain_init(&a);
+  append(&a, "main", 5000); // several table resizes
+  TEST_CHECK(blocktree_init(&tree, (uint8_t *)a.get(&a, 0),
+                            BLOCKTREE_LONGEST) == 0);
+  TEST_CHECK(add_range(&tree, &a, 1, 2500, BLOCKTREE_EXTENDED) == 0);
+  TEST_CHECK(tree.add(&tree, (uint8_t *)a.get(&a, 3000)) == -1);
+  TEST_CHECK(add_range(&tree, &a, 2500, a.length, BLOCKTREE_EXTENDED) == 0);
+  TEST_CHECK(tree.nentries == a.length);
+
+  for (i = 0; i < a.length; i++) {
+    e = tree_entry(&tree, &a, i);
+    bad += e == NULL || e->height != i || tree.get(&tree, i) != e->frame;
+  }
+  TEST_CHECK(bad == 0);
+  TEST_CHECK(tree.get(&tree, a.length) == NULL);
+
+  memcpy(hash, (uint8_t *)a.get(&a, 42) + CURRHASH_POS, HASH_SZ);
+  hash[HASH_SZ - 1] ^= 1;
+  TEST_CHECK(tree.find(&tree, hash) == NULL);
+
+  TEST_CHECK(add_range(&tree, &a, 0, a.length, BLOCKTREE_DUPLICATE) == 0);
+  TEST_CHECK(tree.nentries == a.length);
+
+  blocktree_destroy(&tree);
+  blockchain_destroy(&a);
+}
+
+void test_reorg_longest(void)
+// -----------------------------------------------------------------------------
+// Func: A side branch takes over once it is higher, not when it ties, and
+//       the main chain follows it there and back
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain a, b;
+  BlockTree tree;
+  BlockTreeEntry *old_tip;
+  Reorg r;
+  uint64_t i;
+  int bad = 0;
+
+  blockchain_init(&a);
+  append(&a, "main", 99);                       // tip at 99
+  fork_chain(&b, &a, 60, "side", 45);           // tip at 104
+
+  TEST_CHECK(blocktree_init(&tree, (uint8_t *)a.get(&a, 0),
+                            BLOCKTREE_LONGEST) == 0);
+  memset(&r, 0, sizeof(r));
+  tree.on_reorg = &reorg_record;
+  tree.reorg_ctx = &r;
+  TEST_CHECK(add_range(&tree, &a, 1, a.length, BLOCKTREE_EXTENDED) == 0);
+
+  old_tip = tree.tip;
+  TEST_CHECK(add_range(&tree, &b, 60, 100, BLOCKTREE_SIDE) == 0); // the tie
+  TEST_CHECK(tree.tip == old_tip && r.calls == 0);
+  TEST_CHECK(add_range(&tree, &b, 100, 101, BLOCKTREE_REORG) == 0);
+  TEST_CHECK(add_range(&tree, &b, 101, b.length, BLOCKTREE_EXTENDED) == 0);
+
+  TEST_CHECK(r.calls == 1 && r.old_tip == old_tip);
+  TEST_CHECK(r.ancestor == tree_entry(&tree, &a, 59));
+  TEST_CHECK(r.new_tip == tree_entry(&tree, &b, 100));
+  for (i = 0; i < b.length; i++)
+    bad += memcmp(tree.get(&tree, i), b.get(&b, i), BLOCK_HEADER_SZ) != 0;
+  TEST_CHECK(bad == 0);
+  TEST_CHECK(tree.get(&tree, b.length) == NULL);
+
+  // the old branch comes back
+  append(&a, "more", 10);                       // tip at 109
+  old_tip = tree.tip;
+  TEST_CHECK(add_range(&tree, &a, 100, 105, BLOCKTREE_SIDE) == 0);
+  TEST_CHECK(add_range(&tree, &a, 105, 106, BLOCKTREE_REORG) == 0);
+  TEST_CHECK(add_range(&tree, &a, 106, a.length, BLOCKTREE_EXTENDED) == 0);
+  TEST_CHECK(r.calls == 2 && r.old_tip == old_tip);
+  TEST_CHECK(r.ancestor == tree_entry(&tree, &a, 59));
+  for (i = 0; i < a.length; i++)
+    bad += memcmp(tree.get(&tree, i), a.get(&a, i), BLOCK_HEADER_SZ) != 0;
+  TEST_CHECK(bad == 0);
+  TEST_CHECK(tree.tip->height == a.length - 1);
+
+  blocktree_destroy(&tree);
+  blockchain_destroy(&b);
+  blockchain_destroy(&a);
+}
+
+uint64_t branch_work(Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Cumulative work of a chain, as the tree counts it
+// Args: chain - the chain
+// Retn: the work
+// -----------------------------------------------------------------------------
+{
+  uint64_t i, work = 0;
+
+  for (i = 0; i < chain->length; i++)
+    work += blocktree_work((uint8_t *)chain->get(chain, i) + CURRHASH_POS);
+
+  return work;
+}
+
+void test_reorg_work(void)
+// -----------------------------------------------------------------------------
+// Func: With the most work rule the branch with more work wins, ties keep
+//       the tip, and every entry carries its branch's cumulative work
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain a, b;
+  BlockTree tree;
+  BlockTreeEntry *ta, *tb;
+  uint64_t work_a, work_b;
+  int round;
+
+  // hashes decide the work, so try a few forks and check each against
+  // what the branches add up to
+  for (round = 0; round < 8; round++) {
+    blockchain_init(&a);
+    append(&a, "main", 40);
+    fork_chain(&b, &a, 10, "side", 20 + 10*round);
+
+    TEST_CHECK(blocktree_init(&tree, (uint8_t *)a.get(&a, 0),
+                              BLOCKTREE_MOST_WORK) == 0);
+    TEST_CHECK(add_range(&tree, &a, 1, a.length, BLOCKTREE_EXTENDED) == 0);
+    ta = tree.tip;
+    add_range(&tree, &b, 10, b.length, 0);
+    tb = tree_entry(&tree, &b, b.length - 1);
+
+    work_a = branch_work(&a);
+    work_b = branch_work(&b);
+    TEST_CHECK(ta->work == work_a && tb != NULL && tb->work == work_b);
+    TEST_CHECK(tree.tip == (work_b > work_a ? tb : ta));
+    TEST_CHECK(tree.get(&tree, tree.tip->height) == tree.tip->frame);
+
+    blocktree_destroy(&tree);
+    blockchain_destroy(&b);
+    blockchain_destroy(&a);
+  }
+}
+
+int main(void)
+{
+  test_ancestors();
+  test_common_ancestor();
+  test_find();
+  test_reorg_longest();
+  test_reorg_work();
+
+  return test_report("test_blocktree");
+}
@@ -0,0 +1,198 @@
+/*
+test_bloom.c: tests for the segment bloom filters
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bloom.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SPILL_PATH  "test_bloom.spill"
+#define KEYS        10   // distinct keys, block i has key i % KEYS
+#define KEY_SZ      4
+
+int record_key(void *ctx, const uint8_t *record, uint64_t record_sz,
+               const uint8_t **key, uint64_t *key_sz)
+// -----------------------------------------------------------------------------
+// Func: RecordKeyFunc, the first KEY_SZ bytes of records that start with 'k'
+// Args: see RecordKeyFunc
+// Retn: 0 if the record has a key, -1 otherwise
+// -----------------------------------------------------------------------------
+{
+  (void)ctx;
+  if (record_sz < KEY_SZ || record[0] != 'k')
+    return -1;
+  *key = record;
+  *key_sz = KEY_SZ;
+
+  return 0;
+}
+
+void append(Blockchain *chain, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append n keyed blocks
+// Args: chain - the chain
+//       n - blocks to append
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(record, sizeof(record), "k%03lu block %lu",
+             (unsigned long)(chain->length % KEYS),
+             (unsigned long)chain->length);
+    TEST_CHECK(chain->insert_front(chain, (uint8_t *)record,
+                                   strlen(record) + 1) == 0);
+  }
+}
+
+void count_match(void *ctx, uint64_t index, uint8_t *blockframe)
+// -----------------------------------------------------------------------------
+// Func: BloomMatchFunc, counts matches that carry the key they should
+// Args: ctx - the key number, then the count, as two uint64_t
+//       index - the block
+//       blockframe - the block
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t *c = (uint64_t *)ctx;
+
+  if (index % KEYS == c[0] && blockframe[RECORD_POS] == 'k')
+    c[1]++;
+}
+
+int check_keys(SegmentBloom *bloom, Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Scan for every key and for one that is in no block
+// Args: bloom - the filters
+//       chain - the chain they follow
+// Retn: number of keys whose scan did not find exactly their blocks
+// -----------------------------------------------------------------------------
+{
+  char key[KEY_SZ + 1];
+  uint64_t c[2], want;
+  int bad = 0;
+
+  for (c[0] = 0; c[0] < KEYS; c[0]++) {
+    snprintf(key, sizeof(key), "k%03lu", (unsigned long)c[0]);
+    c[1] = 0;
+    want = (chain->length - 1 + KEYS - c[0]) / KEYS - (c[0] == 0);
+    bad += bloom->scan(bloom, (uint8_t *)key, KEY_SZ, &count_match, c) !=
+           (int64_t)want || c[1] != want;
+  }
+  bad += bloom->scan(bloom, (uint8_t *)"kzzz", KEY_SZ, NULL, NULL) != 0;
+
+  return bad;
+}
+
+void test_scan(void)
+// -----------------------------------------------------------------------------
+// Func: Blocks from before and after init are found, and segments without
+//       the key are passed over
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  SegmentBloom bloom;
+  uint64_t s, skipped = 0;
+
+  blockchain_init(&chain);
+  append(&chain, 100);
+  TEST_CHECK(bloom_init(&bloom, &chain, 16, &record_key, NULL) == 0);
+  append(&chain, 100);
+  TEST_CHECK(bloom.covered == chain.length);
+  TEST_CHECK(check_keys(&bloom, &chain) == 0);
+
+  for (s = 0; s*16 < chain.length; s++)
+    skipped += !bloom.may_contain(&bloom, s, (uint8_t *)"kzzz", KEY_SZ);
+  TEST_CHECK(skipped > 0);
+  TEST_CHECK(!bloom.may_contain(&bloom, s, (uint8_t *)"k001", KEY_SZ));
+
+  bloom_destroy(&bloom);
+  blockchain_destroy(&chain);
+}
+
+void test_behind(void)
+// -----------------------------------------------------------------------------
+// Func: Blocks a failed add left out of the filters are still scanned, and
+//       the next append puts them in
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  SegmentBloom bloom;
+
+  blockchain_init(&chain);
+  append(&chain, 60);
+  TEST_CHECK(bloom_init(&bloom, &chain, 8, &record_key, NULL) == 0);
+
+  // as if growing the filters for segment 3 had failed
+  bloom.covered = 24;
+  memset(&bloom.filters[3*bloom.filter_blocks*BLOOM_WORDS], 0,
+         (bloom.nsegs - 3)*bloom.filter_blocks*BLOOM_WORDS*sizeof(uint32_t));
+  TEST_CHECK(bloom.may_contain(&bloom, 3, (uint8_t *)"kzzz", KEY_SZ));
+  TEST_CHECK(check_keys(&bloom, &chain) == 0);
+
+  append(&chain, 1);
+  TEST_CHECK(bloom.covered == chain.length);
+  TEST_CHECK(check_keys(&bloom, &chain) == 0);
+
+  bloom_destroy(&bloom);
+  blockchain_destroy(&chain);
+}
+
+void test_unreadable(void)
+// -----------------------------------------------------------------------------
+// Func: A scan that can't read a spilled record back fails instead of
+//       returning a short count
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  SegmentBloom bloom;
+
+  blockchain_init(&chain);
+  TEST_CHECK(blockchain_set_pruning(&chain, 8, 0, SPILL_PATH) == 0);
+  append(&chain, 50);
+  TEST_CHECK(bloom_init(&bloom, &chain, 8, &record_key, NULL) == 0);
+  TEST_CHECK(check_keys(&bloom, &chain) == 0);
+
+  TEST_CHECK(truncate(SPILL_PATH, 0) == 0);
+  TEST_CHECK(bloom.scan(&bloom, (uint8_t *)"k003", KEY_SZ, NULL, NULL) == -1);
+
+  bloom_destroy(&bloom);
+  blockchain_destroy(&chain);
+  unlink(SPILL_PATH);
+}
+
+int main(void)
+{
+  test_scan();
+  test_behind();
+  test_unreadable();
+
+  return test_report("test_bloom");
+}
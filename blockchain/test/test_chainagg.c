@@ -0,0 +1,163 @@
+/*
+test_chainagg.c: tests for chain record size aggregates
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chainagg.h"
+#include "test.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define BLOCKS 2000   // in the chain before the aggregate starts
+#define ROUNDS 200    // aggregates started while another thread appends
+
+typedef struct Appender Appender;
+
+struct Appender
+// -----------------------------------------------------------------------------
+// Description
+//  A thread appending to a chain until told to stop
+// -----------------------------------------------------------------------------
+{
+  Blockchain *chain;
+  int stop;
+};
+
+void append_sized(Blockchain *chain, uint64_t i)
+// -----------------------------------------------------------------------------
+// Func: Append a block with a record of 8 to 47 bytes
+// Args: chain - the chain
+//       i - picks the size
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t record[48];
+
+  memset(record, (int)i, sizeof(record));
+  TEST_CHECK(chain->insert_front(chain, record, 8 + i % 40) == 0);
+}
+
+void *appender_run(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Append until stop is set
+// Args: arg - the Appender
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  Appender *a = (Appender *)arg;
+  uint64_t i;
+
+  for (i = 0; !__atomic_load_n(&a->stop, __ATOMIC_ACQUIRE); i++) {
+    append_sized(a->chain, i);
+    sched_yield(); // let init run between appends
+  }
+
+  return NULL;
+}
+
+int same_total(ChainAgg *agg, Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Compare an aggregate with one built from scratch over the same chain
+// Args: agg - the aggregate to check
+//       chain - the chain it follows, not appended to meanwhile
+// Retn: 1 if both hold every block and agree, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  ChainAgg fresh;
+  ChainAggPart got, want;
+
+  if (chainagg_init(&fresh, chain, 60))
+    return 0;
+  agg->total(agg, &got);
+  fresh.total(&fresh, &want);
+  chainagg_destroy(&fresh);
+
+  return got.count == chain->length && !memcmp(&got, &want, sizeof(got));
+}
+
+void test_total(void)
+// -----------------------------------------------------------------------------
+// Func: An aggregate started on a chain counts the blocks already in it and
+//       those appended later, and stops counting once destroyed
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ChainAgg agg;
+  ChainAggPart part;
+  uint64_t i;
+
+  blockchain_init(&chain);
+  for (i = 0; i < BLOCKS; i++)
+    append_sized(&chain, i);
+
+  TEST_CHECK(chainagg_init(&agg, &chain, 60) == 0);
+  TEST_CHECK(same_total(&agg, &chain));
+  for (i = 0; i < BLOCKS; i++)
+    append_sized(&chain, i);
+  TEST_CHECK(same_total(&agg, &chain));
+  agg.total(&agg, &part);
+  TEST_CHECK(part.min == 8 && part.max == 47);
+
+  chainagg_destroy(&agg);
+  TEST_CHECK(chain.nhooks == 0);
+  blockchain_destroy(&chain);
+}
+
+void test_init_while_appending(void)
+// -----------------------------------------------------------------------------
+// Func: Aggregates started while another thread appends neither miss a block
+//       stored during their catch up nor count one twice
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ChainAgg agg;
+  Appender a;
+  pthread_t thread;
+  int r, ok = 1;
+
+  blockchain_init(&chain);
+  for (r = 0; r < ROUNDS; r++) {
+    a.chain = &chain;
+    a.stop = 0;
+    pthread_create(&thread, NULL, &appender_run, &a);
+    ok &= chainagg_init(&agg, &chain, 60) == 0;
+    sched_yield();
+    __atomic_store_n(&a.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    ok &= same_total(&agg, &chain);
+    chainagg_destroy(&agg);
+  }
+  TEST_CHECK(ok);
+
+  blockchain_destroy(&chain);
+}
+
+int main(void)
+{
+  test_total();
+  test_init_while_appending();
+
+  return test_report("test_chainagg");
+}
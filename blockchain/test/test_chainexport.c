@@ -0,0 +1,220 @@
+/*
+test_chainexport.c: tests for exporting snapshots and chain logs
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chainexport.h"
+#include "chainlog.h"
+#include "snapshot.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LOG_PATH    "test_chainexport.log"
+#define SNAP_PATH   "test_chainexport.snap"
+#define OUT_PATH    "test_chainexport.out"
+#define WANT_PATH   "test_chainexport.want"
+#define BLOCKS      10000 // a few segments
+
+uint8_t *slurp(const char *pathname, uint64_t *size)
+// -----------------------------------------------------------------------------
+// Func: Read a whole file
+// Args: pathname - the file
+//       size - set to its size
+// Retn: the contents, to be freed, NULL if it can't be read
+// -----------------------------------------------------------------------------
+{
+  struct stat st;
+  uint8_t *buf;
+  int fd;
+
+  if ((fd = open(pathname, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) || (buf = malloc(st.st_size + 1)) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  *size = read(fd, buf, st.st_size) == st.st_size ? (uint64_t)st.st_size : 0;
+  close(fd);
+
+  return buf;
+}
+
+int same_export(Blockchain *chain, const char *pathname, uint64_t lo,
+                uint64_t hi, int format, ThreadPool *pool)
+// -----------------------------------------------------------------------------
+// Func: Stream a file and check the output is what exporting the chain it
+//       holds from memory gives
+// Args: chain - the chain in the file
+//       pathname - the snapshot or chain log
+//       lo, hi, format - what to export
+//       pool - the workers, NULL for none
+// Retn: 1 if both exports succeed and match, 0 otherwise
+// -----------------------------------------------------------------------------
+{
+  BlockReader reader;
+  uint8_t *out, *want;
+  uint64_t out_sz = 0, want_sz = 0;
+  int fd, ok;
+
+  fd = open(WANT_PATH, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  ok = chainexport_run(chain, lo, hi, format, fd, NULL) == 0;
+  close(fd);
+
+  ok &= blockreader_open(&reader, pathname, 16, BLOCKREADER_AUTO) == 0;
+  if (ok) {
+    fd = open(OUT_PATH, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    ok = chainexport_stream(&reader, lo, hi, format, fd, pool, NULL) == 0;
+    close(fd);
+    blockreader_close(&reader);
+  }
+
+  out = slurp(OUT_PATH, &out_sz);
+  want = slurp(WANT_PATH, &want_sz);
+  ok &= out != NULL && want != NULL && out_sz == want_sz && want_sz > 0 &&
+        !memcmp(out, want, want_sz);
+  free(out);
+  free(want);
+
+  return ok;
+}
+
+void test_formats(Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Streaming a snapshot and a chain log gives the same output as the
+//       chain in memory, in every format, for whole and partial ranges
+// Args: chain - a chain of BLOCKS blocks, also in LOG_PATH and SNAP_PATH
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ThreadPool pool;
+
+  TEST_CHECK(threadpool_init(&pool, 3) == 0);
+
+  TEST_CHECK(same_export(chain, SNAP_PATH, 0, UINT64_MAX, CHAINEXPORT_HEX,
+                         NULL));
+  TEST_CHECK(same_export(chain, SNAP_PATH, 0, UINT64_MAX, CHAINEXPORT_JSON,
+                         &pool));
+  TEST_CHECK(same_export(chain, LOG_PATH, 0, UINT64_MAX, CHAINEXPORT_RAW,
+                         &pool));
+  TEST_CHECK(same_export(chain, LOG_PATH, 5000, 9000, CHAINEXPORT_JSON,
+                         NULL));
+  TEST_CHECK(same_export(chain, SNAP_PATH, 4095, 4097, CHAINEXPORT_HEX,
+                         &pool));
+
+  threadpool_destroy(&pool);
+}
+
+void test_torn_log(Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: A log with a torn tail, as a writer mid append leaves it, exports up
+//       to its last intact record and is not changed
+// Args: chain - the chain in LOG_PATH
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  struct stat before, after;
+  uint8_t junk[100];
+  int fd;
+
+  memset(junk, 0xab, sizeof(junk));
+  fd = open(LOG_PATH, O_WRONLY|O_APPEND);
+  TEST_CHECK(fd >= 0 && write(fd, junk, sizeof(junk)) == sizeof(junk));
+  close(fd);
+
+  TEST_CHECK(stat(LOG_PATH, &before) == 0);
+  TEST_CHECK(same_export(chain, LOG_PATH, 0, UINT64_MAX, CHAINEXPORT_RAW,
+                         NULL));
+  TEST_CHECK(stat(LOG_PATH, &after) == 0);
+  TEST_CHECK(after.st_size == before.st_size);
+}
+
+void test_bad_block(Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: A snapshot block whose record was changed fails the export, even
+//       when it lies before the range written, on either backend. The failed
+//       scan leaves no read in flight behind it.
+// Args: chain - the chain in SNAP_PATH
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  BlockReader reader;
+  uint8_t byte;
+  int fd, backend;
+
+  TEST_CHECK(blockreader_open(&reader, SNAP_PATH, 16, BLOCKREADER_AUTO) == 0);
+  fd = open(SNAP_PATH, O_RDWR);
+  TEST_CHECK(pread(fd, &byte, 1, reader.offsets[1234] + WORD_SZ +
+                   RECORD_POS) == 1);
+  byte ^= 1;
+  TEST_CHECK(pwrite(fd, &byte, 1, reader.offsets[1234] + WORD_SZ +
+                    RECORD_POS) == 1);
+  close(fd);
+  blockreader_close(&reader);
+
+  for (backend = BLOCKREADER_URING; backend <= BLOCKREADER_THREADS;
+       backend++) {
+    if (blockreader_open(&reader, SNAP_PATH, 16, backend))
+      continue; // io_uring may be unavailable
+    fd = open(OUT_PATH, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    TEST_CHECK(chainexport_stream(&reader, 2000, 3000, CHAINEXPORT_HEX, fd,
+                                  NULL, NULL) == -1);
+    TEST_CHECK(reader.inflight == 0 && reader.nfree == reader.depth);
+    TEST_CHECK(chainexport_stream(&reader, 0, 1000, CHAINEXPORT_HEX, fd,
+                                  NULL, NULL) == 0);
+    close(fd);
+    blockreader_close(&reader);
+  }
+  (void)chain;
+}
+
+int main(void)
+{
+  Blockchain chain;
+  ChainLog log;
+  char record[64];
+  uint64_t i;
+
+  blockchain_init(&chain);
+  TEST_CHECK(chainlog_open(&log, LOG_PATH, 0) == 0);
+  TEST_CHECK(chainlog_attach(&log, &chain) == 0);
+  for (i = 1; i < BLOCKS; i++) {
+    snprintf(record, sizeof(record), "record %lu %.*s", (unsigned long)i,
+             (int)(i % 40), "padding padding padding padding padding ");
+    TEST_CHECK(chain.insert_front(&chain, (uint8_t *)record,
+                                  strlen(record)) == 0);
+  }
+  chainlog_close(&log);
+  TEST_CHECK(snapshot_export(&chain, SNAP_PATH) == 0);
+
+  test_formats(&chain);
+  test_torn_log(&chain);
+  test_bad_block(&chain);
+
+  blockchain_destroy(&chain);
+  unlink(LOG_PATH);
+  unlink(SNAP_PATH);
+  unlink(OUT_PATH);
+  unlink(WANT_PATH);
+
+  return test_report("test_chainexport");
+}
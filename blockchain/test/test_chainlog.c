@@ -0,0 +1,309 @@
+/*
+test_chainlog.c: tests for chain log recovery
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chainlog.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LOG_PATH    "test_chainlog.log"
+#define BLOCKS      200
+
+void append(Blockchain *chain, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append n blocks, each holding its index as text
+// Args: chain - the chain
+//       n - blocks to append
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(record, sizeof(record), "record %lu",
+             (unsigned long)chain->length);
+    TEST_CHECK(chain->insert_front(chain, (uint8_t *)record,
+                                   strlen(record) + 1) == 0);
+  }
+}
+
+int last_offset(void *ctx, uint64_t index, uint8_t *blockframe,
+                uint64_t blocksize, uint64_t offset, uint32_t crc)
+// -----------------------------------------------------------------------------
+// Func: ChainLogFunc, keeps the offset of the record it is given, so after a
+//       walk it holds where the last record starts (and the one before ends)
+// Args: ctx - a uint64_t
+//       index, blockframe, blocksize, offset, crc - see ChainLogFunc
+// Retn: 0 to go on
+// -----------------------------------------------------------------------------
+{
+  (void)index;
+  (void)blockframe;
+  (void)blocksize;
+  (void)crc;
+  *(uint64_t *)ctx = offset;
+
+  return 0;
+}
+
+uint64_t file_size(const char *pathname)
+// -----------------------------------------------------------------------------
+// Func: Size of a file
+// Args: pathname - the file
+// Retn: its size, 0 if it can't be read
+// -----------------------------------------------------------------------------
+{
+  struct stat st;
+
+  return stat(pathname, &st) ? 0 : (uint64_t)st.st_size;
+}
+
+void flip(const char *pathname, uint64_t offset)
+// -----------------------------------------------------------------------------
+// Func: Invert one bit of a file
+// Args: pathname - the file
+//       offset - the byte to change
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t byte;
+  int fd = open(pathname, O_RDWR);
+
+  TEST_CHECK(pread(fd, &byte, 1, offset) == 1);
+  byte ^= 1;
+  TEST_CHECK(pwrite(fd, &byte, 1, offset) == 1);
+  close(fd);
+}
+
+void write_log(Blockchain *chain, uint64_t *last)
+// -----------------------------------------------------------------------------
+// Func: Write a fresh log of the chain's blocks
+// Args: chain - the chain
+//       last - set to the offset of the last record's frame
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ChainLog log;
+
+  unlink(LOG_PATH);
+  TEST_CHECK(chainlog_open(&log, LOG_PATH, 0) == 0);
+  TEST_CHECK(chainlog_attach(&log, chain) == 0);
+  TEST_CHECK(log.count == chain->length && log.torn == 0);
+  TEST_CHECK(chainlog_walk(&log, 1, &last_offset, last) == 0);
+  chainlog_close(&log);
+}
+
+int check_recovered(Blockchain *chain, uint64_t count, uint64_t end,
+                    uint64_t file_sz)
+// -----------------------------------------------------------------------------
+// Func: Open the damaged log read only, which must leave it alone, then for
+//       writing, which must cut it back to its intact records, and load what
+//       is left
+// Args: chain - the chain the log was written from
+//       count - the blocks that should survive
+//       end - where the intact records end
+//       file_sz - the damaged log's size
+// Retn: number of problems found
+// -----------------------------------------------------------------------------
+{
+  Blockchain loaded;
+  ChainLog log;
+  uint64_t i;
+  int bad = 0;
+
+  if (chainlog_open_readonly(&log, LOG_PATH))
+    return 1;
+  bad += log.count != count || log.end != end || log.torn != file_sz - end;
+  chainlog_close(&log);
+  bad += file_size(LOG_PATH) != file_sz;
+
+  if (chainlog_open(&log, LOG_PATH, 0))
+    return bad + 1;
+  bad += log.count != count || log.end != end || log.torn != file_sz - end;
+  bad += memcmp(log.tip, &blockchain_get_header(chain, count-1)[CURRHASH_POS],
+                HASH_SZ) != 0;
+  bad += file_size(LOG_PATH) != end;
+
+  blockchain_init_empty(&loaded);
+  bad += chainlog_load(&log, &loaded) != 0;
+  bad += loaded.length != count || !blockchain_verify_headers(&loaded);
+  for (i = 0; i < loaded.length && i < count; i++)
+    bad += memcmp(loaded.get(&loaded, i), chain->get(chain, i),
+                  blockframe_size(chain->get(chain, i))) != 0;
+  blockchain_destroy(&loaded);
+  chainlog_close(&log);
+
+  return bad;
+}
+
+void test_truncated(void)
+// -----------------------------------------------------------------------------
+// Func: A last record cut short anywhere, or followed by a partial append,
+//       is dropped and everything before it kept
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  uint64_t last, end, cut[4];
+  int i, fd;
+
+  blockchain_init(&chain);
+  append(&chain, BLOCKS);
+  write_log(&chain, &last);
+  end = file_size(LOG_PATH);
+
+  cut[0] = end - 1;       // in the trailer's tag
+  cut[1] = end - 12;      // in the trailer's size
+  cut[2] = last + 40;     // in the header
+  cut[3] = last + 3;      // 3 bytes into the record
+  for (i = 0; i < 4; i++) {
+    write_log(&chain, &last);
+    TEST_CHECK(truncate(LOG_PATH, cut[i]) == 0);
+    TEST_CHECK(check_recovered(&chain, BLOCKS, last, cut[i]) == 0);
+  }
+
+  // the record before is whole, only the next append was cut short
+  write_log(&chain, &last);
+  fd = open(LOG_PATH, O_WRONLY|O_APPEND);
+  TEST_CHECK(write(fd, chain.get(&chain, 5), 90) == 90);
+  close(fd);
+  TEST_CHECK(check_recovered(&chain, BLOCKS + 1, end, end + 90) == 0);
+
+  blockchain_destroy(&chain);
+}
+
+void test_flipped(void)
+// -----------------------------------------------------------------------------
+// Func: A last record with a changed byte anywhere is dropped, and appending
+//       after recovery carries on from the record before
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ChainLog log;
+  uint64_t last, end, where[4];
+  int i;
+
+  blockchain_init(&chain);
+  append(&chain, BLOCKS);
+  write_log(&chain, &last);
+  end = file_size(LOG_PATH);
+
+  where[0] = last + RECORD_POS;   // the record
+  where[1] = last + CURRHASH_POS; // the header
+  where[2] = end - 8;             // the trailer's crc
+  where[3] = end - 2;             // the trailer's tag
+  for (i = 0; i < 4; i++) {
+    write_log(&chain, &last);
+    flip(LOG_PATH, where[i]);
+    TEST_CHECK(check_recovered(&chain, BLOCKS, last, end) == 0);
+  }
+
+  // the log now lacks the chain's last block, attach writes it back
+  TEST_CHECK(chainlog_open(&log, LOG_PATH, 0) == 0);
+  TEST_CHECK(log.count == BLOCKS);
+  TEST_CHECK(chainlog_attach(&log, &chain) == 0);
+  append(&chain, 10);
+  TEST_CHECK(log.count == BLOCKS + 11);
+  chainlog_close(&log);
+  TEST_CHECK(check_recovered(&chain, BLOCKS + 11, file_size(LOG_PATH),
+                             file_size(LOG_PATH)) == 0);
+
+  blockchain_destroy(&chain);
+}
+
+void test_body(void)
+// -----------------------------------------------------------------------------
+// Func: A changed record in the body of the log is not a torn tail: opening
+//       keeps it, and loading refuses it without touching the file
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain, loaded;
+  ChainLog log;
+  uint64_t last, end;
+
+  blockchain_init(&chain);
+  append(&chain, BLOCKS);
+  write_log(&chain, &last);
+  end = file_size(LOG_PATH);
+  flip(LOG_PATH, CHAINLOG_HEADER_SZ + RECORD_POS); // the root's record
+
+  TEST_CHECK(chainlog_open(&log, LOG_PATH, 0) == 0);
+  TEST_CHECK(log.count == BLOCKS + 1 && log.torn == 0);
+  blockchain_init_empty(&loaded);
+  TEST_CHECK(chainlog_load(&log, &loaded) == -1);
+  blockchain_destroy(&loaded);
+  chainlog_close(&log);
+  TEST_CHECK(file_size(LOG_PATH) == end);
+
+  blockchain_destroy(&chain);
+}
+
+void test_new(void)
+// -----------------------------------------------------------------------------
+// Func: A missing log is created on open but not read only, and one whose
+//       creation was cut short is started over
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ChainLog log;
+  int fd;
+
+  unlink(LOG_PATH);
+  TEST_CHECK(chainlog_open_readonly(&log, LOG_PATH) == -1);
+  TEST_CHECK(chainlog_open(&log, LOG_PATH, 1) == 0);
+  TEST_CHECK(log.count == 0 && log.end == CHAINLOG_HEADER_SZ);
+  chainlog_close(&log);
+
+  fd = open(LOG_PATH, O_WRONLY|O_TRUNC);
+  TEST_CHECK(write(fd, CHAINLOG_MAGIC, 3) == 3);
+  close(fd);
+  TEST_CHECK(chainlog_open_readonly(&log, LOG_PATH) == -1);
+  TEST_CHECK(chainlog_open(&log, LOG_PATH, 0) == 0);
+  TEST_CHECK(log.count == 0 && file_size(LOG_PATH) == CHAINLOG_HEADER_SZ);
+  chainlog_close(&log);
+
+  fd = open(LOG_PATH, O_WRONLY|O_TRUNC);
+  TEST_CHECK(write(fd, "NOTALOG!", 8) == 8);
+  close(fd);
+  TEST_CHECK(chainlog_open(&log, LOG_PATH, 0) == -1);
+  TEST_CHECK(file_size(LOG_PATH) == 8);
+}
+
+int main(void)
+{
+  test_truncated();
+  test_flipped();
+  test_body();
+  test_new();
+  unlink(LOG_PATH);
+
+  return test_report("test_chainlog");
+}
@@ -0,0 +1,267 @@
+/*
+test_chaintail.c: tests for chain tail subscriptions
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chaintail.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define BLOCKS 20000  // appended while subscribers follow
+
+typedef struct Follower Follower;
+
+struct Follower
+// -----------------------------------------------------------------------------
+// Description
+//  One subscriber thread and what it saw
+// -----------------------------------------------------------------------------
+{
+  TailSubscriber sub;
+  uint64_t end;             // stop once the cursor gets here
+  uint64_t got;             // blocks delivered
+  uint64_t last;            // index of the last block delivered
+  uint64_t bad;             // blocks out of order or not matching their slot
+  int use_fd;               // wait on the eventfd instead of the futex
+  int slow;                 // sleep between drains, to be lapped
+};
+
+int follower_block(void *ctx, uint64_t index, const uint8_t *blockframe,
+                   uint64_t blocksize)
+// -----------------------------------------------------------------------------
+// Func: Drain callback, checks each block holds its own index as record
+// Args: ctx - the Follower
+//       index, blockframe, blocksize - the block
+// Retn: 0, never stops the drain
+// -----------------------------------------------------------------------------
+{
+  Follower *f = (Follower *)ctx;
+  uint64_t record;
+
+  memcpy(&record, &blockframe[RECORD_POS], sizeof(record));
+  if (record != index || (f->got && index <= f->last) ||
+      blocksize != blockframe_size((uint8_t *)blockframe))
+    f->bad++;
+  f->last = index;
+  f->got++;
+
+  return 0;
+}
+
+void *follower_run(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Wait and drain until every block has been seen or lost
+// Args: arg - the Follower
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  Follower *f = (Follower *)arg;
+  struct pollfd p;
+
+  while (f->sub.cursor < f->end) {
+    if (f->use_fd) {
+      if (!f->sub.arm(&f->sub)) {
+        p.fd = f->sub.fd;
+        p.events = POLLIN;
+        poll(&p, 1, 100);
+      }
+    } else if (f->sub.wait(&f->sub, 100000000)) {
+      continue;
+    }
+    f->sub.drain(&f->sub, 0, &follower_block, f);
+    if (f->slow)
+      usleep(2000);
+  }
+
+  return NULL;
+}
+
+void append_index(Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Append a block whose record is its own index
+// Args: chain - the chain
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t index = chain->length;
+
+  TEST_CHECK(chain->insert_front(chain, (uint8_t *)&index,
+                                 sizeof(index)) == 0);
+}
+
+void test_drain(void)
+// -----------------------------------------------------------------------------
+// Func: A subscriber starts after the blocks already in the chain, times out
+//       with nothing new, then gets new blocks in order, max at a time
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ChainTail tail;
+  Follower f;
+  int i;
+
+  blockchain_init(&chain);
+  append_index(&chain);
+  TEST_CHECK(chaintail_init(&tail, &chain, 8) == 0);
+  memset(&f, 0, sizeof(f));
+  TEST_CHECK(chaintail_subscribe(&tail, &f.sub, 0) == 0);
+
+  TEST_CHECK(f.sub.cursor == 2);
+  TEST_CHECK(f.sub.wait(&f.sub, 1000000) == 1);
+  TEST_CHECK(f.sub.drain(&f.sub, 0, &follower_block, &f) == 0);
+
+  for (i = 0; i < 3; i++)
+    append_index(&chain);
+  TEST_CHECK(f.sub.wait(&f.sub, 0) == 0);
+  TEST_CHECK(f.sub.drain(&f.sub, 2, &follower_block, &f) == 2);
+  TEST_CHECK(f.last == 3);
+  TEST_CHECK(f.sub.drain(&f.sub, 0, &follower_block, &f) == 1);
+  TEST_CHECK(f.last == 4 && f.got == 3 && f.bad == 0 && f.sub.lost == 0);
+  TEST_CHECK(f.sub.wait(&f.sub, 1000000) == 1);
+
+  chaintail_unsubscribe(&tail, &f.sub);
+  chaintail_destroy(&tail);
+  blockchain_destroy(&chain);
+}
+
+void test_lapped(void)
+// -----------------------------------------------------------------------------
+// Func: A subscriber more than a ring behind loses the oldest blocks and
+//       gets the rest
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ChainTail tail;
+  Follower f;
+  int i;
+
+  blockchain_init(&chain);
+  TEST_CHECK(chaintail_init(&tail, &chain, 3) == 0); // rounded up to 4
+  memset(&f, 0, sizeof(f));
+  TEST_CHECK(chaintail_subscribe(&tail, &f.sub, 1) == 0);
+  TEST_CHECK(f.sub.fd >= 0);
+
+  for (i = 0; i < 10; i++)
+    append_index(&chain);
+  TEST_CHECK(f.sub.arm(&f.sub) == 1);
+  TEST_CHECK(f.sub.drain(&f.sub, 0, &follower_block, &f) == 4);
+  TEST_CHECK(f.sub.lost == 6 && f.last == 10 && f.bad == 0);
+
+  // armed with nothing ready, the next append writes the eventfd
+  TEST_CHECK(f.sub.arm(&f.sub) == 0);
+  append_index(&chain);
+  TEST_CHECK(poll(&(struct pollfd){f.sub.fd, POLLIN, 0}, 1, 1000) == 1);
+  TEST_CHECK(f.sub.drain(&f.sub, 0, &follower_block, &f) == 1);
+
+  chaintail_unsubscribe(&tail, &f.sub);
+  TEST_CHECK(f.sub.fd == -1);
+  chaintail_destroy(&tail);
+  blockchain_destroy(&chain);
+}
+
+void test_follow(void)
+// -----------------------------------------------------------------------------
+// Func: Subscribers on other threads follow an appender: every block they
+//       get is whole and in order, and none is both missed and not counted
+//       as lost. A slow subscriber on a small ring reads slots as they are
+//       rewritten, which the index check in each slot must catch.
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ChainTail tail;
+  Follower f[3];
+  pthread_t threads[3];
+  int i;
+
+  blockchain_init(&chain);
+  TEST_CHECK(chaintail_init(&tail, &chain, 64) == 0);
+  memset(f, 0, sizeof(f));
+  f[1].use_fd = 1;
+  f[2].slow = 1;
+  for (i = 0; i < 3; i++) {
+    f[i].end = 1 + BLOCKS;
+    TEST_CHECK(chaintail_subscribe(&tail, &f[i].sub, f[i].use_fd) == 0);
+    pthread_create(&threads[i], NULL, &follower_run, &f[i]);
+  }
+
+  for (i = 0; i < BLOCKS; i++) {
+    append_index(&chain);
+    if (i % 256 == 0)
+      usleep(100);
+  }
+
+  for (i = 0; i < 3; i++) {
+    pthread_join(threads[i], NULL);
+    TEST_CHECK(f[i].bad == 0);
+    TEST_CHECK(f[i].got + f[i].sub.lost == BLOCKS);
+    TEST_CHECK(f[i].last == BLOCKS);
+    chaintail_unsubscribe(&tail, &f[i].sub);
+  }
+  TEST_CHECK(f[2].sub.lost > 0);
+
+  chaintail_destroy(&tail);
+  blockchain_destroy(&chain);
+}
+
+void test_pruning(void)
+// -----------------------------------------------------------------------------
+// Func: Pruning can't be turned on while a tail follows the chain, and a
+//       tail can't follow a chain that prunes
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ChainTail tail;
+  TailSubscriber sub;
+
+  blockchain_init(&chain);
+  TEST_CHECK(chaintail_init(&tail, &chain, 8) == 0);
+  TEST_CHECK(chaintail_subscribe(&tail, &sub, 0) == 0);
+  TEST_CHECK(blockchain_set_pruning(&chain, 64, 0, NULL) == -1);
+  TEST_CHECK(blockchain_set_pruning(&chain, 0, 4096, NULL) == -1);
+  TEST_CHECK(chain.prune_depth == 0 && chain.prune_budget == 0);
+  chaintail_unsubscribe(&tail, &sub);
+  chaintail_destroy(&tail);
+
+  TEST_CHECK(blockchain_set_pruning(&chain, 64, 0, NULL) == 0);
+  TEST_CHECK(chaintail_init(&tail, &chain, 8) == -1);
+
+  blockchain_destroy(&chain);
+}
+
+int main(void)
+{
+  test_drain();
+  test_lapped();
+  test_follow();
+  test_pruning();
+
+  return test_report("test_chaintail");
+}
@@ -0,0 +1,178 @@
+/*
+test_chunkstore.c: tests for the deduplicating chunk store
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chunkstore.h"
+#include "blockchain.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RECORD_SZ   65536
+#define AVG_SZ      1024
+
+void fill(uint8_t *buf, uint64_t buf_sz, uint64_t seed)
+// -----------------------------------------------------------------------------
+// Func: Fill a buffer with reproducible pseudo random bytes
+// Args: buf - the buffer
+//       buf_sz - its size
+//       seed - picks the bytes
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t i;
+
+  for (i = 0; i < buf_sz; i++) {
+    seed = seed*6364136223846793005ULL + 1442695040888963407ULL;
+    buf[i] = (uint8_t)(seed >> 56);
+  }
+}
+
+void test_cut(void)
+// -----------------------------------------------------------------------------
+// Func: Chunks stay within their bounds, and bad averages are refused
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ChunkStore store;
+  uint8_t *buf = malloc(RECORD_SZ);
+  uint64_t off, len, n = 0;
+  int bad = 0;
+
+  fill(buf, RECORD_SZ, 1);
+  TEST_CHECK(chunkstore_init(&store, AVG_SZ) == 0);
+  for (off = 0; off < RECORD_SZ; off += len, n++) {
+    len = chunkstore_cut(&store, &buf[off], RECORD_SZ - off);
+    bad += len > AVG_SZ*8 ||
+           (len < AVG_SZ/4 && off + len != RECORD_SZ);
+  }
+  TEST_CHECK(bad == 0);
+  TEST_CHECK(off == RECORD_SZ);
+  TEST_CHECK(n > RECORD_SZ/AVG_SZ/4 && n < RECORD_SZ/AVG_SZ*4);
+  chunkstore_destroy(&store);
+
+  TEST_CHECK(chunkstore_init(&store, CHUNKSTORE_MIN_AVG/2) == -1);
+  TEST_CHECK(chunkstore_init(&store, 3000) == -1);
+  TEST_CHECK(chunkstore_init(&store, CHUNKSTORE_MAX_AVG*2) == -1);
+  free(buf);
+}
+
+void test_dedup(void)
+// -----------------------------------------------------------------------------
+// Func: A record with bytes inserted in the middle shares all but the chunks
+//       around the edit with the original, a repeated record adds no chunks,
+//       and all of them read back whole
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  ChunkStore store;
+  uint8_t *a = malloc(RECORD_SZ), *b = malloc(RECORD_SZ + 100);
+  uint8_t *out = malloc(RECORD_SZ + 100);
+  uint64_t ra, rb, rc, logical, stored, chunks, stored_a, chunks_a;
+
+  fill(a, RECORD_SZ, 2);
+  memcpy(b, a, RECORD_SZ/2);
+  fill(&b[RECORD_SZ/2], 100, 3);
+  memcpy(&b[RECORD_SZ/2 + 100], &a[RECORD_SZ/2], RECORD_SZ/2);
+
+  TEST_CHECK(chunkstore_init(&store, AVG_SZ) == 0);
+  TEST_CHECK(store.put(&store, a, RECORD_SZ, &ra) == 0);
+  chunkstore_stats(&store, &logical, &stored_a, &chunks_a);
+  TEST_CHECK(logical == RECORD_SZ && stored_a == RECORD_SZ);
+
+  TEST_CHECK(store.put(&store, b, RECORD_SZ + 100, &rb) == 0);
+  chunkstore_stats(&store, &logical, &stored, &chunks);
+  TEST_CHECK(logical == 2*RECORD_SZ + 100);
+  TEST_CHECK(stored - stored_a < 3*AVG_SZ*8); // the edited chunks only
+  TEST_CHECK(chunks - chunks_a <= 3);
+
+  TEST_CHECK(store.put(&store, a, RECORD_SZ, &rc) == 0);
+  chunkstore_stats(&store, &logical, &stored_a, &chunks_a);
+  TEST_CHECK(rc != ra && stored_a == stored && chunks_a == chunks);
+
+  TEST_CHECK(store.read(&store, ra, out) == 0 && !memcmp(out, a, RECORD_SZ));
+  TEST_CHECK(store.read(&store, rb, out) == 0 &&
+             !memcmp(out, b, RECORD_SZ + 100));
+  TEST_CHECK(store.read(&store, rc, out) == 0 && !memcmp(out, a, RECORD_SZ));
+  TEST_CHECK(store.read(&store, rc + 1, out) == -1);
+
+  chunkstore_destroy(&store);
+  free(a);
+  free(b);
+  free(out);
+}
+
+void test_chain(void)
+// -----------------------------------------------------------------------------
+// Func: A pruned chain keeps records that share content as shared chunks,
+//       reads the frames back byte for byte and still verifies
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ChunkStore store;
+  uint8_t base[4096], record[4096], frame[BLOCK_HEADER_SZ + 4096];
+  uint64_t i, n, logical, stored, chunks;
+  int bad = 0;
+
+  fill(base, sizeof(base), 4);
+  TEST_CHECK(chunkstore_init(&store, 256) == 0);
+  blockchain_init(&chain);
+  blockchain_set_chunk_store(&chain, &store);
+  TEST_CHECK(blockchain_set_pruning(&chain, 2, 0, NULL) == 0);
+
+  // every record is the same bytes with its index written at the front
+  for (i = 0; i < 50; i++) {
+    memcpy(record, base, sizeof(record));
+    memcpy(record, &i, sizeof(i));
+    TEST_CHECK(chain.insert_front(&chain, record, sizeof(record)) == 0);
+  }
+  TEST_CHECK(chain.pruned == chain.length - 2);
+
+  chunkstore_stats(&store, &logical, &stored, &chunks);
+  TEST_CHECK(logical > 40*sizeof(record));
+  TEST_CHECK(stored < logical/4); // the front chunk of each, the rest once
+
+  for (i = 1; i < chain.length; i++) {
+    bad += blockchain_read_frame(&chain, i, frame) != 0 ||
+           blockframe_size(frame) != BLOCK_HEADER_SZ + sizeof(record);
+    memcpy(record, base, sizeof(record));
+    n = i - 1;
+    memcpy(record, &n, sizeof(n));
+    bad += memcmp(&frame[RECORD_POS], record, sizeof(record)) != 0;
+  }
+  TEST_CHECK(bad == 0);
+  TEST_CHECK(chain.blockchain_verify_chain(&chain) == 1);
+
+  blockchain_destroy(&chain);
+  chunkstore_destroy(&store);
+}
+
+int main(void)
+{
+  test_cut();
+  test_dedup();
+  test_chain();
+
+  return test_report("test_chunkstore");
+}
@@ -0,0 +1,216 @@
+/*
+test_ingest.c: tests for the ingest ring and its sequencer
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ingest.h"
+#include "signature.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define PRODUCERS 4
+#define RECORDS   2000  // per producer
+#define RECORD_SZ 32
+
+typedef struct Producer Producer;
+
+struct Producer
+// -----------------------------------------------------------------------------
+// Description
+//  One producer thread's records and their futures
+// -----------------------------------------------------------------------------
+{
+  IngestQueue *queue;
+  int id;
+  int nrecords;
+  uint8_t (*records)[RECORD_SZ];
+  IngestFuture *futures;
+  int failed;               // submits or waits that failed
+};
+
+void *producer_run(void *arg)
+// -----------------------------------------------------------------------------
+// Func: Submit every record, then wait for all of them
+// Args: arg - the Producer
+// Retn: NULL
+// -----------------------------------------------------------------------------
+{
+  Producer *p = (Producer *)arg;
+  int i;
+
+  for (i = 0; i < p->nrecords; i++) {
+    snprintf((char *)p->records[i], RECORD_SZ, "producer %d record %d",
+             p->id, i);
+    if (p->queue->submit(p->queue, p->records[i],
+                         strlen((char *)p->records[i]), &p->futures[i]))
+      p->failed++;
+  }
+  for (i = 0; i < p->nrecords; i++)
+    if (p->queue->wait(p->queue, &p->futures[i]))
+      p->failed++;
+
+  return NULL;
+}
+
+void check_producers(Blockchain *chain, Producer *p, int nproducers)
+// -----------------------------------------------------------------------------
+// Func: Every record is in the chain once, where its future says, and each
+//       producer's records kept their order
+// Args: chain - the chain the queue appended to
+//       p - the producers, joined
+//       nproducers - how many
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  IngestFuture *f;
+  uint8_t *frame, *seen;
+  int t, i, bad = 0;
+
+  seen = calloc(chain->length, 1);
+  for (t = 0; t < nproducers; t++) {
+    TEST_CHECK(p[t].failed == 0);
+    for (i = 0; i < p[t].nrecords; i++) {
+      f = &p[t].futures[i];
+      if (f->state != INGEST_DONE || f->index >= chain->length ||
+          seen[f->index]++ ||
+          (i > 0 && f->index <= p[t].futures[i-1].index)) {
+        bad++;
+        continue;
+      }
+      frame = (uint8_t *)chain->get(chain, f->index);
+      bad += memcmp(&frame[CURRHASH_POS], f->hash, HASH_SZ) != 0 ||
+             memcmp(&frame[RECORD_POS], p[t].records[i],
+                    strlen((char *)p[t].records[i])) != 0;
+    }
+  }
+  free(seen);
+
+  TEST_CHECK(bad == 0);
+  TEST_CHECK(chain->blockchain_verify_chain(chain));
+}
+
+void test_run(uint64_t ring_sz, uint64_t batch)
+// -----------------------------------------------------------------------------
+// Func: PRODUCERS threads submitting at once through one ring
+// Args: ring_sz - ring size, small to keep producers blocking on a full ring
+//       batch - most records appended at once
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  IngestQueue queue;
+  Producer p[PRODUCERS];
+  pthread_t threads[PRODUCERS];
+  int t;
+
+  blockchain_init(&chain);
+  TEST_CHECK(ingest_init(&queue, &chain, ring_sz, batch) == 0);
+
+  for (t = 0; t < PRODUCERS; t++) {
+    p[t].queue = &queue;
+    p[t].id = t;
+    p[t].nrecords = RECORDS;
+    p[t].records = malloc(RECORDS*RECORD_SZ);
+    p[t].futures = malloc(RECORDS*sizeof(IngestFuture));
+    p[t].failed = 0;
+    pthread_create(&threads[t], NULL, &producer_run, &p[t]);
+  }
+  for (t = 0; t < PRODUCERS; t++)
+    pthread_join(threads[t], NULL);
+  ingest_destroy(&queue);
+
+  TEST_CHECK(chain.length == 1 + PRODUCERS*RECORDS);
+  check_producers(&chain, p, PRODUCERS);
+
+  for (t = 0; t < PRODUCERS; t++) {
+    free(p[t].records);
+    free(p[t].futures);
+  }
+  blockchain_destroy(&chain);
+}
+
+void test_bad_signatures(void)
+// -----------------------------------------------------------------------------
+// Func: A batch holding a badly signed record falls back to appending one by
+//       one: only the bad records fail, the rest go in, in order
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  IngestQueue queue;
+  IngestFuture futures[64];
+  uint8_t *records[64];
+  uint64_t record_sz[64], next = 1;
+  uint8_t seckey[32], pubkey[32], payload[32];
+  uint8_t *frame;
+  int i, n;
+
+  blockchain_init(&chain);
+  blockchain_set_signatures(&chain, NULL, NULL);
+  TEST_CHECK(signature_keypair(seckey, pubkey) == 0);
+
+  for (i = 0; i < 64; i++) {
+    n = snprintf((char *)payload, sizeof(payload), "payment %d", i);
+    records[i] = malloc(n + SIGNATURE_TRAILER_SZ);
+    record_sz[i] = n + SIGNATURE_TRAILER_SZ;
+    signature_sign(seckey, payload, n, records[i]);
+    if (i % 5 == 3)
+      records[i][0] ^= 1; // the signature no longer matches
+  }
+
+  // submit all before waiting, so the sequencer sees mixed batches
+  TEST_CHECK(ingest_init(&queue, &chain, 16, 8) == 0);
+  for (i = 0; i < 64; i++)
+    TEST_CHECK(queue.submit(&queue, records[i], record_sz[i],
+                            &futures[i]) == 0);
+  for (i = 0; i < 64; i++)
+    TEST_CHECK(queue.wait(&queue, &futures[i]) == (i % 5 == 3 ? -1 : 0));
+  ingest_destroy(&queue);
+
+  for (i = 0; i < 64; i++) {
+    if (i % 5 == 3) {
+      TEST_CHECK(futures[i].state == INGEST_FAILED);
+      continue;
+    }
+    TEST_CHECK(futures[i].state == INGEST_DONE);
+    TEST_CHECK(futures[i].index == next++);
+    frame = (uint8_t *)chain.get(&chain, futures[i].index);
+    TEST_CHECK(frame != NULL &&
+               !memcmp(&frame[RECORD_POS], records[i], record_sz[i]));
+  }
+  TEST_CHECK(chain.length == next);
+  TEST_CHECK(chain.blockchain_verify_chain(&chain));
+
+  for (i = 0; i < 64; i++)
+    free(records[i]);
+  blockchain_destroy(&chain);
+}
+
+int main(void)
+{
+  test_run(4096, 0);  // room for everyone
+  test_run(4, 2);     // a full ring most of the time
+  test_run(2, 1);     // the smallest ring, one record per batch
+  test_bad_signatures();
+
+  return test_report("test_ingest");
+}
@@ -0,0 +1,254 @@
+/*
+test_keyindex.c: tests for the record key B+-tree index
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "keyindex.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INDEX_PATH  "test_keyindex.idx"
+#define KEYS        1500  // distinct keys, block i has key i % KEYS
+#define KEY_SZ      6
+
+int record_key(void *ctx, const uint8_t *record, uint64_t record_sz,
+               const uint8_t **key, uint64_t *key_sz)
+// -----------------------------------------------------------------------------
+// Func: RecordKeyFunc, the first KEY_SZ bytes of records that start with 'k'
+// Args: see RecordKeyFunc
+// Retn: 0 if the record has a key, -1 otherwise
+// -----------------------------------------------------------------------------
+{
+  (void)ctx;
+
+  if (record_sz < KEY_SZ || record[0] != 'k')
+    return -1;
+  *key = record;
+  *key_sz = KEY_SZ;
+
+  return 0;
+}
+
+void append(Blockchain *chain, uint64_t n, const char *tag)
+// -----------------------------------------------------------------------------
+// Func: Append n keyed blocks
+// Args: chain - the chain
+//       n - blocks to append
+//       tag - text after the key, so different chains get different hashes
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(record, sizeof(record), "k%05lu %s %lu",
+             (unsigned long)(chain->length % KEYS), tag,
+             (unsigned long)chain->length);
+    TEST_CHECK(chain->insert_front(chain, (uint8_t *)record,
+                                   strlen(record) + 1) == 0);
+  }
+}
+
+int check_key(KeyIndex *index, uint64_t k, uint64_t length)
+// -----------------------------------------------------------------------------
+// Func: Check that a key maps to exactly the blocks that carry it
+// Args: index - the index
+//       k - the key number
+//       length - the chain length the index covers
+// Retn: 1 if the postings are right, 0 if not
+// -----------------------------------------------------------------------------
+{
+  char key[KEY_SZ + 1];
+  const uint64_t *indices;
+  uint64_t n, i, want, latest;
+
+  snprintf(key, sizeof(key), "k%05lu", (unsigned long)k);
+  want = (length - 1 + KEYS - k) / KEYS - (k == 0); // the root has no key
+  indices = index->lookup(index, (uint8_t *)key, KEY_SZ, &n);
+  if (n != want)
+    return 0;
+  for (i = 0; i < n; i++) {
+    if (indices[i] != (k == 0 ? KEYS : k) + i*KEYS)
+      return 0;
+  }
+
+  return n == 0 ||
+         (index->latest(index, (uint8_t *)key, KEY_SZ, &latest) == 0 &&
+          latest == indices[n-1]);
+}
+
+int check_index(KeyIndex *index, Blockchain *chain)
+// -----------------------------------------------------------------------------
+// Func: Check every key, the tree's shape and the chained leaves
+// Args: index - the index
+//       chain - the chain it follows
+// Retn: number of problems found
+// -----------------------------------------------------------------------------
+{
+  KeyIndexNode *node;
+  const uint8_t *prev = NULL;
+  uint64_t k, keys = 0;
+  int bad = 0, i;
+
+  bad += index->covered != chain->length;
+  bad += index->nkeys != (chain->length > KEYS ? KEYS : chain->length - 1);
+  for (k = 0; k < KEYS; k++)
+    bad += !check_key(index, k, chain->length);
+  bad += index->lookup(index, (uint8_t *)"kzzzzz", KEY_SZ, &k) != NULL;
+  bad += index->latest(index, (uint8_t *)"kzzzzz", KEY_SZ, &k) != -1;
+
+  // leaves are reached through the leftmost children and hold every key in
+  // ascending order
+  for (node = index->root; !node->leaf; node = node->children[0])
+    ;
+  for (; node != NULL; node = node->next) {
+    bad += node->n < 1 || node->n > KEYINDEX_ORDER;
+    for (i = 0; i < node->n; i++, keys++) {
+      bad += node->key_sz[i] != KEY_SZ ||
+             (prev != NULL && memcmp(prev, node->keys[i], KEY_SZ) >= 0);
+      prev = node->keys[i];
+    }
+  }
+  bad += keys != index->nkeys;
+
+  return bad;
+}
+
+void count_key(void *ctx, const uint8_t *key, uint64_t key_sz,
+               const uint64_t *indices, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: KeyIndexScanFunc, counts keys that come in order
+// Args: ctx - the previous key number, then the count, as two uint64_t
+//       key, key_sz - the key
+//       indices, n - its blocks
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint64_t *c = (uint64_t *)ctx;
+  uint64_t k = strtoul((const char *)&key[1], NULL, 10);
+
+  (void)key_sz;
+  (void)indices;
+  if (n > 0 && k == c[0] + 1)
+    c[1]++;
+  c[0] = k;
+}
+
+void test_split(void)
+// -----------------------------------------------------------------------------
+// Func: Enough keys to split leaves and internal nodes, looked up, scanned by
+//       prefix and checked for order
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  KeyIndex index;
+  uint64_t c[2];
+
+  blockchain_init(&chain);
+  append(&chain, 1000, "a");
+  TEST_CHECK(keyindex_init(&index, &chain, &record_key, NULL) == 0);
+  append(&chain, 3000, "a"); // indexed by the hook
+  TEST_CHECK(check_index(&index, &chain) == 0);
+  TEST_CHECK(!index.root->leaf && !index.root->children[0]->leaf);
+
+  c[0] = 99;
+  c[1] = 0;
+  TEST_CHECK(index.prefix_scan(&index, (uint8_t *)"k001", 4, &count_key,
+                               c) == 100);
+  TEST_CHECK(c[1] == 100); // k00100 to k00199, in order
+  TEST_CHECK(index.prefix_scan(&index, (uint8_t *)"k9", 2, &count_key,
+                               c) == 0);
+
+  keyindex_destroy(&index);
+  blockchain_destroy(&chain);
+}
+
+void test_save(void)
+// -----------------------------------------------------------------------------
+// Func: An index saved and loaded after more appends catches up with them,
+//       and refuses a chain it was not saved from
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain, other;
+  KeyIndex index, loaded;
+
+  blockchain_init(&chain);
+  append(&chain, 2000, "a");
+  TEST_CHECK(keyindex_init(&index, &chain, &record_key, NULL) == 0);
+  TEST_CHECK(index.save(&index, INDEX_PATH) == 0);
+  TEST_CHECK(access(INDEX_PATH ".tmp", F_OK) != 0);
+  keyindex_destroy(&index);
+
+  append(&chain, 1200, "a");
+  TEST_CHECK(keyindex_load(&loaded, &chain, &record_key, NULL,
+                           INDEX_PATH) == 0);
+  TEST_CHECK(check_index(&loaded, &chain) == 0);
+  append(&chain, 300, "a");
+  TEST_CHECK(check_index(&loaded, &chain) == 0);
+  keyindex_destroy(&loaded);
+
+  // same length, different blocks
+  blockchain_init(&other);
+  append(&other, 2000, "b");
+  TEST_CHECK(keyindex_load(&loaded, &other, &record_key, NULL,
+                           INDEX_PATH) == -1);
+  blockchain_destroy(&other);
+
+  TEST_CHECK(keyindex_load(&loaded, &chain, &record_key, NULL,
+                           "test_keyindex.missing") == -1);
+
+  blockchain_destroy(&chain);
+  unlink(INDEX_PATH);
+}
+
+void test_empty(void)
+// -----------------------------------------------------------------------------
+// Func: An index over a chain with no blocks has no tip hash, so it is not
+//       saved
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  KeyIndex index;
+
+  blockchain_init_empty(&chain);
+  TEST_CHECK(keyindex_init(&index, &chain, &record_key, NULL) == 0);
+  TEST_CHECK(index.covered == 0);
+  TEST_CHECK(index.save(&index, INDEX_PATH) == -1);
+  TEST_CHECK(access(INDEX_PATH, F_OK) != 0);
+  keyindex_destroy(&index);
+  blockchain_destroy(&chain);
+}
+
+int main(void)
+{
+  test_split();
+  test_save();
+  test_empty();
+
+  return test_report("test_keyindex");
+}
@@ -0,0 +1,240 @@
+/*
+test_shmchain.c: tests for the chain published in shared memory
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "shmchain.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define SHM_NAME    "/test_shmchain"
+#define BLOCKS      20000
+
+void append(Blockchain *chain, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append n blocks, each holding its index as text
+// Args: chain - the chain
+//       n - blocks to append
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(record, sizeof(record), "record %lu",
+             (unsigned long)chain->length);
+    TEST_CHECK(chain->insert_front(chain, (uint8_t *)record,
+                                   strlen(record) + 1) == 0);
+  }
+}
+
+int torn(ShmChain *reader, ShmChainTip *tip)
+// -----------------------------------------------------------------------------
+// Func: Check a tip against the front frame it claims to describe
+// Args: reader - the reader side
+//       tip - a tip read from the segment
+// Retn: 1 if any field disagrees with the frame, 0 if the tip is whole
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint8_t *frame;
+
+  if (tip->length == 0 ||
+      (frame = reader->get(reader, tip->length - 1)) == NULL)
+    return 1;
+  snprintf(record, sizeof(record), "record %lu",
+           (unsigned long)(tip->length - 1));
+
+  return memcmp(tip->hash, &frame[CURRHASH_POS], HASH_SZ) != 0 ||
+         memcmp(&tip->timestamp, &frame[TS_POS], WORD_SZ) != 0 ||
+         tip->data_sz != reader->offsets[tip->length - 1] +
+                         blockframe_size(frame) ||
+         (tip->length > 1 && strcmp((char *)&frame[RECORD_POS], record));
+}
+
+int follow(uint64_t length, int ready)
+// -----------------------------------------------------------------------------
+// Func: Reader process, poll the tip until the chain reaches length blocks
+// Args: length - the final length
+//       ready - pipe written once attached, the writer waits for it
+// Retn: the exit status, 0 if every tip read was whole and kept moving
+//       forward, 1 otherwise
+// -----------------------------------------------------------------------------
+{
+  ShmChain reader;
+  ShmChainTip tip;
+  uint64_t last = 0;
+  int bad = 0;
+
+  if (shmchain_attach(&reader, SHM_NAME) ||
+      write(ready, "", 1) != 1)
+    return 1;
+
+  do {
+    reader.tip(&reader, &tip);
+    bad |= tip.length < last || torn(&reader, &tip);
+    last = tip.length;
+  } while (!bad && tip.length < length);
+  shmchain_detach(&reader);
+
+  return bad;
+}
+
+void test_seqlock(void)
+// -----------------------------------------------------------------------------
+// Func: A reader in another process never sees a torn tip while the writer
+//       publishes as fast as it can. The frames are hashed beforehand and
+//       stored straight into the published chain, so the publishes run back
+//       to back and the reader keeps landing on the tip being written.
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain source, chain;
+  ShmChain writer;
+  uint8_t *frame;
+  uint64_t i;
+  pid_t pid;
+  int status, ready[2];
+  char c;
+
+  blockchain_init(&source);
+  append(&source, BLOCKS + 10);
+  blockchain_init_empty(&chain);
+  for (i = 0; i < 11; i++) {
+    frame = (uint8_t *)source.get(&source, i);
+    TEST_CHECK(blockchain_store(&chain, frame, blockframe_size(frame)) == 0);
+  }
+  TEST_CHECK(shmchain_publish(&writer, &chain, SHM_NAME, BLOCKS + 11,
+                              (BLOCKS + 11)*(BLOCK_HEADER_SZ + 32)) == 0);
+
+  TEST_CHECK(pipe(ready) == 0);
+  if ((pid = fork()) == 0)
+    _exit(follow(BLOCKS + 11, ready[1]));
+  TEST_CHECK(pid > 0);
+  TEST_CHECK(read(ready[0], &c, 1) == 1);
+  close(ready[0]);
+  close(ready[1]);
+
+  for (; i < source.length; i++) {
+    frame = (uint8_t *)source.get(&source, i);
+    TEST_CHECK(blockchain_store(&chain, frame, blockframe_size(frame)) == 0);
+  }
+  TEST_CHECK(waitpid(pid, &status, 0) == pid);
+  TEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  shmchain_detach(&writer);
+  blockchain_destroy(&chain);
+  blockchain_destroy(&source);
+}
+
+void test_write_in_progress(void)
+// -----------------------------------------------------------------------------
+// Func: A reader that arrives while a write is half done waits for it,
+//       whatever the scheduler does. The write is staged by hand: the seqlock
+//       is held odd over a tip that does not match its front frame.
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ShmChain writer, reader;
+  ShmChainTip tip, whole;
+  uint64_t seq;
+  pid_t pid;
+  int status, ready[2];
+  char c;
+
+  blockchain_init(&chain);
+  append(&chain, 10);
+  TEST_CHECK(shmchain_publish(&writer, &chain, SHM_NAME, 20,
+                              20*(BLOCK_HEADER_SZ + 32)) == 0);
+  seq = writer.header->seq;
+  whole = writer.header->tip;
+  __atomic_store_n(&writer.header->seq, seq + 1, __ATOMIC_RELEASE);
+  writer.header->tip.length = 5;
+  memset(writer.header->tip.hash, 0, HASH_SZ);
+
+  TEST_CHECK(pipe(ready) == 0);
+  if ((pid = fork()) == 0) {
+    if (shmchain_attach(&reader, SHM_NAME) || write(ready[1], "", 1) != 1)
+      _exit(1);
+    reader.tip(&reader, &tip);
+    _exit(torn(&reader, &tip) || memcmp(&tip, &whole, sizeof(tip)) != 0);
+  }
+  TEST_CHECK(pid > 0);
+  TEST_CHECK(read(ready[0], &c, 1) == 1);
+  close(ready[0]);
+  close(ready[1]);
+
+  usleep(20000); // let the reader reach the odd seqlock
+  writer.header->tip = whole;
+  __atomic_store_n(&writer.header->seq, seq + 2, __ATOMIC_RELEASE);
+  TEST_CHECK(waitpid(pid, &status, 0) == pid);
+  TEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  shmchain_detach(&writer);
+  blockchain_destroy(&chain);
+}
+
+void test_full(void)
+// -----------------------------------------------------------------------------
+// Func: Once a block does not fit the tip stops and readers are told so,
+//       and the name goes away with the writer
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  ShmChain writer, reader;
+  ShmChainTip tip;
+
+  blockchain_init(&chain);
+  append(&chain, 10);
+  TEST_CHECK(shmchain_publish(&writer, &chain, SHM_NAME, 20,
+                              20*(BLOCK_HEADER_SZ + 32)) == 0);
+  TEST_CHECK(shmchain_attach(&reader, SHM_NAME) == 0);
+  TEST_CHECK(reader.tip(&reader, &tip) == 0 && tip.length == 11);
+  TEST_CHECK(!torn(&reader, &tip));
+
+  append(&chain, 15);
+  TEST_CHECK(reader.tip(&reader, &tip) == 1 && tip.length == 20);
+  TEST_CHECK(!torn(&reader, &tip));
+  TEST_CHECK(reader.get(&reader, 19) != NULL);
+  TEST_CHECK(reader.get(&reader, 20) == NULL);
+
+  shmchain_detach(&writer);
+  TEST_CHECK(reader.get(&reader, 19) != NULL); // still mapped
+  shmchain_detach(&reader);
+  TEST_CHECK(shmchain_attach(&reader, SHM_NAME) == -1);
+  blockchain_destroy(&chain);
+}
+
+int main(void)
+{
+  test_seqlock();
+  test_write_in_progress();
+  test_full();
+
+  return test_report("test_shmchain");
+}
@@ -0,0 +1,211 @@
+/*
+test_snapshot.c: tests for snapshot export and import
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "snapshot.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SNAP_PATH   "test_snapshot.snap"
+#define SPILL_PATH  "test_snapshot.spill"
+#define BLOCKS      5000  // more than one SNAPSHOT_BATCH
+
+void append(Blockchain *chain, uint64_t n)
+// -----------------------------------------------------------------------------
+// Func: Append n blocks, each holding its index as text
+// Args: chain - the chain
+//       n - blocks to append
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  char record[32];
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    snprintf(record, sizeof(record), "record %lu",
+             (unsigned long)chain->length);
+    TEST_CHECK(chain->insert_front(chain, (uint8_t *)record,
+                                   strlen(record) + 1) == 0);
+  }
+}
+
+int same_chain(Blockchain *a, Blockchain *b)
+// -----------------------------------------------------------------------------
+// Func: Compare two chains frame by frame, pruned frames read back
+// Args: a, b - the chains
+// Retn: 1 if every frame matches, 0 if not
+// -----------------------------------------------------------------------------
+{
+  uint8_t fa[BLOCK_HEADER_SZ + 32], fb[BLOCK_HEADER_SZ + 32];
+  uint64_t i;
+
+  if (a->length != b->length)
+    return 0;
+  for (i = 0; i < a->length; i++) {
+    if (blockframe_size(blockchain_get_header(a, i)) > sizeof(fa) ||
+        blockchain_read_frame(a, i, fa) || blockchain_read_frame(b, i, fb) ||
+        memcmp(fa, fb, blockframe_size(fa)) != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+uint64_t frame_offset(const char *pathname, uint64_t index)
+// -----------------------------------------------------------------------------
+// Func: Find a block in a snapshot file through its trailer and index
+// Args: pathname - the snapshot
+//       index - the block
+// Retn: file offset of the block's framed header, 0 if it can't be read
+// -----------------------------------------------------------------------------
+{
+  struct stat st;
+  uint64_t index_off, offset = 0;
+  int fd;
+
+  if ((fd = open(pathname, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) ||
+      pread(fd, &index_off, WORD_SZ, st.st_size - SNAPSHOT_TRAILER_SZ) !=
+      WORD_SZ ||
+      pread(fd, &offset, WORD_SZ, index_off + index*WORD_SZ) != WORD_SZ)
+    offset = 0;
+  close(fd);
+
+  return offset ? offset + WORD_SZ : 0;
+}
+
+void flip(const char *pathname, uint64_t offset)
+// -----------------------------------------------------------------------------
+// Func: Invert one bit of a file
+// Args: pathname - the file
+//       offset - the byte to change
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  uint8_t byte;
+  int fd = open(pathname, O_RDWR);
+
+  TEST_CHECK(pread(fd, &byte, 1, offset) == 1);
+  byte ^= 1;
+  TEST_CHECK(pwrite(fd, &byte, 1, offset) == 1);
+  close(fd);
+}
+
+void test_round_trip(void)
+// -----------------------------------------------------------------------------
+// Func: A chain with spilled records exports and imports back to the same
+//       blocks, in one thread or several
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain, copy;
+  int nthreads;
+
+  blockchain_init(&chain);
+  TEST_CHECK(blockchain_set_pruning(&chain, 100, 0, SPILL_PATH) == 0);
+  append(&chain, BLOCKS);
+  TEST_CHECK(chain.pruned > 0);
+  TEST_CHECK(snapshot_export(&chain, SNAP_PATH) == 0);
+
+  for (nthreads = 1; nthreads <= 4; nthreads += 3) {
+    TEST_CHECK(snapshot_import(&copy, SNAP_PATH, nthreads, NULL) == 0);
+    TEST_CHECK(same_chain(&chain, &copy));
+    TEST_CHECK(copy.blockchain_verify_chain(&copy) == 1);
+    blockchain_destroy(&copy);
+  }
+
+  blockchain_destroy(&chain);
+  unlink(SPILL_PATH);
+}
+
+void test_truncated(void)
+// -----------------------------------------------------------------------------
+// Func: A snapshot cut short anywhere is refused
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain copy;
+  struct stat st;
+  off_t cut[3];
+  int i;
+
+  TEST_CHECK(stat(SNAP_PATH, &st) == 0);
+  cut[0] = st.st_size - 1;                       // in the trailer
+  cut[1] = st.st_size - SNAPSHOT_TRAILER_SZ - 8; // in the index
+  cut[2] = st.st_size / 2;                       // in the frames
+  for (i = 0; i < 3; i++) {
+    TEST_CHECK(truncate(SNAP_PATH, cut[i]) == 0);
+    TEST_CHECK(snapshot_import(&copy, SNAP_PATH, 2, NULL) == -1);
+  }
+  TEST_CHECK(truncate(SNAP_PATH, 0) == 0);
+  TEST_CHECK(snapshot_import(&copy, SNAP_PATH, 2, NULL) == -1);
+  TEST_CHECK(snapshot_import(&copy, "test_snapshot.missing", 2, NULL) == -1);
+}
+
+void test_corrupted(void)
+// -----------------------------------------------------------------------------
+// Func: A changed record, header, index entry or trailer is refused
+// Args: None
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain, copy;
+  struct stat st;
+  uint64_t where[4];
+  int i;
+
+  blockchain_init(&chain);
+  append(&chain, BLOCKS);
+  TEST_CHECK(snapshot_export(&chain, SNAP_PATH) == 0);
+  TEST_CHECK(stat(SNAP_PATH, &st) == 0);
+
+  where[0] = frame_offset(SNAP_PATH, 4321) + RECORD_POS;     // a record
+  where[1] = frame_offset(SNAP_PATH, 700) + 1;               // a header
+  where[2] = st.st_size - SNAPSHOT_TRAILER_SZ - 100*WORD_SZ; // the index
+  where[3] = st.st_size - 1 - WORD_SZ;                       // the trailer
+  for (i = 0; i < 4; i++) {
+    TEST_CHECK(where[i] > SNAPSHOT_HEADER_SZ);
+    flip(SNAP_PATH, where[i]);
+    TEST_CHECK(snapshot_import(&copy, SNAP_PATH, 2, NULL) == -1);
+    flip(SNAP_PATH, where[i]); // and back, which imports again
+    TEST_CHECK(snapshot_import(&copy, SNAP_PATH, 2, NULL) == 0);
+    TEST_CHECK(same_chain(&chain, &copy));
+    blockchain_destroy(&copy);
+  }
+
+  blockchain_destroy(&chain);
+}
+
+int main(void)
+{
+  test_round_trip();
+  test_truncated();
+  test_corrupted();
+  unlink(SNAP_PATH);
+
+  return test_report("test_snapshot");
+}
@@ -0,0 +1,16 @@
+{
+  "targets": [
+    {
+      "target_name": "blockchain",
+      "sources": [
+        "src/addon.c",
+        "<!@(ls -1 ../blockchain/src/*.c | grep -v /main.c)"
+      ],
+      "cflags": [
+        "-O2", "-Wall", "-Wextra",
+        "-iquote", "<(module_root_dir)/../blockchain/include"
+      ],
+      "libraries": [ "-lm", "-lssl", "-lcrypto", "-lpthread" ]
+    }
+  ]
+}
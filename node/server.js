@@ -1,6 +1,53 @@
 var http = require('http');
+var Blockchain = require('./build/Release/blockchain.node').Blockchain;
+
+// frames are asked for shared, as Buffers over the chain's own memory, so
+// blocks are written to the socket without being copied or serialized.
+// Shared Buffers must never be written to: that would change the stored
+// block. Leave shared off (the default) for a copy that is safe to modify.
+var chain = new Blockchain(process.env.BLOCKCHAIN_HASH);
+
+function send(res, status, type, body) {
+  res.writeHead(status, {'Content-Type': type});
+  res.end(body);
+}
+
+function sendFrame(res, frame) {
+  if (frame === null)
+    return send(res, 404, 'text/plain', 'no such block\n');
+  send(res, 200, 'application/octet-stream', frame);
+}
+
 http.createServer(function (req, res) {
-  res.writeHead(200, {'Content-Type': 'text/plain'});
-  res.end('Hello World\n');
+  var path = req.url.split('?')[0];
+  var m;
+
+  if (req.method === 'GET' && path === '/length') {
+    send(res, 200, 'application/json', JSON.stringify({length: chain.length}));
+  } else if (req.method === 'GET' && path === '/tip') {
+    sendFrame(res, chain.peekFront(true));
+  } else if (req.method === 'GET' && (m = /^\/blocks\/(\d+)$/.exec(path))) {
+    sendFrame(res, chain.get(Number(m[1]), true));
+  } else if (req.method === 'GET' && path === '/verify') {
+    // runs on the libuv pool, the loop keeps serving meanwhile
+    chain.verify().then(function (valid) {
+      send(res, 200, 'application/json', JSON.stringify({valid: valid}));
+    }, function (err) {
+      send(res, 500, 'text/plain', err.message + '\n');
+    });
+  } else if (req.method === 'POST' && path === '/blocks') {
+    var chunks = [];
+    req.on('data', function (chunk) { chunks.push(chunk); });
+    req.on('end', function () {
+      try {
+        var index = chain.insertFront(Buffer.concat(chunks));
+        send(res, 201, 'application/json', JSON.stringify({index: index}));
+      } catch (err) {
+        send(res, 409, 'text/plain', err.message + '\n');
+      }
+    });
+  } else {
+    send(res, 404, 'text/plain', 'not found\n');
+  }
 }).listen(3000, "127.0.0.1");
-console.log('Server running at http://127.0.0.1:3000/');
\ No newline at end of file
+console.log('Server running at http://127.0.0.1:3000/');
@@ -0,0 +1,529 @@
+/*
+addon.c: node.js bindings for the blockchain
+Copyright (C) 2019
+maintainer: Carlos WM
+email: cwmoreiras@gmail.com
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blockchain.h"
+
+#include <node_api.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bail out of a binding with a pending JS exception when a napi call fails
+#define NAPI_CALL(env, call)                                    \
+  do {                                                          \
+    if ((call) != napi_ok) {                                    \
+      addon_throw_last(env);                                    \
+      return NULL;                                              \
+    }                                                           \
+  } while (0)
+
+// forward declaration
+typedef struct ChainHandle ChainHandle;
+typedef struct VerifyWork VerifyWork;
+
+struct ChainHandle
+// -----------------------------------------------------------------------------
+// Description
+//  The native side of a JS Blockchain object. Frames are handed to JS as
+//  copies unless the caller asks to share them; a shared frame is an
+//  external Buffer that points straight into the chain, so the chain lives
+//  until the JS object and every shared Buffer over one of its frames are
+//  collected. Nothing is ever pruned, frames stay put for the life of the
+//  chain.
+// -----------------------------------------------------------------------------
+{
+  Blockchain chain;
+  uint32_t refs;            // the JS object plus each live shared Buffer
+  uint32_t verifying;       // verifies running on the libuv pool
+};
+
+struct VerifyWork
+// -----------------------------------------------------------------------------
+// Description
+//  A verify queued on the libuv thread pool, settled on the loop thread
+// -----------------------------------------------------------------------------
+{
+  ChainHandle *handle;
+  napi_ref self;            // keeps the JS object alive while the work runs
+  napi_deferred deferred;
+  napi_async_work work;
+  int valid;
+};
+
+// private functions, access through the Blockchain class
+napi_value addon_construct(napi_env env, napi_callback_info info);
+napi_value addon_length(napi_env env, napi_callback_info info);
+napi_value addon_get(napi_env env, napi_callback_info info);
+napi_value addon_peek_front(napi_env env, napi_callback_info info);
+napi_value addon_insert_front(napi_env env, napi_callback_info info);
+napi_value addon_verify(napi_env env, napi_callback_info info);
+
+// private functions
+void addon_throw_last(napi_env env);
+ChainHandle *addon_unwrap(napi_env env, napi_callback_info info, size_t *argc,
+                          napi_value *argv);
+void addon_unref(ChainHandle *handle);
+void addon_finalize_chain(napi_env env, void *data, void *hint);
+void addon_finalize_frame(napi_env env, void *data, void *hint);
+int addon_shared(napi_env env, size_t argc, napi_value *argv, size_t i,
+                 bool *shared);
+napi_value addon_frame(napi_env env, ChainHandle *handle, uint8_t *frame,
+                       bool shared);
+void addon_verify_execute(napi_env env, void *data);
+void addon_verify_complete(napi_env env, napi_status status, void *data);
+napi_value addon_module_init(napi_env env, napi_value exports);
+
+void addon_throw_last(napi_env env)
+// -----------------------------------------------------------------------------
+// Func: Raise the last napi error as a JS exception, unless one is pending
+// Args: env - the calling environment
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  const napi_extended_error_info *info;
+  bool pending;
+
+  napi_is_exception_pending(env, &pending);
+  if (pending)
+    return;
+
+  napi_get_last_error_info(env, &info);
+  napi_throw_error(env, NULL, info->error_message ? info->error_message
+                                                  : "napi call failed");
+}
+
+ChainHandle *addon_unwrap(napi_env env, napi_callback_info info, size_t *argc,
+                          napi_value *argv)
+// -----------------------------------------------------------------------------
+// Func: Fetch the arguments of a method call and the chain it was called on
+// Args: env - the calling environment
+//       info - the call
+//       argc - room in argv, set to the number of arguments given
+//       argv - filled with the arguments
+// Retn: the chain, NULL with an exception pending on failure
+// -----------------------------------------------------------------------------
+{
+  napi_value self;
+  ChainHandle *handle;
+
+  NAPI_CALL(env, napi_get_cb_info(env, info, argc, argv, &self, NULL));
+  NAPI_CALL(env, napi_unwrap(env, self, (void **) &handle));
+
+  return handle;
+}
+
+void addon_unref(ChainHandle *handle)
+// -----------------------------------------------------------------------------
+// Func: Drop a reference to a chain, destroying it with the last one
+// Args: handle - the chain
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  if (--handle->refs > 0)
+    return;
+
+  blockchain_destroy(&handle->chain);
+  free(handle);
+}
+
+void addon_finalize_chain(napi_env env, void *data, void *hint)
+// -----------------------------------------------------------------------------
+// Func: Called when the JS Blockchain object is collected
+// Args: env - the environment
+//       data - the wrapped chain
+//       hint - unused
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  (void) env;
+  (void) hint;
+
+  addon_unref((ChainHandle *) data);
+}
+
+void addon_finalize_frame(napi_env env, void *data, void *hint)
+// -----------------------------------------------------------------------------
+// Func: Called when a shared Buffer over a frame is collected
+// Args: env - the environment
+//       data - the frame, owned by the chain
+//       hint - the chain
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  (void) env;
+  (void) data;
+
+  addon_unref((ChainHandle *) hint);
+}
+
+int addon_shared(napi_env env, size_t argc, napi_value *argv, size_t i,
+                 bool *shared)
+// -----------------------------------------------------------------------------
+// Func: Read the optional shared flag of get and peekFront
+// Args: env - the calling environment
+//       argc, argv - the call's arguments
+//       i - where the flag is
+//       shared - set to the flag, false if it was not given
+// Retn: 0 on success, -1 with an exception pending if it is not a boolean
+// -----------------------------------------------------------------------------
+{
+  napi_valuetype type = napi_undefined;
+
+  *shared = false;
+  if (argc > i && napi_typeof(env, argv[i], &type) != napi_ok) {
+    addon_throw_last(env);
+    return -1;
+  }
+  if (type == napi_undefined)
+    return 0;
+  if (type != napi_boolean ||
+      napi_get_value_bool(env, argv[i], shared) != napi_ok) {
+    napi_throw_type_error(env, NULL, "shared must be a boolean");
+    return -1;
+  }
+
+  return 0;
+}
+
+napi_value addon_frame(napi_env env, ChainHandle *handle, uint8_t *frame,
+                       bool shared)
+// -----------------------------------------------------------------------------
+// Func: Hand a stored frame to JS. By default it is copied, so JS can do as
+//       it likes with the Buffer. A shared frame is not copied: the Buffer
+//       is the chain's own memory and writing to it corrupts the block, so
+//       callers must treat it as read only (JS has no way to enforce that).
+// Args: env - the calling environment
+//       handle - the chain holding the frame
+//       frame - the framed block, NULL for none
+//       shared - true for an external Buffer over the frame
+// Retn: a Buffer holding or over the frame, or null
+// -----------------------------------------------------------------------------
+{
+  napi_value result;
+
+  if (frame == NULL) {
+    NAPI_CALL(env, napi_get_null(env, &result));
+    return result;
+  }
+
+  if (!shared) {
+    NAPI_CALL(env, napi_create_buffer_copy(env, blockframe_size(frame), frame,
+                                           NULL, &result));
+    return result;
+  }
+
+  NAPI_CALL(env, napi_create_external_buffer(env, blockframe_size(frame),
+                                             frame, &addon_finalize_frame,
+                                             handle, &result));
+  handle->refs++;
+
+  return result;
+}
+
+napi_value addon_construct(napi_env env, napi_callback_info info)
+// -----------------------------------------------------------------------------
+// Func: new Blockchain([hash]), build a chain holding only its root block
+// Args: env - the calling environment
+//       info - the call, hash is 'sha256' (the default) or 'blake3'
+// Retn: the new object
+// -----------------------------------------------------------------------------
+{
+  napi_value self, argv[1];
+  napi_valuetype type;
+  size_t argc = 1;
+  char name[8];
+  size_t len;
+  uint8_t hash_alg = BLOCKCHAIN_HASH_SHA256;
+  ChainHandle *handle;
+
+  NAPI_CALL(env, napi_get_cb_info(env, info, &argc, argv, &self, NULL));
+
+  if (argc > 0) {
+    NAPI_CALL(env, napi_typeof(env, argv[0], &type));
+    if (type != napi_undefined) {
+      if (type != napi_string) {
+        napi_throw_type_error(env, NULL, "hash must be a string");
+        return NULL;
+      }
+      NAPI_CALL(env, napi_get_value_string_utf8(env, argv[0], name,
+                                                sizeof(name), &len));
+      if (strcmp(name, "blake3") == 0) {
+        hash_alg = BLOCKCHAIN_HASH_BLAKE3;
+      } else if (strcmp(name, "sha256") != 0) {
+        napi_throw_range_error(env, NULL, "hash must be 'sha256' or 'blake3'");
+        return NULL;
+      }
+    }
+  }
+
+  if ((handle = malloc(sizeof(ChainHandle))) == NULL) {
+    napi_throw_error(env, NULL, "out of memory");
+    return NULL;
+  }
+  blockchain_init_hash(&handle->chain, hash_alg);
+  handle->refs = 1;
+  handle->verifying = 0;
+
+  if (napi_wrap(env, self, handle, &addon_finalize_chain, NULL, NULL)
+      != napi_ok) {
+    addon_unref(handle);
+    addon_throw_last(env);
+    return NULL;
+  }
+
+  return self;
+}
+
+napi_value addon_length(napi_env env, napi_callback_info info)
+// -----------------------------------------------------------------------------
+// Func: chain.length, the number of blocks including the root
+// Args: env - the calling environment
+//       info - the call
+// Retn: the length
+// -----------------------------------------------------------------------------
+{
+  napi_value result;
+  size_t argc = 0;
+  ChainHandle *handle;
+
+  if ((handle = addon_unwrap(env, info, &argc, NULL)) == NULL)
+    return NULL;
+  NAPI_CALL(env, napi_create_double(env, (double) handle->chain.length,
+                                    &result));
+
+  return result;
+}
+
+napi_value addon_get(napi_env env, napi_callback_info info)
+// -----------------------------------------------------------------------------
+// Func: chain.get(index[, shared]), the framed block at index
+// Args: env - the calling environment
+//       info - the call, shared is true for a Buffer over the chain's own
+//              memory instead of a copy, see addon_frame
+// Retn: a Buffer with the frame, null if index is past the front
+// -----------------------------------------------------------------------------
+{
+  napi_value argv[2];
+  size_t argc = 2;
+  int64_t index;
+  bool shared;
+  ChainHandle *handle;
+
+  if ((handle = addon_unwrap(env, info, &argc, argv)) == NULL)
+    return NULL;
+  if (argc < 1 || napi_get_value_int64(env, argv[0], &index) != napi_ok) {
+    napi_throw_type_error(env, NULL, "index must be a number");
+    return NULL;
+  }
+  if (addon_shared(env, argc, argv, 1, &shared))
+    return NULL;
+  if (index < 0)
+    return addon_frame(env, handle, NULL, shared);
+
+  return addon_frame(env, handle,
+                     handle->chain.get(&handle->chain, (uint64_t) index),
+                     shared);
+}
+
+napi_value addon_peek_front(napi_env env, napi_callback_info info)
+// -----------------------------------------------------------------------------
+// Func: chain.peekFront([shared]), the framed block at the front of the
+//       chain
+// Args: env - the calling environment
+//       info - the call, shared as for get
+// Retn: a Buffer with the frame
+// -----------------------------------------------------------------------------
+{
+  napi_value argv[1];
+  size_t argc = 1;
+  bool shared;
+  ChainHandle *handle;
+
+  if ((handle = addon_unwrap(env, info, &argc, argv)) == NULL ||
+      addon_shared(env, argc, argv, 0, &shared))
+    return NULL;
+
+  return addon_frame(env, handle, handle->chain.peek_front(&handle->chain),
+                     shared);
+}
+
+napi_value addon_insert_front(napi_env env, napi_callback_info info)
+// -----------------------------------------------------------------------------
+// Func: chain.insertFront(record), append a record in a new block. Throws if
+//       the record's signature is bad or a verify is still running.
+// Args: env - the calling environment
+//       info - the call, record is a Buffer or typed array
+// Retn: the index of the new block
+// -----------------------------------------------------------------------------
+{
+  napi_value argv[1], result;
+  size_t argc = 1;
+  bool is_buffer;
+  void *record;
+  size_t record_sz;
+  ChainHandle *handle;
+
+  if ((handle = addon_unwrap(env, info, &argc, argv)) == NULL)
+    return NULL;
+  if (argc < 1 || napi_is_buffer(env, argv[0], &is_buffer) != napi_ok ||
+      !is_buffer) {
+    napi_throw_type_error(env, NULL, "record must be a Buffer");
+    return NULL;
+  }
+  NAPI_CALL(env, napi_get_buffer_info(env, argv[0], &record, &record_sz));
+
+  // the pool threads read the index and headers, which appends may move
+  if (handle->verifying) {
+    napi_throw_error(env, NULL, "chain is being verified");
+    return NULL;
+  }
+  if (handle->chain.insert_front(&handle->chain, record, record_sz)) {
+    napi_throw_error(env, NULL, "record rejected");
+    return NULL;
+  }
+
+  NAPI_CALL(env, napi_create_double(env, (double) (handle->chain.length - 1),
+                                    &result));
+  return result;
+}
+
+void addon_verify_execute(napi_env env, void *data)
+// -----------------------------------------------------------------------------
+// Func: Check the chain, on a libuv pool thread
+// Args: env - not to be used off the loop thread
+//       data - the work
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  VerifyWork *work = (VerifyWork *) data;
+  Blockchain *chain = &work->handle->chain;
+
+  (void) env;
+
+  work->valid = chain->blockchain_verify_chain(chain);
+}
+
+void addon_verify_complete(napi_env env, napi_status status, void *data)
+// -----------------------------------------------------------------------------
+// Func: Settle the promise of a finished verify, on the loop thread
+// Args: env - the environment
+//       status - napi_cancelled if the work never ran
+//       data - the work
+// Retn: None
+// -----------------------------------------------------------------------------
+{
+  VerifyWork *work = (VerifyWork *) data;
+  napi_value result;
+
+  work->handle->verifying--;
+
+  if (status == napi_ok) {
+    napi_get_boolean(env, work->valid, &result);
+    napi_resolve_deferred(env, work->deferred, result);
+  } else {
+    napi_create_string_utf8(env, "verify did not run", NAPI_AUTO_LENGTH,
+                            &result);
+    napi_create_error(env, NULL, result, &result);
+    napi_reject_deferred(env, work->deferred, result);
+  }
+
+  napi_delete_reference(env, work->self);
+  napi_delete_async_work(env, work->work);
+  free(work);
+}
+
+napi_value addon_verify(napi_env env, napi_callback_info info)
+// -----------------------------------------------------------------------------
+// Func: chain.verify(), check every hash, link and signature of the chain on
+//       the libuv thread pool. Appends throw until it settles.
+// Args: env - the calling environment
+//       info - the call
+// Retn: a Promise of true if the chain is valid, false if not
+// -----------------------------------------------------------------------------
+{
+  napi_value self, name, promise;
+  size_t argc = 0;
+  VerifyWork *work;
+  int err = 0;
+
+  NAPI_CALL(env, napi_get_cb_info(env, info, &argc, NULL, &self, NULL));
+
+  if ((work = calloc(1, sizeof(VerifyWork))) == NULL) {
+    napi_throw_error(env, NULL, "out of memory");
+    return NULL;
+  }
+
+  err = napi_unwrap(env, self, (void **) &work->handle) != napi_ok ||
+        napi_create_string_utf8(env, "blockchain.verify", NAPI_AUTO_LENGTH,
+                                &name) != napi_ok ||
+        napi_create_reference(env, self, 1, &work->self) != napi_ok;
+  if (!err) {
+    err = napi_create_async_work(env, NULL, name, &addon_verify_execute,
+                                 &addon_verify_complete, work,
+                                 &work->work) != napi_ok;
+    if (err)
+      napi_delete_reference(env, work->self);
+  }
+  if (!err) {
+    err = napi_create_promise(env, &work->deferred, &promise) != napi_ok ||
+          napi_queue_async_work(env, work->work) != napi_ok;
+    if (err) {
+      napi_delete_async_work(env, work->work);
+      napi_delete_reference(env, work->self);
+    }
+  }
+  if (err) {
+    free(work);
+    addon_throw_last(env);
+    return NULL;
+  }
+
+  work->handle->verifying++;
+  return promise;
+}
+
+napi_value addon_module_init(napi_env env, napi_value exports)
+// -----------------------------------------------------------------------------
+// Func: Define the Blockchain class on the module's exports
+// Args: env - the environment
+//       exports - the module's exports
+// Retn: exports
+// -----------------------------------------------------------------------------
+{
+  napi_value cls;
+  napi_property_descriptor props[] = {
+    { "length", NULL, NULL, &addon_length, NULL, NULL, napi_default, NULL },
+    { "get", NULL, &addon_get, NULL, NULL, NULL, napi_default, NULL },
+    { "peekFront", NULL, &addon_peek_front, NULL, NULL, NULL, napi_default,
+      NULL },
+    { "insertFront", NULL, &addon_insert_front, NULL, NULL, NULL,
+      napi_default, NULL },
+    { "verify", NULL, &addon_verify, NULL, NULL, NULL, napi_default, NULL },
+  };
+
+  NAPI_CALL(env, napi_define_class(env, "Blockchain", NAPI_AUTO_LENGTH,
+                                   &addon_construct, NULL,
+                                   sizeof(props) / sizeof(props[0]), props,
+                                   &cls));
+  NAPI_CALL(env, napi_set_named_property(env, exports, "Blockchain", cls));
+
+  return exports;
+}
+
+NAPI_MODULE(NODE_GYP_MODULE_NAME, addon_module_init)